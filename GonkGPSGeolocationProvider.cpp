@@ -15,14 +15,26 @@
  */
 
 #include "GonkGPSGeolocationProvider.h"
+#include "mozstumbler/LocationFusionFilter.h"
+#include "mozstumbler/LocationWarmStart.h"
 #include "mozstumbler/MozStumbler.h"
+#include "mozstumbler/StumbleNmeaParser.h"
+#include "mozstumbler/StumbleScheduler.h"
+#include "mozstumbler/StumbleSvStatus.h"
+#include "mozstumbler/StumblerStats.h"
+#include "mozstumbler/WriteStumbleOnThread.h"
 
 #include <pthread.h>
+#include <time.h>
 #include <hardware/gps.h>
 
 #include "mozilla/Constants.h"
+#include "mozilla/FloatingPoint.h"
 #include "mozilla/Preferences.h"
 #include "mozilla/Services.h"
+#include "mozilla/StaticMutex.h"
+#include "mozilla/StaticPtr.h"
+#include "mozilla/TimeStamp.h"
 #include "nsContentUtils.h"
 #include "nsGeoPosition.h"
 #include "nsIInterfaceRequestorUtils.h"
@@ -81,30 +93,182 @@ NS_IMPL_ISUPPORTS(GonkGPSGeolocationProvider,
                   nsISettingsServiceCallback)
 
 /* static */ GonkGPSGeolocationProvider* GonkGPSGeolocationProvider::sSingleton = nullptr;
+
+// GPS and network positions combined, main thread only
+static LocationFusionFilter&
+GetLocationFusion()
+{
+  static LocationFusionFilter sFusion;
+  return sFusion;
+}
+
+// Main thread only; the init thread loads and saves copies of it.
+static LocationWarmStart&
+GetWarmStart()
+{
+  static LocationWarmStart sWarmStart;
+  return sWarmStart;
+}
+
+// A warm start injects no position less accurate than this (m), about
+// what the fusion filter makes of a day-old estimate.
+static const double kMaxWarmStartAccuracy = 20000;
+
+// Time from StartGPS() to the first fix, main thread only
+struct FirstFixTimer
+{
+  // Null once the first fix came
+  TimeStamp mStart;
+  // Whether a position was injected at the start
+  bool mWarm;
+};
+
+static FirstFixTimer&
+GetFirstFixTimer()
+{
+  static FirstFixTimer sTimer;
+  return sTimer;
+}
+
+// Decides which fixes get a scan. Only used by LocationCallback, on the
+// GPS HAL thread, and reset by ShutdownGPS() once the HAL has stopped.
+static StumbleScheduler sStumbleScheduler;
+
+// Android's elapsedRealtime(), the time reference of inject_time()
+static int64_t
+ElapsedRealtimeMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+InjectGpsTime(const GpsInterface* aGpsInterface)
+{
+  MOZ_ASSERT(NS_IsMainThread());
+  int64_t gpsTime;
+  int32_t uncertainty;
+  if (!GetWarmStart().GetGpsTime(PR_Now() / PR_USEC_PER_MSEC, &gpsTime, &uncertainty)) {
+    // The system clock alone is not worth injecting.
+    return;
+  }
+  if (gDebug_isLoggingEnabled) {
+    nsContentUtils::LogMessageToConsole("geo: injecting time %lld uncertainty: %dms",
+                                        (long long)gpsTime, uncertainty);
+  }
+  aGpsInterface->inject_time(gpsTime, ElapsedRealtimeMs(), uncertainty);
+}
+
+// Requests the cell and wifi scans of a StumblerInfo, on the main thread
+class RequestCellInfoEvent : public nsRunnable {
+public:
+  RequestCellInfoEvent(StumblerInfo *callback)
+    : mRequestCallback(callback)
+    {}
+
+  NS_IMETHOD Run() {
+    MOZ_ASSERT(NS_IsMainThread());
+    mRequestCallback->SetScanStarted();
+    // Get Cell Info
+    nsCOMPtr<nsIMobileConnectionService> service =
+      do_GetService(NS_MOBILE_CONNECTION_SERVICE_CONTRACTID);
+
+    if (!service) {
+      nsContentUtils::LogMessageToConsole("Stumbler-can not get nsIMobileConnectionService \n");
+    } else {
+      nsCOMPtr<nsIMobileConnection> connection;
+      uint32_t numberOfRilServices = 1, cellInfoNum = 0;
+
+      service->GetNumItems(&numberOfRilServices);
+      for (uint32_t rilNum = 0; rilNum < numberOfRilServices; rilNum++) {
+        service->GetItemByServiceId(rilNum /* Client Id */, getter_AddRefs(connection));
+        if (!connection) {
+          nsContentUtils::LogMessageToConsole("Stumbler-can not get nsIMobileConnection \n");
+        } else {
+          cellInfoNum++;
+          nsCOMPtr<nsICellInfoListCallback> callback =
+            mRequestCallback->CreateCellInfoCallback(rilNum);
+          connection->GetCellInfoList(callback);
+        }
+      }
+      mRequestCallback->SetCellInfoResponsesExpected(cellInfoNum);
+    }
+
+    // Get Wifi AP Info
+    nsCOMPtr<nsIInterfaceRequestor> ir = do_GetService("@mozilla.org/telephony/system-worker-manager;1");
+    if (!ir) {
+      nsContentUtils::LogMessageToConsole("Stumbler-doesn't get nsIInterfaceRequestor \n");
+      return NS_OK;
+    } else {
+      nsCOMPtr<nsIWifi> wifi = do_GetInterface(ir);
+      if (!wifi) {
+        mRequestCallback->SetWifiInfoResponseReceived();
+        nsContentUtils::LogMessageToConsole("Stumbler-can not get nsIWifi interface\n");
+        return NS_OK;
+      } else {
+        wifi->GetWifiScanResults(mRequestCallback);
+        return NS_OK;
+      }
+    }
+  }
+private:
+  nsRefPtr<StumblerInfo> mRequestCallback;
+};
+
+// Minimum time between two offline location requests (ms)
+static const int64_t kOfflineLocateIntervalMs = 60 * 1000;
+
+/*
+ Scans the cells and wifi and locates them with the index of past
+ stumbles, without the network; the position goes to aCallback. Main
+ thread only.
+ */
+static void
+RequestOfflineLocation(nsIGeolocationUpdate* aCallback)
+{
+  MOZ_ASSERT(NS_IsMainThread());
+  static int64_t sLastRequest = 0;
+  int64_t now = PR_Now() / PR_USEC_PER_MSEC;
+  if (sLastRequest && now - sLastRequest < kOfflineLocateIntervalMs) {
+    return;
+  }
+  sLastRequest = now;
+
+  nsRefPtr<StumblerInfo> request = new StumblerInfo(nullptr);
+  request->SetLocateCallback(aCallback);
+  NS_DispatchToMainThread(new RequestCellInfoEvent(request));
+}
+
 GpsCallbacks GonkGPSGeolocationProvider::mCallbacks;
 
 #ifdef MOZ_B2G_RIL
 AGpsCallbacks GonkGPSGeolocationProvider::mAGPSCallbacks;
 AGpsRilCallbacks GonkGPSGeolocationProvider::mAGPSRILCallbacks;
-#endif // MOZ_B2G_RIL
 
-double CalculateDeltaInMeter(double aLat, double aLon, double aLastLat, double aLastLon)
-{
-    const double radsInDeg = M_PI / 180.0;
-    const double rNewLat = aLat * radsInDeg;
-    const double rNewLon = aLon * radsInDeg;
-    const double rOldLat = aLastLat * radsInDeg;
-    const double rOldLon = aLastLon * radsInDeg;
-    // WGS84 equatorial radius of earth = 6378137m
-    double cosDelta = (sin(rNewLat) * sin(rOldLat)) +
-                      (cos(rNewLat) * cos(rOldLat) * cos(rOldLon - rNewLon));
-    if (cosDelta > 1.0) {
-      cosDelta = 1.0;
-    } else if (cosDelta < -1.0) {
-      cosDelta = -1.0;
-    }
-    return acos(cosDelta) * 6378137;
+// The AGPS reference location (the cell of the voice connection), kept
+// up to date by RefLocationListener, so AGPSRILRefLocCallback can answer
+// the GPS without the main thread. Guarded by sRefLocationMutex.
+static StaticMutex sRefLocationMutex;
+static AGpsRefLocation sRefLocation;
+static bool sHasRefLocation = false;
+// The init thread, which passes the cached location to the HAL. No HAL
+// documents that set_ref_location() may be called from within its own
+// request_refloc callback, so it never is. Null while stopped.
+static StaticRefPtr<nsIThread> sRefLocationThread;
+// Set on the init thread before the AGPS RIL callbacks can be called
+static Atomic<const AGpsRilInterface*> sAGpsRilInterface;
+
+static void
+SetCachedRefLocation(const AGpsRefLocation* aLocation)
+{
+  StaticMutexAutoLock lock(sRefLocationMutex);
+  sHasRefLocation = !!aLocation;
+  if (aLocation) {
+    sRefLocation = *aLocation;
+  }
 }
+#endif // MOZ_B2G_RIL
 
 void
 GonkGPSGeolocationProvider::LocationCallback(GpsLocation* location)
@@ -115,14 +279,39 @@ GonkGPSGeolocationProvider::LocationCallback(GpsLocation* location)
 
   class UpdateLocationEvent : public nsRunnable {
   public:
-    UpdateLocationEvent(nsGeoPosition* aPosition)
+    UpdateLocationEvent(nsGeoPosition* aPosition, const GpsLocation& aLocation,
+                        int64_t aTime, double aSpeed, double aBearing)
       : mPosition(aPosition)
+      , mLocation(aLocation)
+      , mTime(aTime)
+      , mSpeed(aSpeed)
+      , mBearing(aBearing)
     {}
     NS_IMETHOD Run() {
       nsRefPtr<GonkGPSGeolocationProvider> provider =
         GonkGPSGeolocationProvider::GetSingleton();
       nsCOMPtr<nsIGeolocationUpdate> callback = provider->mLocationCallback;
       provider->mLastGPSPosition = mPosition;
+
+      FirstFixTimer& timer = GetFirstFixTimer();
+      if (!timer.mStart.IsNull()) {
+        TimeDuration ttff = TimeStamp::Now() - timer.mStart;
+        StumblerStats::AddLatency(timer.mWarm ? StumblerStats::STAGE_TTFF_WARM
+                                              : StumblerStats::STAGE_TTFF_COLD, ttff);
+        if (gDebug_isLoggingEnabled) {
+          nsContentUtils::LogMessageToConsole("geo: first fix after %.1fs, %s start\n",
+                                              ttff.ToSeconds(),
+                                              timer.mWarm ? "warm" : "cold");
+        }
+        timer.mStart = TimeStamp();
+      }
+      if (mLocation.timestamp > 0) {
+        GetWarmStart().SetClockOffset(mTime, mLocation.timestamp - mTime);
+      }
+
+      GetLocationFusion().Update(LocationFusionFilter::SOURCE_GPS, mTime,
+                                 mLocation.latitude, mLocation.longitude,
+                                 mLocation.accuracy, mSpeed, mBearing);
       if (callback) {
         callback->Update(mPosition);
       }
@@ -130,6 +319,11 @@ GonkGPSGeolocationProvider::LocationCallback(GpsLocation* location)
     }
   private:
     nsRefPtr<nsGeoPosition> mPosition;
+    GpsLocation mLocation;
+    int64_t mTime;
+    // Negative when unknown
+    double mSpeed;
+    double mBearing;
   };
 
   MOZ_ASSERT(location);
@@ -139,6 +333,7 @@ GonkGPSGeolocationProvider::LocationCallback(GpsLocation* location)
     return;
   }
 
+  int64_t now = PR_Now() / PR_USEC_PER_MSEC;
   nsRefPtr<nsGeoPosition> somewhere = new nsGeoPosition(location->latitude,
                                                         location->longitude,
                                                         location->altitude,
@@ -146,7 +341,7 @@ GonkGPSGeolocationProvider::LocationCallback(GpsLocation* location)
                                                         location->accuracy,
                                                         location->bearing,
                                                         location->speed,
-                                                        PR_Now() / PR_USEC_PER_MSEC);
+                                                        now);
   // Note above: Can't use location->timestamp as the time from the satellite is a
   // minimum of 16 secs old (see http://leapsecond.com/java/gpsclock.htm).
   // All code from this point on expects the gps location to be timestamped with the
@@ -154,98 +349,81 @@ GonkGPSGeolocationProvider::LocationCallback(GpsLocation* location)
   // set in the DOM JS.
 
 
-  NS_DispatchToMainThread(new UpdateLocationEvent(somewhere));
-
-  class RequestCellInfoEvent : public nsRunnable {
-  public:
-    RequestCellInfoEvent(StumblerInfo *callback)
-      : mRequestCallback(callback)
-      {}
-
-    NS_IMETHOD Run() {
-      MOZ_ASSERT(NS_IsMainThread());
-      // Get Cell Info
-      nsCOMPtr<nsIMobileConnectionService> service =
-        do_GetService(NS_MOBILE_CONNECTION_SERVICE_CONTRACTID);
-
-      if (!service) {
-        nsContentUtils::LogMessageToConsole("Stumbler-can not get nsIMobileConnectionService \n");
-      } else {
-        nsCOMPtr<nsIMobileConnection> connection;
-        uint32_t numberOfRilServices = 1, cellInfoNum = 0;
-
-        service->GetNumItems(&numberOfRilServices);
-        for (uint32_t rilNum = 0; rilNum < numberOfRilServices; rilNum++) {
-          service->GetItemByServiceId(rilNum /* Client Id */, getter_AddRefs(connection));
-          if (!connection) {
-            nsContentUtils::LogMessageToConsole("Stumbler-can not get nsIMobileConnection \n");
-          } else {
-            cellInfoNum++;
-            connection->GetCellInfoList(mRequestCallback);
-          }
-        }
-        mRequestCallback->SetCellInfoResponsesExpected(cellInfoNum);
-      }
-
-      // Get Wifi AP Info
-      nsCOMPtr<nsIInterfaceRequestor> ir = do_GetService("@mozilla.org/telephony/system-worker-manager;1");
-      if (!ir) {
-        nsContentUtils::LogMessageToConsole("Stumbler-doesn't get nsIInterfaceRequestor \n");
-        return NS_OK;
-      } else {
-        nsCOMPtr<nsIWifi> wifi = do_GetInterface(ir);
-        if (!wifi) {
-          mRequestCallback->SetWifiInfoResponseReceived();
-          nsContentUtils::LogMessageToConsole("Stumbler-can not get nsIWifi interface\n");
-          return NS_OK;
-        } else {
-          wifi->GetWifiScanResults(mRequestCallback);
-          return NS_OK;
-        }
-      }
+  double speed = (location->flags & GPS_LOCATION_HAS_SPEED) ? location->speed : -1;
+  double bearing = (location->flags & GPS_LOCATION_HAS_BEARING) ? location->bearing : -1;
+  NS_DispatchToMainThread(new UpdateLocationEvent(somewhere, *location, now,
+                                                  speed, bearing));
+
+  StumbleScheduler::Fix fix;
+  fix.mTime = now;
+  fix.mLatitude = location->latitude;
+  fix.mLongitude = location->longitude;
+  fix.mSpeed = speed;
+  fix.mBearing = bearing;
+  StumblerStats::Add(StumblerStats::FIXES);
+
+  // Cell and wifi data placed at a poor fix would only mislead the
+  // server, so the scan is not even requested.
+  StumbleFixQuality quality = StumbleNmeaParser::Latest(fix.mTime);
+  StumbleSvSummary svStatus = StumbleSvStatus::Read();
+  if (quality.IsPoor(fix.mTime) || svStatus.IsPoor(fix.mTime)) {
+    StumblerStats::Add(StumblerStats::FIXES_LOW_QUALITY);
+    if (gDebug_isLoggingEnabled) {
+      nsContentUtils::LogMessageToConsole("Stumbler-Low quality fix. hdop:%u.%02u used:%u type:%d sv used:%u top snr:%u\n",
+                                          quality.mHdopCenti / 100, quality.mHdopCenti % 100,
+                                          quality.mSatellitesUsed, quality.mFixType,
+                                          svStatus.mUsed, svStatus.mTopSnr);
     }
-  private:
-    nsRefPtr<StumblerInfo> mRequestCallback;
-  };
-
-  const double kMinChangeInMeters = 30;
-  static int64_t lastTime_ms = 0;
-  static double sLastLat = 0;
-  static double sLastLon = 0;
-  double delta = -1.0;
-  int64_t timediff = (PR_Now() / PR_USEC_PER_MSEC) - lastTime_ms;
-
-  if (0 != sLastLon || 0 != sLastLat) {
-    delta = CalculateDeltaInMeter(location->latitude, location->longitude, sLastLat, sLastLon);
+    return;
   }
 
+  sStumbleScheduler.UpdateNovelty(StumblerStats::Get(StumblerStats::RECORDS_WRITTEN),
+                           StumblerStats::Get(StumblerStats::RECORDS_DEDUPED));
+  uint64_t fixedPolicyScans = sStumbleScheduler.FixedPolicyScans();
+  bool shouldScan = sStumbleScheduler.ShouldScan(fix);
+  StumblerStats::Add(StumblerStats::SCANS_FIXED_POLICY,
+                     sStumbleScheduler.FixedPolicyScans() - fixedPolicyScans);
+
   if (gDebug_isLoggingEnabled) {
-    nsContentUtils::LogMessageToConsole("Stumbler-Location. [%f , %f] time_diff:%lld, delta : %f\n", location->longitude, location->latitude, timediff, delta);
+    nsContentUtils::LogMessageToConsole("Stumbler-Location. [%f , %f] speed:%f, scan:%d\n", location->longitude, location->latitude, fix.mSpeed, shouldScan);
   }
 
-  if (lastTime_ms == 0 || ((timediff >= STUMBLE_INTERVAL_MS) && (delta > kMinChangeInMeters))){
-    lastTime_ms = (PR_Now() / PR_USEC_PER_MSEC);
-    sLastLat = location->latitude;
-    sLastLon = location->longitude;
-
+  if (shouldScan) {
+    StumblerStats::Add(StumblerStats::SCANS);
     nsRefPtr<StumblerInfo> sRequestCallback = new StumblerInfo(somewhere);
-    NS_DispatchToMainThread(new RequestCellInfoEvent(sRequestCallback));
-  } else {
-    // if we can two continuous location update in the same place. ignore once.
-    if (gDebug_isLoggingEnabled) {
-      nsContentUtils::LogMessageToConsole("Stumbler-less than %d ms. ignore once.\n", STUMBLE_INTERVAL_MS);
+    if (quality.IsFresh(fix.mTime)) {
+      sRequestCallback->SetFixQuality(quality);
     }
+    NS_DispatchToMainThread(new RequestCellInfoEvent(sRequestCallback));
   }
 }
 
 void
 GonkGPSGeolocationProvider::StatusCallback(GpsStatus* status)
 {
+  MOZ_ASSERT(status);
+  if (status->status == GPS_STATUS_SESSION_END ||
+      status->status == GPS_STATUS_ENGINE_OFF) {
+    StumbleSvStatus::Clear();
+  }
 }
 
 void
 GonkGPSGeolocationProvider::SvStatusCallback(GpsSvStatus* sv_info)
 {
+  MOZ_ASSERT(sv_info);
+
+  // Called on the GPS HAL thread; LocationCallback reads the summary.
+  StumbleSvSummaryBuilder builder(PR_Now() / PR_USEC_PER_MSEC);
+  int count = sv_info->num_svs < GPS_MAX_SVS ? sv_info->num_svs : GPS_MAX_SVS;
+  for (int i = 0; i < count; i++) {
+    const GpsSvInfo& sv = sv_info->sv_list[i];
+    // used_in_fix_mask only covers GPS, bit (PRN - 1)
+    bool used = sv.prn >= 1 && sv.prn <= 32 &&
+                (sv_info->used_in_fix_mask & (1u << (sv.prn - 1)));
+    builder.AddSatellite(sv.prn, sv.snr, used);
+  }
+  StumbleSvStatus::Publish(builder.Finish(sv_info->used_in_fix_mask != 0));
 }
 
 void
@@ -255,6 +433,18 @@ GonkGPSGeolocationProvider::NmeaCallback(GpsUtcTime timestamp, const char* nmea,
     nsContentUtils::LogMessageToConsole("geo: NMEA: timestamp:\t%lld, length: %d, %s",
                                         timestamp, length, nmea);
   }
+
+  // Only called on the GPS HAL thread, like LocationCallback, which reads
+  // the fix quality this publishes.
+  static StumbleNmeaParser sNmeaParser;
+  if (!nmea || length <= 0) {
+    return;
+  }
+  uint64_t sentences = sNmeaParser.Sentences();
+  uint64_t rejected = sNmeaParser.Rejected();
+  sNmeaParser.Feed(nmea, length, PR_Now() / PR_USEC_PER_MSEC);
+  StumblerStats::Add(StumblerStats::NMEA_SENTENCES, sNmeaParser.Sentences() - sentences);
+  StumblerStats::Add(StumblerStats::NMEA_REJECTED, sNmeaParser.Rejected() - rejected);
 }
 
 void
@@ -320,6 +510,19 @@ GonkGPSGeolocationProvider::CreateThreadCallback(const char* name, void (*start)
 void
 GonkGPSGeolocationProvider::RequestUtcTimeCallback()
 {
+  class InjectTimeEvent : public nsRunnable {
+  public:
+    NS_IMETHOD Run() {
+      nsRefPtr<GonkGPSGeolocationProvider> provider =
+        GonkGPSGeolocationProvider::GetSingleton();
+      if (provider->mGpsInterface) {
+        InjectGpsTime(provider->mGpsInterface);
+      }
+      return NS_OK;
+    }
+  };
+
+  NS_DispatchToMainThread(new InjectTimeEvent());
 }
 
 #ifdef MOZ_B2G_RIL
@@ -380,19 +583,62 @@ GonkGPSGeolocationProvider::AGPSRILRefLocCallback(uint32_t flags)
 {
   class RequestRefLocEvent : public nsRunnable {
   public:
-    RequestRefLocEvent()
+    explicit RequestRefLocEvent(const TimeStamp& aRequestTime)
+      : mRequestTime(aRequestTime)
     {}
     NS_IMETHOD Run() {
       nsRefPtr<GonkGPSGeolocationProvider> provider =
         GonkGPSGeolocationProvider::GetSingleton();
       provider->SetReferenceLocation();
+      StumblerStats::AddLatencySince(StumblerStats::STAGE_REF_LOCATION, mRequestTime);
+      return NS_OK;
+    }
+  private:
+    TimeStamp mRequestTime;
+  };
+
+  if (!(flags & AGPS_RIL_REQUEST_REFLOC_CELLID)) {
+    return;
+  }
+
+  class SetRefLocEvent : public nsRunnable {
+  public:
+    SetRefLocEvent(const AGpsRefLocation& aLocation, const TimeStamp& aRequestTime)
+      : mLocation(aLocation)
+      , mRequestTime(aRequestTime)
+    {}
+    NS_IMETHOD Run() {
+      const AGpsRilInterface* agpsRil = sAGpsRilInterface;
+      if (agpsRil) {
+        agpsRil->set_ref_location(&mLocation, sizeof(mLocation));
+        StumblerStats::AddLatencySince(StumblerStats::STAGE_REF_LOCATION, mRequestTime);
+      }
       return NS_OK;
     }
+  private:
+    AGpsRefLocation mLocation;
+    TimeStamp mRequestTime;
   };
 
-  if (flags & AGPS_RIL_REQUEST_REFLOC_CELLID) {
-    NS_DispatchToMainThread(new RequestRefLocEvent());
+  TimeStamp requestTime = TimeStamp::Now();
+  AGpsRefLocation location;
+  bool hasLocation;
+  nsCOMPtr<nsIThread> thread;
+  {
+    StaticMutexAutoLock lock(sRefLocationMutex);
+    hasLocation = sHasRefLocation;
+    location = sRefLocation;
+    thread = sRefLocationThread;
+  }
+  if (hasLocation && thread && sAGpsRilInterface) {
+    nsresult rv = thread->Dispatch(new SetRefLocEvent(location, requestTime),
+                                   NS_DISPATCH_NORMAL);
+    if (NS_SUCCEEDED(rv)) {
+      return;
+    }
   }
+  // Not known yet, e.g. before the RIL service was chosen
+  NS_DispatchToMainThread(new RequestRefLocEvent(requestTime));
 }
 #endif // MOZ_B2G_RIL
 
@@ -641,6 +887,244 @@ ConvertToGpsRefLocationType(const nsAString& aConnectionType)
 }
 } // namespace
 
+/*
+ Reads the reference location from the voice connection of aConnection.
+ Returns false if there is no voice connection.
+ */
+static bool
+ReadRefLocation(nsIMobileConnection* aConnection, AGpsRefLocation* aLocation)
+{
+  MOZ_ASSERT(NS_IsMainThread());
+
+  AGpsRefLocation location;
+  memset(&location, 0, sizeof(location));
+
+  nsCOMPtr<nsIMobileConnectionInfo> voice;
+  aConnection->GetVoice(getter_AddRefs(voice));
+  if (!voice) {
+    NS_WARNING("Cannot get mobile connection info.");
+    return false;
+  }
+
+  nsAutoString connectionType;
+  nsresult rv = voice->GetType(connectionType);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    return false;
+  }
+  location.type = ConvertToGpsRefLocationType(connectionType);
+
+  nsCOMPtr<nsIMobileNetworkInfo> networkInfo;
+  voice->GetNetwork(getter_AddRefs(networkInfo));
+  if (networkInfo) {
+    nsresult result;
+    nsAutoString mcc, mnc;
+
+    networkInfo->GetMcc(mcc);
+    networkInfo->GetMnc(mnc);
+
+    location.u.cellID.mcc = mcc.ToInteger(&result);
+    if (result != NS_OK) {
+      NS_WARNING("Cannot parse mcc to integer");
+      location.u.cellID.mcc = 0;
+    }
+
+    location.u.cellID.mnc = mnc.ToInteger(&result);
+    if (result != NS_OK) {
+      NS_WARNING("Cannot parse mnc to integer");
+      location.u.cellID.mnc = 0;
+    }
+  } else {
+    NS_WARNING("Cannot get mobile network info.");
+  }
+
+  nsCOMPtr<nsIMobileCellInfo> cell;
+  voice->GetCell(getter_AddRefs(cell));
+  if (cell) {
+    int32_t lac;
+    int64_t cid;
+
+    cell->GetGsmLocationAreaCode(&lac);
+    // The valid range of LAC is 0x0 to 0xffff which is defined in
+    // hardware/ril/include/telephony/ril.h
+    if (lac >= 0x0 && lac <= 0xffff) {
+      location.u.cellID.lac = lac;
+    }
+
+    cell->GetGsmCellId(&cid);
+    // The valid range of cell id is 0x0 to 0xffffffff which is defined in
+    // hardware/ril/include/telephony/ril.h
+    if (cid >= 0x0 && cid <= 0xffffffff) {
+      location.u.cellID.cid = cid;
+    }
+  } else {
+    NS_WARNING("Cannot get mobile gell info.");
+    location.u.cellID.lac = -1;
+    location.u.cellID.cid = -1;
+  }
+
+  *aLocation = location;
+  return true;
+}
+
+/*
+ Re-reads the reference location whenever the voice connection of the
+ RIL data service changes (which includes a new serving cell) or the
+ radio is switched, so the cached one is current when the GPS asks.
+ */
+class RefLocationListener final : public nsIMobileConnectionListener
+{
+public:
+  NS_DECL_ISUPPORTS
+  NS_DECL_NSIMOBILECONNECTIONLISTENER
+
+  explicit RefLocationListener(nsIMobileConnection* aConnection)
+    : mConnection(aConnection)
+  {}
+
+  void Refresh()
+  {
+    AGpsRefLocation location;
+    SetCachedRefLocation(ReadRefLocation(mConnection, &location) ? &location : nullptr);
+  }
+
+  void Unregister()
+  {
+    mConnection->UnregisterListener(this);
+    SetCachedRefLocation(nullptr);
+  }
+
+private:
+  ~RefLocationListener() {}
+
+  nsCOMPtr<nsIMobileConnection> mConnection;
+};
+
+NS_IMPL_ISUPPORTS(RefLocationListener, nsIMobileConnectionListener)
+
+NS_IMETHODIMP
+RefLocationListener::NotifyVoiceChanged()
+{
+  Refresh();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyRadioStateChanged()
+{
+  Refresh();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyDataChanged()
+{
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyDataError(const nsAString& aMessage)
+{
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyCFStateChanged(uint16_t aAction,
+                                          uint16_t aReason,
+                                          const nsAString& aNumber,
+                                          uint16_t aTimeSeconds,
+                                          uint16_t aServiceClass)
+{
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyEmergencyCbModeChanged(bool aActive, uint32_t aTimeoutMs)
+{
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyOtaStatusChanged(const nsAString& aStatus)
+{
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyClirModeChanged(uint32_t aMode)
+{
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyLastKnownNetworkChanged()
+{
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyLastKnownHomeNetworkChanged()
+{
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyNetworkSelectionModeChanged()
+{
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+RefLocationListener::NotifyDeviceIdentitiesChanged()
+{
+  return NS_OK;
+}
+
+// Main thread only
+static StaticRefPtr<RefLocationListener> sRefLocationListener;
+
+static void
+StopListeningForRefLocation()
+{
+  MOZ_ASSERT(NS_IsMainThread());
+
+  if (sRefLocationListener) {
+    sRefLocationListener->Unregister();
+    sRefLocationListener = nullptr;
+  }
+}
+
+/*
+ Listens to the connection of aServiceId instead of the previous one,
+ and reads its reference location now.
+ */
+static void
+ListenForRefLocation(uint32_t aServiceId)
+{
+  StopListeningForRefLocation();
+
+  nsCOMPtr<nsIMobileConnectionService> service =
+    do_GetService(NS_MOBILE_CONNECTION_SERVICE_CONTRACTID);
+  if (!service) {
+    NS_WARNING("Cannot get MobileConnectionService");
+    return;
+  }
+  nsCOMPtr<nsIMobileConnection> connection;
+  service->GetItemByServiceId(aServiceId, getter_AddRefs(connection));
+  NS_ENSURE_TRUE_VOID(connection);
+
+  nsRefPtr<RefLocationListener> listener = new RefLocationListener(connection);
+  if (NS_FAILED(connection->RegisterListener(listener))) {
+    NS_WARNING("Cannot listen to the voice connection");
+    return;
+  }
+  listener->Refresh();
+  sRefLocationListener = listener;
+}
+
+/*
+ Answers the GPS when AGPSRILRefLocCallback had no cached reference
+ location, and caches the one read.
+ */
 void
 GonkGPSGeolocationProvider::SetReferenceLocation()
 {
@@ -651,8 +1135,6 @@ GonkGPSGeolocationProvider::SetReferenceLocation()
     return;
   }
 
-  AGpsRefLocation location;
-
   nsCOMPtr<nsIMobileConnectionService> service =
     do_GetService(NS_MOBILE_CONNECTION_SERVICE_CONTRACTID);
   if (!service) {
@@ -664,70 +1146,13 @@ GonkGPSGeolocationProvider::SetReferenceLocation()
   service->GetItemByServiceId(mRilDataServiceId, getter_AddRefs(connection));
   NS_ENSURE_TRUE_VOID(connection);
 
-  nsCOMPtr<nsIMobileConnectionInfo> voice;
-  connection->GetVoice(getter_AddRefs(voice));
-  if (voice) {
-    nsAutoString connectionType;
-    nsresult rv = voice->GetType(connectionType);
-    if (NS_WARN_IF(NS_FAILED(rv))) {
-      return;
-    }
-    location.type = ConvertToGpsRefLocationType(connectionType);
-
-    nsCOMPtr<nsIMobileNetworkInfo> networkInfo;
-    voice->GetNetwork(getter_AddRefs(networkInfo));
-    if (networkInfo) {
-      nsresult result;
-      nsAutoString mcc, mnc;
-
-      networkInfo->GetMcc(mcc);
-      networkInfo->GetMnc(mnc);
-
-      location.u.cellID.mcc = mcc.ToInteger(&result);
-      if (result != NS_OK) {
-        NS_WARNING("Cannot parse mcc to integer");
-        location.u.cellID.mcc = 0;
-      }
-
-      location.u.cellID.mnc = mnc.ToInteger(&result);
-      if (result != NS_OK) {
-        NS_WARNING("Cannot parse mnc to integer");
-        location.u.cellID.mnc = 0;
-      }
-    } else {
-      NS_WARNING("Cannot get mobile network info.");
-      location.u.cellID.mcc = 0;
-      location.u.cellID.mnc = 0;
-    }
-
-    nsCOMPtr<nsIMobileCellInfo> cell;
-    voice->GetCell(getter_AddRefs(cell));
-    if (cell) {
-      int32_t lac;
-      int64_t cid;
-
-      cell->GetGsmLocationAreaCode(&lac);
-      // The valid range of LAC is 0x0 to 0xffff which is defined in
-      // hardware/ril/include/telephony/ril.h
-      if (lac >= 0x0 && lac <= 0xffff) {
-        location.u.cellID.lac = lac;
-      }
-
-      cell->GetGsmCellId(&cid);
-      // The valid range of cell id is 0x0 to 0xffffffff which is defined in
-      // hardware/ril/include/telephony/ril.h
-      if (cid >= 0x0 && cid <= 0xffffffff) {
-        location.u.cellID.cid = cid;
-      }
-    } else {
-      NS_WARNING("Cannot get mobile gell info.");
-      location.u.cellID.lac = -1;
-      location.u.cellID.cid = -1;
-    }
-  } else {
-    NS_WARNING("Cannot get mobile connection info.");
+  AGpsRefLocation location;
+  if (!ReadRefLocation(connection, &location)) {
     return;
   }
+  if (sRefLocationListener) {
+    SetCachedRefLocation(&location);
+  }
   mAGpsRilInterface->set_ref_location(&location, sizeof(location));
 }
 
@@ -801,11 +1226,34 @@ GonkGPSGeolocationProvider::Init()
   mAGpsRilInterface =
     static_cast<const AGpsRilInterface*>(mGpsInterface->get_extension(AGPS_RIL_INTERFACE));
   if (mAGpsRilInterface) {
+    sAGpsRilInterface = mAGpsRilInterface;
     mAGpsRilInterface->init(&mAGPSRILCallbacks);
   }
 #endif
 
-  NS_DispatchToMainThread(NS_NewRunnableMethod(this, &GonkGPSGeolocationProvider::StartGPS));
+  class StartGPSEvent : public nsRunnable {
+  public:
+    explicit StartGPSEvent(const LocationWarmStart& aWarmStart)
+      : mWarmStart(aWarmStart)
+    {}
+    NS_IMETHOD Run() {
+      nsRefPtr<GonkGPSGeolocationProvider> provider =
+        GonkGPSGeolocationProvider::GetSingleton();
+      GetWarmStart() = mWarmStart;
+      provider->StartGPS();
+      return NS_OK;
+    }
+  private:
+    LocationWarmStart mWarmStart;
+  };
+
+  // Read here, off the main thread; see StartGPS()
+  LocationWarmStart warmStart;
+  nsresult rv = warmStart.Load();
+  if (NS_FAILED(rv)) {
+    NS_WARNING("geo: Cannot load the warm start state");
+  }
+  NS_DispatchToMainThread(new StartGPSEvent(warmStart));
 }
 
 void
@@ -846,6 +1294,28 @@ GonkGPSGeolocationProvider::StartGPS()
   mGpsInterface->delete_aiding_data(GPS_DELETE_ALL);
 #endif
 
+  // Warm start: the last estimate, unless the fusion filter has a newer
+  // one, and the time, so the first search is narrower.
+  int64_t now = PR_Now() / PR_USEC_PER_MSEC;
+  LocationFusionFilter& fusion = GetLocationFusion();
+  int64_t fixTime;
+  double lat, lon, acc;
+  if (!fusion.HasEstimate() &&
+      GetWarmStart().GetFix(now, &fixTime, &lat, &lon, &acc)) {
+    fusion.Update(LocationFusionFilter::SOURCE_NETWORK, fixTime, lat, lon, acc);
+  }
+  FirstFixTimer& timer = GetFirstFixTimer();
+  timer.mWarm = false;
+  if (fusion.HasEstimate()) {
+    LocationFusionFilter::Estimate estimate = fusion.Predict(now);
+    if (estimate.mAccuracy <= kMaxWarmStartAccuracy) {
+      InjectLocation(estimate.mLatitude, estimate.mLongitude, estimate.mAccuracy);
+      timer.mWarm = true;
+    }
+  }
+  InjectGpsTime(mGpsInterface);
+
+  timer.mStart = TimeStamp::Now();
   mGpsInterface->start();
 }
 
@@ -877,6 +1347,7 @@ GonkGPSGeolocationProvider::UpdateRadioInterface()
   nsCOMPtr<nsIRadioInterfaceLayer> ril = do_GetService("@mozilla.org/ril;1");
   NS_ENSURE_TRUE_VOID(ril);
   ril->GetRadioInterface(mRilDataServiceId, getter_AddRefs(mRadioInterface));
+  ListenForRefLocation(mRilDataServiceId);
 }
 
 bool
@@ -890,6 +1361,10 @@ GonkGPSGeolocationProvider::IsValidRilServiceId(uint32_t aServiceId)
 NS_IMPL_ISUPPORTS(GonkGPSGeolocationProvider::NetworkLocationUpdate,
                   nsIGeolocationUpdate)
 
+// The network gives no altitude; a fused position takes that of a GPS fix
+// younger than this (ms), so watchers do not see it drop between fixes.
+static const int64_t kGpsAltitudeMaxAgeMs = 10 * 1000;
+
 NS_IMETHODIMP
 GonkGPSGeolocationProvider::NetworkLocationUpdate::Update(nsIDOMGeoPosition *position)
 {
@@ -907,59 +1382,51 @@ GonkGPSGeolocationProvider::NetworkLocationUpdate::Update(nsIDOMGeoPosition *pos
   coords->GetLongitude(&lon);
   coords->GetAccuracy(&acc);
 
-  double delta = -1.0;
-
-  static double sLastMLSPosLat = 0;
-  static double sLastMLSPosLon = 0;
-
-  if (0 != sLastMLSPosLon || 0 != sLastMLSPosLat) {
-    delta = CalculateDeltaInMeter(lat, lon, sLastMLSPosLat, sLastMLSPosLon);
-  }
-
-  sLastMLSPosLat = lat;
-  sLastMLSPosLon = lon;
-
-  // if the MLS coord change is smaller than this arbitrarily small value
-  // assume the MLS coord is unchanged, and stick with the GPS location
-  const double kMinMLSCoordChangeInMeters = 10;
+  // The network position is combined with the GPS fixes, weighted by
+  // their accuracies and the time since each. While the GPS is on, the
+  // estimate follows it; once the GPS stops, it extrapolates the last
+  // motion and shifts towards the network positions as it becomes less
+  // certain, instead of switching to them after a fixed time.
+  int64_t now = PR_Now() / PR_USEC_PER_MSEC;
+  LocationFusionFilter& fusion = GetLocationFusion();
+  bool accepted = fusion.Update(LocationFusionFilter::SOURCE_NETWORK, now,
+                                lat, lon, acc);
+  LocationFusionFilter::Estimate estimate = fusion.Predict(now);
 
   DOMTimeStamp time_ms = 0;
   if (provider->mLastGPSPosition) {
     provider->mLastGPSPosition->GetTimestamp(&time_ms);
   }
-  const int64_t diff_ms = (PR_Now() / PR_USEC_PER_MSEC) - time_ms;
 
-  // We want to distinguish between the GPS being inactive completely
-  // and temporarily inactive. In the former case, we would use a low
-  // accuracy network location; in the latter, we only want a network
-  // location that appears to updating with movement.
-
-  const bool isGPSFullyInactive = diff_ms > 1000 * 60 * 2; // two mins
-  const bool isGPSTempInactive = diff_ms > 1000 * 10; // 10 secs
+  if (gDebug_isLoggingEnabled) {
+    nsContentUtils::LogMessageToConsole("geo: Using fused location, GPS age:%fs, accuracy:%fm, MLS %s\n",
+                                        (now - int64_t(time_ms)) / 1000.0,
+                                        estimate.mAccuracy,
+                                        accepted ? "used" : "rejected");
+  }
 
   if (provider->mLocationCallback) {
-    if (isGPSFullyInactive ||
-       (isGPSTempInactive && delta > kMinMLSCoordChangeInMeters))
-    {
-      if (gDebug_isLoggingEnabled) {
-        nsContentUtils::LogMessageToConsole("geo: Using MLS, GPS age:%fs, MLS Delta:%fm\n",
-                                            diff_ms / 1000.0, delta);
+    double alt = UnspecifiedNaN<double>();
+    double altAcc = UnspecifiedNaN<double>();
+    if (provider->mLastGPSPosition && now - int64_t(time_ms) <= kGpsAltitudeMaxAgeMs) {
+      nsCOMPtr<nsIDOMGeoPositionCoords> gpsCoords;
+      provider->mLastGPSPosition->GetCoords(getter_AddRefs(gpsCoords));
+      if (gpsCoords) {
+        gpsCoords->GetAltitude(&alt);
+        gpsCoords->GetAltitudeAccuracy(&altAcc);
       }
-      provider->mLocationCallback->Update(position);
-    } else if (provider->mLastGPSPosition) {
-      if (gDebug_isLoggingEnabled) {
-        nsContentUtils::LogMessageToConsole("geo: Using old GPS age:%fs\n",
-                                            diff_ms / 1000.0);
-      }
-
-      // This is a fallback case so that the GPS provider responds with its last
-      // location rather than waiting for a more recent GPS or network location.
-      // The service decides if the location is too old, not the provider.
-      provider->mLocationCallback->Update(provider->mLastGPSPosition);
     }
+    nsRefPtr<nsGeoPosition> fused =
+      new nsGeoPosition(estimate.mLatitude, estimate.mLongitude,
+                        alt, estimate.mAccuracy,
+                        altAcc, estimate.mHeading,
+                        estimate.mSpeed, now);
+    // The service decides if the location is too old, not the provider.
+    provider->mLocationCallback->Update(fused);
   }
 
-  provider->InjectLocation(lat, lon, acc);
+  provider->InjectLocation(estimate.mLatitude, estimate.mLongitude,
+                           estimate.mAccuracy);
   return NS_OK;
 }
 
@@ -972,6 +1439,9 @@ GonkGPSGeolocationProvider::NetworkLocationUpdate::LocationUpdatePending()
 NS_IMETHODIMP
 GonkGPSGeolocationProvider::NetworkLocationUpdate::NotifyError(uint16_t error)
 {
+  // No network, or MLS failed: fall back to the past stumbles. The
+  // position comes back through Update(), so it is fused and injected.
+  RequestOfflineLocation(this);
   return NS_OK;
 }
 
@@ -987,6 +1457,8 @@ GonkGPSGeolocationProvider::Startup()
   RequestSettingValue(kSettingDebugEnabled);
   RequestSettingValue(kSettingDebugGpsIgnored);
 
+  StumblerStats::RegisterMemoryReporter();
+
   // Setup an observer to watch changes to the setting.
   nsCOMPtr<nsIObserverService> observerService = services::GetObserverService();
   if (observerService) {
@@ -1003,18 +1475,27 @@ GonkGPSGeolocationProvider::Startup()
     nsresult rv = NS_NewThread(getter_AddRefs(mInitThread));
     NS_ENSURE_SUCCESS(rv, rv);
   }
+#ifdef MOZ_B2G_RIL
+  {
+    StaticMutexAutoLock lock(sRefLocationMutex);
+    sRefLocationThread = mInitThread;
+  }
+#endif
 
   mInitThread->Dispatch(NS_NewRunnableMethod(this, &GonkGPSGeolocationProvider::Init),
                         NS_DISPATCH_NORMAL);
 
+  nsRefPtr<NetworkLocationUpdate> update = new NetworkLocationUpdate();
   mNetworkLocationProvider = do_CreateInstance("@mozilla.org/geolocation/mls-provider;1");
   if (mNetworkLocationProvider) {
     nsresult rv = mNetworkLocationProvider->Startup();
     if (NS_SUCCEEDED(rv)) {
-      nsRefPtr<NetworkLocationUpdate> update = new NetworkLocationUpdate();
       mNetworkLocationProvider->Watch(update);
     }
   }
+  // A first position for the GPS and the callback, usually well before
+  // MLS answers
+  RequestOfflineLocation(update);
 
   mStarted = true;
 #ifdef MOZ_B2G_RIL
@@ -1069,6 +1550,45 @@ GonkGPSGeolocationProvider::Shutdown()
   mInitThread->Dispatch(NS_NewRunnableMethod(this, &GonkGPSGeolocationProvider::ShutdownGPS),
                         NS_DISPATCH_NORMAL);
 
+  class SaveWarmStartEvent : public nsRunnable {
+  public:
+    explicit SaveWarmStartEvent(const LocationWarmStart& aWarmStart)
+      : mWarmStart(aWarmStart)
+    {}
+    NS_IMETHOD Run() {
+      MOZ_ASSERT(!NS_IsMainThread());
+      nsresult rv = mWarmStart.Save();
+      if (NS_FAILED(rv)) {
+        NS_WARNING("geo: Cannot save the warm start state");
+      }
+      return NS_OK;
+    }
+  private:
+    LocationWarmStart mWarmStart;
+  };
+
+  // For the next start, written on the init thread after the GPS stopped
+  LocationWarmStart& warmStart = GetWarmStart();
+  LocationFusionFilter& fusion = GetLocationFusion();
+  if (fusion.HasEstimate()) {
+    LocationFusionFilter::Estimate estimate = fusion.Predict(PR_Now() / PR_USEC_PER_MSEC);
+    warmStart.SetFix(estimate.mTime, estimate.mLatitude, estimate.mLongitude,
+                     estimate.mAccuracy);
+  }
+  mInitThread->Dispatch(new SaveWarmStartEvent(warmStart), NS_DISPATCH_NORMAL);
+#ifdef MOZ_B2G_RIL
+  StopListeningForRefLocation();
+  {
+    // Later requests go through the main thread.
+    StaticMutexAutoLock lock(sRefLocationMutex);
+    sRefLocationThread = nullptr;
+  }
+#endif
+  // A fix still on its way is not a first fix
+  GetFirstFixTimer().mStart = TimeStamp();
+
+  WriteStumbleOnThread::FinishWriter();
+
   return NS_OK;
 }
 
@@ -1081,6 +1601,8 @@ GonkGPSGeolocationProvider::ShutdownGPS()
     mGpsInterface->stop();
     mGpsInterface->cleanup();
   }
+  // The next session does not space its scans from this one's last.
+  sStumbleScheduler = StumbleScheduler();
 }
 
 NS_IMETHODIMP
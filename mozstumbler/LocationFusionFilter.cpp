@@ -0,0 +1,235 @@
+#include "LocationFusionFilter.h"
+#include "StumblerGeodesy.h"
+#include "mozilla/Constants.h"
+#include "mozilla/FloatingPoint.h"
+#include <math.h>
+
+using namespace mozilla;
+
+const double LocationFusionFilter::kVelocityTau = 20;
+const double LocationFusionFilter::kVelocitySigma = 8;
+const double LocationFusionFilter::kMinHeadingSpeed = 0.5;
+
+static const double kRadsInDeg = M_PI / 180.0;
+static const double kMetersPerDegree = kRadsInDeg * kGeoEarthRadiusMeters;
+
+// Accuracies are clamped to this, so no measurement is taken as exact.
+static const double kMinAccuracy = 1;
+// Of the GPS speed and heading, per axis
+static const double kVelocityAccuracy = 1;
+// Squared distance over the summed variances beyond which a position is
+// an outlier: the 99.9% point of chi-square with two degrees of freedom
+static const double kOutlierGate = 13.8;
+// This many network outliers in a row restart the filter from the last,
+// e.g. after the device moved far with the GPS off.
+static const uint32_t kMaxOutliersInRow = 3;
+// The reference point moves to the estimate once it is this far away.
+static const double kRecenterMeters = 10000;
+
+LocationFusionFilter::LocationFusionFilter()
+  : mHasState(false)
+  , mTime(0)
+  , mRefLatitude(0)
+  , mRefLongitude(0)
+  , mLonScale(kMetersPerDegree)
+  , mOutliersInRow(0)
+  , mState()
+{
+}
+
+void
+LocationFusionFilter::ToPlane(double aLatitude, double aLongitude,
+                              double* aX, double* aY) const
+{
+  double dLon = aLongitude - mRefLongitude;
+  if (dLon > 180) {
+    dLon -= 360;
+  } else if (dLon < -180) {
+    dLon += 360;
+  }
+  *aX = dLon * mLonScale;
+  *aY = (aLatitude - mRefLatitude) * kMetersPerDegree;
+}
+
+void
+LocationFusionFilter::FromPlane(double aX, double aY,
+                                double* aLatitude, double* aLongitude) const
+{
+  *aLatitude = mRefLatitude + aY / kMetersPerDegree;
+  double lon = mRefLongitude + aX / mLonScale;
+  if (lon > 180) {
+    lon -= 360;
+  } else if (lon < -180) {
+    lon += 360;
+  }
+  *aLongitude = lon;
+}
+
+void
+LocationFusionFilter::Start(int64_t aTimeMs, double aLatitude,
+                            double aLongitude, double aAccuracy)
+{
+  mHasState = true;
+  mTime = aTimeMs;
+  mOutliersInRow = 0;
+  SetReference(aLatitude, aLongitude);
+  mState.mX[0] = mState.mX[1] = 0;
+  mState.mY[0] = mState.mY[1] = 0;
+  mState.mPP = aAccuracy * aAccuracy;
+  mState.mPV = 0;
+  mState.mVV = kVelocitySigma * kVelocitySigma;
+}
+
+void
+LocationFusionFilter::SetReference(double aLatitude, double aLongitude)
+{
+  mRefLatitude = aLatitude;
+  mRefLongitude = aLongitude;
+  // Clamped, so the plane stays usable next to the poles
+  double cosLat = cos(aLatitude * kRadsInDeg);
+  mLonScale = kMetersPerDegree * (cosLat > 0.01 ? cosLat : 0.01);
+}
+
+void
+LocationFusionFilter::Recenter()
+{
+  double lat, lon;
+  FromPlane(mState.mX[0], mState.mY[0], &lat, &lon);
+  SetReference(lat, lon);
+  mState.mX[0] = mState.mY[0] = 0;
+}
+
+/*
+ The exact discrete form of the Gauss-Markov velocity: with e the decay
+ of the velocity over the step, the position moves by tau (1 - e) times
+ the velocity, and the process noise is that of the integrated velocity.
+ */
+/* static */ void
+LocationFusionFilter::Advance(State& aState, double aSeconds)
+{
+  if (aSeconds <= 0) {
+    return;
+  }
+  const double tau = kVelocityTau;
+  const double q = kVelocitySigma * kVelocitySigma;
+  double e = exp(-aSeconds / tau);
+  double a = tau * (1 - e);
+
+  aState.mX[0] += a * aState.mX[1];
+  aState.mX[1] *= e;
+  aState.mY[0] += a * aState.mY[1];
+  aState.mY[1] *= e;
+
+  double pp = aState.mPP + 2 * a * aState.mPV + a * a * aState.mVV;
+  double pv = e * (aState.mPV + a * aState.mVV);
+  double vv = e * e * aState.mVV;
+  pp += q * tau * tau * (2 * aSeconds / tau - 3 + 4 * e - e * e);
+  pv += q * tau * (1 - e) * (1 - e);
+  vv += q * (1 - e * e);
+  aState.mPP = pp;
+  aState.mPV = pv;
+  aState.mVV = vv;
+}
+
+bool
+LocationFusionFilter::Update(Source aSource, int64_t aTimeMs, double aLatitude,
+                             double aLongitude, double aAccuracy,
+                             double aSpeed, double aHeading)
+{
+  if (!IsFinite(aLatitude) || !IsFinite(aLongitude)) {
+    return false;
+  }
+  double accuracy = IsFinite(aAccuracy) && aAccuracy > kMinAccuracy ?
+                    aAccuracy : kMinAccuracy;
+  if (!mHasState) {
+    Start(aTimeMs, aLatitude, aLongitude, accuracy);
+    return true;
+  }
+
+  if (aTimeMs > mTime) {
+    Advance(mState, (aTimeMs - mTime) / 1000.0);
+    mTime = aTimeMs;
+  }
+
+  double x, y;
+  ToPlane(aLatitude, aLongitude, &x, &y);
+  double r = accuracy * accuracy;
+  double s = mState.mPP + r;
+  double ix = x - mState.mX[0];
+  double iy = y - mState.mY[0];
+  if ((ix * ix + iy * iy) / s > kOutlierGate) {
+    if (aSource == SOURCE_NETWORK && ++mOutliersInRow < kMaxOutliersInRow) {
+      return false;
+    }
+    // The estimate went wrong, e.g. after a bad network position while
+    // the GPS was off.
+    Start(aTimeMs, aLatitude, aLongitude, accuracy);
+    return true;
+  }
+  mOutliersInRow = 0;
+
+  double kp = mState.mPP / s;
+  double kv = mState.mPV / s;
+  mState.mX[0] += kp * ix;
+  mState.mX[1] += kv * ix;
+  mState.mY[0] += kp * iy;
+  mState.mY[1] += kv * iy;
+  double pp = mState.mPP;
+  double pv = mState.mPV;
+  mState.mPP = pp * r / s;
+  mState.mPV = pv * r / s;
+  mState.mVV -= pv * pv / s;
+
+  // A stationary GPS has no heading, but its velocity is still known.
+  bool hasVelocity = aSpeed >= 0 && (aHeading >= 0 || aSpeed < kMinHeadingSpeed);
+  if (aSource == SOURCE_GPS && hasVelocity) {
+    double vx = 0;
+    double vy = 0;
+    if (aHeading >= 0) {
+      vx = aSpeed * sin(aHeading * kRadsInDeg);
+      vy = aSpeed * cos(aHeading * kRadsInDeg);
+    }
+    double rv = kVelocityAccuracy * kVelocityAccuracy;
+    double sv = mState.mVV + rv;
+    double ivx = vx - mState.mX[1];
+    double ivy = vy - mState.mY[1];
+    kp = mState.mPV / sv;
+    kv = mState.mVV / sv;
+    mState.mX[0] += kp * ivx;
+    mState.mX[1] += kv * ivx;
+    mState.mY[0] += kp * ivy;
+    mState.mY[1] += kv * ivy;
+    pv = mState.mPV;
+    double vv = mState.mVV;
+    mState.mPP -= pv * pv / sv;
+    mState.mPV = pv * rv / sv;
+    mState.mVV = vv * rv / sv;
+  }
+
+  if (fabs(mState.mX[0]) > kRecenterMeters || fabs(mState.mY[0]) > kRecenterMeters) {
+    Recenter();
+  }
+  return true;
+}
+
+LocationFusionFilter::Estimate
+LocationFusionFilter::Predict(int64_t aTimeMs) const
+{
+  State state = mState;
+  if (aTimeMs > mTime) {
+    Advance(state, (aTimeMs - mTime) / 1000.0);
+  }
+
+  Estimate estimate;
+  estimate.mTime = aTimeMs > mTime ? aTimeMs : mTime;
+  FromPlane(state.mX[0], state.mY[0], &estimate.mLatitude, &estimate.mLongitude);
+  estimate.mAccuracy = sqrt(state.mPP);
+  estimate.mSpeed = sqrt(state.mX[1] * state.mX[1] + state.mY[1] * state.mY[1]);
+  if (estimate.mSpeed < kMinHeadingSpeed) {
+    estimate.mHeading = UnspecifiedNaN<double>();
+  } else {
+    double heading = atan2(state.mX[1], state.mY[1]) / kRadsInDeg;
+    estimate.mHeading = heading < 0 ? heading + 360 : heading;
+  }
+  return estimate;
+}
@@ -0,0 +1,94 @@
+#ifndef LocationFusionFilter_H
+#define LocationFusionFilter_H
+
+#include <stdint.h>
+
+/*
+ Kalman filter over GPS and network (MLS) positions, giving one estimate
+ of the position with its accuracy.
+
+ The state is the position and velocity east and north, in metres on a
+ plane tangent at a reference point near the estimate. The velocity is
+ a first-order Gauss-Markov process: it decays towards zero with time
+ constant kVelocityTau and varies by kVelocitySigma, so the estimate
+ keeps the heading for a while after the GPS stops and then stays put
+ while its accuracy grows. Both axes have the same noise, so they share
+ one 2x2 covariance and an update costs a few dozen flops.
+
+ Accuracies are taken as 1-sigma radii, as Android reports them.
+ Network positions whose distance to the estimate is unlikely given both
+ accuracies are dropped as outliers, unless several in a row are; a GPS
+ fix that far off restarts the filter. Measurements older than the
+ estimate are taken as current. The estimate is kept while the GPS is
+ stopped, with its accuracy growing, so the next start can use it.
+
+ Not thread-safe; the provider uses it on the main thread.
+ */
+class LocationFusionFilter
+{
+public:
+  enum Source {
+    SOURCE_GPS,
+    SOURCE_NETWORK
+  };
+
+  struct Estimate
+  {
+    int64_t mTime;
+    double mLatitude;
+    double mLongitude;
+    // m, 1-sigma
+    double mAccuracy;
+    // m/s, and degrees from north, NaN when slower than kMinHeadingSpeed
+    double mSpeed;
+    double mHeading;
+  };
+
+  // s and m/s
+  static const double kVelocityTau;
+  static const double kVelocitySigma;
+  static const double kMinHeadingSpeed;
+
+  LocationFusionFilter();
+
+  // aSpeed (m/s) and aHeading (degrees) are negative when unknown.
+  // Returns false if the measurement was dropped as an outlier.
+  bool Update(Source aSource, int64_t aTimeMs, double aLatitude,
+              double aLongitude, double aAccuracy,
+              double aSpeed = -1, double aHeading = -1);
+
+  bool HasEstimate() const { return mHasState; }
+  // The estimate carried forward to aTimeMs. HasEstimate() must be true.
+  Estimate Predict(int64_t aTimeMs) const;
+
+private:
+  struct State
+  {
+    // Position (m) and velocity (m/s) east and north of the reference
+    double mX[2];
+    double mY[2];
+    // Covariance of either axis: position, cross term, velocity
+    double mPP;
+    double mPV;
+    double mVV;
+  };
+
+  void Start(int64_t aTimeMs, double aLatitude, double aLongitude,
+             double aAccuracy);
+  static void Advance(State& aState, double aSeconds);
+  void SetReference(double aLatitude, double aLongitude);
+  void ToPlane(double aLatitude, double aLongitude, double* aX, double* aY) const;
+  void FromPlane(double aX, double aY, double* aLatitude, double* aLongitude) const;
+  void Recenter();
+
+  bool mHasState;
+  int64_t mTime;
+  double mRefLatitude;
+  double mRefLongitude;
+  // m per degree of longitude at the reference latitude
+  double mLonScale;
+  uint32_t mOutliersInRow;
+  State mState;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "LocationWarmStart.h"
+#include "StumblerLogging.h"
+#include "mozilla/FloatingPoint.h"
+#include "nsDumpUtils.h"
+#include "nsIFile.h"
+#include "nsString.h"
+#include "prio.h"
+#include <stdio.h>
+
+using namespace mozilla;
+
+static const int64_t kMsecPerDay = 24 * 60 * 60 * 1000;
+
+NS_NAMED_LITERAL_CSTRING(kOutputDirName, "mozstumbler");
+NS_NAMED_LITERAL_CSTRING(kStateName, "location.warm-start");
+NS_NAMED_LITERAL_CSTRING(kStateTmpName, "location.warm-start.tmp");
+
+static nsresult
+GetStateFile(const nsACString& aName, nsIFile** aFile)
+{
+  return nsDumpUtils::OpenTempFile(aName, aFile, kOutputDirName, nsDumpUtils::CREATE);
+}
+
+LocationWarmStart::LocationWarmStart()
+  : mFixTime(0)
+  , mLatitude(0)
+  , mLongitude(0)
+  , mAccuracy(0)
+  , mClockOffsetTime(0)
+  , mClockOffset(0)
+{
+}
+
+void
+LocationWarmStart::SetFix(int64_t aTimeMs, double aLatitude, double aLongitude,
+                          double aAccuracy)
+{
+  if (!IsFinite(aLatitude) || !IsFinite(aLongitude) || !IsFinite(aAccuracy)) {
+    return;
+  }
+  mFixTime = aTimeMs;
+  mLatitude = aLatitude;
+  mLongitude = aLongitude;
+  mAccuracy = aAccuracy;
+}
+
+void
+LocationWarmStart::SetClockOffset(int64_t aTimeMs, int64_t aOffsetMs)
+{
+  mClockOffsetTime = aTimeMs;
+  mClockOffset = aOffsetMs;
+}
+
+bool
+LocationWarmStart::GetFix(int64_t aNowMs, int64_t* aTimeMs, double* aLatitude,
+                          double* aLongitude, double* aAccuracy) const
+{
+  // A fix from the future means the clock was set back; its age is unknown.
+  if (!mFixTime || aNowMs < mFixTime || aNowMs - mFixTime > kMaxFixAgeMs) {
+    return false;
+  }
+  *aTimeMs = mFixTime;
+  *aLatitude = mLatitude;
+  *aLongitude = mLongitude;
+  *aAccuracy = mAccuracy;
+  return true;
+}
+
+bool
+LocationWarmStart::GetGpsTime(int64_t aNowMs, int64_t* aTimeMs,
+                              int32_t* aUncertaintyMs) const
+{
+  int64_t age = aNowMs - mClockOffsetTime;
+  if (!mClockOffsetTime || age < 0 || age > kMaxClockOffsetAgeMs) {
+    return false;
+  }
+  *aTimeMs = aNowMs + mClockOffset;
+  *aUncertaintyMs = kMinClockUncertaintyMs +
+                    int32_t(age * kClockDriftMsPerDay / kMsecPerDay);
+  return true;
+}
+
+nsresult
+LocationWarmStart::Load()
+{
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = GetStateFile(kStateName, getter_AddRefs(file));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = file->OpenNSPRFileDesc(PR_RDONLY, 0, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+  char buf[256];
+  int32_t bytesRead = PR_Read(fd, buf, sizeof(buf) - 1);
+  PR_Close(fd);
+  if (bytesRead <= 0) {
+    // First run
+    return NS_OK;
+  }
+  buf[bytesRead] = '\0';
+
+  long long fixTime, clockOffsetTime, clockOffset;
+  double lat, lon, acc;
+  if (sscanf(buf, "fix %lld %lf %lf %lf clock %lld %lld", &fixTime, &lat, &lon,
+             &acc, &clockOffsetTime, &clockOffset) != 6) {
+    STUMBLER_ERR("Unreadable warm start state, starting cold");
+    return NS_OK;
+  }
+  mFixTime = 0;
+  if (fixTime) {
+    SetFix(fixTime, lat, lon, acc);
+  }
+  SetClockOffset(clockOffsetTime, clockOffset);
+  return NS_OK;
+}
+
+nsresult
+LocationWarmStart::Save() const
+{
+  nsAutoCString data;
+  data.AppendPrintf("fix %lld %.7f %.7f %.1f clock %lld %lld\n",
+                    (long long)mFixTime, mLatitude, mLongitude, mAccuracy,
+                    (long long)mClockOffsetTime, (long long)mClockOffset);
+
+  nsCOMPtr<nsIFile> tmpFile;
+  nsresult rv = GetStateFile(kStateTmpName, getter_AddRefs(tmpFile));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = tmpFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE, 0644, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+  int32_t written = PR_Write(fd, data.get(), data.Length());
+  PR_Close(fd);
+  if (written != int32_t(data.Length())) {
+    return NS_ERROR_FAILURE;
+  }
+  return tmpFile->MoveToNative(/* directory */ nullptr, kStateName);
+}
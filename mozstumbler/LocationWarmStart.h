@@ -0,0 +1,61 @@
+#ifndef LocationWarmStart_H
+#define LocationWarmStart_H
+
+#include "nsError.h"
+#include <stdint.h>
+
+/*
+ What the GPS can be told when it starts, so it does not search cold:
+ the last position estimate and the offset of the GPS clock from the
+ system clock. Both are kept across restarts and reboots in
+ location.warm-start.
+
+ The position is the fused estimate at shutdown, see
+ LocationFusionFilter, which also grows its accuracy with the time
+ since. It is not used after kMaxFixAgeMs.
+
+ The clock offset is the GPS time minus the system clock at the last
+ fix. The GPS time is then the system clock plus that offset, with an
+ uncertainty growing by kClockDriftMsPerDay from kMinClockUncertaintyMs,
+ until kMaxClockOffsetAgeMs. Without an offset it is unknown: the system
+ clock alone may be minutes off (set by hand, no NITZ or NTP), which
+ would mislead the GPS more than no time at all.
+
+ Times are ms since epoch on the system clock. Not thread-safe; the
+ provider passes copies between its init thread, which reads and writes
+ the file, and the main thread.
+ */
+class LocationWarmStart
+{
+public:
+  static const int64_t kMaxFixAgeMs = 24 * 60 * 60 * 1000;
+  static const int64_t kMaxClockOffsetAgeMs = 7 * 24 * 60 * 60 * 1000;
+  static const int32_t kMinClockUncertaintyMs = 1000;
+  static const int32_t kClockDriftMsPerDay = 2000;
+
+  LocationWarmStart();
+
+  nsresult Load();
+  nsresult Save() const;
+
+  void SetFix(int64_t aTimeMs, double aLatitude, double aLongitude, double aAccuracy);
+  void SetClockOffset(int64_t aTimeMs, int64_t aOffsetMs);
+
+  // False if there is no fix, or it is older than kMaxFixAgeMs at aNowMs.
+  bool GetFix(int64_t aNowMs, int64_t* aTimeMs, double* aLatitude,
+              double* aLongitude, double* aAccuracy) const;
+  // The GPS time at aNowMs on the system clock. False if there is no
+  // clock offset, or it is older than kMaxClockOffsetAgeMs at aNowMs.
+  bool GetGpsTime(int64_t aNowMs, int64_t* aTimeMs, int32_t* aUncertaintyMs) const;
+
+private:
+  // 0 when absent
+  int64_t mFixTime;
+  double mLatitude;
+  double mLongitude;
+  double mAccuracy;
+  int64_t mClockOffsetTime;
+  int64_t mClockOffset;
+};
+
+#endif
@@ -5,9 +5,10 @@
  * You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "MozStumbler.h"
+#include "nsComponentManagerUtils.h"
 #include "nsGeoPosition.h"
-#include "nsPrintfCString.h"
 #include "StumblerLogging.h"
+#include "StumblerStats.h"
 #include "WriteStumbleOnThread.h"
 #include "nsNetCID.h"
 
@@ -15,7 +16,100 @@ using namespace mozilla;
 using namespace mozilla::dom;
 
 
-NS_IMPL_ISUPPORTS(StumblerInfo, nsICellInfoListCallback, nsIWifiScanResultsReady)
+NS_IMPL_ISUPPORTS(StumblerInfo, nsICellInfoListCallback, nsIWifiScanResultsReady,
+                  nsITimerCallback)
+
+/*
+ Stands in for StumblerInfo in the request to one RIL service, to time
+ the response of that service.
+ */
+class CellInfoServiceCallback final : public nsICellInfoListCallback
+{
+public:
+  NS_DECL_ISUPPORTS
+  NS_DECL_NSICELLINFOLISTCALLBACK
+
+  CellInfoServiceCallback(StumblerInfo* aInfo, uint32_t aServiceId)
+    : mInfo(aInfo)
+    , mStage(aServiceId ? StumblerStats::STAGE_CELL_RESPONSE_RIL1
+                        : StumblerStats::STAGE_CELL_RESPONSE_RIL0)
+    , mRequestTime(TimeStamp::Now())
+  {}
+
+private:
+  ~CellInfoServiceCallback() {}
+
+  nsRefPtr<StumblerInfo> mInfo;
+  StumblerStats::Stage mStage;
+  TimeStamp mRequestTime;
+};
+
+NS_IMPL_ISUPPORTS(CellInfoServiceCallback, nsICellInfoListCallback)
+
+NS_IMETHODIMP
+CellInfoServiceCallback::NotifyGetCellInfoList(uint32_t count, nsICellInfo** aCellInfos)
+{
+  StumblerStats::AddLatencySince(mStage, mRequestTime);
+  return mInfo->NotifyGetCellInfoList(count, aCellInfos);
+}
+
+NS_IMETHODIMP
+CellInfoServiceCallback::NotifyGetCellInfoListFailed(const nsAString& error)
+{
+  StumblerStats::AddLatencySince(mStage, mRequestTime);
+  return mInfo->NotifyGetCellInfoListFailed(error);
+}
+
+already_AddRefed<nsICellInfoListCallback>
+StumblerInfo::CreateCellInfoCallback(uint32_t aServiceId)
+{
+  nsCOMPtr<nsICellInfoListCallback> callback = new CellInfoServiceCallback(this, aServiceId);
+  return callback.forget();
+}
+
+void
+StumblerInfo::SetScanStarted()
+{
+  MOZ_ASSERT(NS_IsMainThread());
+  mScanStartTime = TimeStamp::Now();
+  StumblerStats::AddLatency(StumblerStats::STAGE_SCAN_DISPATCH, mScanStartTime - mFixTime);
+
+  // The timer holds a reference to this until it fires or is cancelled,
+  // so a radio that never answers cannot keep the record from being queued.
+  mDeadlineTimer = do_CreateInstance(NS_TIMER_CONTRACTID);
+  if (!mDeadlineTimer ||
+      NS_FAILED(mDeadlineTimer->InitWithCallback(this, kScanDeadlineMs,
+                                                 nsITimer::TYPE_ONE_SHOT))) {
+    STUMBLER_ERR("No scan deadline timer, waiting for every response");
+    mDeadlineTimer = nullptr;
+  }
+}
+
+NS_IMETHODIMP
+StumblerInfo::Notify(nsITimer* aTimer)
+{
+  MOZ_ASSERT(NS_IsMainThread());
+  mDeadlineTimer = nullptr;
+  if (mIsDumped) {
+    return NS_OK;
+  }
+  STUMBLER_LOG("Scan deadline passed with %d/%d cell responses, wifi %s",
+               mCellInfoResponsesReceived, mCellInfoResponsesExpected,
+               mIsWifiInfoResponseReceived ? "received" : "missing");
+  StumblerStats::Add(StumblerStats::SCANS_TIMED_OUT);
+  DumpStumblerInfo();
+  return NS_OK;
+}
+
+bool
+StumblerInfo::IgnoreLateResponse()
+{
+  if (mIsDumped) {
+    STUMBLER_DBG("Response after the record was queued, ignored\n");
+    StumblerStats::Add(StumblerStats::LATE_RESPONSES);
+  }
+  return mIsDumped;
+}
 
 void
 StumblerInfo::SetWifiInfoResponseReceived()
@@ -40,8 +134,25 @@ StumblerInfo::SetCellInfoResponsesExpected(int count)
   }
 }
 
+void
+StumblerInfo::SetFixQuality(const StumbleFixQuality& aQuality)
+{
+  if (aQuality.mHdopCenti) {
+    mRecord.mHdop = aQuality.mHdopCenti / 100.0;
+  }
+  if (aQuality.mSatellitesUsed != StumbleFixQuality::kUnknownCount) {
+    mRecord.mSatellites = aQuality.mSatellitesUsed;
+  }
+}
+
+void
+StumblerInfo::SetLocateCallback(nsIGeolocationUpdate* aCallback)
+{
+  mLocateCallback = aCallback;
+}
+
 nsresult
-StumblerInfo::LocationInfoToString(nsCString& aLocDesc)
+StumblerInfo::LocationInfoToRecord()
 {
   nsCOMPtr<nsIDOMGeoPositionCoords> coords;
   mPosition->GetCoords(getter_AddRefs(coords));
@@ -49,167 +160,117 @@ StumblerInfo::LocationInfoToString(nsCString& aLocDesc)
     return NS_ERROR_FAILURE;
   }
 
-  NS_NAMED_LITERAL_CSTRING(lat, "latitude");
-  NS_NAMED_LITERAL_CSTRING(lon, "longitude");
-  NS_NAMED_LITERAL_CSTRING(acc, "accuracy");
-  NS_NAMED_LITERAL_CSTRING(alt, "altitude");
-  NS_NAMED_LITERAL_CSTRING(altacc, "altitudeAccuracy");
-  NS_NAMED_LITERAL_CSTRING(head, "heading");
-  NS_NAMED_LITERAL_CSTRING(spd, "speed");
-
-  std::map<nsLiteralCString, double> info;
-  coords->GetLatitude(&info[lat]);
-  coords->GetLongitude(&info[lon]);
-  coords->GetAccuracy(&info[acc]);
-  coords->GetAltitude(&info[alt]);
-  coords->GetAltitudeAccuracy(&info[altacc]);
-  coords->GetHeading(&info[head]);
-  coords->GetSpeed(&info[spd]);
-
-  for (auto it = info.begin(); it != info.end(); ++it) {
-    double val = it->second;
-    if (!IsNaN(val)){
-      aLocDesc += nsPrintfCString("\"%s\":%f,", it->first.get(), it->second);
-    }
-  }
-  aLocDesc += nsPrintfCString("\"timestamp\":%lld,", PR_Now() / PR_USEC_PER_MSEC).get();
+  coords->GetLatitude(&mRecord.mLatitude);
+  coords->GetLongitude(&mRecord.mLongitude);
+  coords->GetAccuracy(&mRecord.mAccuracy);
+  coords->GetAltitude(&mRecord.mAltitude);
+  coords->GetAltitudeAccuracy(&mRecord.mAltitudeAccuracy);
+  coords->GetHeading(&mRecord.mHeading);
+  coords->GetSpeed(&mRecord.mSpeed);
+  mRecord.mTimestamp = PR_Now() / PR_USEC_PER_MSEC;
   return NS_OK;
 }
 
-NS_NAMED_LITERAL_CSTRING(keyRadioType, "radioType");
-NS_NAMED_LITERAL_CSTRING(keyMcc, "mobileCountryCode");
-NS_NAMED_LITERAL_CSTRING(keyMnc, "mobileNetworkCode");
-NS_NAMED_LITERAL_CSTRING(keyLac, "locationAreaCode");
-NS_NAMED_LITERAL_CSTRING(keyCid, "cellId");
-NS_NAMED_LITERAL_CSTRING(keyPsc, "psc");
-NS_NAMED_LITERAL_CSTRING(keyStrengthAsu, "asu");
-NS_NAMED_LITERAL_CSTRING(keyStrengthDbm, "signalStrength");
-NS_NAMED_LITERAL_CSTRING(keyRegistered, "serving");
-NS_NAMED_LITERAL_CSTRING(keyTimingAdvance, "timingAdvance");
-
 template <class T> void
-ExtractCommonNonCDMACellInfoItems(nsCOMPtr<T>& cell, std::map<nsLiteralCString, int32_t>& info)
+ExtractCommonNonCDMACellInfoItems(nsCOMPtr<T>& cell, StumbleCell& info)
 {
-  int32_t mcc, mnc, cid, sig;
-
-  cell->GetMcc(&mcc);
-  cell->GetMnc(&mnc);
-  cell->GetCid(&cid);
-  cell->GetSignalStrength(&sig);
-
-  info[keyMcc] = mcc;
-  info[keyMnc] = mnc;
-  info[keyCid] = cid;
-  info[keyStrengthAsu] = sig;
+  cell->GetMcc(&info.mMcc);
+  cell->GetMnc(&info.mMnc);
+  cell->GetCid(&info.mCid);
+  cell->GetSignalStrength(&info.mAsu);
 }
 
-nsresult
-StumblerInfo::CellNetworkInfoToString(nsCString& aCellDesc)
+void
+StumblerInfo::CellNetworkInfoToRecord()
 {
-  aCellDesc += "\"cellTowers\": [";
-
   for (uint32_t idx = 0; idx < mCellInfo.Length() ; idx++) {
-    const char* radioType = 0;
     int32_t type;
     mCellInfo[idx]->GetType(&type);
     bool registered;
     mCellInfo[idx]->GetRegistered(&registered);
-    if (idx) {
-      aCellDesc += ",{";
-    } else {
-      aCellDesc += "{";
-    }
 
     STUMBLER_DBG("type=%d\n", type);
 
-    std::map<nsLiteralCString, int32_t> info;
-    info[keyRegistered] = registered;
+    StumbleCell info;
+    info.mType = type;
+    info.mRegistered = registered;
 
     if(type == nsICellInfo::CELL_INFO_TYPE_GSM) {
-      radioType = "gsm";
       nsCOMPtr<nsIGsmCellInfo> gsmCellInfo = do_QueryInterface(mCellInfo[idx]);
       ExtractCommonNonCDMACellInfoItems(gsmCellInfo, info);
-      int32_t lac;
-      gsmCellInfo->GetLac(&lac);
-      info[keyLac] = lac;
+      gsmCellInfo->GetLac(&info.mLac);
     } else if (type == nsICellInfo::CELL_INFO_TYPE_WCDMA) {
-      radioType = "wcdma";
       nsCOMPtr<nsIWcdmaCellInfo> wcdmaCellInfo = do_QueryInterface(mCellInfo[idx]);
       ExtractCommonNonCDMACellInfoItems(wcdmaCellInfo, info);
-      int32_t lac, psc;
-      wcdmaCellInfo->GetLac(&lac);
-      wcdmaCellInfo->GetPsc(&psc);
-      info[keyLac] = lac;
-      info[keyPsc] = psc;
+      wcdmaCellInfo->GetLac(&info.mLac);
+      wcdmaCellInfo->GetPsc(&info.mPsc);
     } else if (type == nsICellInfo::CELL_INFO_TYPE_CDMA) {
-      radioType = "cdma";
       nsCOMPtr<nsICdmaCellInfo> cdmaCellInfo = do_QueryInterface(mCellInfo[idx]);
-      int32_t mnc, lac, cid, sig;
-      cdmaCellInfo->GetSystemId(&mnc);
-      cdmaCellInfo->GetNetworkId(&lac);
-      cdmaCellInfo->GetBaseStationId(&cid);
-      info[keyMnc] = mnc;
-      info[keyLac] = lac;
-      info[keyCid] = cid;
+      int32_t sig;
+      cdmaCellInfo->GetSystemId(&info.mMnc);
+      cdmaCellInfo->GetNetworkId(&info.mLac);
+      cdmaCellInfo->GetBaseStationId(&info.mCid);
 
       cdmaCellInfo->GetEvdoDbm(&sig);
       if (sig < 0 || sig == nsICellInfo::UNKNOWN_VALUE) {
         cdmaCellInfo->GetCdmaDbm(&sig);
       }
       if (sig > -1 && sig != nsICellInfo::UNKNOWN_VALUE)  {
-        sig *= -1;
-        info[keyStrengthDbm] = sig;
+        info.mSignalDbm = sig * -1;
       }
     } else if (type == nsICellInfo::CELL_INFO_TYPE_LTE) {
-      radioType = "lte";
       nsCOMPtr<nsILteCellInfo> lteCellInfo = do_QueryInterface(mCellInfo[idx]);
       ExtractCommonNonCDMACellInfoItems(lteCellInfo, info);
-      int32_t lac, timingAdvance, pcid, rsrp;
-      lteCellInfo->GetTac(&lac);
-      lteCellInfo->GetTimingAdvance(&timingAdvance);
-      lteCellInfo->GetPcid(&pcid);
+      int32_t rsrp;
+      lteCellInfo->GetTac(&info.mLac);
+      lteCellInfo->GetTimingAdvance(&info.mTimingAdvance);
+      lteCellInfo->GetPcid(&info.mPsc);
       lteCellInfo->GetRsrp(&rsrp);
-      info[keyLac] = lac;
-      info[keyTimingAdvance] = timingAdvance;
-      info[keyPsc] = pcid;
       if (rsrp != nsICellInfo::UNKNOWN_VALUE) {
-        info[keyStrengthDbm] = rsrp * -1;
+        info.mSignalDbm = rsrp * -1;
       }
+    } else {
+      STUMBLER_DBG("unknown cell type, skip this cell\n");
+      continue;
     }
 
-    aCellDesc += nsPrintfCString("\"%s\":\"%s\"", keyRadioType.get(), radioType);
-    for (auto iter = info.begin(); iter != info.end(); ++iter) {
-      int32_t value = iter->second;
-      if (value != nsICellInfo::UNKNOWN_VALUE) {
-        aCellDesc += nsPrintfCString(",\"%s\":%d", iter->first.get(), value);
-      }
-    }
-    aCellDesc += "}";
+    mRecord.mCells.AppendElement(info);
   }
-  aCellDesc += "]";
-  return NS_OK;
 }
 
 void
 StumblerInfo::DumpStumblerInfo()
 {
-  nsAutoCString desc;
-  nsresult rv = LocationInfoToString(desc);
-  if (NS_WARN_IF(NS_FAILED(rv))) {
-    STUMBLER_ERR("LocationInfoToString failed, skip this dump");
+  if (mIsDumped) {
     return;
   }
+  mIsDumped = true;
+  TimeStamp start = TimeStamp::Now();
+  if (mDeadlineTimer) {
+    mDeadlineTimer->Cancel();
+    mDeadlineTimer = nullptr;
+  }
+  StumblerStats::AddLatencySince(StumblerStats::STAGE_SCAN, mScanStartTime);
 
-  CellNetworkInfoToString(desc);
-  desc += mWifiDesc;
+  if (mLocateCallback) {
+    CellNetworkInfoToRecord();
+    STUMBLER_DBG("locate scan with the geo index\n");
+    WriteStumbleOnThread::Locate(mRecord, mLocateCallback);
+    return;
+  }
+
+  nsresult rv = LocationInfoToRecord();
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    STUMBLER_ERR("LocationInfoToRecord failed, skip this dump");
+    return;
+  }
 
-  STUMBLER_DBG("dispatch write event to thread\n");
-  nsCOMPtr<nsIEventTarget> target = do_GetService(NS_STREAMTRANSPORTSERVICE_CONTRACTID);
-  MOZ_ASSERT(target);
+  CellNetworkInfoToRecord();
 
-  nsCOMPtr<nsIRunnable> event = new WriteStumbleOnThread(desc);
-  target->Dispatch(event, NS_DISPATCH_NORMAL);
-  return;
+  STUMBLER_DBG("queue record for the write thread\n");
+  WriteStumbleOnThread::Write(mRecord);
+  StumblerStats::AddLatency(StumblerStats::STAGE_MAIN_THREAD,
+                            mMainThreadTime + (TimeStamp::Now() - start));
 }
 
 /* void notifyGetCellInfoList (in uint32_t count, [array, size_is (count)] in nsICellInfo result); */
@@ -217,6 +278,9 @@ NS_IMETHODIMP
 StumblerInfo::NotifyGetCellInfoList(uint32_t count, nsICellInfo** aCellInfos)
 {
   MOZ_ASSERT(NS_IsMainThread());
+  if (IgnoreLateResponse()) {
+    return NS_OK;
+  }
   STUMBLER_DBG("There are %d cellinfo in the result\n",count);
 
   for (uint32_t i = 0; i < count; i++) {
@@ -236,6 +300,9 @@ StumblerInfo::NotifyGetCellInfoList(uint32_t count, nsICellInfo** aCellInfos)
 NS_IMETHODIMP StumblerInfo::NotifyGetCellInfoListFailed(const nsAString& error)
 {
   MOZ_ASSERT(NS_IsMainThread());
+  if (IgnoreLateResponse()) {
+    return NS_OK;
+  }
   mCellInfoResponsesReceived++;
   STUMBLER_ERR("NotifyGetCellInfoListFailedm CellInfoReadyNum=%d, mCellInfoResponsesExpected=%d, mIsWifiInfoResponseReceived=%d",
                 mCellInfoResponsesReceived, mCellInfoResponsesExpected, mIsWifiInfoResponseReceived);
@@ -250,48 +317,23 @@ NS_IMETHODIMP
 StumblerInfo::Onready(uint32_t count, nsIWifiScanResult** results)
 {
   MOZ_ASSERT(NS_IsMainThread());
+  StumblerStats::AddLatencySince(StumblerStats::STAGE_WIFI_RESPONSE, mScanStartTime);
+  if (IgnoreLateResponse()) {
+    return NS_OK;
+  }
   STUMBLER_DBG("There are %d wifiAPinfo in the result\n",count);
 
-  mWifiDesc += ",\"wifiAccessPoints\": [";
-  bool firstItem = true;
+  // Only a copy here; the strings share their buffers with the results.
+  // ParseRawWifi() filters and parses them on the write thread.
+  TimeStamp start = TimeStamp::Now();
+  mRecord.mHasWifi = true;
+  StumbleRawWifi* raw = mRecord.mRawWifi.AppendElements(count);
   for (uint32_t i = 0 ; i < count ; i++) {
-    nsString ssid;
-    results[i]->GetSsid(ssid);
-    if (ssid.IsEmpty()) {
-      STUMBLER_DBG("no ssid, skip this AP\n");
-      continue;
-    }
-
-    if (ssid.Length() >= 6) {
-      if (ssid.Find("_nomap", false, ssid.Length()-6, 6) != -1) {
-        STUMBLER_DBG("end with _nomap. skip this AP(ssid :%s)\n", ssid.get());
-        continue;
-      }
-    }
-
-    if (firstItem) {
-      mWifiDesc += "{";
-      firstItem = false;
-    } else {
-      mWifiDesc += ",{";
-    }
-
-    // mac address
-    nsString bssid;
-    results[i]->GetBssid(bssid);
-    //   00:00:00:00:00:00 --> 000000000000
-    bssid.StripChars(":");
-    mWifiDesc += "\"macAddress\":\"";
-    mWifiDesc += NS_ConvertUTF16toUTF8(bssid);
-
-    uint32_t signal;
-    results[i]->GetSignalStrength(&signal);
-    mWifiDesc += "\",\"signalStrength\":";
-    mWifiDesc += nsPrintfCString("%d", signal).get();
-
-    mWifiDesc += "}";
+    results[i]->GetSsid(raw[i].mSsid);
+    results[i]->GetBssid(raw[i].mBssid);
+    results[i]->GetSignalStrength(&raw[i].mSignal);
   }
-  mWifiDesc += "]";
+  mMainThreadTime += TimeStamp::Now() - start;
 
   if (mCellInfoResponsesReceived == mCellInfoResponsesExpected) {
     STUMBLER_DBG("Call DumpStumblerInfo from Onready:\n");
@@ -306,6 +348,10 @@ NS_IMETHODIMP
 StumblerInfo::Onfailure()
 {
   MOZ_ASSERT(NS_IsMainThread());
+  StumblerStats::AddLatencySince(StumblerStats::STAGE_WIFI_RESPONSE, mScanStartTime);
+  if (IgnoreLateResponse()) {
+    return NS_OK;
+  }
   STUMBLER_ERR("GetWifiScanResults Onfailure\n");
   if (mCellInfoResponsesReceived == mCellInfoResponsesExpected) {
     STUMBLER_DBG("Call DumpStumblerInfo from Onfailure:\n");
@@ -9,37 +9,74 @@
 
 #include "nsIDOMEventTarget.h"
 #include "nsICellInfo.h"
+#include "nsIGeolocationProvider.h"
+#include "nsITimer.h"
 #include "nsIWifi.h"
-
-#define STUMBLE_INTERVAL_MS 3000
+#include "mozilla/TimeStamp.h"
+#include "StumbleNmeaParser.h"
+#include "StumbleRecord.h"
 
 class nsGeoPosition;
 
+/*
+ Collects the cell and wifi scans for one GPS fix, and queues the record
+ once every response is in, or when the scan deadline passes, whichever
+ comes first. Responses arriving after that are ignored.
+ */
 class StumblerInfo final : public nsICellInfoListCallback,
-                           public nsIWifiScanResultsReady
+                           public nsIWifiScanResultsReady,
+                           public nsITimerCallback
 {
 public:
   NS_DECL_ISUPPORTS
   NS_DECL_NSICELLINFOLISTCALLBACK
   NS_DECL_NSIWIFISCANRESULTSREADY
+  NS_DECL_NSITIMERCALLBACK
+
+  // The deadline for all responses, counted from SetScanStarted()
+  static const uint32_t kScanDeadlineMs = 8000;
 
   explicit StumblerInfo(nsGeoPosition* position)
     : mPosition(position), mCellInfoResponsesExpected(0), mCellInfoResponsesReceived(0), mIsWifiInfoResponseReceived(0)
+    , mIsDumped(false)
+    , mFixTime(mozilla::TimeStamp::Now())
   {}
+  // Called when the cell and wifi requests are about to be sent; starts
+  // the deadline timer.
+  void SetScanStarted();
+  // Callback for the cell info request to one RIL service; it records the
+  // response time of that service and forwards to this object.
+  already_AddRefed<nsICellInfoListCallback> CreateCellInfoCallback(uint32_t aServiceId);
   void SetWifiInfoResponseReceived();
   void SetCellInfoResponsesExpected(int count);
+  // Before SetScanStarted(); the known parts of aQuality go into the record.
+  void SetFixQuality(const StumbleFixQuality& aQuality);
+  // Before SetScanStarted(); the scan is located with the index of past
+  // stumbles and the position passed to aCallback, instead of being
+  // written. The position given to the constructor is then unused.
+  void SetLocateCallback(nsIGeolocationUpdate* aCallback);
 
 private:
   ~StumblerInfo() {}
   void DumpStumblerInfo();
-  nsresult LocationInfoToString(nsCString& aLocDesc);
-  nsresult CellNetworkInfoToString(nsCString& aCellDesc);
+  bool IgnoreLateResponse();
+  nsresult LocationInfoToRecord();
+  void CellNetworkInfoToRecord();
   nsTArray<nsRefPtr<nsICellInfo>> mCellInfo;
-  nsCString mWifiDesc;
+  // Raw wifi results are added as they arrive, the rest in DumpStumblerInfo
+  StumbleRecord mRecord;
   nsRefPtr<nsGeoPosition> mPosition;
+  nsCOMPtr<nsIGeolocationUpdate> mLocateCallback;
   int mCellInfoResponsesExpected;
   int mCellInfoResponsesReceived;
   bool mIsWifiInfoResponseReceived;
+  // Set once the record is queued
+  bool mIsDumped;
+  nsCOMPtr<nsITimer> mDeadlineTimer;
+  // For the StumblerStats latency histograms
+  mozilla::TimeDuration mMainThreadTime;
+  mozilla::TimeStamp mFixTime;
+  mozilla::TimeStamp mScanStartTime;
 };
 #endif // mozilla_system_mozstumbler_h__
 
@@ -0,0 +1,243 @@
+#include "StumbleAppendLog.h"
+#include "StumblerLogging.h"
+#include "zlib.h"
+
+static const char kMagic[] = { 'M', 'Z', 'A', 'L' };
+static const uint8_t kFormatVersion = 1;
+static const uint32_t kHeaderLength = 8;
+static const uint32_t kEntryLength = 8;
+
+// Sync once this many bytes were appended, or when the last sync is this
+// old. Whatever was not synced is lost if the device loses power.
+static const uint32_t kSyncBytes = 4 * 1024;
+static const PRTime kSyncIntervalMs = 60 * 1000;
+
+StumbleAppendLog::StumbleAppendLog()
+  : mFD(nullptr)
+  , mMap(nullptr)
+  , mBase(nullptr)
+  , mDataLength(0)
+  , mRecordCount(0)
+  , mUnsyncedBytes(0)
+  , mLastSync(0)
+{
+}
+
+StumbleAppendLog::~StumbleAppendLog()
+{
+  Close();
+}
+
+nsresult
+StumbleAppendLog::Open(nsIFile* aFile)
+{
+  MOZ_ASSERT(!mBase);
+  mFile = aFile;
+
+  nsresult rv = Map(false);
+  if (rv == NS_ERROR_FILE_CORRUPTED) {
+    STUMBLER_ERR("Unknown stumble log, starting over");
+    rv = Map(true);
+  }
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  uint32_t dropped = Recover();
+  if (dropped) {
+    STUMBLER_ERR("Dropped %u bytes after record %u of the stumble log", dropped,
+                 mRecordCount);
+    rv = Sync();
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+  mUnsyncedBytes = 0;
+  mLastSync = PR_Now() / PR_USEC_PER_MSEC;
+  return NS_OK;
+}
+
+nsresult
+StumbleAppendLog::Map(bool aTruncate)
+{
+  int32_t flags = PR_RDWR | PR_CREATE_FILE;
+  if (aTruncate) {
+    flags |= PR_TRUNCATE;
+  }
+  nsresult rv = mFile->OpenNSPRFileDesc(flags, 0644, &mFD);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileInfo64 info;
+  if (PR_GetOpenFileInfo64(mFD, &info) != PR_SUCCESS) {
+    Unmap();
+    return NS_ERROR_FAILURE;
+  }
+  bool isNew = info.size == 0;
+  if (isNew) {
+    // Real zeros, not a hole: a store into a hole that the disk has no
+    // room for faults with SIGBUS, while a short write here just fails.
+    static const char zeros[4096] = { 0 };
+    static_assert(kFileSize % sizeof(zeros) == 0, "Whole blocks of zeros");
+    for (uint32_t written = 0; written < kFileSize; written += sizeof(zeros)) {
+      if (PR_Write(mFD, zeros, sizeof(zeros)) != int32_t(sizeof(zeros))) {
+        STUMBLER_ERR("Cannot allocate the stumble log, disk full?");
+        Unmap();
+        return NS_ERROR_FILE_NO_DEVICE_SPACE;
+      }
+    }
+  } else if (info.size != kFileSize) {
+    Unmap();
+    return NS_ERROR_FILE_CORRUPTED;
+  }
+
+  mMap = PR_CreateFileMap(mFD, kFileSize, PR_PROT_READWRITE);
+  if (!mMap) {
+    Unmap();
+    return NS_ERROR_FAILURE;
+  }
+  mBase = static_cast<char*>(PR_MemMap(mMap, 0, kFileSize));
+  if (!mBase) {
+    Unmap();
+    return NS_ERROR_FAILURE;
+  }
+
+  if (isNew) {
+    memcpy(mBase, kMagic, sizeof(kMagic));
+    mBase[sizeof(kMagic)] = kFormatVersion;
+  } else if (memcmp(mBase, kMagic, sizeof(kMagic)) ||
+             uint8_t(mBase[sizeof(kMagic)]) != kFormatVersion) {
+    Unmap();
+    return NS_ERROR_FILE_CORRUPTED;
+  }
+  return NS_OK;
+}
+
+void
+StumbleAppendLog::Unmap()
+{
+  if (mBase) {
+    PR_MemUnmap(mBase, kFileSize);
+    mBase = nullptr;
+  }
+  if (mMap) {
+    PR_CloseFileMap(mMap);
+    mMap = nullptr;
+  }
+  if (mFD) {
+    PR_Close(mFD);
+    mFD = nullptr;
+  }
+}
+
+char*
+StumbleAppendLog::IndexEntry(uint32_t aIndex) const
+{
+  return mBase + kFileSize - (aIndex + 1) * kEntryLength;
+}
+
+const char*
+StumbleAppendLog::Data() const
+{
+  return mBase + kHeaderLength;
+}
+
+/*
+ Finds the last record that the index and its checksum vouch for, and
+ zeros everything between it and its index entry, so that stale entries
+ are never picked up after later appends. Returns how many non-zero bytes
+ were dropped.
+ */
+uint32_t
+StumbleAppendLog::Recover()
+{
+  const char* data = Data();
+  uint32_t maxCount = (kFileSize - kHeaderLength) / kEntryLength;
+  uint32_t end = 0;
+  uint32_t count = 0;
+  for (; count < maxCount; count++) {
+    uint32_t recordEnd, crc;
+    memcpy(&recordEnd, IndexEntry(count), sizeof(recordEnd));
+    memcpy(&crc, IndexEntry(count) + sizeof(recordEnd), sizeof(crc));
+    // The record may not reach into the index, including its own entry.
+    uint32_t dataLimit = kFileSize - kHeaderLength - (count + 1) * kEntryLength;
+    if (recordEnd <= end || recordEnd > dataLimit) {
+      break;
+    }
+    if (crc32(0, reinterpret_cast<const Bytef*>(data + end), recordEnd - end) != crc) {
+      break;
+    }
+    end = recordEnd;
+  }
+  mDataLength = end;
+  mRecordCount = count;
+
+  char* from = mBase + kHeaderLength + end;
+  char* to = mBase + kFileSize - count * kEntryLength;
+  uint32_t dropped = 0;
+  for (char* p = from; p < to; p++) {
+    if (*p) {
+      dropped++;
+    }
+  }
+  if (dropped) {
+    memset(from, 0, to - from);
+  }
+  return dropped;
+}
+
+bool
+StumbleAppendLog::Append(const nsACString& aRecord)
+{
+  uint32_t length = aRecord.Length();
+  uint32_t free = kFileSize - kHeaderLength - mDataLength -
+                  mRecordCount * kEntryLength;
+  if (!mBase || !length || free < length + kEntryLength) {
+    return false;
+  }
+
+  char* record = mBase + kHeaderLength + mDataLength;
+  memcpy(record, aRecord.BeginReading(), length);
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(record), length);
+  mDataLength += length;
+
+  // After the record, so the entry never covers bytes not yet written
+  char* entry = IndexEntry(mRecordCount);
+  memcpy(entry, &mDataLength, sizeof(mDataLength));
+  memcpy(entry + sizeof(mDataLength), &crc, sizeof(crc));
+  mRecordCount++;
+  mUnsyncedBytes += length + kEntryLength;
+  return true;
+}
+
+bool
+StumbleAppendLog::ShouldSync() const
+{
+  if (!mUnsyncedBytes) {
+    return false;
+  }
+  return mUnsyncedBytes >= kSyncBytes ||
+         (PR_Now() / PR_USEC_PER_MSEC) - mLastSync >= kSyncIntervalMs;
+}
+
+nsresult
+StumbleAppendLog::Sync()
+{
+  NS_ENSURE_TRUE(mBase, NS_ERROR_NOT_INITIALIZED);
+
+  if (PR_SyncMemMap(mFD, mBase, kFileSize) != PR_SUCCESS) {
+    return NS_ERROR_FAILURE;
+  }
+  mUnsyncedBytes = 0;
+  mLastSync = PR_Now() / PR_USEC_PER_MSEC;
+  return NS_OK;
+}
+
+nsresult
+StumbleAppendLog::Close()
+{
+  if (!mBase) {
+    return NS_OK;
+  }
+  nsresult rv = NS_OK;
+  if (mUnsyncedBytes) {
+    rv = Sync();
+  }
+  Unmap();
+  return rv;
+}
@@ -0,0 +1,77 @@
+#ifndef StumbleAppendLog_H
+#define StumbleAppendLog_H
+
+#include "nsCOMPtr.h"
+#include "nsIFile.h"
+#include "nsISupportsImpl.h"
+#include "nsString.h"
+#include "prio.h"
+
+/*
+ Uncompressed, memory-mapped log of encoded stumble records, used for the
+ head segment. An append is a memcpy into the mapping; the mapping is
+ synced to disk once kSyncBytes were appended or kSyncIntervalMs passed.
+ If the process dies, the kernel still writes the pages.
+
+ The file has a fixed size:
+
+   header:  "MZAL" version(u8) padding(3 bytes)
+   records, back to back from the header on
+   free space (zeros)
+   index, growing down from the end of the file, one entry per record:
+            end offset of the record in the data (u32)
+            CRC-32 of the record (u32)
+
+ The index entry is written after the record it describes. Open() walks
+ the index and keeps the records up to the first entry that is missing,
+ out of range or whose checksum does not match, which is what a power
+ loss between syncs can leave behind. Everything after that is zeroed.
+ This costs one pass over the records, and nothing is decompressed.
+
+ The file is compressed into a sealed segment when it is full, see
+ StumbleSegmentQueue::Seal().
+ */
+class StumbleAppendLog final
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(StumbleAppendLog)
+
+  // Records plus index; about SEGMENT_MAX_BYTES once compressed.
+  // Written out in full when created, so the mapping never has holes.
+  static const uint32_t kFileSize = 24 * 1024;
+
+  StumbleAppendLog();
+
+  nsresult Open(nsIFile* aFile);
+  // Returns false, writing nothing, if aRecord does not fit.
+  bool Append(const nsACString& aRecord);
+  nsresult Sync();
+  // Syncs and unmaps.
+  nsresult Close();
+
+  // The records, back to back.
+  const char* Data() const;
+  uint32_t DataLength() const { return mDataLength; }
+  // Size/time sync policy, see kSyncBytes and kSyncIntervalMs.
+  bool ShouldSync() const;
+  nsIFile* File() const { return mFile; }
+
+private:
+  ~StumbleAppendLog();
+
+  nsresult Map(bool aTruncate);
+  void Unmap();
+  uint32_t Recover();
+  char* IndexEntry(uint32_t aIndex) const;
+
+  nsCOMPtr<nsIFile> mFile;
+  PRFileDesc* mFD;
+  PRFileMap* mMap;
+  char* mBase;
+  uint32_t mDataLength;
+  uint32_t mRecordCount;
+  uint32_t mUnsyncedBytes;
+  PRTime mLastSync;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include "StumbleDedupIndex.h"
+#include "StumblerLogging.h"
+#include "mozilla/Constants.h"
+#include "mozilla/FloatingPoint.h"
+#include "nsDumpUtils.h"
+#include "nsICellInfo.h"
+#include "nsIFile.h"
+#include "prio.h"
+#include <math.h>
+#include <string.h>
+
+using namespace mozilla;
+
+// Grid square height, about 222 m; the width is scaled to match
+static const double kGridDegrees = 0.002;
+static const uint32_t kFilterBits = StumbleDedupIndex::kFilterBytes * 8;
+// Changes between automatic writes of the index
+static const uint32_t kSaveEveryChanges = 16;
+static const int64_t kMsecPerDay = 24 * 60 * 60 * 1000;
+
+static const char kMagic[] = { 'M', 'Z', 'D', 'X' };
+static const uint8_t kFormatVersion = 1;
+// Magic, version, square count, use clock
+static const uint32_t kHeaderLength = 4 + 1 + 4 + 4;
+
+NS_NAMED_LITERAL_CSTRING(kOutputDirName, "mozstumbler");
+NS_NAMED_LITERAL_CSTRING(kIndexName, "stumbles.dedup");
+NS_NAMED_LITERAL_CSTRING(kIndexTmpName, "stumbles.dedup.tmp");
+
+static nsresult
+GetIndexFile(const nsACString& aName, nsIFile** aFile)
+{
+  return nsDumpUtils::OpenTempFile(aName, aFile, kOutputDirName, nsDumpUtils::CREATE);
+}
+
+/*
+ Sets the four filter bits of aKey, each taken from 16 bits of the
+ mixed key. Returns true if any of them was clear, i.e. aKey is new.
+ */
+static bool
+TestAndSet(uint8_t* aFilter, uint64_t aKey)
+{
+  uint64_t hash = StumbleMix64(aKey);
+  bool isNew = false;
+  for (uint32_t i = 0; i < 4; i++) {
+    uint32_t bit = uint32_t(hash >> (i * 16)) % kFilterBits;
+    uint8_t mask = 1 << (bit & 7);
+    if (!(aFilter[bit >> 3] & mask)) {
+      aFilter[bit >> 3] |= mask;
+      isNew = true;
+    }
+  }
+  return isNew;
+}
+
+StumbleDedupIndex::StumbleDedupIndex()
+  : mUseClock(0)
+  , mUnsavedChanges(0)
+{
+  static_assert(sizeof(Square) == 16 + kFilterBytes, "Square is written as is");
+}
+
+nsresult
+StumbleDedupIndex::Load()
+{
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = GetIndexFile(kIndexName, getter_AddRefs(file));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = file->OpenNSPRFileDesc(PR_RDONLY, 0, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsAutoCString data;
+  char buf[4096];
+  int32_t bytesRead;
+  while ((bytesRead = PR_Read(fd, buf, sizeof(buf))) > 0) {
+    data.Append(buf, bytesRead);
+  }
+  PR_Close(fd);
+  if (bytesRead < 0) {
+    return NS_ERROR_FAILURE;
+  }
+
+  mSquares.Clear();
+  if (data.IsEmpty()) {
+    // First run
+    return NS_OK;
+  }
+
+  const char* cur = data.BeginReading();
+  uint32_t count;
+  if (data.Length() < kHeaderLength || memcmp(cur, kMagic, sizeof(kMagic)) ||
+      uint8_t(cur[4]) != kFormatVersion) {
+    STUMBLER_ERR("Unknown dedup index, starting an empty one");
+    return NS_OK;
+  }
+  memcpy(&count, cur + 5, sizeof(count));
+  memcpy(&mUseClock, cur + 9, sizeof(mUseClock));
+  if (count > kMaxSquares || data.Length() != kHeaderLength + count * sizeof(Square)) {
+    STUMBLER_ERR("Truncated dedup index, starting an empty one");
+    mUseClock = 0;
+    return NS_OK;
+  }
+
+  mSquares.SetLength(count);
+  memcpy(mSquares.Elements(), cur + kHeaderLength, count * sizeof(Square));
+  STUMBLER_DBG("Loaded %u dedup squares\n", count);
+  return NS_OK;
+}
+
+nsresult
+StumbleDedupIndex::Save()
+{
+  if (!mUnsavedChanges) {
+    return NS_OK;
+  }
+
+  char header[kHeaderLength];
+  uint32_t count = mSquares.Length();
+  memcpy(header, kMagic, sizeof(kMagic));
+  header[4] = kFormatVersion;
+  memcpy(header + 5, &count, sizeof(count));
+  memcpy(header + 9, &mUseClock, sizeof(mUseClock));
+
+  nsCOMPtr<nsIFile> tmpFile;
+  nsresult rv = GetIndexFile(kIndexTmpName, getter_AddRefs(tmpFile));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = tmpFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE, 0644, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+  int32_t squaresLength = count * sizeof(Square);
+  bool ok = PR_Write(fd, header, sizeof(header)) == int32_t(sizeof(header)) &&
+            PR_Write(fd, mSquares.Elements(), squaresLength) == squaresLength;
+  PR_Close(fd);
+  if (!ok) {
+    STUMBLER_ERR("Writing the dedup index failed");
+    return NS_ERROR_FAILURE;
+  }
+
+  rv = tmpFile->MoveToNative(/* directory */ nullptr, kIndexName);
+  NS_ENSURE_SUCCESS(rv, rv);
+  mUnsavedChanges = 0;
+  return NS_OK;
+}
+
+StumbleDedupIndex::Square*
+StumbleDedupIndex::GetSquare(double aLat, double aLon, uint32_t aToday)
+{
+  int32_t latIndex = int32_t(floor(aLat / kGridDegrees));
+  // Same width for the whole row, taken at its centre
+  double rowCos = cos((latIndex + 0.5) * kGridDegrees * (M_PI / 180.0));
+  double lonStep = kGridDegrees / (rowCos > 0.01 ? rowCos : 0.01);
+  int32_t lonIndex = int32_t(floor(aLon / lonStep));
+
+  mUseClock++;
+  Square* oldest = nullptr;
+  for (Square& square : mSquares) {
+    if (square.mLatIndex == latIndex && square.mLonIndex == lonIndex) {
+      square.mLastUse = mUseClock;
+      return &square;
+    }
+    if (!oldest || square.mLastUse < oldest->mLastUse) {
+      oldest = &square;
+    }
+  }
+
+  Square* square = mSquares.Length() < kMaxSquares ? mSquares.AppendElement() : oldest;
+  square->mLatIndex = latIndex;
+  square->mLonIndex = lonIndex;
+  square->mDay = aToday;
+  square->mLastUse = mUseClock;
+  memset(square->mFilter, 0, sizeof(square->mFilter));
+  return square;
+}
+
+bool
+StumbleDedupIndex::AddIfNovel(const StumbleRecord& aRecord)
+{
+  if (!IsFinite(aRecord.mLatitude) || !IsFinite(aRecord.mLongitude)) {
+    return true;
+  }
+
+  uint32_t today = uint32_t(aRecord.mTimestamp / kMsecPerDay);
+  Square* square = GetSquare(aRecord.mLatitude, aRecord.mLongitude, today);
+  if (today >= square->mDay + kRefreshDays) {
+    memset(square->mFilter, 0, sizeof(square->mFilter));
+    square->mDay = today;
+  }
+
+  bool isNovel = false;
+  for (const StumbleWifi& ap : aRecord.mWifi) {
+    isNovel |= TestAndSet(square->mFilter, ap.mBssid);
+  }
+  for (const StumbleCell& cell : aRecord.mCells) {
+    isNovel |= TestAndSet(square->mFilter, StumbleCellKey(cell));
+  }
+
+  if (isNovel && ++mUnsavedChanges >= kSaveEveryChanges) {
+    nsresult rv = Save();
+    if (NS_WARN_IF(NS_FAILED(rv))) {
+      STUMBLER_ERR("Saving the dedup index failed");
+    }
+  }
+  return isNovel;
+}
@@ -0,0 +1,68 @@
+#ifndef StumbleDedupIndex_H
+#define StumbleDedupIndex_H
+
+#include "nsISupportsImpl.h"
+#include "nsTArray.h"
+#include "StumbleRecord.h"
+
+/*
+ Remembers which wifi APs and cell towers were recently stumbled near
+ each place, so a route travelled every day does not fill the log with
+ the same transmitters.
+
+ The map is cut into a grid of about 200 m squares. Each grid square
+ that was stumbled in has a Bloom filter of the BSSIDs and cell
+ identities recorded there. A record is novel if any of its transmitters
+ is missing from the filter of its square; records that are not novel
+ (including those with no transmitters at all) are dropped. A square's
+ filter is cleared after kRefreshDays so that the server still gets
+ fresh observations of a known place.
+
+ The number of squares is bounded; the least recently used square is
+ reused when the index is full. The index is kept in stumbles.dedup,
+ written (to a temporary file, then renamed) every few changes and by
+ Save().
+
+ Not thread-safe; WriteStumbleOnThread serializes access.
+ */
+class StumbleDedupIndex final
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(StumbleDedupIndex)
+
+  StumbleDedupIndex();
+
+  nsresult Load();
+  // Writes the index if it changed since it was last written.
+  nsresult Save();
+
+  // Returns true if aRecord has a transmitter not recently recorded in
+  // its grid square; its transmitters are then added to the square.
+  bool AddIfNovel(const StumbleRecord& aRecord);
+
+  static const uint32_t kMaxSquares = 512;
+  static const uint32_t kFilterBytes = 128;
+  static const uint32_t kRefreshDays = 30;
+
+private:
+  struct Square
+  {
+    int32_t mLatIndex;
+    int32_t mLonIndex;
+    // Days since epoch when the filter was last cleared
+    uint32_t mDay;
+    uint32_t mLastUse;
+    uint8_t mFilter[kFilterBytes];
+  };
+
+  ~StumbleDedupIndex() {}
+
+  Square* GetSquare(double aLat, double aLon, uint32_t aToday);
+
+  nsTArray<Square> mSquares;
+  // Incremented on each lookup; orders the squares for reuse
+  uint32_t mUseClock;
+  uint32_t mUnsavedChanges;
+};
+
+#endif
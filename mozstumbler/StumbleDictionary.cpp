@@ -0,0 +1,180 @@
+#include "StumbleDictionary.h"
+#include "StumbleGZReader.h"
+#include "StumbleRecord.h"
+#include "StumblerLogging.h"
+#include "nsDumpUtils.h"
+#include "nsIFile.h"
+#include "nsTArray.h"
+#include "prio.h"
+#include "zlib.h"
+
+NS_NAMED_LITERAL_CSTRING(kOutputDirName, "mozstumbler");
+NS_NAMED_LITERAL_CSTRING(kDictName, "stumbles.dict");
+NS_NAMED_LITERAL_CSTRING(kDictTmpName, "stumbles.dict.tmp");
+
+static const uint32_t kBssidLength = 6;
+
+static nsresult
+GetDictFile(const nsACString& aName, nsIFile** aFile)
+{
+  return nsDumpUtils::OpenTempFile(aName, aFile, kOutputDirName, nsDumpUtils::CREATE);
+}
+
+namespace {
+
+struct BssidCount
+{
+  uint32_t mCount;
+  uint64_t mBssid;
+
+  bool operator==(const BssidCount& aOther) const
+  {
+    return mCount == aOther.mCount && mBssid == aOther.mBssid;
+  }
+  bool operator<(const BssidCount& aOther) const
+  {
+    return mCount < aOther.mCount ||
+           (mCount == aOther.mCount && mBssid < aOther.mBssid);
+  }
+};
+
+} // anonymous namespace
+
+StumbleDictionary::StumbleDictionary(const nsACString& aData)
+  : mData(aData)
+{
+  mId = adler32(adler32(0, Z_NULL, 0),
+                reinterpret_cast<const Bytef*>(mData.get()), mData.Length());
+}
+
+/* static */ already_AddRefed<StumbleDictionary>
+StumbleDictionary::Load()
+{
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = GetDictFile(kDictName, getter_AddRefs(file));
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    return nullptr;
+  }
+
+  PRFileDesc* fd;
+  rv = file->OpenNSPRFileDesc(PR_RDONLY, 0, &fd);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    return nullptr;
+  }
+  char buf[kMaxLength];
+  int32_t bytesRead = PR_Read(fd, buf, sizeof(buf));
+  PR_Close(fd);
+  if (bytesRead <= 0) {
+    // Not trained yet
+    return nullptr;
+  }
+
+  nsRefPtr<StumbleDictionary> dict =
+    new StumbleDictionary(nsDependentCSubstring(buf, bytesRead));
+  STUMBLER_DBG("Loaded stumble dictionary %08x, %u bytes\n", dict->Id(), dict->Length());
+  return dict.forget();
+}
+
+/* static */ already_AddRefed<StumbleDictionary>
+StumbleDictionary::Train(nsIFile* aLog)
+{
+  StumbleGZReader reader;
+  nsresult rv = reader.Open(aLog, nullptr);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    return nullptr;
+  }
+
+  nsTArray<uint64_t> bssids;
+  nsAutoCString pending;
+  StumbleRecordDecoder decoder;
+  StumbleRecord record;
+  bool headerRead = false;
+  char buf[4096];
+  uint32_t bytesRead;
+  do {
+    rv = reader.Read(buf, sizeof(buf), &bytesRead);
+    if (NS_WARN_IF(NS_FAILED(rv))) {
+      return nullptr;
+    }
+    pending.Append(buf, bytesRead);
+
+    const char* cur = pending.BeginReading();
+    const char* end = pending.EndReading();
+    if (!headerRead) {
+      if (pending.Length() < StumbleRecordDecoder::kHeaderLength) {
+        continue;
+      }
+      if (!StumbleRecordDecoder::ReadHeader(cur, end)) {
+        return nullptr;
+      }
+      headerRead = true;
+    }
+    while (decoder.Decode(cur, end, record)) {
+      for (const StumbleWifi& ap : record.mWifi) {
+        bssids.AppendElement(ap.mBssid);
+      }
+    }
+    pending.Cut(0, cur - pending.BeginReading());
+  } while (bytesRead);
+
+  bssids.Sort();
+  nsTArray<BssidCount> counts;
+  for (uint32_t i = 0; i < bssids.Length(); i++) {
+    if (i && bssids[i] == bssids[i - 1]) {
+      counts.LastElement().mCount++;
+    } else {
+      BssidCount* count = counts.AppendElement();
+      count->mCount = 1;
+      count->mBssid = bssids[i];
+    }
+  }
+  if (counts.Length() < kMinBssids) {
+    STUMBLER_DBG("Only %u BSSIDs, not training a dictionary\n", counts.Length());
+    return nullptr;
+  }
+
+  // zlib finds the end of the dictionary cheapest to refer to, so the
+  // most frequent BSSIDs go last.
+  counts.Sort();
+  uint32_t first = 0;
+  if (counts.Length() > kMaxLength / kBssidLength) {
+    first = counts.Length() - kMaxLength / kBssidLength;
+  }
+  nsAutoCString data;
+  for (uint32_t i = first; i < counts.Length(); i++) {
+    for (int shift = 40; shift >= 0; shift -= 8) {
+      data.Append(char((counts[i].mBssid >> shift) & 0xff));
+    }
+  }
+
+  nsRefPtr<StumbleDictionary> dict = new StumbleDictionary(data);
+  rv = dict->Save();
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    STUMBLER_ERR("Saving the stumble dictionary failed");
+    return nullptr;
+  }
+  STUMBLER_LOG("Trained stumble dictionary %08x from %u BSSIDs", dict->Id(),
+               counts.Length() - first);
+  return dict.forget();
+}
+
+nsresult
+StumbleDictionary::Save()
+{
+  nsCOMPtr<nsIFile> tmpFile;
+  nsresult rv = GetDictFile(kDictTmpName, getter_AddRefs(tmpFile));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = tmpFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE, 0644, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+  int32_t written = PR_Write(fd, mData.get(), mData.Length());
+  // Segments will depend on this file, so it must be on disk before the
+  // first of them.
+  PR_Sync(fd);
+  PR_Close(fd);
+  if (written != int32_t(mData.Length())) {
+    return NS_ERROR_FAILURE;
+  }
+  return tmpFile->MoveToNative(/* directory */ nullptr, kDictName);
+}
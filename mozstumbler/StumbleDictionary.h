@@ -0,0 +1,56 @@
+#ifndef StumbleDictionary_H
+#define StumbleDictionary_H
+
+#include "nsCOMPtr.h"
+#include "nsISupportsImpl.h"
+#include "nsString.h"
+
+class nsIFile;
+
+/*
+ Preset deflate dictionary for the stumble log, trained from the
+ stumbles of this device.
+
+ Segments are small (see StumbleSegmentQueue), so each deflate stream
+ starts with little history. The dictionary holds the BSSIDs seen most
+ often in a sealed segment, as 6-byte strings like in the binary records,
+ so the APs of a route travelled again compress to back-references from
+ the first record of a segment.
+
+ Segments written with the dictionary use the zlib wrapper instead of
+ gzip, whose header carries the dictionary ID (the Adler-32 of the
+ dictionary); StumbleGZReader reads both. The dictionary is trained once,
+ from the first segment sealed without one, and kept in stumbles.dict.
+ It is never replaced, as sealed segments may depend on it.
+ */
+class StumbleDictionary final
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(StumbleDictionary)
+
+  // The deflate window; zlib only uses that much of a dictionary.
+  static const uint32_t kMaxLength = 32 * 1024;
+  // Fewer distinct BSSIDs than this are not worth a dictionary.
+  static const uint32_t kMinBssids = 64;
+
+  // Null if no dictionary was trained yet.
+  static already_AddRefed<StumbleDictionary> Load();
+  // Trains a dictionary from the stumble log aLog and saves it. Null if
+  // the log has too few APs.
+  static already_AddRefed<StumbleDictionary> Train(nsIFile* aLog);
+
+  const char* Data() const { return mData.get(); }
+  uint32_t Length() const { return mData.Length(); }
+  uint32_t Id() const { return mId; }
+
+private:
+  explicit StumbleDictionary(const nsACString& aData);
+  ~StumbleDictionary() {}
+
+  nsresult Save();
+
+  nsCString mData;
+  uint32_t mId;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include "StumbleExporter.h"
+#include "StumbleGZReader.h"
+#include "StumbleRecord.h"
+#include "StumblerLogging.h"
+#include "nsGZFileWriter.h"
+
+// JSON is built in a fixed buffer and handed to the gzip writer once
+// it is this full, so the export does not allocate per record.
+static const uint32_t kJSONBufferSize = 8192;
+static const uint32_t kJSONFlushSize = 6 * 1024;
+
+nsresult
+ExportStumbleLogAsJSON(nsIFile* aLog, StumbleDictionary* aDictionary,
+                       nsIFile* aJSON,
+                       uint32_t aFirstRecord, uint32_t aMaxRecords,
+                       uint32_t* aRecordCount, bool* aIsLast)
+{
+  *aRecordCount = 0;
+  *aIsLast = true;
+
+  StumbleGZReader reader;
+  nsresult rv = reader.Open(aLog, aDictionary);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsRefPtr<nsGZFileWriter> gzWriter = new nsGZFileWriter(nsGZFileWriter::Create);
+  rv = gzWriter->Init(aJSON);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // Bytes of the log that do not make a complete record yet
+  nsAutoCString pending;
+  char jsonStorage[kJSONBufferSize];
+  nsFixedCString json(jsonStorage, sizeof(jsonStorage), 0);
+  json.AssignLiteral("{\"items\":[");
+
+  StumbleRecordDecoder decoder;
+  StumbleRecord record;
+  bool headerRead = false;
+  // Index of the next record in the log
+  uint32_t index = 0;
+  char buf[4096];
+  uint32_t bytesRead;
+  do {
+    rv = reader.Read(buf, sizeof(buf), &bytesRead);
+    NS_ENSURE_SUCCESS(rv, rv);
+    pending.Append(buf, bytesRead);
+
+    const char* cur = pending.BeginReading();
+    const char* end = pending.EndReading();
+    if (!headerRead) {
+      if (pending.Length() < StumbleRecordDecoder::kHeaderLength) {
+        continue;
+      }
+      if (!StumbleRecordDecoder::ReadHeader(cur, end)) {
+        STUMBLER_ERR("Unknown stumble log header");
+        return NS_ERROR_FILE_CORRUPTED;
+      }
+      headerRead = true;
+    }
+
+    // Earlier records are still decoded, since timestamps are deltas
+    while (*aIsLast && decoder.Decode(cur, end, record)) {
+      if (index++ < aFirstRecord) {
+        continue;
+      }
+      if (*aRecordCount == aMaxRecords) {
+        *aIsLast = false;
+        break;
+      }
+      if ((*aRecordCount)++) {
+        json.Append(',');
+      }
+      StumbleRecordToJSON(record, json);
+      if (json.Length() >= kJSONFlushSize) {
+        rv = gzWriter->Write(json);
+        NS_ENSURE_SUCCESS(rv, rv);
+        json.Truncate();
+      }
+    }
+    pending.Cut(0, cur - pending.BeginReading());
+  } while (bytesRead && *aIsLast);
+
+  rv = gzWriter->Write(json);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  if (*aIsLast && !pending.IsEmpty()) {
+    STUMBLER_ERR("Dropping %u trailing bytes of the stumble log", pending.Length());
+  }
+
+  rv = gzWriter->Write("]}");
+  NS_ENSURE_SUCCESS(rv, rv);
+  return gzWriter->Finish();
+}
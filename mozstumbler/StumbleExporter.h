@@ -0,0 +1,24 @@
+#ifndef StumbleExporter_H
+#define StumbleExporter_H
+
+#include "nsError.h"
+
+class nsIFile;
+class StumbleDictionary;
+
+/*
+ Converts a binary stumble log (see StumbleRecord.h) into the gzipped
+ {"items":[...]} JSON that the upload server expects. The log is decoded
+ and the JSON written one chunk at a time, so memory use does not depend
+ on the size of the log. A torn record at the end of the log is dropped.
+
+ Only the records from index aFirstRecord on are exported, at most
+ aMaxRecords of them. aIsLast is set if no record follows the exported
+ ones. aDictionary is the one the log was written with, if any.
+ */
+nsresult ExportStumbleLogAsJSON(nsIFile* aLog, StumbleDictionary* aDictionary,
+                                nsIFile* aJSON,
+                                uint32_t aFirstRecord, uint32_t aMaxRecords,
+                                uint32_t* aRecordCount, bool* aIsLast);
+
+#endif
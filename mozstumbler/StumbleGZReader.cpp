@@ -0,0 +1,91 @@
+#include "StumbleGZReader.h"
+#include "nsIFile.h"
+
+StumbleGZReader::StumbleGZReader()
+  : mFD(nullptr)
+  , mEOF(false)
+  , mMemberEnded(false)
+  , mError(false)
+{
+  memset(&mZStream, 0, sizeof(mZStream));
+}
+
+StumbleGZReader::~StumbleGZReader()
+{
+  if (mFD) {
+    inflateEnd(&mZStream);
+    PR_Close(mFD);
+  }
+}
+
+nsresult
+StumbleGZReader::Open(nsIFile* aFile, StumbleDictionary* aDictionary)
+{
+  MOZ_ASSERT(!mFD);
+
+  nsresult rv = aFile->OpenNSPRFileDesc(PR_RDONLY, 0, &mFD);
+  NS_ENSURE_SUCCESS(rv, rv);
+  mDictionary = aDictionary;
+
+  // 32 + MAX_WBITS detects the gzip or zlib wrapper of each member.
+  if (inflateInit2(&mZStream, 32 + MAX_WBITS) != Z_OK) {
+    PR_Close(mFD);
+    mFD = nullptr;
+    return NS_ERROR_FAILURE;
+  }
+  return NS_OK;
+}
+
+nsresult
+StumbleGZReader::Read(char* aBuf, uint32_t aCount, uint32_t* aRead)
+{
+  NS_ENSURE_TRUE(mFD, NS_ERROR_NOT_INITIALIZED);
+
+  mZStream.next_out = reinterpret_cast<Bytef*>(aBuf);
+  mZStream.avail_out = aCount;
+
+  while (mZStream.avail_out && !mError) {
+    if (!mZStream.avail_in) {
+      if (mEOF) {
+        break;
+      }
+      int32_t bytesRead = PR_Read(mFD, mIn, sizeof(mIn));
+      if (bytesRead < 0) {
+        mError = true;
+        break;
+      }
+      if (bytesRead == 0) {
+        mEOF = true;
+        break;
+      }
+      mZStream.next_in = reinterpret_cast<Bytef*>(mIn);
+      mZStream.avail_in = bytesRead;
+    }
+
+    if (mMemberEnded) {
+      // Another member follows the one that just ended.
+      inflateReset(&mZStream);
+      mMemberEnded = false;
+    }
+
+    int ret = inflate(&mZStream, Z_NO_FLUSH);
+    if (ret == Z_NEED_DICT) {
+      // adler holds the dictionary ID from the zlib header
+      if (!mDictionary || mZStream.adler != mDictionary->Id() ||
+          inflateSetDictionary(&mZStream,
+                               reinterpret_cast<const Bytef*>(mDictionary->Data()),
+                               mDictionary->Length()) != Z_OK) {
+        mError = true;
+      }
+    } else if (ret == Z_STREAM_END) {
+      mMemberEnded = true;
+    } else if (ret == Z_BUF_ERROR && mZStream.avail_in) {
+      mError = true;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      mError = true;
+    }
+  }
+
+  *aRead = aCount - mZStream.avail_out;
+  return NS_OK;
+}
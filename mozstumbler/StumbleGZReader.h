@@ -0,0 +1,42 @@
+#ifndef StumbleGZReader_H
+#define StumbleGZReader_H
+
+#include "nsError.h"
+#include "prio.h"
+#include "StumbleDictionary.h"
+#include "zlib.h"
+
+class nsIFile;
+
+/*
+ Streams the decompressed content of a gzip file with one or more members,
+ such as the ones StumbleGZWriter produces. Memory use is a fixed buffer,
+ whatever the size of the file.
+
+ Members may also be zlib streams; those that need a preset dictionary
+ are read if aDictionary has the ID in their header.
+ */
+class StumbleGZReader final
+{
+public:
+  StumbleGZReader();
+  ~StumbleGZReader();
+
+  nsresult Open(nsIFile* aFile, StumbleDictionary* aDictionary);
+  // Reads up to aCount bytes; *aRead is 0 once the data is exhausted,
+  // either at the end of the file or at the first corrupt byte.
+  nsresult Read(char* aBuf, uint32_t aCount, uint32_t* aRead);
+  // Once Read() returned 0: true if the file ended with a complete member.
+  bool IsComplete() const { return mEOF && mMemberEnded && !mError; }
+
+private:
+  PRFileDesc* mFD;
+  nsRefPtr<StumbleDictionary> mDictionary;
+  z_stream mZStream;
+  bool mEOF;
+  bool mMemberEnded;
+  bool mError;
+  char mIn[4096];
+};
+
+#endif
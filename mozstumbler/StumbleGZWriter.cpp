@@ -0,0 +1,162 @@
+#include "StumbleGZWriter.h"
+#include "StumbleGZReader.h"
+#include "StumblerLogging.h"
+#include "StumblerStats.h"
+
+static const uint32_t kChunkSize = 4096;
+
+/*
+ Inflate every gzip member of aFile into aOut. Returns true only if the
+ file ends with a complete member; aOut holds whatever could be decoded.
+ */
+static bool
+InflateGZipFile(nsIFile* aFile, StumbleDictionary* aDictionary, nsACString& aOut)
+{
+  StumbleGZReader reader;
+  nsresult rv = reader.Open(aFile, aDictionary);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    return false;
+  }
+
+  char buf[kChunkSize];
+  uint32_t bytesRead;
+  do {
+    rv = reader.Read(buf, sizeof(buf), &bytesRead);
+    if (NS_WARN_IF(NS_FAILED(rv))) {
+      return false;
+    }
+    aOut.Append(buf, bytesRead);
+  } while (bytesRead);
+
+  return reader.IsComplete();
+}
+
+StumbleGZWriter::StumbleGZWriter()
+  : mFD(nullptr)
+{
+  memset(&mZStream, 0, sizeof(mZStream));
+}
+
+StumbleGZWriter::~StumbleGZWriter()
+{
+  if (mFD) {
+    Finish();
+  }
+}
+
+nsresult
+StumbleGZWriter::Open(nsIFile* aFile, ValidLengthFunc aValidLength,
+                      StumbleDictionary* aDictionary)
+{
+  MOZ_ASSERT(!mFD);
+  mFile = aFile;
+  mDictionary = aDictionary;
+
+  // A file that does not exist yet is created empty.
+  bool exists = false;
+  nsresult rv = mFile->Exists(&exists);
+  NS_ENSURE_SUCCESS(rv, rv);
+  int64_t fileSize = 0;
+  if (exists) {
+    rv = mFile->GetFileSize(&fileSize);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  nsAutoCString recovered;
+  int32_t flags = PR_WRONLY | PR_CREATE_FILE | PR_APPEND;
+  if (fileSize > 0 && !InflateGZipFile(mFile, mDictionary, recovered)) {
+    // Keep complete records only, and start over with a single member.
+    recovered.SetLength(aValidLength(recovered));
+    STUMBLER_ERR("Unterminated gzip file, recovered %u bytes\n", recovered.Length());
+    flags = PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE;
+  }
+
+  rv = mFile->OpenNSPRFileDesc(flags, 0644, &mFD);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  memset(&mZStream, 0, sizeof(mZStream));
+  // 16 + MAX_WBITS selects the gzip wrapper, which has no room for a
+  // dictionary ID; MAX_WBITS alone is the zlib wrapper.
+  int windowBits = mDictionary ? MAX_WBITS : 16 + MAX_WBITS;
+  if (deflateInit2(&mZStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                   windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    PR_Close(mFD);
+    mFD = nullptr;
+    return NS_ERROR_FAILURE;
+  }
+  if (mDictionary &&
+      deflateSetDictionary(&mZStream, reinterpret_cast<const Bytef*>(mDictionary->Data()),
+                           mDictionary->Length()) != Z_OK) {
+    deflateEnd(&mZStream);
+    PR_Close(mFD);
+    mFD = nullptr;
+    return NS_ERROR_FAILURE;
+  }
+
+  if (!recovered.IsEmpty()) {
+    return Write(recovered);
+  }
+  return NS_OK;
+}
+
+nsresult
+StumbleGZWriter::Deflate(int aFlush)
+{
+  char buf[kChunkSize];
+  do {
+    mZStream.next_out = reinterpret_cast<Bytef*>(buf);
+    mZStream.avail_out = sizeof(buf);
+    if (deflate(&mZStream, aFlush) == Z_STREAM_ERROR) {
+      return NS_ERROR_FAILURE;
+    }
+    mPending.Append(buf, sizeof(buf) - mZStream.avail_out);
+  } while (mZStream.avail_out == 0);
+  return NS_OK;
+}
+
+nsresult
+StumbleGZWriter::WritePending()
+{
+  const char* data = mPending.BeginReading();
+  int32_t remaining = mPending.Length();
+  while (remaining > 0) {
+    int32_t written = PR_Write(mFD, data, remaining);
+    if (written <= 0) {
+      return NS_ERROR_FAILURE;
+    }
+    data += written;
+    remaining -= written;
+    StumblerStats::Add(StumblerStats::BYTES_COMPRESSED, written);
+  }
+  mPending.Truncate();
+  return NS_OK;
+}
+
+nsresult
+StumbleGZWriter::Write(const nsACString& aStr)
+{
+  NS_ENSURE_TRUE(mFD, NS_ERROR_NOT_INITIALIZED);
+
+  mZStream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(aStr.BeginReading()));
+  mZStream.avail_in = aStr.Length();
+  nsresult rv = Deflate(Z_NO_FLUSH);
+  NS_ENSURE_SUCCESS(rv, rv);
+  MOZ_ASSERT(mZStream.avail_in == 0);
+  return NS_OK;
+}
+
+nsresult
+StumbleGZWriter::Finish()
+{
+  NS_ENSURE_TRUE(mFD, NS_ERROR_NOT_INITIALIZED);
+
+  nsresult rv = Deflate(Z_FINISH);
+  if (NS_SUCCEEDED(rv)) {
+    rv = WritePending();
+  }
+  deflateEnd(&mZStream);
+  PR_Close(mFD);
+  mFD = nullptr;
+  mPending.Truncate();
+  return rv;
+}
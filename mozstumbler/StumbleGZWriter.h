@@ -0,0 +1,53 @@
+#ifndef StumbleGZWriter_H
+#define StumbleGZWriter_H
+
+#include "nsCOMPtr.h"
+#include "nsIFile.h"
+#include "nsISupportsImpl.h"
+#include "nsString.h"
+#include "prio.h"
+#include "StumbleDictionary.h"
+#include "zlib.h"
+
+/*
+ Compresses a head into a sealed segment, see StumbleSegmentQueue::Seal():
+ Open(), Write() the header and the records, then Finish(), which writes
+ the trailer and closes the file. The segment is one deflate stream, in
+ a gzip member, or with aDictionary in a zlib stream primed with that
+ preset dictionary, see StumbleDictionary.
+
+ Open() on a file that already has data appends a new member. If the
+ last member has no trailer, as a gzip head written before
+ StumbleAppendLog can have after a crash, the file is rewritten with the
+ prefix that aValidLength accepts (the caller knows where its records
+ end).
+ */
+class StumbleGZWriter final
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(StumbleGZWriter)
+
+  StumbleGZWriter();
+
+  // Returns the length of the longest prefix made of complete records.
+  typedef uint32_t (*ValidLengthFunc)(const nsACString& aData);
+
+  nsresult Open(nsIFile* aFile, ValidLengthFunc aValidLength,
+                StumbleDictionary* aDictionary);
+  nsresult Write(const nsACString& aStr);
+  nsresult Finish();
+
+private:
+  ~StumbleGZWriter();
+
+  nsresult Deflate(int aFlush);
+  nsresult WritePending();
+
+  nsCOMPtr<nsIFile> mFile;
+  nsRefPtr<StumbleDictionary> mDictionary;
+  PRFileDesc* mFD;
+  z_stream mZStream;
+  nsCString mPending;
+};
+
+#endif
@@ -0,0 +1,449 @@
+#include "StumbleGeoIndex.h"
+#include "StumblerGeodesy.h"
+#include "StumblerLogging.h"
+#include "mozilla/Constants.h"
+#include "mozilla/FloatingPoint.h"
+#include "nsDumpUtils.h"
+#include "nsICellInfo.h"
+#include "nsIFile.h"
+#include "prio.h"
+#include "prtime.h"
+#include <math.h>
+#include <string.h>
+
+using namespace mozilla;
+
+static const double kDegreeScale = 1e7;
+static const double kMetersPerDegree = M_PI / 180.0 * kGeoEarthRadiusMeters;
+static const int64_t kMsecPerDay = 24 * 60 * 60 * 1000;
+// Time between automatic writes of the whole index, about 147 KB when
+// full; it is also written when the GPS stops, see Save(). What was added
+// since is lost if the process dies, and is stumbled again.
+static const int64_t kSaveIntervalMs = 6 * 60 * 60 * 1000;
+
+// GPS accuracies are clamped to this (m) when weighing an observation,
+// and records less accurate than kMaxAccuracy are not used at all.
+static const double kMinAccuracy = 10;
+static const double kMaxAccuracy = 100;
+static const double kUnknownAccuracy = 50;
+// Floors of the radius when weighing a transmitter, and of the accuracy
+// of a position from APs or cells only
+static const double kMinWifiRadius = 10;
+static const double kMinCellRadius = 100;
+static const double kMinWifiAccuracy = 20;
+static const double kMinCellAccuracy = 300;
+
+// BSSIDs are 48 bits; cell keys are hashes with the top bit set.
+static const uint64_t kWifiTag = uint64_t(1) << 48;
+static const uint64_t kCellTag = uint64_t(1) << 63;
+
+static const char kMagic[] = { 'M', 'Z', 'G', 'X' };
+static const uint8_t kFormatVersion = 1;
+// Magic, version, entry count
+static const uint32_t kHeaderLength = 4 + 1 + 4;
+
+NS_NAMED_LITERAL_CSTRING(kOutputDirName, "mozstumbler");
+NS_NAMED_LITERAL_CSTRING(kIndexName, "stumbles.geo");
+NS_NAMED_LITERAL_CSTRING(kIndexTmpName, "stumbles.geo.tmp");
+
+static nsresult
+GetIndexFile(const nsACString& aName, nsIFile** aFile)
+{
+  return nsDumpUtils::OpenTempFile(aName, aFile, kOutputDirName, nsDumpUtils::CREATE);
+}
+
+static uint64_t
+WifiKey(uint64_t aBssid)
+{
+  return aBssid | kWifiTag;
+}
+
+static uint64_t
+CellKey(const StumbleCell& aCell)
+{
+  return StumbleCellKey(aCell) | kCellTag;
+}
+
+// 1 at -40 dBm and stronger, down to 0.001 at -100 dBm
+static double
+SignalWeight(uint32_t aSignal)
+{
+  int32_t dbm = int32_t(aSignal);
+  if (dbm > 0) {
+    // Some drivers report the magnitude
+    dbm = -dbm;
+  } else if (dbm == 0) {
+    dbm = -100;
+  }
+  if (dbm > -40) {
+    dbm = -40;
+  } else if (dbm < -100) {
+    dbm = -100;
+  }
+  return pow(10, (dbm + 40) / 20.0);
+}
+
+static double
+WrapLongitude(double aLon)
+{
+  if (aLon > 180) {
+    return aLon - 360;
+  }
+  if (aLon < -180) {
+    return aLon + 360;
+  }
+  return aLon;
+}
+
+StumbleGeoIndex::StumbleGeoIndex()
+  : mCount(0)
+  , mUnsavedRecords(0)
+  , mLastSave(PR_Now() / PR_USEC_PER_MSEC)
+{
+  static_assert(sizeof(Entry) == 24, "Entry is written as is");
+  static_assert(!(kSlots & (kSlots - 1)), "kSlots is a power of two");
+  mSlots.SetLength(kSlots);
+  memset(mSlots.Elements(), 0, kSlots * sizeof(Entry));
+}
+
+int32_t
+StumbleGeoIndex::FindSlot(uint64_t aKey) const
+{
+  uint32_t slot = StumbleMix64(aKey) & (kSlots - 1);
+  for (uint32_t i = 0; i < kSlots; i++) {
+    uint64_t key = mSlots[slot].mKey;
+    if (key == aKey) {
+      return slot;
+    }
+    if (!key) {
+      return -1;
+    }
+    slot = (slot + 1) & (kSlots - 1);
+  }
+  return -1;
+}
+
+StumbleGeoIndex::Entry*
+StumbleGeoIndex::Insert(uint64_t aKey, uint16_t aDay)
+{
+  if (mCount >= kMaxEntries) {
+    Evict(aDay);
+  }
+  uint32_t slot = StumbleMix64(aKey) & (kSlots - 1);
+  while (mSlots[slot].mKey) {
+    slot = (slot + 1) & (kSlots - 1);
+  }
+  Entry* entry = &mSlots[slot];
+  entry->mKey = aKey;
+  mCount++;
+  return entry;
+}
+
+static uint32_t
+AgeInDays(uint16_t aDay, uint16_t aToday)
+{
+  uint32_t age = aToday > aDay ? aToday - aDay : 0;
+  return age < 255 ? age : 255;
+}
+
+/*
+ Drops an eighth of kMaxEntries, those not seen for longest, and
+ rehashes the rest; deleting single entries would need tombstones.
+ Entries of the cutoff age are dropped in slot order, i.e. at random.
+ */
+void
+StumbleGeoIndex::Evict(uint16_t aToday)
+{
+  uint32_t ages[256];
+  memset(ages, 0, sizeof(ages));
+  for (const Entry& entry : mSlots) {
+    if (entry.mKey) {
+      ages[AgeInDays(entry.mDay, aToday)]++;
+    }
+  }
+  const uint32_t target = kMaxEntries / 8;
+  uint32_t cutoff = 255;
+  uint32_t older = 0;
+  while (cutoff > 0 && older + ages[cutoff] < target) {
+    older += ages[cutoff--];
+  }
+  uint32_t dropAtCutoff = target - older;
+
+  nsTArray<Entry> kept;
+  kept.SetCapacity(mCount);
+  for (const Entry& entry : mSlots) {
+    if (!entry.mKey) {
+      continue;
+    }
+    uint32_t age = AgeInDays(entry.mDay, aToday);
+    if (age > cutoff) {
+      continue;
+    }
+    if (age == cutoff && dropAtCutoff) {
+      dropAtCutoff--;
+      continue;
+    }
+    kept.AppendElement(entry);
+  }
+  STUMBLER_DBG("Geo index full, dropping %u entries\n", mCount - kept.Length());
+
+  memset(mSlots.Elements(), 0, kSlots * sizeof(Entry));
+  mCount = 0;
+  for (const Entry& entry : kept) {
+    *Insert(entry.mKey, aToday) = entry;
+  }
+}
+
+void
+StumbleGeoIndex::Observe(uint64_t aKey, double aLatitude, double aLongitude,
+                         double aWeight, uint16_t aDay)
+{
+  int32_t slot = FindSlot(aKey);
+  if (slot < 0) {
+    Entry* entry = Insert(aKey, aDay);
+    entry->mLatitude = int32_t(floor(aLatitude * kDegreeScale + 0.5));
+    entry->mLongitude = int32_t(floor(aLongitude * kDegreeScale + 0.5));
+    entry->mWeight = aWeight;
+    entry->mRadius = 0;
+    entry->mDay = aDay;
+    return;
+  }
+
+  Entry& entry = mSlots[slot];
+  double lat = entry.mLatitude / kDegreeScale;
+  double lon = entry.mLongitude / kDegreeScale;
+  double total = entry.mWeight + aWeight;
+  lat += (aLatitude - lat) * aWeight / total;
+  lon = WrapLongitude(lon + WrapLongitude(aLongitude - lon) * aWeight / total);
+  double distance = GeoDistanceMeters(lat, lon, aLatitude, aLongitude);
+  double radius = (entry.mWeight * entry.mRadius + aWeight * distance) / total;
+
+  entry.mLatitude = int32_t(floor(lat * kDegreeScale + 0.5));
+  entry.mLongitude = int32_t(floor(lon * kDegreeScale + 0.5));
+  entry.mWeight = total < kMaxWeight ? total : kMaxWeight;
+  entry.mRadius = radius < 65535 ? uint16_t(radius + 0.5) : 65535;
+  entry.mDay = aDay;
+}
+
+void
+StumbleGeoIndex::Add(const StumbleRecord& aRecord)
+{
+  if (!IsFinite(aRecord.mLatitude) || !IsFinite(aRecord.mLongitude)) {
+    return;
+  }
+  double accuracy = IsFinite(aRecord.mAccuracy) ? aRecord.mAccuracy : kUnknownAccuracy;
+  if (accuracy > kMaxAccuracy) {
+    return;
+  }
+  if (accuracy < kMinAccuracy) {
+    accuracy = kMinAccuracy;
+  }
+  double fixWeight = (kMinAccuracy * kMinAccuracy) / (accuracy * accuracy);
+  uint16_t day = uint16_t(aRecord.mTimestamp / kMsecPerDay);
+
+  for (const StumbleWifi& ap : aRecord.mWifi) {
+    Observe(WifiKey(ap.mBssid), aRecord.mLatitude, aRecord.mLongitude,
+            fixWeight * SignalWeight(ap.mSignal), day);
+  }
+  for (const StumbleCell& cell : aRecord.mCells) {
+    // Neighbouring cells with only a PSC are ambiguous.
+    if (cell.mCid == nsICellInfo::UNKNOWN_VALUE) {
+      continue;
+    }
+    Observe(CellKey(cell), aRecord.mLatitude, aRecord.mLongitude, fixWeight, day);
+  }
+
+  mUnsavedRecords++;
+  int64_t now = PR_Now() / PR_USEC_PER_MSEC;
+  if (now - mLastSave >= kSaveIntervalMs) {
+    nsresult rv = Save();
+    if (NS_WARN_IF(NS_FAILED(rv))) {
+      STUMBLER_ERR("Saving the geo index failed");
+      // Not retried on every record, e.g. while the disk is full
+      mLastSave = now;
+    }
+  }
+}
+
+namespace {
+
+struct Match
+{
+  uint32_t mSlot;
+  double mWeight;
+};
+
+} // anonymous namespace
+
+bool
+StumbleGeoIndex::Locate(const StumbleRecord& aScan, Estimate* aEstimate) const
+{
+  nsAutoTArray<Match, 32> matches;
+  for (const StumbleWifi& ap : aScan.mWifi) {
+    int32_t slot = FindSlot(WifiKey(ap.mBssid));
+    if (slot >= 0) {
+      double radius = mSlots[slot].mRadius > kMinWifiRadius ?
+                      mSlots[slot].mRadius : kMinWifiRadius;
+      Match* match = matches.AppendElement();
+      match->mSlot = slot;
+      match->mWeight = SignalWeight(ap.mSignal) / (radius * radius);
+    }
+  }
+  aEstimate->mWifiMatches = matches.Length();
+  aEstimate->mCellMatches = 0;
+  if (matches.IsEmpty()) {
+    for (const StumbleCell& cell : aScan.mCells) {
+      if (cell.mCid == nsICellInfo::UNKNOWN_VALUE) {
+        continue;
+      }
+      int32_t slot = FindSlot(CellKey(cell));
+      if (slot >= 0) {
+        double radius = mSlots[slot].mRadius > kMinCellRadius ?
+                        mSlots[slot].mRadius : kMinCellRadius;
+        Match* match = matches.AppendElement();
+        match->mSlot = slot;
+        match->mWeight = 1 / (radius * radius);
+      }
+    }
+    aEstimate->mCellMatches = matches.Length();
+  }
+  if (matches.IsEmpty()) {
+    return false;
+  }
+
+  // Weighted centroid on a plane tangent at the first match
+  const Entry* first = &mSlots[matches[0].mSlot];
+  double refLat = first->mLatitude / kDegreeScale;
+  double refLon = first->mLongitude / kDegreeScale;
+  double lonScale = cos(refLat * (M_PI / 180.0)) * kMetersPerDegree;
+  double sumWeight = 0;
+  double sumX = 0;
+  double sumY = 0;
+  for (const Match& match : matches) {
+    const Entry* entry = &mSlots[match.mSlot];
+    sumX += match.mWeight * WrapLongitude(entry->mLongitude / kDegreeScale - refLon) * lonScale;
+    sumY += match.mWeight * (entry->mLatitude / kDegreeScale - refLat) * kMetersPerDegree;
+    sumWeight += match.mWeight;
+  }
+  double x = sumX / sumWeight;
+  double y = sumY / sumWeight;
+
+  // Spread of the transmitters around the estimate, and their own radii
+  double sumSquares = 0;
+  for (const Match& match : matches) {
+    const Entry* entry = &mSlots[match.mSlot];
+    double dx = WrapLongitude(entry->mLongitude / kDegreeScale - refLon) * lonScale - x;
+    double dy = (entry->mLatitude / kDegreeScale - refLat) * kMetersPerDegree - y;
+    sumSquares += match.mWeight * (dx * dx + dy * dy + double(entry->mRadius) * entry->mRadius);
+  }
+  double minAccuracy = aEstimate->mWifiMatches ? kMinWifiAccuracy : kMinCellAccuracy;
+  double accuracy = sqrt(sumSquares / sumWeight);
+
+  aEstimate->mLatitude = refLat + y / kMetersPerDegree;
+  aEstimate->mLongitude = WrapLongitude(refLon + (lonScale > 0 ? x / lonScale : 0));
+  aEstimate->mAccuracy = accuracy > minAccuracy ? accuracy : minAccuracy;
+  return true;
+}
+
+nsresult
+StumbleGeoIndex::Load()
+{
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = GetIndexFile(kIndexName, getter_AddRefs(file));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = file->OpenNSPRFileDesc(PR_RDONLY, 0, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsAutoCString data;
+  char buf[4096];
+  int32_t bytesRead;
+  while ((bytesRead = PR_Read(fd, buf, sizeof(buf))) > 0) {
+    data.Append(buf, bytesRead);
+  }
+  PR_Close(fd);
+  if (bytesRead < 0) {
+    return NS_ERROR_FAILURE;
+  }
+
+  memset(mSlots.Elements(), 0, kSlots * sizeof(Entry));
+  mCount = 0;
+  // The first save is due kSaveIntervalMs after loading, not after the
+  // object was created.
+  mLastSave = PR_Now() / PR_USEC_PER_MSEC;
+  if (data.IsEmpty()) {
+    // First run
+    return NS_OK;
+  }
+
+  const char* cur = data.BeginReading();
+  uint32_t count;
+  if (data.Length() < kHeaderLength || memcmp(cur, kMagic, sizeof(kMagic)) ||
+      uint8_t(cur[4]) != kFormatVersion) {
+    STUMBLER_ERR("Unknown geo index, starting an empty one");
+    return NS_OK;
+  }
+  memcpy(&count, cur + 5, sizeof(count));
+  if (count > kMaxEntries || data.Length() != kHeaderLength + count * sizeof(Entry)) {
+    STUMBLER_ERR("Truncated geo index, starting an empty one");
+    return NS_OK;
+  }
+
+  cur += kHeaderLength;
+  for (uint32_t i = 0; i < count; i++, cur += sizeof(Entry)) {
+    Entry entry;
+    memcpy(&entry, cur, sizeof(entry));
+    if (!entry.mKey || FindSlot(entry.mKey) >= 0) {
+      continue;
+    }
+    *Insert(entry.mKey, entry.mDay) = entry;
+  }
+  STUMBLER_DBG("Loaded %u geo index entries\n", mCount);
+  return NS_OK;
+}
+
+nsresult
+StumbleGeoIndex::Save()
+{
+  if (!mUnsavedRecords) {
+    return NS_OK;
+  }
+
+  char header[kHeaderLength];
+  memcpy(header, kMagic, sizeof(kMagic));
+  header[4] = kFormatVersion;
+  memcpy(header + 5, &mCount, sizeof(mCount));
+
+  nsCOMPtr<nsIFile> tmpFile;
+  nsresult rv = GetIndexFile(kIndexTmpName, getter_AddRefs(tmpFile));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = tmpFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE, 0644, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+  bool ok = PR_Write(fd, header, sizeof(header)) == int32_t(sizeof(header));
+  // Only the used slots, in runs, so a sparse table is written quickly
+  uint32_t runStart = 0;
+  for (uint32_t i = 0; ok && i <= kSlots; i++) {
+    if (i < kSlots && mSlots[i].mKey) {
+      continue;
+    }
+    if (i > runStart) {
+      int32_t length = (i - runStart) * sizeof(Entry);
+      ok = PR_Write(fd, &mSlots[runStart], length) == length;
+    }
+    runStart = i + 1;
+  }
+  PR_Close(fd);
+  if (!ok) {
+    STUMBLER_ERR("Writing the geo index failed");
+    return NS_ERROR_FAILURE;
+  }
+
+  rv = tmpFile->MoveToNative(/* directory */ nullptr, kIndexName);
+  NS_ENSURE_SUCCESS(rv, rv);
+  mUnsavedRecords = 0;
+  mLastSave = PR_Now() / PR_USEC_PER_MSEC;
+  return NS_OK;
+}
@@ -0,0 +1,96 @@
+#ifndef StumbleGeoIndex_H
+#define StumbleGeoIndex_H
+
+#include "nsISupportsImpl.h"
+#include "nsTArray.h"
+#include "StumbleRecord.h"
+
+/*
+ On-device index of where each wifi AP and cell tower was stumbled, so a
+ scan can be located without a network request.
+
+ Every record written with a GPS position is folded in. Each BSSID and
+ cell (with a known CID) has a weighted centroid of the positions it was
+ seen at, and a radius: the weighted mean distance of those positions
+ from the centroid. An observation weighs more the better the GPS
+ accuracy and, for APs, the stronger the signal, since a strong AP is
+ close. The total weight is capped at kMaxWeight, so an AP that moved
+ is followed after a few observations.
+
+ Locate() takes the weighted centroid of the known APs of a scan, each
+ weighted by its signal and the inverse square of its radius, or of the
+ known cells if no AP is known. It costs one hash lookup per
+ transmitter.
+
+ The entries are kept in an open-addressing hash table of kSlots with
+ linear probing. When kMaxEntries is reached, the entries not seen for
+ longest are dropped, an eighth of the table at a time. The index is
+ kept in stumbles.geo, written (to a temporary file, then renamed) by
+ Save(), when the writer finishes, and every few hours while stumbling.
+
+ Not thread-safe; WriteStumbleOnThread serializes access.
+ */
+class StumbleGeoIndex final
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(StumbleGeoIndex)
+
+  static const uint32_t kMaxEntries = 6144;
+  static const uint32_t kSlots = 8192;
+  static const uint32_t kMaxWeight = 32;
+
+  struct Estimate
+  {
+    double mLatitude;
+    double mLongitude;
+    // m
+    double mAccuracy;
+    uint32_t mWifiMatches;
+    uint32_t mCellMatches;
+  };
+
+  StumbleGeoIndex();
+
+  nsresult Load();
+  // Writes the index if it changed since it was last written.
+  nsresult Save();
+
+  // Adds the transmitters of a record that has a position.
+  void Add(const StumbleRecord& aRecord);
+  // Returns false if no transmitter of aScan is in the index.
+  bool Locate(const StumbleRecord& aScan, Estimate* aEstimate) const;
+
+  uint32_t Count() const { return mCount; }
+
+private:
+  struct Entry
+  {
+    // 0 for a free slot
+    uint64_t mKey;
+    // 1e-7 degrees
+    int32_t mLatitude;
+    int32_t mLongitude;
+    float mWeight;
+    // m, at most 65535
+    uint16_t mRadius;
+    // Days since epoch of the last observation
+    uint16_t mDay;
+  };
+
+  ~StumbleGeoIndex() {}
+
+  // Returns -1 if aKey is not in the index.
+  int32_t FindSlot(uint64_t aKey) const;
+  void Observe(uint64_t aKey, double aLatitude, double aLongitude,
+               double aWeight, uint16_t aDay);
+  Entry* Insert(uint64_t aKey, uint16_t aDay);
+  void Evict(uint16_t aToday);
+
+  nsTArray<Entry> mSlots;
+  uint32_t mCount;
+  uint32_t mUnsavedRecords;
+  // ms since epoch
+  int64_t mLastSave;
+};
+
+#endif
@@ -0,0 +1,383 @@
+#include "StumbleNmeaParser.h"
+#include <string.h>
+
+using namespace mozilla;
+
+/*
+ Layout of sLatest:
+   bits 0-15   HDOP in hundredths, 0 when unknown
+   bits 16-23  satellites used
+   bits 24-31  satellites in view
+   bits 32-33  fix type
+   bit 34      set once anything was published
+   bits 36-63  time in 100 ms units, modulo 2^28 (about 310 days)
+ */
+static const uint64_t kValidBit = uint64_t(1) << 34;
+static const uint32_t kTimeShift = 36;
+static const uint64_t kTimeMask = (uint64_t(1) << 28) - 1;
+static const int64_t kTimeUnitMs = 100;
+
+// A constellation missing from the GSV sentences for this long is no
+// longer counted in view.
+static const int64_t kInViewMaxAgeMs = 10000;
+
+Atomic<uint64_t, ReleaseAcquire> StumbleNmeaParser::sLatest;
+
+bool
+StumbleFixQuality::IsFresh(int64_t aNowMs) const
+{
+  return mValid && aNowMs - mTime <= kMaxAgeMs;
+}
+
+bool
+StumbleFixQuality::IsPoor(int64_t aNowMs) const
+{
+  if (!IsFresh(aNowMs)) {
+    return false;
+  }
+  return mFixType == FIX_NONE ||
+         (mSatellitesUsed != kUnknownCount && mSatellitesUsed < kMinSatellitesUsed) ||
+         mHdopCenti > kMaxHdopCenti;
+}
+
+namespace {
+
+/*
+ Walks the comma-separated fields of a sentence, from the address field
+ to the one before the checksum.
+ */
+class NmeaFields
+{
+public:
+  NmeaFields(const char* aBegin, const char* aEnd)
+    : mField(aBegin), mFieldEnd(aBegin), mNext(aBegin), mEnd(aEnd)
+  {
+    Next();
+  }
+
+  // Moves to the next field; false if there is none.
+  bool Next()
+  {
+    if (mNext > mEnd) {
+      return false;
+    }
+    mField = mNext;
+    const char* p = mNext;
+    while (p < mEnd && *p != ',') {
+      p++;
+    }
+    mFieldEnd = p;
+    mNext = p + 1;
+    return true;
+  }
+
+  bool Skip(uint32_t aCount)
+  {
+    for (uint32_t i = 0; i < aCount; i++) {
+      if (!Next()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  uint32_t Length() const { return mFieldEnd - mField; }
+  const char* Field() const { return mField; }
+
+  bool ReadUint(uint32_t* aValue) const
+  {
+    // More digits than any field here has would overflow
+    if (!Length() || Length() > 9) {
+      return false;
+    }
+    uint32_t value = 0;
+    for (const char* p = mField; p < mFieldEnd; p++) {
+      if (*p < '0' || *p > '9') {
+        return false;
+      }
+      value = value * 10 + (*p - '0');
+    }
+    *aValue = value;
+    return true;
+  }
+
+  // Reads a decimal like "1.25" in hundredths; further digits are cut.
+  bool ReadCenti(uint32_t* aValue) const
+  {
+    uint32_t value = 0;
+    uint32_t intDigits = 0;
+    uint32_t fracDigits = 0;
+    bool inFraction = false;
+    for (const char* p = mField; p < mFieldEnd; p++) {
+      if (*p == '.' && !inFraction) {
+        inFraction = true;
+        continue;
+      }
+      if (*p < '0' || *p > '9') {
+        return false;
+      }
+      if (!inFraction) {
+        if (++intDigits > 5) {
+          return false;
+        }
+        value = value * 10 + (*p - '0');
+      } else if (fracDigits < 2) {
+        value = value * 10 + (*p - '0');
+        fracDigits++;
+      }
+    }
+    if (!intDigits && !fracDigits) {
+      return false;
+    }
+    for (; fracDigits < 2; fracDigits++) {
+      value *= 10;
+    }
+    *aValue = value;
+    return true;
+  }
+
+private:
+  const char* mField;
+  const char* mFieldEnd;
+  const char* mNext;
+  const char* mEnd;
+};
+
+} // anonymous namespace
+
+static int
+HexValue(char aChar)
+{
+  if (aChar >= '0' && aChar <= '9') {
+    return aChar - '0';
+  }
+  if (aChar >= 'A' && aChar <= 'F') {
+    return aChar - 'A' + 10;
+  }
+  if (aChar >= 'a' && aChar <= 'f') {
+    return aChar - 'a' + 10;
+  }
+  return -1;
+}
+
+// Slot in mInView for the talker ID of a GSV sentence
+static uint32_t
+TalkerSlot(char aFirst, char aSecond)
+{
+  if (aFirst == 'G') {
+    switch (aSecond) {
+      case 'P': return 0; // GPS
+      case 'L': return 1; // GLONASS
+      case 'A': return 2; // Galileo
+      case 'B': return 3; // BeiDou
+      case 'Q': return 4; // QZSS
+    }
+  }
+  if (aFirst == 'B' && aSecond == 'D') {
+    return 3;
+  }
+  return 5;
+}
+
+StumbleNmeaParser::StumbleNmeaParser()
+  : mLength(0)
+  , mSkipping(false)
+  , mHdopCenti(0)
+  , mSatellitesUsed(StumbleFixQuality::kUnknownCount)
+  , mFixType(StumbleFixQuality::FIX_UNKNOWN)
+  , mSentences(0)
+  , mRejected(0)
+{
+  memset(mInView, 0, sizeof(mInView));
+  memset(mInViewTime, 0, sizeof(mInViewTime));
+}
+
+void
+StumbleNmeaParser::Feed(const char* aData, uint32_t aLength, int64_t aNowMs)
+{
+  for (uint32_t i = 0; i < aLength; i++) {
+    char c = aData[i];
+    if (c == '$') {
+      // A new sentence, even if the last one was not terminated
+      if (mLength) {
+        mRejected++;
+      }
+      mBuffer[0] = c;
+      mLength = 1;
+      mSkipping = false;
+      continue;
+    }
+    if (c == '\r' || c == '\n' || c == '\0') {
+      if (mLength) {
+        Count(ParseSentence(aNowMs));
+        mLength = 0;
+      }
+      continue;
+    }
+    if (mSkipping || !mLength) {
+      continue;
+    }
+    if (mLength == kMaxSentenceLength) {
+      mRejected++;
+      mLength = 0;
+      mSkipping = true;
+      continue;
+    }
+    mBuffer[mLength++] = c;
+  }
+
+  // Some HALs pass sentences without a line ending.
+  if (mLength > 3 && mBuffer[mLength - 3] == '*') {
+    Count(ParseSentence(aNowMs));
+    mLength = 0;
+  }
+}
+
+bool
+StumbleNmeaParser::ParseSentence(int64_t aNowMs)
+{
+  // "$" address(5) "*" checksum(2)
+  if (mLength < 9 || mBuffer[mLength - 3] != '*') {
+    return false;
+  }
+  const char* star = mBuffer + mLength - 3;
+  int high = HexValue(star[1]);
+  int low = HexValue(star[2]);
+  if (high < 0 || low < 0) {
+    return false;
+  }
+  uint8_t checksum = 0;
+  for (const char* p = mBuffer + 1; p < star; p++) {
+    checksum ^= uint8_t(*p);
+  }
+  if (checksum != ((high << 4) | low)) {
+    return false;
+  }
+
+  NmeaFields fields(mBuffer + 1, star);
+  if (fields.Length() != 5) {
+    return false;
+  }
+  const char* address = fields.Field();
+  if (address[0] == 'P') {
+    // Proprietary sentence
+    return true;
+  }
+  const char* type = address + 2;
+
+  uint32_t value;
+  if (!memcmp(type, "GGA", 3)) {
+    // time, latitude, N/S, longitude, E/W, quality, satellites used, HDOP
+    uint32_t quality;
+    if (!fields.Skip(6) || !fields.ReadUint(&quality) || !fields.Next()) {
+      return false;
+    }
+    if (!fields.Length()) {
+      mSatellitesUsed = StumbleFixQuality::kUnknownCount;
+    } else if (fields.ReadUint(&value)) {
+      mSatellitesUsed = value < StumbleFixQuality::kUnknownCount ?
+                        value : StumbleFixQuality::kUnknownCount - 1;
+    } else {
+      return false;
+    }
+    if (!fields.Next()) {
+      return false;
+    }
+    if (!fields.Length()) {
+      mHdopCenti = 0;
+    } else if (!fields.ReadCenti(&mHdopCenti)) {
+      return false;
+    }
+    if (!quality) {
+      mFixType = StumbleFixQuality::FIX_NONE;
+    } else if (mFixType == StumbleFixQuality::FIX_NONE) {
+      mFixType = StumbleFixQuality::FIX_UNKNOWN;
+    }
+  } else if (!memcmp(type, "GSA", 3)) {
+    // mode, fix type, 12 satellite IDs, PDOP, HDOP
+    if (!fields.Skip(2) || !fields.ReadUint(&value) || value < 1 || value > 3) {
+      return false;
+    }
+    mFixType = StumbleFixQuality::FixType(StumbleFixQuality::FIX_NONE + value - 1);
+    if (fields.Skip(14) && fields.Length() && !fields.ReadCenti(&mHdopCenti)) {
+      return false;
+    }
+  } else if (!memcmp(type, "GSV", 3)) {
+    // message count, message number, satellites in view
+    if (!fields.Skip(3) || !fields.ReadUint(&value)) {
+      return false;
+    }
+    uint32_t slot = TalkerSlot(address[0], address[1]);
+    mInView[slot] = value < StumbleFixQuality::kUnknownCount ?
+                    value : StumbleFixQuality::kUnknownCount - 1;
+    mInViewTime[slot] = aNowMs;
+  } else if (!memcmp(type, "RMC", 3)) {
+    // time, status
+    if (!fields.Skip(2) || fields.Length() != 1) {
+      return false;
+    }
+    if (fields.Field()[0] == 'V') {
+      mFixType = StumbleFixQuality::FIX_NONE;
+    } else if (fields.Field()[0] == 'A') {
+      if (mFixType == StumbleFixQuality::FIX_NONE) {
+        mFixType = StumbleFixQuality::FIX_UNKNOWN;
+      }
+    } else {
+      return false;
+    }
+  } else {
+    // Valid, but nothing we use
+    return true;
+  }
+
+  Publish(aNowMs);
+  return true;
+}
+
+void
+StumbleNmeaParser::Publish(int64_t aNowMs)
+{
+  uint32_t inView = 0;
+  bool hasInView = false;
+  for (uint32_t i = 0; i < kTalkerCount; i++) {
+    if (mInViewTime[i] && aNowMs - mInViewTime[i] <= kInViewMaxAgeMs) {
+      inView += mInView[i];
+      hasInView = true;
+    }
+  }
+  if (!hasInView) {
+    inView = StumbleFixQuality::kUnknownCount;
+  } else if (inView >= StumbleFixQuality::kUnknownCount) {
+    inView = StumbleFixQuality::kUnknownCount - 1;
+  }
+  uint32_t hdop = mHdopCenti > 0xffff ? 0xffff : mHdopCenti;
+
+  uint64_t word = hdop |
+                  (uint64_t(mSatellitesUsed) << 16) |
+                  (uint64_t(inView) << 24) |
+                  (uint64_t(mFixType) << 32) |
+                  kValidBit |
+                  ((uint64_t(aNowMs / kTimeUnitMs) & kTimeMask) << kTimeShift);
+  sLatest = word;
+}
+
+/* static */ StumbleFixQuality
+StumbleNmeaParser::Latest(int64_t aNowMs)
+{
+  uint64_t word = sLatest;
+
+  StumbleFixQuality quality;
+  quality.mValid = word & kValidBit;
+  quality.mHdopCenti = word & 0xffff;
+  quality.mSatellitesUsed = (word >> 16) & 0xff;
+  quality.mSatellitesInView = (word >> 24) & 0xff;
+  quality.mFixType = StumbleFixQuality::FixType((word >> 32) & 0x3);
+  uint64_t age = ((uint64_t(aNowMs / kTimeUnitMs) & kTimeMask) -
+                  (word >> kTimeShift)) & kTimeMask;
+  quality.mTime = aNowMs - int64_t(age) * kTimeUnitMs;
+  if (!quality.mValid) {
+    quality.mSatellitesUsed = quality.mSatellitesInView =
+      StumbleFixQuality::kUnknownCount;
+  }
+  return quality;
+}
@@ -0,0 +1,107 @@
+#ifndef StumbleNmeaParser_H
+#define StumbleNmeaParser_H
+
+#include "mozilla/Atomics.h"
+#include <stdint.h>
+
+/*
+ Quality of the latest GPS fix, as reported by the NMEA sentences of the
+ GPS chip. See StumbleNmeaParser::Latest().
+ */
+struct StumbleFixQuality
+{
+  enum FixType {
+    FIX_UNKNOWN,
+    FIX_NONE,
+    FIX_2D,
+    FIX_3D
+  };
+
+  static const uint8_t kUnknownCount = 0xff;
+
+  // Fixes with no fix, fewer satellites or a larger HDOP than this are
+  // not worth a scan.
+  static const uint32_t kMinSatellitesUsed = 4;
+  static const uint32_t kMaxHdopCenti = 500;
+  // Older values are not taken to describe the current fix.
+  static const uint32_t kMaxAgeMs = 3000;
+
+  // False if nothing was published yet
+  bool mValid;
+  // ms, as passed to StumbleNmeaParser::Feed(), 100 ms resolution
+  int64_t mTime;
+  // Hundredths, 0 when unknown
+  uint32_t mHdopCenti;
+  // kUnknownCount when unknown
+  uint8_t mSatellitesUsed;
+  uint8_t mSatellitesInView;
+  FixType mFixType;
+
+  // True if the quality is recent and known to be too low for stumbling.
+  // Unknown quality never counts as poor.
+  bool IsPoor(int64_t aNowMs) const;
+  bool IsFresh(int64_t aNowMs) const;
+};
+
+/*
+ Streaming NMEA 0183 parser for the GGA, GSA, GSV and RMC sentences,
+ called with whatever the GPS HAL hands to NmeaCallback: whole sentences,
+ several at once, or fragments, with or without line endings. Sentences
+ with a missing or wrong checksum are dropped.
+
+ It does not allocate: a sentence is collected in a fixed buffer of the
+ maximum NMEA length, and the fields are parsed in place.
+
+ After each sentence the HDOP, satellite counts and fix type are packed
+ into one 64-bit atomic, which any thread can read with Latest() without
+ locking. Only one parser may feed it; NmeaCallback runs on one thread.
+ */
+class StumbleNmeaParser
+{
+public:
+  // "$" to the end of the checksum; NMEA allows 82 with the line ending
+  static const uint32_t kMaxSentenceLength = 80;
+
+  StumbleNmeaParser();
+
+  void Feed(const char* aData, uint32_t aLength, int64_t aNowMs);
+
+  static StumbleFixQuality Latest(int64_t aNowMs);
+
+  // Sentences accepted, and dropped for their checksum, length or fields
+  uint64_t Sentences() const { return mSentences; }
+  uint64_t Rejected() const { return mRejected; }
+
+private:
+  enum { kTalkerCount = 6 };
+
+  bool ParseSentence(int64_t aNowMs);
+  void Count(bool aAccepted)
+  {
+    if (aAccepted) {
+      mSentences++;
+    } else {
+      mRejected++;
+    }
+  }
+  void Publish(int64_t aNowMs);
+
+  char mBuffer[kMaxSentenceLength];
+  uint32_t mLength;
+  // Set when a sentence outgrew the buffer; the rest of it is skipped.
+  bool mSkipping;
+
+  uint32_t mHdopCenti;
+  uint8_t mSatellitesUsed;
+  StumbleFixQuality::FixType mFixType;
+  // Satellites in view, per constellation, from the GSV sentences
+  uint8_t mInView[kTalkerCount];
+  int64_t mInViewTime[kTalkerCount];
+
+  uint64_t mSentences;
+  uint64_t mRejected;
+
+  static mozilla::Atomic<uint64_t, mozilla::ReleaseAcquire> sLatest;
+};
+
+#endif
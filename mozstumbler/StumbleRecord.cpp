@@ -0,0 +1,841 @@
+#include "StumbleRecord.h"
+#include "StumblerLogging.h"
+#include "mozilla/FloatingPoint.h"
+#include "mozilla/double-conversion.h"
+#include "nsICellInfo.h"
+#include <cmath>
+
+using namespace mozilla;
+
+static const char kMagic[] = { 'M', 'Z', 'S', 'B' };
+static const uint8_t kFormatVersion = 3;
+// Oldest version that can still be read
+static const uint8_t kMinFormatVersion = 1;
+
+enum {
+  kFlagAbsoluteTime = 1 << 0,
+  kFlagHasWifi = 1 << 1,
+  // Since version 2
+  kFlagListDelta = 1 << 2
+};
+
+static const uint8_t kRegisteredBit = 0x80;
+
+static const double kDegreeScale = 1e7;
+
+// Name and length for the field tables, so keys are copied without strlen
+#define FIELD_NAME(aName) aName, sizeof(aName) - 1
+
+/*
+ Location fields in the order of the JSON keys (which is the order the
+ old std::map produced). mBit is the bit in the location mask.
+ */
+static const struct {
+  const char* mName;
+  uint32_t mNameLength;
+  double StumbleRecord::* mField;
+  uint16_t mBit;
+} kLocationFields[] = {
+  { FIELD_NAME("accuracy"), &StumbleRecord::mAccuracy, 1 << 2 },
+  { FIELD_NAME("altitude"), &StumbleRecord::mAltitude, 1 << 3 },
+  { FIELD_NAME("altitudeAccuracy"), &StumbleRecord::mAltitudeAccuracy, 1 << 4 },
+  { FIELD_NAME("hdop"), &StumbleRecord::mHdop, 1 << 7 },
+  { FIELD_NAME("heading"), &StumbleRecord::mHeading, 1 << 5 },
+  { FIELD_NAME("latitude"), &StumbleRecord::mLatitude, 1 << 0 },
+  { FIELD_NAME("longitude"), &StumbleRecord::mLongitude, 1 << 1 },
+  { FIELD_NAME("satellites"), &StumbleRecord::mSatellites, 1 << 8 },
+  { FIELD_NAME("speed"), &StumbleRecord::mSpeed, 1 << 6 },
+};
+
+static const uint16_t kLatitudeBit = 1 << 0;
+static const uint16_t kLongitudeBit = 1 << 1;
+// One past the highest bit in the location mask
+static const uint32_t kLocationMaskEnd = 1 << 9;
+
+// Cell fields in the order of the JSON keys; "serving" goes after "psc".
+static const struct {
+  const char* mName;
+  uint32_t mNameLength;
+  int32_t StumbleCell::* mField;
+} kCellFields[] = {
+  { FIELD_NAME("asu"), &StumbleCell::mAsu },
+  { FIELD_NAME("cellId"), &StumbleCell::mCid },
+  { FIELD_NAME("locationAreaCode"), &StumbleCell::mLac },
+  { FIELD_NAME("mobileCountryCode"), &StumbleCell::mMcc },
+  { FIELD_NAME("mobileNetworkCode"), &StumbleCell::mMnc },
+  { FIELD_NAME("psc"), &StumbleCell::mPsc },
+  { FIELD_NAME("signalStrength"), &StumbleCell::mSignalDbm },
+  { FIELD_NAME("timingAdvance"), &StumbleCell::mTimingAdvance },
+};
+
+static const uint32_t kServingAfterField = 5; // "psc"
+
+StumbleCell::StumbleCell()
+  : mType(0)
+  , mRegistered(false)
+  , mAsu(nsICellInfo::UNKNOWN_VALUE)
+  , mCid(nsICellInfo::UNKNOWN_VALUE)
+  , mLac(nsICellInfo::UNKNOWN_VALUE)
+  , mMcc(nsICellInfo::UNKNOWN_VALUE)
+  , mMnc(nsICellInfo::UNKNOWN_VALUE)
+  , mPsc(nsICellInfo::UNKNOWN_VALUE)
+  , mSignalDbm(nsICellInfo::UNKNOWN_VALUE)
+  , mTimingAdvance(nsICellInfo::UNKNOWN_VALUE)
+{
+}
+
+StumbleRecord::StumbleRecord()
+  : mTimestamp(0)
+  , mLatitude(UnspecifiedNaN<double>())
+  , mLongitude(UnspecifiedNaN<double>())
+  , mAccuracy(UnspecifiedNaN<double>())
+  , mAltitude(UnspecifiedNaN<double>())
+  , mAltitudeAccuracy(UnspecifiedNaN<double>())
+  , mHeading(UnspecifiedNaN<double>())
+  , mSpeed(UnspecifiedNaN<double>())
+  , mHdop(UnspecifiedNaN<double>())
+  , mSatellites(UnspecifiedNaN<double>())
+  , mHasWifi(false)
+{
+}
+
+void
+StumbleRecord::Clear()
+{
+  mTimestamp = 0;
+  mLatitude = mLongitude = mAccuracy = mAltitude = UnspecifiedNaN<double>();
+  mAltitudeAccuracy = mHeading = mSpeed = UnspecifiedNaN<double>();
+  mHdop = mSatellites = UnspecifiedNaN<double>();
+  mCells.Clear();
+  mHasWifi = false;
+  mWifi.Clear();
+  mRawWifi.Clear();
+}
+
+uint64_t
+StumbleMix64(uint64_t aValue)
+{
+  aValue ^= aValue >> 30;
+  aValue *= 0xbf58476d1ce4e5b9ULL;
+  aValue ^= aValue >> 27;
+  aValue *= 0x94d049bb133111ebULL;
+  aValue ^= aValue >> 31;
+  return aValue;
+}
+
+uint64_t
+StumbleCellKey(const StumbleCell& aCell)
+{
+  uint64_t key = StumbleMix64((uint64_t(aCell.mType) << 32) | uint32_t(aCell.mMcc));
+  key = StumbleMix64(key ^ ((uint64_t(uint32_t(aCell.mMnc)) << 32) | uint32_t(aCell.mLac)));
+  // Neighbouring cells often only have a PSC
+  return StumbleMix64(key ^ ((uint64_t(uint32_t(aCell.mCid)) << 32) | uint32_t(aCell.mPsc)));
+}
+
+bool
+ParseBssid(const nsAString& aBssid, uint64_t* aResult)
+{
+  uint64_t value = 0;
+  uint32_t digits = 0;
+  for (uint32_t i = 0; i < aBssid.Length(); i++) {
+    char16_t c = aBssid[i];
+    uint32_t nibble;
+    if (c >= '0' && c <= '9') {
+      nibble = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      nibble = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      nibble = c - 'A' + 10;
+    } else if (c == ':' || c == '-') {
+      continue;
+    } else {
+      return false;
+    }
+    value = (value << 4) | nibble;
+    digits++;
+  }
+  if (digits != 12) {
+    return false;
+  }
+  *aResult = value;
+  return true;
+}
+
+void
+ParseRawWifi(StumbleRecord& aRecord)
+{
+  for (const StumbleRawWifi& raw : aRecord.mRawWifi) {
+    if (raw.mSsid.IsEmpty()) {
+      STUMBLER_DBG("no ssid, skip this AP\n");
+      continue;
+    }
+
+    if (StringEndsWith(raw.mSsid, NS_LITERAL_STRING("_nomap"))) {
+      STUMBLER_DBG("end with _nomap. skip this AP(ssid :%s)\n",
+                   NS_ConvertUTF16toUTF8(raw.mSsid).get());
+      continue;
+    }
+
+    StumbleWifi ap;
+    if (!ParseBssid(raw.mBssid, &ap.mBssid)) {
+      STUMBLER_DBG("invalid bssid, skip this AP\n");
+      continue;
+    }
+    ap.mSignal = raw.mSignal;
+    aRecord.mWifi.AppendElement(ap);
+  }
+  aRecord.mRawWifi.Clear();
+}
+
+static void
+WriteVarint(nsACString& aOut, uint64_t aValue)
+{
+  while (aValue >= 0x80) {
+    aOut.Append(char((aValue & 0x7f) | 0x80));
+    aValue >>= 7;
+  }
+  aOut.Append(char(aValue));
+}
+
+static bool
+ReadVarint(const char*& aCur, const char* aEnd, uint64_t* aValue)
+{
+  uint64_t result = 0;
+  for (uint32_t shift = 0; shift < 64; shift += 7) {
+    if (aCur == aEnd) {
+      return false;
+    }
+    uint8_t byte = *aCur++;
+    result |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *aValue = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t
+ZigZag(int64_t aValue)
+{
+  return (uint64_t(aValue) << 1) ^ uint64_t(aValue >> 63);
+}
+
+static int64_t
+UnZigZag(uint64_t aValue)
+{
+  return int64_t(aValue >> 1) ^ -int64_t(aValue & 1);
+}
+
+static void
+WriteUint32(nsACString& aOut, uint32_t aValue)
+{
+  for (uint32_t i = 0; i < 4; i++) {
+    aOut.Append(char((aValue >> (8 * i)) & 0xff));
+  }
+}
+
+static bool
+ReadUint32(const char*& aCur, const char* aEnd, uint32_t* aValue)
+{
+  if (aEnd - aCur < 4) {
+    return false;
+  }
+  uint32_t value = 0;
+  for (uint32_t i = 0; i < 4; i++) {
+    value |= uint32_t(uint8_t(*aCur++)) << (8 * i);
+  }
+  *aValue = value;
+  return true;
+}
+
+static void
+WriteFloat(nsACString& aOut, double aValue)
+{
+  float f = float(aValue);
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  WriteUint32(aOut, bits);
+}
+
+static bool
+ReadFloat(const char*& aCur, const char* aEnd, double* aValue)
+{
+  uint32_t bits;
+  if (!ReadUint32(aCur, aEnd, &bits)) {
+    return false;
+  }
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  *aValue = f;
+  return true;
+}
+
+// The fields that identify a cell; the others are measurements.
+static bool
+IsSameCell(const StumbleCell& aA, const StumbleCell& aB)
+{
+  return aA.mType == aB.mType && aA.mCid == aB.mCid && aA.mLac == aB.mLac &&
+         aA.mMcc == aB.mMcc && aA.mMnc == aB.mMnc && aA.mPsc == aB.mPsc;
+}
+
+static bool
+IsSameWifi(const StumbleWifi& aA, const StumbleWifi& aB)
+{
+  return aA.mBssid == aB.mBssid;
+}
+
+/*
+ Index of the entry of aList matching aEntry, or -1. Scans usually list
+ entries in the same order as the previous scan, so the search starts at
+ aHint, just after the previous match.
+ */
+template <class T>
+static int32_t
+FindInList(const nsTArray<T>& aList, const T& aEntry, uint32_t aHint,
+           bool (*aIsSame)(const T&, const T&))
+{
+  uint32_t length = aList.Length();
+  for (uint32_t i = 0; i < length; i++) {
+    uint32_t idx = (aHint + i) % length;
+    if (aIsSame(aList[idx], aEntry)) {
+      return int32_t(idx);
+    }
+  }
+  return -1;
+}
+
+static void
+EncodeCell(const StumbleCell& aCell, nsACString& aOut)
+{
+  aOut.Append(char(aCell.mType | (aCell.mRegistered ? kRegisteredBit : 0)));
+  uint8_t cellMask = 0;
+  for (uint32_t i = 0; i < ArrayLength(kCellFields); i++) {
+    if (aCell.*kCellFields[i].mField != nsICellInfo::UNKNOWN_VALUE) {
+      cellMask |= 1 << i;
+    }
+  }
+  aOut.Append(char(cellMask));
+  for (uint32_t i = 0; i < ArrayLength(kCellFields); i++) {
+    if (cellMask & (1 << i)) {
+      WriteVarint(aOut, ZigZag(aCell.*kCellFields[i].mField));
+    }
+  }
+}
+
+static bool
+DecodeCell(const char*& aCur, const char* aEnd, StumbleCell* aCell)
+{
+  if (aEnd - aCur < 2) {
+    return false;
+  }
+  uint8_t type = *aCur++;
+  aCell->mType = type & ~kRegisteredBit;
+  aCell->mRegistered = type & kRegisteredBit;
+  uint8_t cellMask = *aCur++;
+  for (uint32_t f = 0; f < ArrayLength(kCellFields); f++) {
+    if (cellMask & (1 << f)) {
+      uint64_t value;
+      if (!ReadVarint(aCur, aEnd, &value)) {
+        return false;
+      }
+      aCell->*kCellFields[f].mField = int32_t(UnZigZag(value));
+    }
+  }
+  return true;
+}
+
+static void
+EncodeAP(const StumbleWifi& aAP, nsACString& aOut)
+{
+  for (int shift = 40; shift >= 0; shift -= 8) {
+    aOut.Append(char((aAP.mBssid >> shift) & 0xff));
+  }
+  WriteVarint(aOut, aAP.mSignal);
+}
+
+static bool
+DecodeAP(const char*& aCur, const char* aEnd, StumbleWifi* aAP)
+{
+  if (aEnd - aCur < 6) {
+    return false;
+  }
+  aAP->mBssid = 0;
+  for (uint32_t b = 0; b < 6; b++) {
+    aAP->mBssid = (aAP->mBssid << 8) | uint8_t(*aCur++);
+  }
+  uint64_t value;
+  if (!ReadVarint(aCur, aEnd, &value)) {
+    return false;
+  }
+  aAP->mSignal = uint32_t(value);
+  return true;
+}
+
+/* static */ void
+StumbleRecordEncoder::WriteHeader(nsACString& aOut)
+{
+  aOut.Append(kMagic, sizeof(kMagic));
+  aOut.Append(char(kFormatVersion));
+}
+
+void
+StumbleRecordEncoder::Reset()
+{
+  mHasLastTimestamp = false;
+  mLastCells.Clear();
+  mLastWifi.Clear();
+}
+
+void
+StumbleRecordEncoder::Encode(const StumbleRecord& aRecord, nsACString& aOut)
+{
+  // Keeps its buffer, so records stop allocating once one was as large
+  nsCString& payload = mPayload;
+  payload.Truncate();
+
+  uint8_t flags = 0;
+  bool isDelta = mHasLastTimestamp;
+  if (isDelta) {
+    flags |= kFlagListDelta;
+  } else {
+    flags |= kFlagAbsoluteTime;
+  }
+  if (aRecord.mHasWifi) {
+    flags |= kFlagHasWifi;
+  }
+  payload.Append(char(flags));
+
+  if (flags & kFlagAbsoluteTime) {
+    WriteVarint(payload, uint64_t(aRecord.mTimestamp));
+  } else {
+    WriteVarint(payload, ZigZag(aRecord.mTimestamp - mLastTimestamp));
+  }
+  mHasLastTimestamp = true;
+  mLastTimestamp = aRecord.mTimestamp;
+
+  uint32_t mask = 0;
+  for (const auto& field : kLocationFields) {
+    if (!IsNaN(aRecord.*field.mField)) {
+      mask |= field.mBit;
+    }
+  }
+  WriteVarint(payload, mask);
+  if (mask & kLatitudeBit) {
+    WriteUint32(payload, uint32_t(int32_t(floor(aRecord.mLatitude * kDegreeScale + 0.5))));
+  }
+  if (mask & kLongitudeBit) {
+    WriteUint32(payload, uint32_t(int32_t(floor(aRecord.mLongitude * kDegreeScale + 0.5))));
+  }
+  // Remaining fields, in mask bit order
+  for (uint32_t bit = 1 << 2; bit < kLocationMaskEnd; bit <<= 1) {
+    for (const auto& field : kLocationFields) {
+      if (field.mBit == bit && (mask & bit)) {
+        WriteFloat(payload, aRecord.*field.mField);
+      }
+    }
+  }
+
+  WriteVarint(payload, aRecord.mCells.Length());
+  uint32_t hint = 0;
+  for (const StumbleCell& cell : aRecord.mCells) {
+    if (!isDelta) {
+      EncodeCell(cell, payload);
+      continue;
+    }
+    int32_t last = FindInList(mLastCells, cell, hint, IsSameCell);
+    if (last < 0) {
+      WriteVarint(payload, 0);
+      EncodeCell(cell, payload);
+      continue;
+    }
+    const StumbleCell& lastCell = mLastCells[last];
+    WriteVarint(payload, (uint64_t(last + 1) << 1) | (cell.mRegistered ? 1 : 0));
+    uint8_t changedMask = 0;
+    for (uint32_t i = 0; i < ArrayLength(kCellFields); i++) {
+      if (cell.*kCellFields[i].mField != lastCell.*kCellFields[i].mField) {
+        changedMask |= 1 << i;
+      }
+    }
+    payload.Append(char(changedMask));
+    for (uint32_t i = 0; i < ArrayLength(kCellFields); i++) {
+      if (changedMask & (1 << i)) {
+        WriteVarint(payload, ZigZag(cell.*kCellFields[i].mField));
+      }
+    }
+    hint = last + 1;
+  }
+
+  if (aRecord.mHasWifi) {
+    WriteVarint(payload, aRecord.mWifi.Length());
+    hint = 0;
+    for (const StumbleWifi& ap : aRecord.mWifi) {
+      if (!isDelta) {
+        EncodeAP(ap, payload);
+        continue;
+      }
+      int32_t last = FindInList(mLastWifi, ap, hint, IsSameWifi);
+      if (last < 0) {
+        WriteVarint(payload, 0);
+        EncodeAP(ap, payload);
+        continue;
+      }
+      WriteVarint(payload, last + 1);
+      // Signals are negative dBm stored as uint32
+      WriteVarint(payload, ZigZag(int64_t(int32_t(ap.mSignal)) -
+                                  int32_t(mLastWifi[last].mSignal)));
+      hint = last + 1;
+    }
+  }
+
+  mLastCells.Clear();
+  mLastCells.AppendElements(aRecord.mCells);
+  if (aRecord.mHasWifi) {
+    mLastWifi.Clear();
+    mLastWifi.AppendElements(aRecord.mWifi);
+  }
+
+  WriteVarint(aOut, payload.Length());
+  aOut.Append(payload);
+}
+
+/* static */ bool
+StumbleRecordDecoder::ReadHeader(const char*& aCur, const char* aEnd)
+{
+  static_assert(sizeof(kMagic) + 1 == kHeaderLength, "header layout");
+  if (aEnd - aCur < int(kHeaderLength)) {
+    return false;
+  }
+  uint8_t version = aCur[sizeof(kMagic)];
+  if (memcmp(aCur, kMagic, sizeof(kMagic)) ||
+      version < kMinFormatVersion || version > kFormatVersion) {
+    return false;
+  }
+  aCur += kHeaderLength;
+  return true;
+}
+
+bool
+StumbleRecordDecoder::Decode(const char*& aCur, const char* aEnd, StumbleRecord& aRecord)
+{
+  const char* cur = aCur;
+  uint64_t length;
+  if (!ReadVarint(cur, aEnd, &length) || uint64_t(aEnd - cur) < length) {
+    return false;
+  }
+  const char* end = cur + length;
+
+  // Decoded in place: the caller reuses one record, whose arrays keep
+  // their storage.
+  StumbleRecord& record = aRecord;
+  record.Clear();
+  uint64_t value;
+
+  if (cur == end) {
+    return false;
+  }
+  uint8_t flags = *cur++;
+  bool isDelta = flags & kFlagListDelta;
+  if (isDelta && (flags & kFlagAbsoluteTime)) {
+    return false;
+  }
+  if (!ReadVarint(cur, end, &value)) {
+    return false;
+  }
+  if (flags & kFlagAbsoluteTime) {
+    record.mTimestamp = int64_t(value);
+  } else {
+    record.mTimestamp = mLastTimestamp + UnZigZag(value);
+  }
+
+  if (!ReadVarint(cur, end, &value)) {
+    return false;
+  }
+  uint64_t mask = value;
+  if (mask >= kLocationMaskEnd) {
+    return false;
+  }
+  uint32_t fixed;
+  if (mask & kLatitudeBit) {
+    if (!ReadUint32(cur, end, &fixed)) {
+      return false;
+    }
+    record.mLatitude = int32_t(fixed) / kDegreeScale;
+  }
+  if (mask & kLongitudeBit) {
+    if (!ReadUint32(cur, end, &fixed)) {
+      return false;
+    }
+    record.mLongitude = int32_t(fixed) / kDegreeScale;
+  }
+  for (uint32_t bit = 1 << 2; bit < kLocationMaskEnd; bit <<= 1) {
+    for (const auto& field : kLocationFields) {
+      if (field.mBit == bit && (mask & bit) &&
+          !ReadFloat(cur, end, &(record.*field.mField))) {
+        return false;
+      }
+    }
+  }
+
+  if (!DecodeCells(cur, end, isDelta, record)) {
+    return false;
+  }
+
+  record.mHasWifi = flags & kFlagHasWifi;
+  if (record.mHasWifi && !DecodeWifi(cur, end, isDelta, record)) {
+    return false;
+  }
+
+  if (cur != end) {
+    return false;
+  }
+
+  // Same state as the encoder had after this record
+  mLastTimestamp = record.mTimestamp;
+  mLastCells.Clear();
+  mLastCells.AppendElements(record.mCells);
+  if (flags & kFlagAbsoluteTime) {
+    mLastWifi.Clear();
+  }
+  if (record.mHasWifi) {
+    mLastWifi.Clear();
+    mLastWifi.AppendElements(record.mWifi);
+  }
+  aCur = end;
+  return true;
+}
+
+bool
+StumbleRecordDecoder::DecodeCells(const char*& aCur, const char* aEnd, bool aIsDelta,
+                                  StumbleRecord& aRecord)
+{
+  uint64_t count;
+  if (!ReadVarint(aCur, aEnd, &count) || count > uint64_t(aEnd - aCur)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t tag = 0;
+    if (aIsDelta && !ReadVarint(aCur, aEnd, &tag)) {
+      return false;
+    }
+    if (!tag) {
+      if (!DecodeCell(aCur, aEnd, aRecord.mCells.AppendElement())) {
+        return false;
+      }
+      continue;
+    }
+
+    uint64_t last = (tag >> 1) - 1;
+    if (last >= mLastCells.Length() || aCur == aEnd) {
+      return false;
+    }
+    StumbleCell* cell = aRecord.mCells.AppendElement(mLastCells[last]);
+    cell->mRegistered = tag & 1;
+    uint8_t changedMask = *aCur++;
+    for (uint32_t f = 0; f < ArrayLength(kCellFields); f++) {
+      if (changedMask & (1 << f)) {
+        uint64_t value;
+        if (!ReadVarint(aCur, aEnd, &value)) {
+          return false;
+        }
+        cell->*kCellFields[f].mField = int32_t(UnZigZag(value));
+      }
+    }
+  }
+  return true;
+}
+
+bool
+StumbleRecordDecoder::DecodeWifi(const char*& aCur, const char* aEnd, bool aIsDelta,
+                                 StumbleRecord& aRecord)
+{
+  uint64_t count;
+  if (!ReadVarint(aCur, aEnd, &count) || count > uint64_t(aEnd - aCur)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t tag = 0;
+    if (aIsDelta && !ReadVarint(aCur, aEnd, &tag)) {
+      return false;
+    }
+    if (!tag) {
+      if (!DecodeAP(aCur, aEnd, aRecord.mWifi.AppendElement())) {
+        return false;
+      }
+      continue;
+    }
+
+    uint64_t last = tag - 1;
+    uint64_t delta;
+    if (last >= mLastWifi.Length() || !ReadVarint(aCur, aEnd, &delta)) {
+      return false;
+    }
+    StumbleWifi* ap = aRecord.mWifi.AppendElement();
+    ap->mBssid = mLastWifi[last].mBssid;
+    ap->mSignal = uint32_t(int32_t(mLastWifi[last].mSignal) + int32_t(UnZigZag(delta)));
+  }
+  return true;
+}
+
+uint32_t
+StumbleLogValidLength(const nsACString& aData)
+{
+  const char* start = aData.BeginReading();
+  const char* cur = start;
+  const char* end = aData.EndReading();
+  if (!StumbleRecordDecoder::ReadHeader(cur, end)) {
+    return 0;
+  }
+
+  StumbleRecordDecoder decoder;
+  StumbleRecord record;
+  while (decoder.Decode(cur, end, record)) {
+  }
+  return cur - start;
+}
+
+static const char*
+RadioTypeName(uint8_t aType)
+{
+  switch (aType) {
+    case nsICellInfo::CELL_INFO_TYPE_GSM:
+      return "gsm";
+    case nsICellInfo::CELL_INFO_TYPE_WCDMA:
+      return "wcdma";
+    case nsICellInfo::CELL_INFO_TYPE_CDMA:
+      return "cdma";
+    case nsICellInfo::CELL_INFO_TYPE_LTE:
+      return "lte";
+    default:
+      return "";
+  }
+}
+
+static void
+AppendUint(nsACString& aOut, uint64_t aValue)
+{
+  char buf[20];
+  char* p = buf + sizeof(buf);
+  do {
+    *--p = '0' + aValue % 10;
+    aValue /= 10;
+  } while (aValue);
+  aOut.Append(p, buf + sizeof(buf) - p);
+}
+
+static void
+AppendInt(nsACString& aOut, int64_t aValue)
+{
+  if (aValue < 0) {
+    aOut.Append('-');
+    AppendUint(aOut, uint64_t(0) - uint64_t(aValue));
+  } else {
+    AppendUint(aOut, uint64_t(aValue));
+  }
+}
+
+/*
+ Shortest digits that read back as the same value. Fields stored as
+ float32 are formatted as floats, so 12.3 stays "12.3" rather than the
+ digits of the widened double.
+ */
+static void
+AppendDouble(nsACString& aOut, double aValue, bool aIsSingle)
+{
+  using double_conversion::DoubleToStringConverter;
+  using double_conversion::StringBuilder;
+
+  char buf[32];
+  StringBuilder builder(buf, sizeof(buf));
+  const DoubleToStringConverter& converter =
+    DoubleToStringConverter::EcmaScriptConverter();
+  if (aIsSingle) {
+    converter.ToShortestSingle(float(aValue), &builder);
+  } else {
+    converter.ToShortest(aValue, &builder);
+  }
+  uint32_t length = builder.position();
+  aOut.Append(builder.Finalize(), length);
+}
+
+static void
+AppendKey(nsACString& aOut, const char* aName, uint32_t aNameLength)
+{
+  aOut.Append('"');
+  aOut.Append(aName, aNameLength);
+  aOut.AppendLiteral("\":");
+}
+
+// 48-bit BSSID as 12 lowercase hex digits, like "%012llx"
+static void
+AppendBssid(nsACString& aOut, uint64_t aBssid)
+{
+  static const char kHex[] = "0123456789abcdef";
+  char buf[12];
+  for (int i = 11; i >= 0; i--) {
+    buf[i] = kHex[aBssid & 0xf];
+    aBssid >>= 4;
+  }
+  aOut.Append(buf, sizeof(buf));
+}
+
+void
+StumbleRecordToJSON(const StumbleRecord& aRecord, nsACString& aOut)
+{
+  aOut.Append('{');
+  for (const auto& field : kLocationFields) {
+    double val = aRecord.*field.mField;
+    // JSON has no representation for NaN or infinity
+    if (IsFinite(val)) {
+      AppendKey(aOut, field.mName, field.mNameLength);
+      bool isSingle = !(field.mBit & (kLatitudeBit | kLongitudeBit));
+      AppendDouble(aOut, val, isSingle);
+      aOut.Append(',');
+    }
+  }
+  aOut.AppendLiteral("\"timestamp\":");
+  AppendInt(aOut, aRecord.mTimestamp);
+  aOut.Append(',');
+
+  aOut.AppendLiteral("\"cellTowers\": [");
+  for (uint32_t idx = 0; idx < aRecord.mCells.Length(); idx++) {
+    const StumbleCell& cell = aRecord.mCells[idx];
+    if (idx) {
+      aOut.Append(',');
+    }
+    aOut.AppendLiteral("{\"radioType\":\"");
+    aOut.Append(RadioTypeName(cell.mType));
+    aOut.Append('"');
+    for (uint32_t f = 0; f < ArrayLength(kCellFields); f++) {
+      int32_t value = cell.*kCellFields[f].mField;
+      if (value != nsICellInfo::UNKNOWN_VALUE) {
+        aOut.Append(',');
+        AppendKey(aOut, kCellFields[f].mName, kCellFields[f].mNameLength);
+        AppendInt(aOut, value);
+      }
+      if (f == kServingAfterField) {
+        aOut.AppendLiteral(",\"serving\":");
+        aOut.Append(cell.mRegistered ? '1' : '0');
+      }
+    }
+    aOut.Append('}');
+  }
+  aOut.Append(']');
+
+  if (aRecord.mHasWifi) {
+    aOut.AppendLiteral(",\"wifiAccessPoints\": [");
+    for (uint32_t idx = 0; idx < aRecord.mWifi.Length(); idx++) {
+      const StumbleWifi& ap = aRecord.mWifi[idx];
+      if (idx) {
+        aOut.Append(',');
+      }
+      aOut.AppendLiteral("{\"macAddress\":\"");
+      AppendBssid(aOut, ap.mBssid);
+      aOut.AppendLiteral("\",\"signalStrength\":");
+      AppendInt(aOut, int32_t(ap.mSignal));
+      aOut.Append('}');
+    }
+    aOut.Append(']');
+  }
+  aOut.Append('}');
+}
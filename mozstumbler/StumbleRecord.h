@@ -0,0 +1,195 @@
+#ifndef StumbleRecord_H
+#define StumbleRecord_H
+
+#include "nsString.h"
+#include "nsTArray.h"
+
+/*
+ Plain-data form of one stumble, and its compact binary encoding.
+
+ The stumble log is a gzip stream holding a header followed by
+ length-prefixed records:
+
+   header:  "MZSB" version(u8)
+   record:  length(varint) payload
+
+   payload: flags(u8)
+            timestamp(varint, absolute ms if kFlagAbsoluteTime, else
+                      zigzag delta from the previous record)
+            location mask(u8; varint since version 3), then for each
+            present field:
+              latitude, longitude  int32, 1e-7 degrees
+              other fields         float32
+            cell count(varint), then per cell:
+              radioType(u8, high bit set when serving)
+              field mask(u8), then a zigzag varint per present field
+            if kFlagHasWifi:
+              AP count(varint), then per AP:
+                BSSID (6 bytes, big-endian), signalStrength(varint)
+
+ Consecutive scans mostly see the same cells and APs, so from version 2
+ a record with kFlagListDelta encodes its lists against those of the
+ previous record (the last one with wifi, for the AP list):
+            cell count(varint), then per cell a tag(varint):
+              0: a new cell, encoded as above
+              (index in previous list + 1) << 1 | serving:
+                changed field mask(u8), then a zigzag varint per field
+                that differs from the previous cell
+            if kFlagHasWifi:
+              AP count(varint), then per AP a tag(varint):
+                0: a new AP, encoded as above
+                index in previous list + 1: zigzag signal delta(varint)
+ Entries missing from the new list are simply not referenced. A record
+ with kFlagAbsoluteTime never has kFlagListDelta, so every chain of
+ deltas starts from a full record. Records without kFlagListDelta are
+ laid out as in version 1, which is still read. Version 3 added the hdop
+ and satellites location fields, which needed a wider location mask;
+ masks of the older versions read the same as a varint.
+
+ Multi-byte fixed-width fields are little-endian. JSON is only produced
+ from this at upload time, see ExportStumbleLogAsJSON().
+ kFormatVersion must be bumped whenever the layout changes.
+ */
+
+struct StumbleCell
+{
+  // nsICellInfo::CELL_INFO_TYPE_*
+  uint8_t mType;
+  bool mRegistered;
+  // nsICellInfo::UNKNOWN_VALUE when absent
+  int32_t mAsu;
+  int32_t mCid;
+  int32_t mLac;
+  int32_t mMcc;
+  int32_t mMnc;
+  int32_t mPsc;
+  int32_t mSignalDbm;
+  int32_t mTimingAdvance;
+
+  StumbleCell();
+};
+
+struct StumbleWifi
+{
+  uint64_t mBssid;
+  uint32_t mSignal;
+};
+
+// A wifi scan result as the main thread got it, see ParseRawWifi().
+struct StumbleRawWifi
+{
+  nsString mSsid;
+  nsString mBssid;
+  uint32_t mSignal;
+};
+
+struct StumbleRecord
+{
+  // Milliseconds since epoch at the time the record was made
+  int64_t mTimestamp;
+  // NaN when absent
+  double mLatitude;
+  double mLongitude;
+  double mAccuracy;
+  double mAltitude;
+  double mAltitudeAccuracy;
+  double mHeading;
+  double mSpeed;
+  // Of the GPS fix, from the NMEA sentences (see StumbleNmeaParser)
+  double mHdop;
+  double mSatellites;
+  // Inline storage covers a typical scan, so a record reused for decoding
+  // does not allocate.
+  nsAutoTArray<StumbleCell, 4> mCells;
+  // False if the wifi scan failed, which omits "wifiAccessPoints"
+  bool mHasWifi;
+  nsAutoTArray<StumbleWifi, 32> mWifi;
+  // Filled on the main thread instead of mWifi, which is not encoded.
+  nsTArray<StumbleRawWifi> mRawWifi;
+
+  StumbleRecord();
+
+  // Back to the state of a new record.
+  void Clear();
+};
+
+// splitmix64 finalizer, for hashing BSSIDs and cell keys
+uint64_t StumbleMix64(uint64_t aValue);
+// Hash of the radio type, MCC, MNC, LAC, CID and PSC of a cell
+uint64_t StumbleCellKey(const StumbleCell& aCell);
+
+// Parses "00:11:22:aa:bb:cc" (separators optional) into a 48-bit value.
+bool ParseBssid(const nsAString& aBssid, uint64_t* aResult);
+
+/*
+ Moves mRawWifi into mWifi, leaving out hidden networks, networks that
+ opted out with an SSID ending in "_nomap", and invalid BSSIDs. Done on
+ the write thread, so the main thread only copies the scan results.
+ */
+void ParseRawWifi(StumbleRecord& aRecord);
+
+/*
+ Encoding keeps the last timestamp and cell and AP lists so that records
+ can be delta-encoded. Reset() must be called whenever a new file (or a
+ reopened file, whose last record is unknown) is started.
+ */
+class StumbleRecordEncoder
+{
+public:
+  StumbleRecordEncoder() : mHasLastTimestamp(false), mLastTimestamp(0) {}
+
+  static void WriteHeader(nsACString& aOut);
+  // Appends the length-prefixed record to aOut.
+  void Encode(const StumbleRecord& aRecord, nsACString& aOut);
+  void Reset();
+
+private:
+  bool mHasLastTimestamp;
+  int64_t mLastTimestamp;
+  nsTArray<StumbleCell> mLastCells;
+  nsTArray<StumbleWifi> mLastWifi;
+  // The record being encoded, before its length prefix
+  nsCString mPayload;
+};
+
+class StumbleRecordDecoder
+{
+public:
+  StumbleRecordDecoder() : mLastTimestamp(0) {}
+
+  static const uint32_t kHeaderLength = 5;
+
+  // Returns false if [aCur, aEnd) does not start with a known header.
+  static bool ReadHeader(const char*& aCur, const char* aEnd);
+  // Decodes one record from [aCur, aEnd) into aRecord, advancing aCur.
+  // Returns false, leaving aCur untouched, if the record is incomplete or
+  // invalid; aRecord is then partly overwritten.
+  bool Decode(const char*& aCur, const char* aEnd, StumbleRecord& aRecord);
+
+private:
+  bool DecodeCells(const char*& aCur, const char* aEnd, bool aIsDelta,
+                   StumbleRecord& aRecord);
+  bool DecodeWifi(const char*& aCur, const char* aEnd, bool aIsDelta,
+                  StumbleRecord& aRecord);
+
+  int64_t mLastTimestamp;
+  nsTArray<StumbleCell> mLastCells;
+  nsTArray<StumbleWifi> mLastWifi;
+};
+
+/*
+ Length of the longest prefix of aData made of the header and complete
+ records. Torn records of the head are dropped by StumbleAppendLog; this
+ is only needed to seal a gzip head written before it, see
+ StumbleGZWriter::Open().
+ */
+uint32_t StumbleLogValidLength(const nsACString& aData);
+
+/*
+ Appends the record as the JSON object the upload server expects.
+ Numbers are formatted in place (shortest round-trip for doubles), so
+ nothing is allocated once aOut has the capacity for the record.
+ */
+void StumbleRecordToJSON(const StumbleRecord& aRecord, nsACString& aOut);
+
+#endif
@@ -0,0 +1,111 @@
+#include "StumbleRecordQueue.h"
+
+StumbleRecordQueue::StumbleRecordQueue(uint32_t aMaxDepth)
+  : mMaxDepth(aMaxDepth)
+  , mHead(&mStub)
+  , mTail(&mStub)
+  , mDepth(0)
+  , mHighWaterDepth(0)
+  , mPushed(0)
+  , mDropped(0)
+  , mBatches(0)
+  , mLastBatchSize(0)
+  , mMaxBatchSize(0)
+{
+}
+
+StumbleRecordQueue::~StumbleRecordQueue()
+{
+  while (RecordNode* node = Pop()) {
+    delete node;
+  }
+}
+
+bool
+StumbleRecordQueue::Push(const StumbleRecord& aRecord)
+{
+  uint32_t depth = ++mDepth;
+  if (depth > mMaxDepth) {
+    mDepth--;
+    mDropped++;
+    return false;
+  }
+
+  uint32_t highWater = mHighWaterDepth;
+  while (depth > highWater && !mHighWaterDepth.compareExchange(highWater, depth)) {
+    highWater = mHighWaterDepth;
+  }
+
+  PushNode(new RecordNode(aRecord));
+  mPushed++;
+  return true;
+}
+
+void
+StumbleRecordQueue::PushNode(Node* aNode)
+{
+  aNode->mNext = nullptr;
+  Node* prev = mHead.exchange(aNode);
+  // Between the exchange and this store the list is briefly unlinked;
+  // Pop() sees that as empty and the record is picked up by the next drain.
+  prev->mNext = aNode;
+}
+
+StumbleRecordQueue::RecordNode*
+StumbleRecordQueue::Pop()
+{
+  Node* tail = mTail;
+  Node* next = tail->mNext;
+
+  if (tail == &mStub) {
+    if (!next) {
+      return nullptr;
+    }
+    mTail = next;
+    tail = next;
+    next = next->mNext;
+  }
+
+  if (next) {
+    mTail = next;
+    mDepth--;
+    return static_cast<RecordNode*>(tail);
+  }
+
+  if (tail != mHead) {
+    // A producer is between its exchange and its link
+    return nullptr;
+  }
+
+  // tail is the last node; put the stub behind it so it can be taken
+  PushNode(&mStub);
+  next = tail->mNext;
+  if (next) {
+    mTail = next;
+    mDepth--;
+    return static_cast<RecordNode*>(tail);
+  }
+  return nullptr;
+}
+
+void
+StumbleRecordQueue::RecordBatch(uint32_t aCount)
+{
+  mBatches++;
+  mLastBatchSize = aCount;
+  if (aCount > mMaxBatchSize) {
+    mMaxBatchSize = aCount;
+  }
+}
+
+void
+StumbleRecordQueue::GetStats(Stats* aStats) const
+{
+  aStats->mDepth = mDepth;
+  aStats->mMaxDepth = mHighWaterDepth;
+  aStats->mPushed = mPushed;
+  aStats->mDropped = mDropped;
+  aStats->mBatches = mBatches;
+  aStats->mLastBatchSize = mLastBatchSize;
+  aStats->mMaxBatchSize = mMaxBatchSize;
+}
@@ -0,0 +1,98 @@
+#ifndef StumbleRecordQueue_H
+#define StumbleRecordQueue_H
+
+#include "mozilla/Atomics.h"
+#include "mozilla/TimeStamp.h"
+#include "StumbleRecord.h"
+
+/*
+ Unbounded-in-design, bounded-by-policy queue of stumble records, with any
+ number of producers and a single consumer. This is the intrusive MPSC
+ queue by Dmitry Vyukov: Push() is one atomic exchange and never blocks,
+ Drain() takes no lock either.
+
+ Push() drops the record (and counts it) once aMaxDepth records are
+ waiting, so a stalled consumer cannot exhaust memory.
+
+ Only one thread may call Drain() at a time; WriteStumbleOnThread
+ guarantees this by having at most one drain runnable scheduled.
+ */
+class StumbleRecordQueue final
+{
+public:
+  struct Stats
+  {
+    uint32_t mDepth;
+    uint32_t mMaxDepth;
+    uint64_t mPushed;
+    uint64_t mDropped;
+    uint64_t mBatches;
+    uint32_t mLastBatchSize;
+    uint32_t mMaxBatchSize;
+  };
+
+  explicit StumbleRecordQueue(uint32_t aMaxDepth);
+  ~StumbleRecordQueue();
+
+  // Any thread. Returns false if the record was dropped.
+  bool Push(const StumbleRecord& aRecord);
+
+  // Consumer only. Calls aFunc(record, time pushed) for each queued
+  // record, oldest first, and returns how many were drained. aFunc may
+  // change the record, which is deleted afterwards.
+  template <class Func>
+  uint32_t Drain(Func aFunc)
+  {
+    uint32_t count = 0;
+    while (RecordNode* node = Pop()) {
+      aFunc(node->mRecord, node->mPushTime);
+      delete node;
+      count++;
+    }
+    if (count) {
+      RecordBatch(count);
+    }
+    return count;
+  }
+
+  bool IsEmpty() const { return mDepth == 0; }
+  void GetStats(Stats* aStats) const;
+
+private:
+  struct Node
+  {
+    Node() : mNext(nullptr) {}
+    mozilla::Atomic<Node*> mNext;
+  };
+
+  struct RecordNode : public Node
+  {
+    explicit RecordNode(const StumbleRecord& aRecord)
+      : mRecord(aRecord)
+      , mPushTime(mozilla::TimeStamp::Now())
+    {}
+    StumbleRecord mRecord;
+    mozilla::TimeStamp mPushTime;
+  };
+
+  void PushNode(Node* aNode);
+  RecordNode* Pop();
+  void RecordBatch(uint32_t aCount);
+
+  const uint32_t mMaxDepth;
+  // Producers swap themselves in at mHead; the consumer reads from mTail.
+  mozilla::Atomic<Node*> mHead;
+  Node* mTail;
+  Node mStub;
+
+  mozilla::Atomic<uint32_t> mDepth;
+  mozilla::Atomic<uint32_t> mHighWaterDepth;
+  mozilla::Atomic<uint64_t> mPushed;
+  mozilla::Atomic<uint64_t> mDropped;
+  // Only written by the consumer
+  mozilla::Atomic<uint64_t> mBatches;
+  mozilla::Atomic<uint32_t> mLastBatchSize;
+  mozilla::Atomic<uint32_t> mMaxBatchSize;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "StumbleScheduler.h"
+#include "StumblerGeodesy.h"
+#include <math.h>
+
+// Below this speed (m/s) the device is taken as standing still
+static const double kStationarySpeed = 0.5;
+// The fixed policy used before the scheduler
+static const double kFixedPolicyMeters = 30;
+
+StumbleScheduler::StumbleScheduler()
+  : mHasLastScan(false)
+  , mLastScan()
+  , mBearingAtScan(-1)
+  , mStaleScans(0)
+  , mLastWritten(0)
+  , mLastDeduped(0)
+  , mFixedHasLast(false)
+  , mFixedLast()
+  , mScans(0)
+  , mFixedPolicyScans(0)
+{
+}
+
+void
+StumbleScheduler::UpdateNovelty(uint64_t aWritten, uint64_t aDeduped)
+{
+  if (aWritten != mLastWritten) {
+    mStaleScans = 0;
+  } else if (aDeduped != mLastDeduped && mStaleScans < kMaxSpacingFactor) {
+    mStaleScans++;
+  }
+  mLastWritten = aWritten;
+  mLastDeduped = aDeduped;
+}
+
+static double
+BearingDelta(double aFrom, double aTo)
+{
+  double delta = fabs(aTo - aFrom);
+  return delta > 180 ? 360 - delta : delta;
+}
+
+double
+StumbleScheduler::SpacingMeters(const Fix& aFix) const
+{
+  double spacing = kTargetSpacingMeters * (1 + mStaleScans);
+  if (spacing > kTargetSpacingMeters * kMaxSpacingFactor) {
+    spacing = kTargetSpacingMeters * kMaxSpacingFactor;
+  }
+  if (aFix.mSpeed >= 0 && aFix.mSpeed < kStationarySpeed) {
+    spacing = kTargetSpacingMeters * kMaxSpacingFactor;
+  } else if (aFix.mBearing >= 0 && mBearingAtScan >= 0 &&
+             BearingDelta(mBearingAtScan, aFix.mBearing) >= kTurnDegrees) {
+    spacing /= 2;
+  }
+  return spacing;
+}
+
+bool
+StumbleScheduler::FixedPolicyWouldScan(const Fix& aFix)
+{
+  if (mFixedHasLast &&
+      (aFix.mTime - mFixedLast.mTime < STUMBLE_INTERVAL_MS ||
+       GeoDistanceMeters(aFix.mLatitude, aFix.mLongitude,
+                         mFixedLast.mLatitude, mFixedLast.mLongitude) <= kFixedPolicyMeters)) {
+    return false;
+  }
+  mFixedHasLast = true;
+  mFixedLast = aFix;
+  mFixedPolicyScans++;
+  return true;
+}
+
+bool
+StumbleScheduler::ShouldScan(const Fix& aFix)
+{
+  FixedPolicyWouldScan(aFix);
+
+  if (mHasLastScan) {
+    if (aFix.mTime - mLastScan.mTime < kMinIntervalMs) {
+      return false;
+    }
+    double distance = GeoDistanceMeters(aFix.mLatitude, aFix.mLongitude,
+                                        mLastScan.mLatitude, mLastScan.mLongitude);
+    if (distance < SpacingMeters(aFix)) {
+      return false;
+    }
+  }
+
+  mHasLastScan = true;
+  mLastScan = aFix;
+  mBearingAtScan = aFix.mBearing;
+  mScans++;
+  return true;
+}
@@ -0,0 +1,84 @@
+#ifndef StumbleScheduler_H
+#define StumbleScheduler_H
+
+#include <stdint.h>
+
+// Minimum time between scans in the old fixed policy
+#define STUMBLE_INTERVAL_MS 3000
+
+/*
+ Decides which GPS fixes start a cell and wifi scan, aiming for one
+ stumble every kTargetSpacingMeters along the route rather than a fixed
+ time and distance.
+
+ - The distance since the last scan must reach the target spacing, so
+   walking is not oversampled and a highway is sampled as densely as the
+   minimum interval between scans allows.
+ - A change of heading of kTurnDegrees or more halves the spacing, since
+   turning into a new street brings new transmitters into range.
+ - When the reported speed is below kStationarySpeed, the spacing is
+   kMaxSpacingFactor times larger, so that GPS jitter while standing
+   still does not start scans.
+ - While the last scans added nothing new (see StumbleDedupIndex), the
+   spacing grows, up to kMaxSpacingFactor times.
+
+ The old fixed policy (STUMBLE_INTERVAL_MS and 30 m) is evaluated
+ alongside, so the number of scans saved can be reported.
+
+ Only uses the fixes passed in, no clock, so a replayed trace gives the
+ same decisions. Not thread-safe; LocationCallback runs on one thread.
+ */
+class StumbleScheduler
+{
+public:
+  struct Fix
+  {
+    // ms, monotonic or since epoch
+    int64_t mTime;
+    double mLatitude;
+    double mLongitude;
+    // m/s and degrees, negative when unknown
+    double mSpeed;
+    double mBearing;
+  };
+
+  // About the time a wifi scan takes
+  static const uint32_t kMinIntervalMs = 2000;
+  // About the indoor range of a wifi AP
+  static const uint32_t kTargetSpacingMeters = 50;
+  static const uint32_t kTurnDegrees = 30;
+  static const uint32_t kMaxSpacingFactor = 4;
+
+  StumbleScheduler();
+
+  // Total records written and deduped so far, to tell whether the scans
+  // since the last call found anything new.
+  void UpdateNovelty(uint64_t aWritten, uint64_t aDeduped);
+
+  // Returns true if a scan should be started for aFix.
+  bool ShouldScan(const Fix& aFix);
+
+  uint64_t Scans() const { return mScans; }
+  // Scans the fixed interval and distance policy would have started
+  uint64_t FixedPolicyScans() const { return mFixedPolicyScans; }
+
+private:
+  double SpacingMeters(const Fix& aFix) const;
+  bool FixedPolicyWouldScan(const Fix& aFix);
+
+  bool mHasLastScan;
+  Fix mLastScan;
+  // Bearing of the fix that started the last scan, negative if unknown
+  double mBearingAtScan;
+  uint32_t mStaleScans;
+  uint64_t mLastWritten;
+  uint64_t mLastDeduped;
+
+  bool mFixedHasLast;
+  Fix mFixedLast;
+
+  uint64_t mScans;
+  uint64_t mFixedPolicyScans;
+};
+
+#endif
@@ -0,0 +1,533 @@
+#include "StumbleSegmentQueue.h"
+#include "StumbleAppendLog.h"
+#include "StumbleDictionary.h"
+#include "StumbleGZWriter.h"
+#include "StumblerLogging.h"
+#include "StumblerStats.h"
+#include "nsDumpUtils.h"
+#include "nsIFile.h"
+#include "nsISimpleEnumerator.h"
+#include "prio.h"
+#include <stdio.h>
+#include <string.h>
+
+// About the compressed size of a full head, see StumbleAppendLog::kFileSize
+#define SEGMENT_MAX_BYTES (15 * 1024)
+// All segments together, including the head
+#define TOTAL_BUDGET_BYTES (8 * SEGMENT_MAX_BYTES)
+// The head is uncompressed, so it is budgeted as the segment it becomes
+// and the sealed segments share the rest.
+#define SEALED_BUDGET_BYTES (TOTAL_BUDGET_BYTES - SEGMENT_MAX_BYTES)
+
+NS_NAMED_LITERAL_CSTRING(kOutputDirName, "mozstumbler");
+NS_NAMED_LITERAL_CSTRING(kManifestName, "stumbles.manifest");
+NS_NAMED_LITERAL_CSTRING(kManifestTmpName, "stumbles.manifest.tmp");
+NS_NAMED_LITERAL_CSTRING(kManifestMagic, "mozstumbler-segments 1");
+
+static nsresult
+GetStumbleFile(const nsACString& aName, nsIFile** aFile)
+{
+  return nsDumpUtils::OpenTempFile(aName, aFile, kOutputDirName, nsDumpUtils::CREATE);
+}
+
+static nsCString
+SegmentFileName(uint32_t aSeq)
+{
+  nsCString name;
+  name.AppendPrintf("stumbles.%u.log.gz", aSeq);
+  return name;
+}
+
+// Creates the file if it does not exist.
+static nsresult
+GetSegmentFile(uint32_t aSeq, nsIFile** aFile)
+{
+  return GetStumbleFile(SegmentFileName(aSeq), aFile);
+}
+
+// The uncompressed head, see StumbleAppendLog
+static nsresult
+GetHeadLogFile(uint32_t aSeq, nsIFile** aFile)
+{
+  nsAutoCString name;
+  name.AppendPrintf("stumbles.%u.log", aSeq);
+  return GetStumbleFile(name, aFile);
+}
+
+// stumbles.<seq>.log or stumbles.<seq>.log.gz
+static bool
+IsSegmentFileName(const nsACString& aName)
+{
+  nsAutoCString name(aName);
+  unsigned int seq;
+  int length = 0;
+  if (sscanf(name.get(), "stumbles.%u.log%n", &seq, &length) != 1 || !length) {
+    return false;
+  }
+  const char* rest = name.get() + length;
+  return !*rest || !strcmp(rest, ".gz");
+}
+
+static int64_t
+NowMs()
+{
+  return PR_Now() / PR_USEC_PER_MSEC;
+}
+
+StumbleSegmentQueue::StumbleSegmentQueue()
+  : mHeadSeq(0)
+  , mHasPinned(false)
+  , mPinnedSeq(0)
+{
+}
+
+StumbleSegmentQueue::~StumbleSegmentQueue()
+{
+  if (mHead) {
+    mHead->Close();
+  }
+}
+
+nsresult
+StumbleSegmentQueue::Init()
+{
+  mDictionary = StumbleDictionary::Load();
+
+  nsresult rv = LoadManifest();
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    STUMBLER_ERR("Unreadable manifest, starting an empty queue");
+    mSealed.Clear();
+    mHeadSeq = 0;
+    // The files the manifest listed would be orphans, outside the budget.
+    rv = RemoveSegmentFiles();
+    NS_ENSURE_SUCCESS(rv, rv);
+    return SaveManifest();
+  }
+
+  // Seal() removes the head log only once the manifest has its segment.
+  for (const Segment& segment : mSealed) {
+    nsCOMPtr<nsIFile> logFile;
+    if (NS_SUCCEEDED(GetHeadLogFile(segment.mSeq, getter_AddRefs(logFile)))) {
+      logFile->Remove(false);
+    }
+  }
+  return NS_OK;
+}
+
+/*
+ Removes every segment and head log in the directory, whether or not the
+ manifest lists it.
+ */
+nsresult
+StumbleSegmentQueue::RemoveSegmentFiles()
+{
+  nsCOMPtr<nsIFile> manifest;
+  nsresult rv = GetStumbleFile(kManifestName, getter_AddRefs(manifest));
+  NS_ENSURE_SUCCESS(rv, rv);
+  nsCOMPtr<nsIFile> dir;
+  rv = manifest->GetParent(getter_AddRefs(dir));
+  NS_ENSURE_SUCCESS(rv, rv);
+  nsCOMPtr<nsISimpleEnumerator> entries;
+  rv = dir->GetDirectoryEntries(getter_AddRefs(entries));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  uint32_t removed = 0;
+  bool hasMore;
+  while (NS_SUCCEEDED(entries->HasMoreElements(&hasMore)) && hasMore) {
+    nsCOMPtr<nsISupports> entry;
+    rv = entries->GetNext(getter_AddRefs(entry));
+    NS_ENSURE_SUCCESS(rv, rv);
+    nsCOMPtr<nsIFile> file = do_QueryInterface(entry);
+    nsAutoCString name;
+    if (!file || NS_FAILED(file->GetNativeLeafName(name)) ||
+        !IsSegmentFileName(name)) {
+      continue;
+    }
+    if (NS_WARN_IF(NS_FAILED(file->Remove(false)))) {
+      STUMBLER_ERR("Cannot remove %s", name.get());
+      continue;
+    }
+    removed++;
+  }
+  STUMBLER_LOG("Removed %u segment files", removed);
+  return NS_OK;
+}
+
+nsresult
+StumbleSegmentQueue::LoadManifest()
+{
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = GetStumbleFile(kManifestName, getter_AddRefs(file));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = file->OpenNSPRFileDesc(PR_RDONLY, 0, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsAutoCString data;
+  char buf[1024];
+  int32_t bytesRead;
+  while ((bytesRead = PR_Read(fd, buf, sizeof(buf))) > 0) {
+    data.Append(buf, bytesRead);
+  }
+  PR_Close(fd);
+  if (bytesRead < 0) {
+    return NS_ERROR_FAILURE;
+  }
+
+  if (data.IsEmpty()) {
+    // First run
+    return NS_OK;
+  }
+
+  bool dirty = false;
+  bool first = true;
+  int32_t start = 0;
+  while (start < int32_t(data.Length())) {
+    int32_t end = data.FindChar('\n', start);
+    if (end < 0) {
+      end = data.Length();
+    }
+    nsAutoCString line(Substring(data, start, end - start));
+    start = end + 1;
+
+    if (first) {
+      if (!line.Equals(kManifestMagic)) {
+        return NS_ERROR_FILE_CORRUPTED;
+      }
+      first = false;
+      continue;
+    }
+
+    unsigned int seq, uploaded = 0;
+    long long size, sealedTime;
+    if (sscanf(line.get(), "head %u", &seq) == 1) {
+      mHeadSeq = seq;
+    } else if (sscanf(line.get(), "sealed %u %lld %lld %u",
+                      &seq, &size, &sealedTime, &uploaded) >= 3) {
+      // The upload progress is missing in manifests from before batching
+      nsCOMPtr<nsIFile> segmentFile;
+      int64_t actualSize = 0;
+      if (NS_SUCCEEDED(GetSegmentFile(seq, getter_AddRefs(segmentFile)))) {
+        segmentFile->GetFileSize(&actualSize);
+      }
+      if (actualSize <= 0) {
+        // Deleted before the manifest was updated
+        if (segmentFile) {
+          segmentFile->Remove(false);
+        }
+        dirty = true;
+        continue;
+      }
+      Segment* segment = mSealed.AppendElement();
+      segment->mSeq = seq;
+      segment->mSize = actualSize;
+      segment->mSealedTime = sealedTime;
+      segment->mUploadedRecords = uploaded;
+    } else {
+      return NS_ERROR_FILE_CORRUPTED;
+    }
+  }
+
+  STUMBLER_DBG("Loaded %u sealed segments, head %u\n", mSealed.Length(), mHeadSeq);
+  return dirty ? SaveManifest() : NS_OK;
+}
+
+nsresult
+StumbleSegmentQueue::SaveManifest()
+{
+  nsAutoCString data(kManifestMagic);
+  data.Append('\n');
+  data.AppendPrintf("head %u\n", mHeadSeq);
+  for (const Segment& segment : mSealed) {
+    data.AppendPrintf("sealed %u %lld %lld %u\n", segment.mSeq,
+                      segment.mSize, segment.mSealedTime, segment.mUploadedRecords);
+  }
+
+  nsCOMPtr<nsIFile> tmpFile;
+  nsresult rv = GetStumbleFile(kManifestTmpName, getter_AddRefs(tmpFile));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = tmpFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE, 0644, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+  int32_t written = PR_Write(fd, data.get(), data.Length());
+  PR_Sync(fd);
+  PR_Close(fd);
+  if (written != int32_t(data.Length())) {
+    STUMBLER_ERR("Writing the manifest failed");
+    return NS_ERROR_FAILURE;
+  }
+
+  // rename() replaces the old manifest atomically
+  return tmpFile->MoveToNative(/* directory */ nullptr, kManifestName);
+}
+
+nsresult
+StumbleSegmentQueue::OpenHead()
+{
+  if (mHead) {
+    return NS_OK;
+  }
+
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = GetHeadLogFile(mHeadSeq, getter_AddRefs(file));
+  // Only looked up, unlike with GetSegmentFile(): the segment is written
+  // by Seal(), and an empty one left by a crash would be an orphan.
+  nsCOMPtr<nsIFile> gzFile;
+  if (NS_SUCCEEDED(rv)) {
+    rv = file->Clone(getter_AddRefs(gzFile));
+  }
+  if (NS_SUCCEEDED(rv)) {
+    rv = gzFile->SetNativeLeafName(SegmentFileName(mHeadSeq));
+  }
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    STUMBLER_ERR("Open a file for stumble failed");
+    return rv;
+  }
+
+  int64_t gzSize = 0;
+  int64_t logSize = 0;
+  gzFile->GetFileSize(&gzSize);
+  file->GetFileSize(&logSize);
+  if (gzSize > 0 && logSize == 0) {
+    // A head written before the append log; it is sealed as it is.
+    STUMBLER_LOG("Sealing gzip head segment %u", mHeadSeq);
+    nsRefPtr<StumbleGZWriter> writer = new StumbleGZWriter();
+    rv = writer->Open(gzFile, StumbleLogValidLength, mDictionary);
+    if (NS_SUCCEEDED(rv)) {
+      rv = writer->Finish();
+    }
+    if (NS_WARN_IF(NS_FAILED(rv))) {
+      gzFile->Remove(false);
+    } else {
+      AddSealed(gzFile);
+    }
+    file->Remove(false);
+    return OpenHead();
+  }
+
+  nsRefPtr<StumbleAppendLog> log = new StumbleAppendLog();
+  rv = log->Open(file);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    STUMBLER_ERR("Stumble log init failed");
+    return rv;
+  }
+  mHead = log;
+  // The last record of a reopened file is unknown, start without a delta.
+  mEncoder.Reset();
+  return NS_OK;
+}
+
+nsresult
+StumbleSegmentQueue::Append(const StumbleRecord& aRecord)
+{
+  nsresult rv = OpenHead();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // Large enough for any usual record, so encoding does not allocate
+  char storage[1024];
+  nsFixedCString data(storage, sizeof(storage), 0);
+  mEncoder.Encode(aRecord, data);
+  if (!mHead->Append(data)) {
+    // The head is full. The record is encoded again for the new head,
+    // where it starts without a delta.
+    rv = Seal();
+    if (NS_WARN_IF(NS_FAILED(rv))) {
+      STUMBLER_ERR("Sealing segment %u failed", mHeadSeq);
+      // The encoder has moved past a record that is not in the log
+      mEncoder.Reset();
+      return rv;
+    }
+    rv = OpenHead();
+    NS_ENSURE_SUCCESS(rv, rv);
+    data.Truncate();
+    mEncoder.Encode(aRecord, data);
+    if (!mHead->Append(data)) {
+      STUMBLER_ERR("A record of %u bytes does not fit in a stumble log", data.Length());
+      mEncoder.Reset();
+      return NS_ERROR_FAILURE;
+    }
+  }
+  StumblerStats::Add(StumblerStats::RECORDS_WRITTEN);
+  StumblerStats::Add(StumblerStats::BYTES_ENCODED, data.Length());
+
+  if (mHead->ShouldSync()) {
+    rv = mHead->Sync();
+    if (NS_WARN_IF(NS_FAILED(rv))) {
+      STUMBLER_ERR("Stumble log sync failed");
+    }
+  }
+
+  EnforceBudget();
+  return NS_OK;
+}
+
+nsresult
+StumbleSegmentQueue::Seal()
+{
+  MOZ_ASSERT(mHead);
+
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = GetSegmentFile(mHeadSeq, getter_AddRefs(file));
+  NS_ENSURE_SUCCESS(rv, rv);
+  // Left over from an interrupted Seal()
+  file->Remove(false);
+
+  nsRefPtr<StumbleGZWriter> writer = new StumbleGZWriter();
+  rv = writer->Open(file, StumbleLogValidLength, mDictionary);
+  NS_ENSURE_SUCCESS(rv, rv);
+  nsAutoCString header;
+  StumbleRecordEncoder::WriteHeader(header);
+  rv = writer->Write(header);
+  if (NS_SUCCEEDED(rv)) {
+    rv = writer->Write(nsDependentCSubstring(mHead->Data(), mHead->DataLength()));
+  }
+  nsresult finishRv = writer->Finish();
+  if (NS_SUCCEEDED(rv)) {
+    rv = finishRv;
+  }
+  if (NS_FAILED(rv)) {
+    file->Remove(false);
+    return rv;
+  }
+
+  nsCOMPtr<nsIFile> logFile = mHead->File();
+  mHead->Close();
+  mHead = nullptr;
+  rv = AddSealed(file);
+  // Only now, see Init()
+  logFile->Remove(false);
+  return rv;
+}
+
+nsresult
+StumbleSegmentQueue::AddSealed(nsIFile* aFile)
+{
+  Segment* segment = mSealed.AppendElement();
+  segment->mSeq = mHeadSeq;
+  segment->mSize = 0;
+  aFile->GetFileSize(&segment->mSize);
+  segment->mSealedTime = NowMs();
+  segment->mUploadedRecords = 0;
+
+  STUMBLER_LOG("Sealed segment %u, %lld bytes", mHeadSeq, segment->mSize);
+  StumblerStats::Add(StumblerStats::SEGMENTS_SEALED);
+  mHeadSeq++;
+  nsresult rv = SaveManifest();
+
+  if (!mDictionary) {
+    // The next head is the first segment to use it.
+    mDictionary = StumbleDictionary::Train(aFile);
+  }
+  return rv;
+}
+
+nsresult
+StumbleSegmentQueue::FinishHead()
+{
+  if (!mHead) {
+    return NS_OK;
+  }
+  nsresult rv = mHead->Close();
+  mHead = nullptr;
+  return rv;
+}
+
+int64_t
+StumbleSegmentQueue::SealedSize() const
+{
+  int64_t total = 0;
+  for (const Segment& segment : mSealed) {
+    total += segment.mSize;
+  }
+  return total;
+}
+
+void
+StumbleSegmentQueue::EnforceBudget()
+{
+  while (SealedSize() > SEALED_BUDGET_BYTES) {
+    uint32_t idx = 0;
+    if (mHasPinned && idx < mSealed.Length() && mSealed[idx].mSeq == mPinnedSeq) {
+      idx++;
+    }
+    if (idx >= mSealed.Length()) {
+      return;
+    }
+    STUMBLER_LOG("Over budget, evicting segment %u", mSealed[idx].mSeq);
+    if (NS_FAILED(Remove(mSealed[idx].mSeq))) {
+      return;
+    }
+    StumblerStats::Add(StumblerStats::SEGMENTS_EVICTED);
+  }
+}
+
+bool
+StumbleSegmentQueue::GetUploadCandidate(int64_t aMinAgeMs, uint32_t* aSeq, nsIFile** aFile,
+                                        uint32_t* aUploadedRecords)
+{
+  if (mSealed.IsEmpty() || NowMs() - mSealed[0].mSealedTime < aMinAgeMs) {
+    return false;
+  }
+
+  nsresult rv = GetSegmentFile(mSealed[0].mSeq, aFile);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    return false;
+  }
+  *aSeq = mSealed[0].mSeq;
+  *aUploadedRecords = mSealed[0].mUploadedRecords;
+  mHasPinned = true;
+  mPinnedSeq = *aSeq;
+  return true;
+}
+
+void
+StumbleSegmentQueue::Unpin()
+{
+  mHasPinned = false;
+}
+
+nsresult
+StumbleSegmentQueue::RemovePinned()
+{
+  if (!mHasPinned) {
+    return NS_OK;
+  }
+  return Remove(mPinnedSeq);
+}
+
+nsresult
+StumbleSegmentQueue::SetPinnedProgress(uint32_t aUploadedRecords)
+{
+  if (!mHasPinned) {
+    return NS_OK;
+  }
+  for (Segment& segment : mSealed) {
+    if (segment.mSeq == mPinnedSeq) {
+      segment.mUploadedRecords = aUploadedRecords;
+      return SaveManifest();
+    }
+  }
+  return NS_ERROR_NOT_AVAILABLE;
+}
+
+nsresult
+StumbleSegmentQueue::Remove(uint32_t aSeq)
+{
+  for (uint32_t i = 0; i < mSealed.Length(); i++) {
+    if (mSealed[i].mSeq != aSeq) {
+      continue;
+    }
+    nsCOMPtr<nsIFile> file;
+    if (NS_SUCCEEDED(GetSegmentFile(aSeq, getter_AddRefs(file)))) {
+      file->Remove(false);
+    }
+    mSealed.RemoveElementAt(i);
+    if (mHasPinned && mPinnedSeq == aSeq) {
+      mHasPinned = false;
+    }
+    return SaveManifest();
+  }
+  return NS_ERROR_NOT_AVAILABLE;
+}
@@ -0,0 +1,97 @@
+#ifndef StumbleSegmentQueue_H
+#define StumbleSegmentQueue_H
+
+#include "nsCOMPtr.h"
+#include "nsISupportsImpl.h"
+#include "nsTArray.h"
+#include "StumbleRecord.h"
+
+class nsIFile;
+class StumbleAppendLog;
+class StumbleDictionary;
+
+/*
+ The stumble log, split into numbered segment files so that writing
+ never waits for an upload.
+
+ Records are always appended to the head segment. When the head reaches
+ the segment size it is sealed and a new head is started. Uploads take
+ sealed segments from the tail (oldest first). If the sealed segments go
+ over the byte budget, less one segment for the head, the oldest are
+ evicted, except one that is being uploaded.
+
+ A sealed segment is uploaded in batches of records; the number of
+ records already uploaded is kept per segment, so an interrupted upload
+ resumes with the next batch.
+
+ Once a segment is sealed, a preset deflate dictionary is trained from
+ it for the segments that follow, see StumbleDictionary.
+
+ The list of segments is kept in stumbles.manifest, which is rewritten
+ (to a temporary file, then renamed) whenever a segment is sealed or
+ removed. Segment files are deleted before the manifest drops them, so
+ a crash can leave a manifest entry for a missing file, which Init()
+ ignores, but never an orphaned file.
+
+ Not thread-safe; WriteStumbleOnThread serializes access.
+ */
+class StumbleSegmentQueue final
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(StumbleSegmentQueue)
+
+  StumbleSegmentQueue();
+
+  nsresult Init();
+
+  // Appends to the head segment, sealing it when it is full.
+  nsresult Append(const StumbleRecord& aRecord);
+  // Syncs and closes the head segment, e.g. on shutdown.
+  nsresult FinishHead();
+
+  // The oldest sealed segment, if it was sealed at least aMinAgeMs ago,
+  // and how many of its records were already uploaded. The segment is
+  // pinned (never evicted) until RemovePinned() or Unpin().
+  bool GetUploadCandidate(int64_t aMinAgeMs, uint32_t* aSeq, nsIFile** aFile,
+                          uint32_t* aUploadedRecords);
+  void Unpin();
+  nsresult RemovePinned();
+  // Records the upload progress of the pinned segment in the manifest.
+  nsresult SetPinnedProgress(uint32_t aUploadedRecords);
+
+  // Compressed bytes of the sealed segments
+  int64_t SealedSize() const;
+  // Needed to read the segments; null until one was trained.
+  StumbleDictionary* Dictionary() const { return mDictionary; }
+
+private:
+  struct Segment
+  {
+    uint32_t mSeq;
+    int64_t mSize;
+    // ms since epoch
+    int64_t mSealedTime;
+    uint32_t mUploadedRecords;
+  };
+
+  ~StumbleSegmentQueue();
+
+  nsresult OpenHead();
+  nsresult Seal();
+  nsresult AddSealed(nsIFile* aFile);
+  void EnforceBudget();
+  nsresult Remove(uint32_t aSeq);
+  nsresult RemoveSegmentFiles();
+  nsresult LoadManifest();
+  nsresult SaveManifest();
+
+  nsTArray<Segment> mSealed;  // oldest first
+  uint32_t mHeadSeq;
+  nsRefPtr<StumbleAppendLog> mHead;
+  nsRefPtr<StumbleDictionary> mDictionary;
+  StumbleRecordEncoder mEncoder;
+  bool mHasPinned;
+  uint32_t mPinnedSeq;
+};
+
+#endif
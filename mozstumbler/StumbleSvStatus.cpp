@@ -0,0 +1,181 @@
+#include "StumbleSvStatus.h"
+#include <string.h>
+
+using namespace mozilla;
+
+static_assert(sizeof(StumbleSvSummary) % sizeof(uint32_t) == 0,
+              "the summary is copied in whole words");
+
+Atomic<uint32_t> StumbleSvStatus::sSequence;
+Atomic<uint32_t> StumbleSvStatus::sWords[StumbleSvStatus::kWords];
+
+StumbleSvSummary::StumbleSvSummary()
+  : mTime(0)
+  , mUsedInFixMask(0)
+  , mInView(0)
+  , mUsed(kUnknownCount)
+  , mMaxSnr(0)
+  , mTopSnr(0)
+  , mMeanUsedSnr(0)
+{
+  memset(mInViewBy, 0, sizeof(mInViewBy));
+}
+
+bool
+StumbleSvSummary::IsFresh(int64_t aNowMs) const
+{
+  return mTime && aNowMs - mTime <= kMaxAgeMs;
+}
+
+bool
+StumbleSvSummary::IsPoor(int64_t aNowMs) const
+{
+  if (!IsFresh(aNowMs)) {
+    return false;
+  }
+  if (mUsed != kUnknownCount && mUsed < kMinSatellitesUsed) {
+    return true;
+  }
+  return mInView && mTopSnr < kMinTopSnr;
+}
+
+StumbleSvSummaryBuilder::StumbleSvSummaryBuilder(int64_t aNowMs)
+  : mUsed(0)
+  , mUsedSnrSum(0)
+{
+  mSummary.mTime = aNowMs;
+  memset(mTop, 0, sizeof(mTop));
+  memset(mTopUsed, 0, sizeof(mTopUsed));
+}
+
+/* static */ StumbleSvSummary::Constellation
+StumbleSvSummaryBuilder::ConstellationForPrn(int aPrn)
+{
+  if (aPrn >= 1 && aPrn <= 32) {
+    return StumbleSvSummary::GPS;
+  }
+  if (aPrn >= 33 && aPrn <= 64) {
+    return StumbleSvSummary::SBAS;
+  }
+  if (aPrn >= 65 && aPrn <= 96) {
+    return StumbleSvSummary::GLONASS;
+  }
+  if (aPrn >= 193 && aPrn <= 200) {
+    return StumbleSvSummary::QZSS;
+  }
+  if (aPrn >= 201 && aPrn <= 235) {
+    return StumbleSvSummary::BEIDOU;
+  }
+  if (aPrn >= 301 && aPrn <= 336) {
+    return StumbleSvSummary::GALILEO;
+  }
+  return StumbleSvSummary::OTHER;
+}
+
+/* static */ void
+StumbleSvSummaryBuilder::AddTop(uint8_t (&aTop)[kTopCount], uint8_t aSnr)
+{
+  for (uint32_t i = 0; i < kTopCount; i++) {
+    if (aSnr > aTop[i]) {
+      memmove(aTop + i + 1, aTop + i, kTopCount - i - 1);
+      aTop[i] = aSnr;
+      return;
+    }
+  }
+}
+
+/* static */ uint8_t
+StumbleSvSummaryBuilder::TopMean(const uint8_t (&aTop)[kTopCount])
+{
+  uint32_t sum = 0;
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < kTopCount && aTop[i]; i++) {
+    sum += aTop[i];
+    count++;
+  }
+  return count ? (sum + count / 2) / count : 0;
+}
+
+void
+StumbleSvSummaryBuilder::AddSatellite(int aPrn, float aSnr, bool aUsed)
+{
+  if (mSummary.mInView == StumbleSvSummary::kUnknownCount - 1) {
+    return;
+  }
+  mSummary.mInView++;
+  mSummary.mInViewBy[ConstellationForPrn(aPrn)]++;
+
+  // Also rejects NaN
+  uint8_t snr = 0;
+  if (aSnr > 0) {
+    snr = aSnr >= 99 ? 99 : uint8_t(aSnr + 0.5f);
+  }
+  if (snr > mSummary.mMaxSnr) {
+    mSummary.mMaxSnr = snr;
+  }
+  AddTop(mTop, snr);
+
+  if (aUsed) {
+    mUsed++;
+    mUsedSnrSum += snr;
+    AddTop(mTopUsed, snr);
+    if (aPrn >= 1 && aPrn <= 32) {
+      mSummary.mUsedInFixMask |= 1u << (aPrn - 1);
+    }
+  }
+}
+
+StumbleSvSummary
+StumbleSvSummaryBuilder::Finish(bool aUsedKnown)
+{
+  // used_in_fix_mask only covers GPS PRNs, so with other satellites in
+  // view it says nothing about how many the fix used.
+  bool gpsOnly = mSummary.mInViewBy[StumbleSvSummary::GPS] == mSummary.mInView;
+  if (aUsedKnown && gpsOnly) {
+    mSummary.mUsed = mUsed;
+    mSummary.mMeanUsedSnr = mUsed ? (mUsedSnrSum + mUsed / 2) / mUsed : 0;
+    mSummary.mTopSnr = TopMean(mTopUsed);
+  } else {
+    mSummary.mTopSnr = TopMean(mTop);
+  }
+  return mSummary;
+}
+
+/* static */ void
+StumbleSvStatus::Publish(const StumbleSvSummary& aSummary)
+{
+  uint32_t words[kWords];
+  memcpy(words, &aSummary, sizeof(aSummary));
+
+  uint32_t sequence = sSequence;
+  sSequence = sequence + 1;
+  for (uint32_t i = 0; i < kWords; i++) {
+    sWords[i] = words[i];
+  }
+  sSequence = sequence + 2;
+}
+
+/* static */ void
+StumbleSvStatus::Clear()
+{
+  Publish(StumbleSvSummary());
+}
+
+/* static */ StumbleSvSummary
+StumbleSvStatus::Read()
+{
+  uint32_t words[kWords];
+  uint32_t before;
+  uint32_t after;
+  do {
+    before = sSequence;
+    for (uint32_t i = 0; i < kWords; i++) {
+      words[i] = sWords[i];
+    }
+    after = sSequence;
+  } while ((before & 1) || before != after);
+
+  StumbleSvSummary summary;
+  memcpy(&summary, words, sizeof(summary));
+  return summary;
+}
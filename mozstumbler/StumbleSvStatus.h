@@ -0,0 +1,113 @@
+#ifndef StumbleSvStatus_H
+#define StumbleSvStatus_H
+
+#include "mozilla/Atomics.h"
+#include <stdint.h>
+
+/*
+ Compact form of one satellite status report of the GPS HAL
+ (GpsSvStatus), see StumbleSvSummaryBuilder.
+ */
+struct StumbleSvSummary
+{
+  // By the PRN ranges the GPS HALs use
+  enum Constellation {
+    GPS,
+    SBAS,
+    GLONASS,
+    QZSS,
+    BEIDOU,
+    GALILEO,
+    OTHER,
+    CONSTELLATION_COUNT
+  };
+
+  static const uint8_t kUnknownCount = 0xff;
+
+  // Fixes with fewer satellites used, or whose strongest signals are
+  // weaker than this (indoors, street canyons), are not worth a scan.
+  static const uint32_t kMinSatellitesUsed = 4;
+  static const uint32_t kMinTopSnr = 25;
+  // Older reports are not taken to describe the current fix.
+  static const uint32_t kMaxAgeMs = 3000;
+
+  // ms, 0 if there is no report
+  int64_t mTime;
+  // GPS satellites used in the fix, bit (PRN - 1)
+  uint32_t mUsedInFixMask;
+  uint8_t mInView;
+  // kUnknownCount if the HAL does not report it, or if satellites other
+  // than GPS are in view, which used_in_fix_mask does not cover
+  uint8_t mUsed;
+  // SNRs in dB-Hz: the strongest, the mean of the four strongest (of the
+  // satellites used, if known) and the mean of the satellites used
+  uint8_t mMaxSnr;
+  uint8_t mTopSnr;
+  uint8_t mMeanUsedSnr;
+  // Satellites in view per constellation
+  uint8_t mInViewBy[CONSTELLATION_COUNT];
+
+  StumbleSvSummary();
+
+  bool IsFresh(int64_t aNowMs) const;
+  // True if the report is recent and shows a fix too poor for stumbling.
+  bool IsPoor(int64_t aNowMs) const;
+};
+
+/*
+ Builds a StumbleSvSummary from the satellites of one report, without
+ allocating. GonkGPSGeolocationProvider::SvStatusCallback feeds it the
+ entries of GpsSvStatus::sv_list.
+ */
+class StumbleSvSummaryBuilder
+{
+public:
+  explicit StumbleSvSummaryBuilder(int64_t aNowMs);
+
+  void AddSatellite(int aPrn, float aSnr, bool aUsed);
+  // aUsedKnown is false when the HAL leaves used_in_fix_mask empty. The
+  // satellites used are only counted if all in view are GPS.
+  StumbleSvSummary Finish(bool aUsedKnown);
+
+  static StumbleSvSummary::Constellation ConstellationForPrn(int aPrn);
+
+private:
+  enum { kTopCount = 4 };
+
+  static void AddTop(uint8_t (&aTop)[kTopCount], uint8_t aSnr);
+  static uint8_t TopMean(const uint8_t (&aTop)[kTopCount]);
+
+  StumbleSvSummary mSummary;
+  uint32_t mUsed;
+  uint32_t mUsedSnrSum;
+  // Strongest SNRs, descending, of all satellites and of those used
+  uint8_t mTop[kTopCount];
+  uint8_t mTopUsed[kTopCount];
+};
+
+/*
+ The latest summary, written by the GPS HAL thread and read by
+ LocationCallback, or any other thread, without locking. A seqlock: the
+ writer makes the sequence odd, stores the words of the summary and makes
+ it even again; a reader retries until it saw the same even sequence
+ before and after copying the words. All stores are sequentially
+ consistent atomics, so a copy is never torn. One report a second makes
+ retries rare.
+ */
+class StumbleSvStatus
+{
+public:
+  // One writer at a time
+  static void Publish(const StumbleSvSummary& aSummary);
+  // When the GPS session ends, so no stale report is used.
+  static void Clear();
+  static StumbleSvSummary Read();
+
+private:
+  static const uint32_t kWords = (sizeof(StumbleSvSummary) + 3) / 4;
+
+  static mozilla::Atomic<uint32_t> sSequence;
+  static mozilla::Atomic<uint32_t> sWords[kWords];
+};
+
+#endif
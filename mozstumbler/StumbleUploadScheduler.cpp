@@ -0,0 +1,157 @@
+#include "StumbleUploadScheduler.h"
+#include "StumblerLogging.h"
+#include "nsDumpUtils.h"
+#include "nsIFile.h"
+#include "prio.h"
+#include <stdio.h>
+
+NS_NAMED_LITERAL_CSTRING(kOutputDirName, "mozstumbler");
+NS_NAMED_LITERAL_CSTRING(kStateName, "stumbles.upload-state");
+NS_NAMED_LITERAL_CSTRING(kStateTmpName, "stumbles.upload-state.tmp");
+
+static nsresult
+GetStateFile(const nsACString& aName, nsIFile** aFile)
+{
+  return nsDumpUtils::OpenTempFile(aName, aFile, kOutputDirName, nsDumpUtils::CREATE);
+}
+
+StumbleUploadScheduler::StumbleUploadScheduler(uint64_t aSeed)
+  : mConsecutiveFailures(0)
+  , mNextAttemptMs(0)
+  // xorshift must not start at zero
+  , mRandomState(aSeed ? aSeed : 1)
+{
+}
+
+/* static */ StumbleUploadScheduler::Outcome
+StumbleUploadScheduler::OutcomeForStatus(uint32_t aHttpStatus)
+{
+  if (aHttpStatus >= 200 && aHttpStatus < 300) {
+    return SUCCEEDED;
+  }
+  if (aHttpStatus >= 400 && aHttpStatus < 500) {
+    switch (aHttpStatus) {
+      case 401:
+      case 403:
+      case 404:
+      case 408:
+      case 429:
+        return FAILED;
+      default:
+        return REJECTED;
+    }
+  }
+  return FAILED;
+}
+
+uint64_t
+StumbleUploadScheduler::NextRandom()
+{
+  mRandomState ^= mRandomState << 13;
+  mRandomState ^= mRandomState >> 7;
+  mRandomState ^= mRandomState << 17;
+  return mRandomState;
+}
+
+void
+StumbleUploadScheduler::ClampNextAttempt(int64_t aNowMs)
+{
+  if (mNextAttemptMs > aNowMs + kMaxBackoffMs) {
+    STUMBLER_ERR("Next upload attempt too far away, the clock moved back?");
+    mNextAttemptMs = aNowMs + kMaxBackoffMs;
+  }
+}
+
+bool
+StumbleUploadScheduler::CanUpload(int64_t aNowMs)
+{
+  ClampNextAttempt(aNowMs);
+  return aNowMs >= mNextAttemptMs;
+}
+
+void
+StumbleUploadScheduler::OnUploadEnded(int64_t aNowMs, Outcome aOutcome, int64_t aRetryAfterMs)
+{
+  if (aOutcome != FAILED) {
+    mConsecutiveFailures = 0;
+    mNextAttemptMs = 0;
+  } else {
+    int64_t backoff = kInitialBackoffMs;
+    for (uint32_t i = 0; i < mConsecutiveFailures && backoff < kMaxBackoffMs; i++) {
+      backoff *= 2;
+    }
+    if (backoff > kMaxBackoffMs) {
+      backoff = kMaxBackoffMs;
+    }
+    // Between half and all of the backoff
+    backoff -= int64_t(NextRandom() % uint64_t(backoff / 2 + 1));
+    if (aRetryAfterMs > backoff) {
+      backoff = aRetryAfterMs;
+      if (backoff > kMaxBackoffMs) {
+        backoff = kMaxBackoffMs;
+      }
+    }
+    mConsecutiveFailures++;
+    mNextAttemptMs = aNowMs + backoff;
+    STUMBLER_LOG("upload failure %u, next attempt in %lld s",
+                 mConsecutiveFailures, backoff / 1000);
+  }
+
+  nsresult rv = Save();
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    STUMBLER_ERR("Saving the upload state failed");
+  }
+}
+
+nsresult
+StumbleUploadScheduler::Load(int64_t aNowMs)
+{
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = GetStateFile(kStateName, getter_AddRefs(file));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = file->OpenNSPRFileDesc(PR_RDONLY, 0, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+  char buf[128];
+  int32_t bytesRead = PR_Read(fd, buf, sizeof(buf) - 1);
+  PR_Close(fd);
+  if (bytesRead <= 0) {
+    // First run
+    return NS_OK;
+  }
+  buf[bytesRead] = '\0';
+
+  unsigned int failures;
+  long long nextAttempt;
+  if (sscanf(buf, "failures %u next %lld", &failures, &nextAttempt) != 2) {
+    STUMBLER_ERR("Unreadable upload state, starting without backoff");
+    return NS_OK;
+  }
+  mConsecutiveFailures = failures;
+  mNextAttemptMs = nextAttempt;
+  ClampNextAttempt(aNowMs);
+  return NS_OK;
+}
+
+nsresult
+StumbleUploadScheduler::Save()
+{
+  nsAutoCString data;
+  data.AppendPrintf("failures %u next %lld\n", mConsecutiveFailures, mNextAttemptMs);
+
+  nsCOMPtr<nsIFile> tmpFile;
+  nsresult rv = GetStateFile(kStateTmpName, getter_AddRefs(tmpFile));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  PRFileDesc* fd;
+  rv = tmpFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE, 0644, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+  int32_t written = PR_Write(fd, data.get(), data.Length());
+  PR_Sync(fd);
+  PR_Close(fd);
+  if (written != int32_t(data.Length())) {
+    return NS_ERROR_FAILURE;
+  }
+  return tmpFile->MoveToNative(/* directory */ nullptr, kStateName);
+}
@@ -0,0 +1,70 @@
+#ifndef StumbleUploadScheduler_H
+#define StumbleUploadScheduler_H
+
+#include "nsError.h"
+#include "nsISupportsImpl.h"
+
+/*
+ Decides when the next upload batch may be sent, replacing the fixed
+ number of attempts per day.
+
+ After a failure the next attempt waits kInitialBackoffMs, doubling with
+ each consecutive failure up to kMaxBackoffMs, with random jitter down to
+ half of that so that devices do not retry in step. A Retry-After from
+ the server is honoured if it asks for longer (up to kMaxBackoffMs). A
+ success clears the backoff.
+
+ The state is kept in stumbles.upload-state so that a reboot does not
+ reset it. The next attempt is never more than kMaxBackoffMs away, so a
+ failure recorded while the clock was wrong (e.g. a bad RTC after a
+ battery pull) cannot block uploads once it is corrected.
+
+ The clock is passed in (ms since epoch) and the jitter comes from a
+ seeded generator, so the schedule can be replayed exactly.
+
+ Not thread-safe; WriteStumbleOnThread serializes access.
+ */
+class StumbleUploadScheduler final
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(StumbleUploadScheduler)
+
+  enum Outcome {
+    // 2xx
+    SUCCEEDED,
+    // The server refused the data itself (most 4xx); the batch is dropped
+    // and the next one may go right away.
+    REJECTED,
+    // Network error, timeout, 5xx, 408, 429, or a 4xx that points at the
+    // endpoint rather than the data (401, 403, 404); retried with backoff
+    FAILED
+  };
+
+  static const int64_t kInitialBackoffMs = 5 * 60 * 1000;
+  static const int64_t kMaxBackoffMs = 24 * 60 * 60 * 1000;
+
+  explicit StumbleUploadScheduler(uint64_t aSeed);
+
+  nsresult Load(int64_t aNowMs);
+
+  static Outcome OutcomeForStatus(uint32_t aHttpStatus);
+
+  bool CanUpload(int64_t aNowMs);
+  int64_t NextAttemptMs() const { return mNextAttemptMs; }
+
+  // aRetryAfterMs is the delay the server asked for, or 0. Saves the state.
+  void OnUploadEnded(int64_t aNowMs, Outcome aOutcome, int64_t aRetryAfterMs);
+
+private:
+  ~StumbleUploadScheduler() {}
+
+  nsresult Save();
+  uint64_t NextRandom();
+  void ClampNextAttempt(int64_t aNowMs);
+
+  uint32_t mConsecutiveFailures;
+  int64_t mNextAttemptMs;
+  uint64_t mRandomState;
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "StumblerGeodesy.h"
+#include "mozilla/Constants.h"
+#include <math.h>
+
+static const double kRadsInDeg = M_PI / 180.0;
+
+// Longitude difference in [-180, 180], so the antimeridian is not a jump
+static inline double
+LongitudeDelta(double aLon1, double aLon2)
+{
+  double delta = aLon2 - aLon1;
+  if (delta > 180) {
+    delta -= 360;
+  } else if (delta < -180) {
+    delta += 360;
+  }
+  return delta;
+}
+
+double
+GeoDistanceMeters(double aLat1, double aLon1, double aLat2, double aLon2)
+{
+  double dLat = aLat2 - aLat1;
+  double dLon = LongitudeDelta(aLon1, aLon2);
+
+  if (fabs(dLat) < kGeoFastPathDegrees && fabs(dLon) < kGeoFastPathDegrees) {
+    // Equirectangular: one cosine and a square root
+    double x = dLon * cos((aLat1 + aLat2) * 0.5 * kRadsInDeg);
+    return sqrt(x * x + dLat * dLat) * kRadsInDeg * kGeoEarthRadiusMeters;
+  }
+
+  double sinHalfLat = sin(dLat * 0.5 * kRadsInDeg);
+  double sinHalfLon = sin(dLon * 0.5 * kRadsInDeg);
+  double a = sinHalfLat * sinHalfLat +
+             cos(aLat1 * kRadsInDeg) * cos(aLat2 * kRadsInDeg) * sinHalfLon * sinHalfLon;
+  if (a > 1.0) {
+    a = 1.0;
+  }
+  return 2 * asin(sqrt(a)) * kGeoEarthRadiusMeters;
+}
+
+void
+GeoDistancesMeters(double aLat, double aLon,
+                   const double* aLats, const double* aLons,
+                   double* aDistances, uint32_t aCount)
+{
+  const double cosLat = cos(aLat * kRadsInDeg);
+  const double scale = kRadsInDeg * kGeoEarthRadiusMeters;
+  for (uint32_t i = 0; i < aCount; i++) {
+    double dLat = aLats[i] - aLat;
+    double dLon = aLons[i] - aLon;
+    // Branch-free LongitudeDelta()
+    dLon -= 360 * floor((dLon + 180) * (1.0 / 360));
+    double x = dLon * cosLat;
+    aDistances[i] = sqrt(x * x + dLat * dLat) * scale;
+  }
+}
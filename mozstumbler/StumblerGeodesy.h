@@ -0,0 +1,37 @@
+#ifndef StumblerGeodesy_H
+#define StumblerGeodesy_H
+
+#include <stdint.h>
+
+/*
+ Distances between WGS84 coordinates in degrees, on a sphere with the
+ equatorial radius (6378137 m), the model CalculateDeltaInMeter used.
+
+ GeoDistanceMeters() uses the equirectangular approximation when the
+ points are less than kGeoFastPathDegrees apart in both latitude and
+ longitude, and haversine otherwise. Below 85 degrees of latitude the
+ fast path is within 0.001% of haversine. Both keep their precision
+ for distances under a metre, unlike the acos() of the spherical law of
+ cosines used before, which rounds short distances to the nearest few
+ tens of centimetres.
+
+ GeoDistancesMeters() is the batch form for many points against one
+ reference point, e.g. a dedup pass over stored stumbles. It takes
+ separate latitude and longitude arrays and has no branches in its
+ loop, so the compiler can vectorize it. It always uses the
+ equirectangular approximation with the cosine of the reference
+ latitude. The error is below 0.05% for points within 10 km of the
+ reference and below 60 degrees of latitude, and grows with distance
+ and latitude beyond that.
+ */
+
+const double kGeoEarthRadiusMeters = 6378137;
+const double kGeoFastPathDegrees = 0.5;
+
+double GeoDistanceMeters(double aLat1, double aLon1, double aLat2, double aLon2);
+
+void GeoDistancesMeters(double aLat, double aLon,
+                        const double* aLats, const double* aLons,
+                        double* aDistances, uint32_t aCount);
+
+#endif
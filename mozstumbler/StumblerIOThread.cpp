@@ -0,0 +1,78 @@
+#include "StumblerIOThread.h"
+#include "StumblerLogging.h"
+#include "StumblerStats.h"
+#include "mozilla/ClearOnShutdown.h"
+#include "mozilla/LazyIdleThread.h"
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace mozilla;
+
+Atomic<uint32_t> StumblerIOThread::sPendingEvents(0);
+StaticMutex StumblerIOThread::sThreadMutex;
+StaticRefPtr<LazyIdleThread> StumblerIOThread::sThread;
+
+/*
+ Counts the event as pending until it starts. The priority is set by
+ each event, as LazyIdleThread starts a new thread after an idle stop;
+ it is one syscall, next to file I/O.
+ */
+class StumblerIOThread::PendingEvent : public nsRunnable
+{
+public:
+  explicit PendingEvent(nsIRunnable* aEvent)
+    : mEvent(aEvent)
+  {}
+
+  NS_IMETHODIMP
+  Run() override
+  {
+    sPendingEvents--;
+    setpriority(PRIO_PROCESS, gettid(), kNiceness);
+    return mEvent->Run();
+  }
+
+private:
+  ~PendingEvent() {}
+  nsCOMPtr<nsIRunnable> mEvent;
+};
+
+/* static */ nsresult
+StumblerIOThread::Dispatch(nsIRunnable* aEvent)
+{
+  nsRefPtr<LazyIdleThread> thread;
+  {
+    StaticMutexAutoLock lock(sThreadMutex);
+    if (!sThread) {
+      // LazyIdleThread is owned by the thread that creates it, which
+      // gets its idle notifications.
+      if (NS_WARN_IF(!NS_IsMainThread())) {
+        return NS_ERROR_NOT_AVAILABLE;
+      }
+      sThread = new LazyIdleThread(kIdleTimeoutMs, NS_LITERAL_CSTRING("Stumbler I/O"));
+      // The thread itself stops at xpcom-shutdown-threads.
+      ClearOnShutdown(&sThread);
+    }
+    thread = sThread;
+  }
+
+  sPendingEvents++;
+  nsCOMPtr<nsIRunnable> event = new PendingEvent(aEvent);
+  nsresult rv = thread->Dispatch(event, NS_DISPATCH_NORMAL);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    sPendingEvents--;
+  }
+  return rv;
+}
+
+/* static */ nsresult
+StumblerIOThread::TryDispatch(nsIRunnable* aEvent)
+{
+  if (sPendingEvents >= kMaxPendingEvents) {
+    StumblerStats::Add(StumblerStats::IO_EVENTS_REFUSED);
+    STUMBLER_ERR("Stumbler I/O thread has %u events pending, refusing more",
+                 uint32_t(sPendingEvents));
+    return NS_ERROR_ABORT;
+  }
+  return Dispatch(aEvent);
+}
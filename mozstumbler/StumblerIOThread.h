@@ -0,0 +1,52 @@
+#ifndef StumblerIOThread_H
+#define StumblerIOThread_H
+
+#include "mozilla/Atomics.h"
+#include "mozilla/StaticMutex.h"
+#include "mozilla/StaticPtr.h"
+#include "nsThreadUtils.h"
+
+namespace mozilla {
+class LazyIdleThread;
+}
+
+/*
+ The one thread for the stumbler's file work: writing records, the
+ indexes, and exporting uploads. It used to be the stream transport
+ service pool, which every network stream copy shares, so stumble
+ writes competed with page loads and could run concurrently with each
+ other.
+
+ Events run in order, one at a time, at background priority. The thread
+ is started by the first event, which must come from the main thread
+ (earlier ones from other threads are refused), and stops after
+ kIdleTimeoutMs without any, see LazyIdleThread.
+
+ TryDispatch() refuses an event once kMaxPendingEvents are waiting, for
+ work that can be dropped or retried, so a stuck disk cannot grow the
+ queue without bound. Dispatch() always queues, for events that end an
+ operation, like the end of an upload.
+ */
+class StumblerIOThread
+{
+public:
+  static const uint32_t kIdleTimeoutMs = 60 * 1000;
+  static const uint32_t kMaxPendingEvents = 8;
+  // Android's THREAD_PRIORITY_BACKGROUND
+  static const int kNiceness = 10;
+
+  static nsresult Dispatch(nsIRunnable* aEvent);
+  static nsresult TryDispatch(nsIRunnable* aEvent);
+
+  static uint32_t PendingEvents() { return sPendingEvents; }
+
+private:
+  class PendingEvent;
+
+  // Events dispatched and not yet started
+  static mozilla::Atomic<uint32_t> sPendingEvents;
+  static mozilla::StaticMutex sThreadMutex;
+  static mozilla::StaticRefPtr<mozilla::LazyIdleThread> sThread;
+};
+
+#endif
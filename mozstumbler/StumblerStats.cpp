@@ -0,0 +1,175 @@
+#include "StumblerStats.h"
+#include "StumblerLogging.h"
+#include "mozilla/ArrayUtils.h"
+#include "mozilla/MathAlgorithms.h"
+#include "nsIMemoryReporter.h"
+#include "nsPrintfCString.h"
+#include "nsString.h"
+#include "nsThreadUtils.h"
+
+using namespace mozilla;
+
+StumblerStats::CounterValue StumblerStats::sCounters[StumblerStats::COUNTER_COUNT];
+StumblerStats::BucketValue StumblerStats::sLatency[StumblerStats::STAGE_COUNT]
+                                                  [StumblerStats::kLatencyBuckets];
+
+static const char* const kCounterNames[] = {
+  "fixes",
+  "fixes with low quality",
+  "scans",
+  "scans (fixed policy)",
+  "scans timed out",
+  "late responses",
+  "records queued",
+  "records deduped",
+  "records written",
+  "bytes encoded",
+  "bytes compressed",
+  "segments sealed",
+  "segments evicted",
+  "uploads started",
+  "uploads succeeded",
+  "records uploaded",
+  "bytes uploaded",
+  "nmea sentences",
+  "nmea sentences rejected",
+  "io events refused",
+};
+
+static const char* const kStageNames[] = {
+  "scan dispatch",
+  "scan",
+  "cell response (ril 0)",
+  "cell response (ril 1+)",
+  "wifi response",
+  "main thread",
+  "queue wait",
+  "write",
+  "upload",
+  "ttff (cold)",
+  "ttff (warm)",
+  "agps ref location",
+};
+
+static_assert(ArrayLength(kCounterNames) == StumblerStats::COUNTER_COUNT,
+              "every counter needs a name");
+static_assert(ArrayLength(kStageNames) == StumblerStats::STAGE_COUNT,
+              "every stage needs a name");
+
+/* static */ void
+StumblerStats::AddLatency(Stage aStage, const TimeDuration& aDuration)
+{
+  double us = aDuration.ToMicroseconds();
+  uint32_t bucket = 0;
+  if (us >= 1) {
+    bucket = 1 + FloorLog2(uint64_t(us));
+    if (bucket >= kLatencyBuckets) {
+      bucket = kLatencyBuckets - 1;
+    }
+  }
+  sLatency[aStage][bucket]++;
+}
+
+/* static */ void
+StumblerStats::Snapshot(uint64_t (&aValues)[COUNTER_COUNT])
+{
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    aValues[i] = sCounters[i];
+  }
+}
+
+/* static */ void
+StumblerStats::GetLatencyHistogram(Stage aStage, uint32_t (&aBuckets)[kLatencyBuckets])
+{
+  for (uint32_t i = 0; i < kLatencyBuckets; i++) {
+    aBuckets[i] = sLatency[aStage][i];
+  }
+}
+
+/* static */ const char*
+StumblerStats::CounterName(Counter aCounter)
+{
+  return kCounterNames[aCounter];
+}
+
+/* static */ const char*
+StumblerStats::StageName(Stage aStage)
+{
+  return kStageNames[aStage];
+}
+
+/* static */ void
+StumblerStats::Dump()
+{
+  uint64_t values[COUNTER_COUNT];
+  Snapshot(values);
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    STUMBLER_LOG("%s: %llu", kCounterNames[i], (unsigned long long)values[i]);
+  }
+
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    uint32_t buckets[kLatencyBuckets];
+    GetLatencyHistogram(Stage(stage), buckets);
+    nsAutoCString line;
+    for (uint32_t i = 0; i < kLatencyBuckets; i++) {
+      if (buckets[i]) {
+        line.AppendPrintf(" <%lluus:%u", 1ULL << i, buckets[i]);
+      }
+    }
+    if (!line.IsEmpty()) {
+      STUMBLER_LOG("%s latency:%s", kStageNames[stage], line.get());
+    }
+  }
+}
+
+class StumblerStatsReporter final : public nsIMemoryReporter
+{
+  ~StumblerStatsReporter() {}
+
+public:
+  NS_DECL_ISUPPORTS
+
+  NS_IMETHOD
+  CollectReports(nsIHandleReportCallback* aHandleReport,
+                 nsISupports* aData, bool aAnonymize) override
+  {
+    uint64_t values[StumblerStats::COUNTER_COUNT];
+    StumblerStats::Snapshot(values);
+    for (int i = 0; i < StumblerStats::COUNTER_COUNT; i++) {
+      nsPrintfCString path("stumbler/counters/%s", kCounterNames[i]);
+      aHandleReport->Callback(EmptyCString(), path, KIND_OTHER, UNITS_COUNT,
+                              int64_t(values[i]),
+                              NS_LITERAL_CSTRING("Stumble pipeline counter."), aData);
+    }
+
+    for (int stage = 0; stage < StumblerStats::STAGE_COUNT; stage++) {
+      uint32_t buckets[StumblerStats::kLatencyBuckets];
+      StumblerStats::GetLatencyHistogram(StumblerStats::Stage(stage), buckets);
+      for (uint32_t i = 0; i < StumblerStats::kLatencyBuckets; i++) {
+        if (!buckets[i]) {
+          continue;
+        }
+        nsPrintfCString path("stumbler/latency/%s/under %llu us",
+                             kStageNames[stage], 1ULL << i);
+        aHandleReport->Callback(EmptyCString(), path, KIND_OTHER, UNITS_COUNT,
+                                int64_t(buckets[i]),
+                                NS_LITERAL_CSTRING("Stumble pipeline stage latency."),
+                                aData);
+      }
+    }
+    return NS_OK;
+  }
+};
+
+NS_IMPL_ISUPPORTS(StumblerStatsReporter, nsIMemoryReporter)
+
+/* static */ void
+StumblerStats::RegisterMemoryReporter()
+{
+  MOZ_ASSERT(NS_IsMainThread());
+  static bool sRegistered = false;
+  if (!sRegistered) {
+    sRegistered = true;
+    RegisterStrongMemoryReporter(new StumblerStatsReporter());
+  }
+}
@@ -0,0 +1,125 @@
+#ifndef StumblerStats_H
+#define StumblerStats_H
+
+#include "mozilla/Atomics.h"
+#include "mozilla/TimeStamp.h"
+
+/*
+ Process-wide counters for each stage of the stumble pipeline, from the
+ GPS fix to the upload, and latency histograms for the time spent in
+ each stage. They are cheap enough (one or two relaxed atomic adds) to
+ be left on, and are what any measurement of a pipeline change should
+ compare: Snapshot() and GetLatencyHistogram() for code, Dump() for the
+ log, and the "stumbler" entries of about:memory.
+
+ Latencies are measured with mozilla::TimeStamp, carried on StumblerInfo,
+ the record queue and the upload listener. Histogram bucket 0 counts
+ durations under 1 us, bucket n those in [2^(n-1), 2^n) us; the last
+ bucket also holds everything longer.
+ */
+class StumblerStats
+{
+public:
+  enum Counter {
+    // GPS fixes seen by the stumbling gate in LocationCallback
+    FIXES,
+    // Fixes not scanned for, as the NMEA data or the satellite status
+    // showed a poor fix
+    FIXES_LOW_QUALITY,
+    // Fixes that started a cell and wifi scan
+    SCANS,
+    // Scans the old fixed 3 s / 30 m policy would have started
+    SCANS_FIXED_POLICY,
+    // Scans queued at the deadline, without every response
+    SCANS_TIMED_OUT,
+    // Responses that arrived after the deadline and were ignored
+    LATE_RESPONSES,
+    RECORDS_QUEUED,
+    // Records with nothing new for their place, see StumbleDedupIndex
+    RECORDS_DEDUPED,
+    RECORDS_WRITTEN,
+    // Binary records before compression
+    BYTES_ENCODED,
+    // Compressed bytes written to the segment files
+    BYTES_COMPRESSED,
+    SEGMENTS_SEALED,
+    SEGMENTS_EVICTED,
+    UPLOADS_STARTED,
+    UPLOADS_SUCCEEDED,
+    RECORDS_UPLOADED,
+    BYTES_UPLOADED,
+    // NMEA sentences parsed, and dropped for a bad checksum or layout
+    NMEA_SENTENCES,
+    NMEA_REJECTED,
+    // Events not queued as the stumbler I/O thread was too far behind
+    IO_EVENTS_REFUSED,
+    COUNTER_COUNT
+  };
+
+  static void Add(Counter aCounter, uint64_t aAmount = 1)
+  {
+    sCounters[aCounter] += aAmount;
+  }
+
+  static uint64_t Get(Counter aCounter)
+  {
+    return sCounters[aCounter];
+  }
+
+  enum Stage {
+    // LocationCallback to the start of the cell and wifi requests
+    STAGE_SCAN_DISPATCH,
+    // Requests sent to the last cell or wifi response, or the deadline
+    STAGE_SCAN,
+    // Requests sent to the cell info response of RIL service 0, 1 (or
+    // higher), and to the wifi scan results
+    STAGE_CELL_RESPONSE_RIL0,
+    STAGE_CELL_RESPONSE_RIL1,
+    STAGE_WIFI_RESPONSE,
+    // Main thread time spent on one record: copying the wifi results and
+    // building the record in DumpStumblerInfo
+    STAGE_MAIN_THREAD,
+    // DumpStumblerInfo to the write thread taking the record
+    STAGE_QUEUE_WAIT,
+    // Wifi filtering, dedup check, encoding and compression of one record
+    STAGE_WRITE,
+    // Upload sent to its load, error or timeout event
+    STAGE_UPLOAD,
+    // GPS start to the first fix (TTFF), without and with a position
+    // injected at the start
+    STAGE_TTFF_COLD,
+    STAGE_TTFF_WARM,
+    // AGPS reference location request of the GPS to the answer
+    STAGE_REF_LOCATION,
+    STAGE_COUNT
+  };
+
+  static const uint32_t kLatencyBuckets = 28;
+
+  static void AddLatency(Stage aStage, const mozilla::TimeDuration& aDuration);
+  static void AddLatencySince(Stage aStage, const mozilla::TimeStamp& aStart)
+  {
+    if (!aStart.IsNull()) {
+      AddLatency(aStage, mozilla::TimeStamp::Now() - aStart);
+    }
+  }
+
+  static void Snapshot(uint64_t (&aValues)[COUNTER_COUNT]);
+  static void GetLatencyHistogram(Stage aStage, uint32_t (&aBuckets)[kLatencyBuckets]);
+  static void Dump();
+
+  // As in Dump(), e.g. "records written"
+  static const char* CounterName(Counter aCounter);
+  static const char* StageName(Stage aStage);
+
+  // Main thread. Adds the counters and histograms to about:memory.
+  static void RegisterMemoryReporter();
+
+private:
+  typedef mozilla::Atomic<uint64_t, mozilla::Relaxed> CounterValue;
+  typedef mozilla::Atomic<uint32_t, mozilla::Relaxed> BucketValue;
+  static CounterValue sCounters[COUNTER_COUNT];
+  static BucketValue sLatency[STAGE_COUNT][kLatencyBuckets];
+};
+
+#endif
@@ -1,14 +1,20 @@
 #include "UploadStumbleRunnable.h"
 #include "StumblerLogging.h"
+#include "StumblerStats.h"
+#include "WriteStumbleOnThread.h"
 #include "mozilla/dom/Event.h"
 #include "nsIScriptSecurityManager.h"
 #include "nsIURLFormatter.h"
 #include "nsIVariant.h"
 #include "nsIXMLHttpRequest.h"
 #include "nsNetUtil.h"
+#include "prtime.h"
+#include <stdlib.h>
 
-UploadStumbleRunnable::UploadStumbleRunnable(const nsACString& aUploadData)
-: mUploadData(aUploadData)
+UploadStumbleRunnable::UploadStumbleRunnable(nsIInputStream* aUploadStream,
+                                             int64_t aUploadSize,
+                                             uint32_t aRecordCount)
+: mUploadStream(aUploadStream), mUploadSize(aUploadSize), mRecordCount(aRecordCount)
 {
 }
 
@@ -17,11 +23,27 @@ UploadStumbleRunnable::Run()
 {
   MOZ_ASSERT(NS_IsMainThread());
 
+  nsRefPtr<UploadEventListener> listener;
+  nsresult rv = Upload(getter_AddRefs(listener));
+  // The batch is released and the backoff applies, unless the listener
+  // already ended the upload.
+  if (NS_FAILED(rv) && (!listener || listener->MarkEnded())) {
+    STUMBLER_ERR("Upload could not be sent");
+    WriteStumbleOnThread::UploadEnded(StumbleUploadScheduler::FAILED, 0);
+  }
+  return rv;
+}
+
+nsresult
+UploadStumbleRunnable::Upload(UploadEventListener** aListener)
+{
   nsresult rv;
   nsCOMPtr<nsIWritableVariant> variant =
     do_CreateInstance("@mozilla.org/variant;1", &rv);
   NS_ENSURE_SUCCESS(rv, rv);
-  rv = variant->SetAsACString(mUploadData);
+  // XHR wraps the stream in a small buffered stream and reads it as the
+  // request goes out.
+  rv = variant->SetAsISupports(mUploadStream);
   NS_ENSURE_SUCCESS(rv, rv);
 
   nsCOMPtr<nsIXMLHttpRequest> xhr = do_CreateInstance(NS_XMLHTTPREQUEST_CONTRACTID, &rv);
@@ -57,7 +79,8 @@ UploadStumbleRunnable::Run()
   xhr->SetTimeout(60 * 1000);
 
   nsCOMPtr<EventTarget> target(do_QueryInterface(xhr));
-  nsCOMPtr<nsIDOMEventListener> listener = new UploadEventListener(xhr, mUploadData.Length());
+  nsRefPtr<UploadEventListener> listener = new UploadEventListener(xhr, mUploadSize, mRecordCount);
+  NS_ADDREF(*aListener = listener);
   rv = target->AddEventListener(NS_LITERAL_STRING("timeout"), listener, false);
   NS_ENSURE_SUCCESS(rv, rv);
   // loadend catches abort, load, and error
@@ -74,39 +97,96 @@ UploadStumbleRunnable::Run()
 
 NS_IMPL_ISUPPORTS(UploadEventListener, nsIDOMEventListener)
 
-UploadEventListener::UploadEventListener(nsCOMPtr<nsIXMLHttpRequest> aXHR, int64_t aFileSize)
-: mXHR(aXHR), mFileSize(aFileSize)
+UploadEventListener::UploadEventListener(nsCOMPtr<nsIXMLHttpRequest> aXHR, int64_t aFileSize,
+                                         uint32_t aRecordCount)
+: mXHR(aXHR), mFileSize(aFileSize), mRecordCount(aRecordCount)
+, mSendTime(mozilla::TimeStamp::Now()), mEnded(false)
 {
 }
 
+/*
+ Retry-After is either a number of seconds or an HTTP date. Returns the
+ delay in ms, or 0 if the header is missing or malformed.
+ */
+static int64_t
+ParseRetryAfterMs(const nsACString& aValue)
+{
+  if (aValue.IsEmpty()) {
+    return 0;
+  }
+
+  nsAutoCString value(aValue);
+  char* end = nullptr;
+  long long seconds = strtoll(value.get(), &end, 10);
+  if (end != value.get() && *end == '\0') {
+    return seconds > 0 ? seconds * PR_MSEC_PER_SEC : 0;
+  }
+
+  PRTime date;
+  if (PR_ParseTimeString(value.get(), true, &date) != PR_SUCCESS) {
+    return 0;
+  }
+  int64_t delayMs = (date - PR_Now()) / PR_USEC_PER_MSEC;
+  return delayMs > 0 ? delayMs : 0;
+}
+
+/*
+ loadend follows the event that ended the upload, and a failed Send() may
+ follow either; only the first may end it, or the next batch would be
+ acknowledged twice. Returns false if the upload already ended.
+ */
+bool
+UploadEventListener::MarkEnded()
+{
+  if (mEnded) {
+    return false;
+  }
+  mEnded = true;
+  return true;
+}
+
 NS_IMETHODIMP
 UploadEventListener::HandleEvent(nsIDOMEvent* aEvent)
 {
+  if (!MarkEnded()) {
+    return NS_OK;
+  }
+
   nsString type;
   if (NS_FAILED(aEvent->GetType(type))) {
     STUMBLER_ERR("Failed to get event type");
-    WriteStumbleOnThread::UploadEnded(false);
+    WriteStumbleOnThread::UploadEnded(StumbleUploadScheduler::FAILED, 0);
     return NS_ERROR_FAILURE;
   }
 
-  bool doDelete = false;
-  if (type.EqualsLiteral("load")) {
-    STUMBLER_DBG("Got load Event : size %lld", mFileSize);
-    // I suspect that the file upload is finish when we got load event.
-    // Will record the amount of upload and the time of upload
-    doDelete = true;
-  } else if (type.EqualsLiteral("error") && mXHR) {
-    STUMBLER_ERR("Upload Error");
-    uint32_t statusCode;
+  StumblerStats::AddLatencySince(StumblerStats::STAGE_UPLOAD, mSendTime);
+
+  StumbleUploadScheduler::Outcome outcome = StumbleUploadScheduler::FAILED;
+  int64_t retryAfterMs = 0;
+  // HTTP errors also end in a load event; only the status tells them apart.
+  if (type.EqualsLiteral("load") && mXHR) {
+    uint32_t statusCode = 0;
     mXHR->GetStatus(&statusCode);
-    if (400 == statusCode) {
-      doDelete = true;
+    outcome = StumbleUploadScheduler::OutcomeForStatus(statusCode);
+    STUMBLER_DBG("Got load Event : status %u size %lld", statusCode, mFileSize);
+
+    if (outcome == StumbleUploadScheduler::SUCCEEDED) {
+      StumblerStats::Add(StumblerStats::UPLOADS_SUCCEEDED);
+      StumblerStats::Add(StumblerStats::RECORDS_UPLOADED, mRecordCount);
+      StumblerStats::Add(StumblerStats::BYTES_UPLOADED, mFileSize);
+    } else {
+      STUMBLER_ERR("Upload Error, status %u", statusCode);
+      nsAutoCString retryAfter;
+      if (NS_SUCCEEDED(mXHR->GetResponseHeader(NS_LITERAL_CSTRING("Retry-After"),
+                                               retryAfter))) {
+        retryAfterMs = ParseRetryAfterMs(retryAfter);
+      }
     }
   } else {
-    STUMBLER_DBG("Receive %s Event", type.get());
+    STUMBLER_ERR("Upload ended with %s Event", NS_ConvertUTF16toUTF8(type).get());
   }
 
-  WriteStumbleOnThread::UploadEnded(doDelete);
+  WriteStumbleOnThread::UploadEnded(outcome, retryAfterMs);
 
   return NS_OK;
 }
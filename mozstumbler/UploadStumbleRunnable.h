@@ -2,38 +2,59 @@
 #define UPLOADSTUMBLERUNNABLE_H
 
 #include "nsIDOMEventListener.h"
+#include "mozilla/TimeStamp.h"
 
+class nsIInputStream;
 class nsIXMLHttpRequest;
+class UploadEventListener;
 
 /*
  This runnable is managed by WriteStumbleOnThread only, see that class
  for how this is scheduled.
+
+ The upload body is read from aUploadStream (the gzipped JSON export on
+ disk) as the request is sent, so the payload is never held in memory;
+ only the stream buffers are, whatever the size of the file.
+
+ If the request cannot be sent, the upload ends as FAILED, like a failed
+ request, so the batch is released and retried after the backoff.
  */
 class UploadStumbleRunnable final : public nsRunnable
 {
 public:
-  explicit UploadStumbleRunnable(const nsACString& aUploadData);
+  UploadStumbleRunnable(nsIInputStream* aUploadStream, int64_t aUploadSize,
+                        uint32_t aRecordCount);
 
   NS_IMETHOD Run() override;
 private:
   virtual ~UploadStumbleRunnable() {}
-  const nsCString mUploadData;
+  // Sets aListener once it is listening to the request.
+  nsresult Upload(UploadEventListener** aListener);
+  nsCOMPtr<nsIInputStream> mUploadStream;
+  int64_t mUploadSize;
+  uint32_t mRecordCount;
 };
 
 
 class UploadEventListener : public nsIDOMEventListener
 {
 public:
-  UploadEventListener(nsCOMPtr<nsIXMLHttpRequest> aXHR, int64_t aFileSize);
+  UploadEventListener(nsCOMPtr<nsIXMLHttpRequest> aXHR, int64_t aFileSize,
+                      uint32_t aRecordCount);
 
   /*interfaces for addref and release and queryinterface*/
   NS_DECL_ISUPPORTS
   NS_DECL_NSIDOMEVENTLISTENER
 
+  bool MarkEnded();
+
 protected:
   virtual ~UploadEventListener() {}
   nsCOMPtr<nsIXMLHttpRequest> mXHR;
   int64_t mFileSize;
+  uint32_t mRecordCount;
+  mozilla::TimeStamp mSendTime;
+  bool mEnded;
 };
 
 #endif
\ No newline at end of file
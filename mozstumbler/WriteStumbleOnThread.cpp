@@ -1,296 +1,511 @@
 #include "WriteStumbleOnThread.h"
+#include "StumbleDedupIndex.h"
+#include "StumbleExporter.h"
+#include "StumbleGeoIndex.h"
+#include "StumbleSegmentQueue.h"
+#include "StumblerIOThread.h"
 #include "StumblerLogging.h"
+#include "StumblerStats.h"
 #include "UploadStumbleRunnable.h"
+#include "mozilla/ClearOnShutdown.h"
+#include "mozilla/FloatingPoint.h"
 #include "nsDumpUtils.h"
-#include "nsGZFileWriter.h"
-#include "nsIFileStreams.h"
+#include "nsGeoPosition.h"
+#include "nsIGeolocationProvider.h"
 #include "nsIInputStream.h"
+#include "nsNetUtil.h"
 #include "nsPrintfCString.h"
+#include "nsProxyRelease.h"
 
-#define MAXFILESIZE_KB (15 * 1024)
 #define ONEDAY_IN_MSEC (24 * 60 * 60 * 1000)
-#define MAX_UPLOAD_ATTEMPTS 20
+// Records per upload batch; the size adapts between the bounds so that a
+// batch takes about TARGET_UPLOAD_SECONDS at the measured throughput,
+// well inside the 60 s request timeout.
+#define DEFAULT_UPLOAD_BATCH 100
+#define MIN_UPLOAD_BATCH 10
+#define MAX_UPLOAD_BATCH 1000
+#define TARGET_UPLOAD_SECONDS 15
+// Records waiting for the write thread; scans come every few seconds at
+// most, so this is only reached if the thread is stuck.
+#define MAX_QUEUED_RECORDS 64
 
 mozilla::Atomic<bool> WriteStumbleOnThread::sIsUploading(false);
-mozilla::Atomic<bool> WriteStumbleOnThread::sIsAlreadyRunning(false);
-WriteStumbleOnThread::UploadFreqGuard WriteStumbleOnThread::sUploadFreqGuard = {0};
-
-NS_NAMED_LITERAL_CSTRING(kOutputFileNameInProgress, "stumbles.json.gz");
-NS_NAMED_LITERAL_CSTRING(kOutputFileNameCompleted, "stumbles.done.json.gz");
+mozilla::Atomic<bool> WriteStumbleOnThread::sIsDrainScheduled(false);
+StumbleRecordQueue WriteStumbleOnThread::sRecordQueue(MAX_QUEUED_RECORDS);
+WriteStumbleOnThread::UploadBatch WriteStumbleOnThread::sUploadBatch;
+uint32_t WriteStumbleOnThread::sUploadBatchSize = DEFAULT_UPLOAD_BATCH;
+mozilla::StaticMutex WriteStumbleOnThread::sQueueMutex;
+mozilla::StaticRefPtr<StumbleSegmentQueue> WriteStumbleOnThread::sQueue;
+mozilla::StaticRefPtr<StumbleUploadScheduler> WriteStumbleOnThread::sUploadScheduler;
+mozilla::StaticRefPtr<StumbleDedupIndex> WriteStumbleOnThread::sDedupIndex;
+mozilla::StaticRefPtr<StumbleGeoIndex> WriteStumbleOnThread::sGeoIndex;
+
+NS_NAMED_LITERAL_CSTRING(kOutputFileNameUpload, "stumbles.upload.json.gz");
 NS_NAMED_LITERAL_CSTRING(kOutputDirName, "mozstumbler");
 
-void
-WriteStumbleOnThread::UploadEnded(bool deleteUploadFile)
+// Files written as JSON before the binary log was introduced
+NS_NAMED_LITERAL_CSTRING(kLegacyFileNameInProgress, "stumbles.json.gz");
+NS_NAMED_LITERAL_CSTRING(kLegacyFileNameCompleted, "stumbles.done.json.gz");
+
+static void
+RemoveStumbleFile(const nsACString& aName)
 {
-  if (!deleteUploadFile) {
-    sIsUploading = false;
-    return;
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = nsDumpUtils::OpenTempFile(aName, getter_AddRefs(file),
+                                          kOutputDirName, nsDumpUtils::CREATE);
+  if (!NS_FAILED(rv)) {
+    file->Remove(true);
+  }
+}
+
+/* static */ void
+WriteStumbleOnThread::AdaptUploadBatchSize(bool aSucceeded)
+{
+  sQueueMutex.AssertCurrentThreadOwns();
+
+  uint32_t size = sUploadBatchSize;
+  if (!aSucceeded) {
+    size /= 2;
+  } else {
+    double seconds = (mozilla::TimeStamp::Now() - sUploadBatch.mStartTime).ToSeconds();
+    if (seconds > 0 && sUploadBatch.mRecordCount) {
+      double recordsPerSecond = sUploadBatch.mRecordCount / seconds;
+      // Halfway to the target, so one fast or slow batch does not swing it
+      size = uint32_t((size + recordsPerSecond * TARGET_UPLOAD_SECONDS) / 2);
+    }
+  }
+  if (size < MIN_UPLOAD_BATCH) {
+    size = MIN_UPLOAD_BATCH;
+  } else if (size > MAX_UPLOAD_BATCH) {
+    size = MAX_UPLOAD_BATCH;
   }
+  if (size != sUploadBatchSize) {
+    STUMBLER_LOG("upload batch size %u -> %u", sUploadBatchSize, size);
+    sUploadBatchSize = size;
+  }
+}
 
-  class DeleteRunnable : public nsRunnable
+void
+WriteStumbleOnThread::UploadEnded(StumbleUploadScheduler::Outcome aOutcome,
+                                  int64_t aRetryAfterMs)
+{
+  class UploadEndedRunnable : public nsRunnable
   {
   public:
-    DeleteRunnable() {}
+    UploadEndedRunnable(StumbleUploadScheduler::Outcome aOutcome, int64_t aRetryAfterMs)
+      : mOutcome(aOutcome)
+      , mRetryAfterMs(aRetryAfterMs)
+    {}
 
     NS_IMETHODIMP
     Run() override
     {
-      nsCOMPtr<nsIFile> tmpFile;
-      nsresult rv = nsDumpUtils::OpenTempFile(kOutputFileNameCompleted,
-                                              getter_AddRefs(tmpFile),
-                                              kOutputDirName,
-                                              nsDumpUtils::CREATE);
-      if (!NS_FAILED(rv)) {
-        tmpFile->Remove(true);
+      bool hasMoreBatches = false;
+      {
+        mozilla::StaticMutexAutoLock lock(sQueueMutex);
+        if (sQueue) {
+          bool acknowledged = mOutcome != StumbleUploadScheduler::FAILED;
+          if (mOutcome == StumbleUploadScheduler::REJECTED) {
+            STUMBLER_ERR("Server rejected records %u-%u, dropping them",
+                         sUploadBatch.mFirstRecord,
+                         sUploadBatch.mFirstRecord + sUploadBatch.mRecordCount - 1);
+          }
+          sUploadScheduler->OnUploadEnded(PR_Now() / PR_USEC_PER_MSEC, mOutcome,
+                                          mRetryAfterMs);
+          if (!acknowledged) {
+            sQueue->Unpin();
+          } else if (sUploadBatch.mIsLast) {
+            sQueue->RemovePinned();
+          } else {
+            // The next upload resumes after this batch, even after a reboot
+            sQueue->SetPinnedProgress(sUploadBatch.mFirstRecord +
+                                      sUploadBatch.mRecordCount);
+            sQueue->Unpin();
+            hasMoreBatches = true;
+          }
+          AdaptUploadBatchSize(mOutcome == StumbleUploadScheduler::SUCCEEDED);
+        }
       }
-      // critically, this sets this flag to false so writing can happen again
+      RemoveStumbleFile(kOutputFileNameUpload);
+      StumblerStats::Dump();
+      // critically, this sets this flag to false so the next batch
+      // can be uploaded
       sIsUploading = false;
+      if (hasMoreBatches) {
+        // The drain runnable starts the next batch without waiting for
+        // the next record.
+        ScheduleDrain();
+      }
       return NS_OK;
     }
 
   private:
-    ~DeleteRunnable() {}
+    ~UploadEndedRunnable() {}
+    StumbleUploadScheduler::Outcome mOutcome;
+    int64_t mRetryAfterMs;
   };
 
-  nsCOMPtr<nsIEventTarget> target = do_GetService(NS_STREAMTRANSPORTSERVICE_CONTRACTID);
-  MOZ_ASSERT(target);
-  nsCOMPtr<nsIRunnable> event = new DeleteRunnable();
-  target->Dispatch(event, NS_DISPATCH_NORMAL);
+  // Never refused: sIsUploading stays set until this runs.
+  nsCOMPtr<nsIRunnable> event = new UploadEndedRunnable(aOutcome, aRetryAfterMs);
+  StumblerIOThread::Dispatch(event);
 }
 
 void
-WriteStumbleOnThread::WriteJSON(Partition aPart)
+WriteStumbleOnThread::FinishWriter()
 {
-  MOZ_ASSERT(!NS_IsMainThread());
+  class FinishWriterRunnable : public nsRunnable
+  {
+  public:
+    FinishWriterRunnable() {}
 
-  nsCOMPtr<nsIFile> tmpFile;
-  nsresult rv;
-  rv = nsDumpUtils::OpenTempFile(kOutputFileNameInProgress, getter_AddRefs(tmpFile),
-                                 kOutputDirName, nsDumpUtils::CREATE);
-  if (NS_WARN_IF(NS_FAILED(rv))) {
-    STUMBLER_ERR("Open a file for stumble failed");
-    return;
-  }
+    NS_IMETHODIMP
+    Run() override
+    {
+      mozilla::StaticMutexAutoLock lock(sQueueMutex);
+      if (sQueue) {
+        // Syncs the head log; the next write maps it again.
+        nsresult rv = sQueue->FinishHead();
+        if (NS_WARN_IF(NS_FAILED(rv))) {
+          STUMBLER_ERR("Closing the stumble log failed");
+        }
+      }
+      if (sDedupIndex) {
+        sDedupIndex->Save();
+      }
+      if (sGeoIndex) {
+        sGeoIndex->Save();
+      }
+      StumblerStats::Dump();
+      return NS_OK;
+    }
 
-  nsRefPtr<nsGZFileWriter> gzWriter = new nsGZFileWriter(nsGZFileWriter::Append);
-  rv = gzWriter->Init(tmpFile);
-  if (NS_WARN_IF(NS_FAILED(rv))) {
-    STUMBLER_ERR("gzWriter init failed");
-    return;
-  }
+  private:
+    ~FinishWriterRunnable() {}
+  };
 
-  /*
-   The json format is like below.
-   {items:[
-   {item},
-   {item},
-   {item}
-   ]}
-   */
-
-  // Need to add "]}" after the last item
-  if (aPart == Partition::End) {
-    gzWriter->Write("]}");
-    rv = gzWriter->Finish();
-    if (NS_WARN_IF(NS_FAILED(rv))) {
-      STUMBLER_ERR("gzWriter finish failed");
-    }
+  nsCOMPtr<nsIRunnable> event = new FinishWriterRunnable();
+  StumblerIOThread::Dispatch(event);
+}
 
-    nsCOMPtr<nsIFile> targetFile;
-    nsresult rv = nsDumpUtils::OpenTempFile(kOutputFileNameCompleted, getter_AddRefs(targetFile),
-                                            kOutputDirName, nsDumpUtils::CREATE);
-    nsAutoString targetFilename;
-    rv = targetFile->GetLeafName(targetFilename);
-    if (NS_WARN_IF(NS_FAILED(rv))) {
-      STUMBLER_ERR("Get Filename failed");
-      return;
-    }
-    rv = targetFile->Remove(true);
-    if (NS_WARN_IF(NS_FAILED(rv))) {
-      STUMBLER_ERR("Remove File failed");
-      return;
-    }
-    // Rename tmpfile
-    rv = tmpFile->MoveTo(/* directory */ nullptr, targetFilename);
-    if (NS_WARN_IF(NS_FAILED(rv))) {
-      STUMBLER_ERR("Rename File failed");
-      return;
+/*
+ Releases the queue and the indexes when XPCOM shuts down, after the I/O
+ thread has stopped. They are created on that thread, and ClearOnShutdown
+ is main thread only.
+ */
+/* static */ void
+WriteStumbleOnThread::ClearStateOnShutdown()
+{
+  class ClearOnShutdownRunnable : public nsRunnable
+  {
+  public:
+    NS_IMETHODIMP
+    Run() override
+    {
+      static bool sRegistered = false;
+      if (!sRegistered) {
+        sRegistered = true;
+        mozilla::ClearOnShutdown(&sQueue);
+        mozilla::ClearOnShutdown(&sUploadScheduler);
+        mozilla::ClearOnShutdown(&sDedupIndex);
+        mozilla::ClearOnShutdown(&sGeoIndex);
+      }
+      return NS_OK;
     }
-    return;
-  }
 
-  // Need to add "{items:[" before the first item
-  if (aPart == Partition::Begining) {
-    gzWriter->Write("{\"items\":[{");
-  } else if (aPart == Partition::Middle) {
-    gzWriter->Write(",{");
-  }
-  gzWriter->Write(mDesc.get());
-  //  one item is end with '}' (e.g. {item})
-  gzWriter->Write("}");
-  rv = gzWriter->Finish();
-  if (NS_WARN_IF(NS_FAILED(rv))) {
-    STUMBLER_ERR("gzWriter finish failed");
-  }
+  private:
+    ~ClearOnShutdownRunnable() {}
+  };
 
-  // check if it is the end of this file
-  int64_t fileSize = 0;
-  rv = tmpFile->GetFileSize(&fileSize);
-  if (NS_WARN_IF(NS_FAILED(rv))) {
-    STUMBLER_ERR("GetFileSize failed");
-    return;
-  }
-  if (fileSize >= MAXFILESIZE_KB) {
-    WriteJSON(Partition::End);
-    return;
-  }
+  NS_DispatchToMainThread(new ClearOnShutdownRunnable());
 }
 
-WriteStumbleOnThread::Partition
-WriteStumbleOnThread::GetWritePosition()
+/* static */ nsresult
+WriteStumbleOnThread::EnsureQueue()
 {
   MOZ_ASSERT(!NS_IsMainThread());
+  sQueueMutex.AssertCurrentThreadOwns();
 
-  nsCOMPtr<nsIFile> tmpFile;
-  nsresult rv = nsDumpUtils::OpenTempFile(kOutputFileNameInProgress, getter_AddRefs(tmpFile),
-                                          kOutputDirName, nsDumpUtils::CREATE);
+  if (sQueue) {
+    return NS_OK;
+  }
+
+  RemoveStumbleFile(kLegacyFileNameInProgress);
+  RemoveStumbleFile(kLegacyFileNameCompleted);
+  // A JSON export left over from an upload that never ended
+  RemoveStumbleFile(kOutputFileNameUpload);
+
+  nsRefPtr<StumbleSegmentQueue> queue = new StumbleSegmentQueue();
+  nsresult rv = queue->Init();
   if (NS_WARN_IF(NS_FAILED(rv))) {
-    STUMBLER_ERR("Open a file for stumble failed");
-    return Partition::Unknown;
+    STUMBLER_ERR("Segment queue init failed");
+    return rv;
   }
+  sQueue = queue;
 
-  int64_t fileSize = 0;
-  rv = tmpFile->GetFileSize(&fileSize);
+  nsRefPtr<StumbleUploadScheduler> scheduler = new StumbleUploadScheduler(PR_Now());
+  rv = scheduler->Load(PR_Now() / PR_USEC_PER_MSEC);
   if (NS_WARN_IF(NS_FAILED(rv))) {
-    STUMBLER_ERR("GetFileSize failed");
-    return Partition::Unknown;
+    STUMBLER_ERR("Upload state load failed, starting without backoff");
   }
+  sUploadScheduler = scheduler;
 
-  if (fileSize == 0) {
-    return Partition::Begining;
-  } else if (fileSize >= MAXFILESIZE_KB) {
-    return Partition::End;
+  nsRefPtr<StumbleDedupIndex> dedupIndex = new StumbleDedupIndex();
+  rv = dedupIndex->Load();
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    STUMBLER_ERR("Dedup index load failed, writing every record");
   } else {
-    return Partition::Middle;
+    sDedupIndex = dedupIndex;
   }
+
+  nsRefPtr<StumbleGeoIndex> geoIndex = new StumbleGeoIndex();
+  rv = geoIndex->Load();
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    STUMBLER_ERR("Geo index load failed, no offline positions");
+  } else {
+    sGeoIndex = geoIndex;
+  }
+  ClearStateOnShutdown();
+  return NS_OK;
 }
 
-NS_IMETHODIMP
-WriteStumbleOnThread::Run()
+void
+WriteStumbleOnThread::Locate(const StumbleRecord& aScan, nsIGeolocationUpdate* aCallback)
 {
-  MOZ_ASSERT(!NS_IsMainThread());
+  MOZ_ASSERT(NS_IsMainThread());
 
-  bool b = sIsAlreadyRunning.exchange(true);
-  if (b) {
-    return NS_OK;
-  }
+  class LocateResultRunnable : public nsRunnable
+  {
+  public:
+    LocateResultRunnable(const nsMainThreadPtrHandle<nsIGeolocationUpdate>& aCallback,
+                         const StumbleGeoIndex::Estimate& aEstimate)
+      : mCallback(aCallback)
+      , mEstimate(aEstimate)
+    {}
 
-  STUMBLER_DBG("In WriteStumbleOnThread\n");
+    NS_IMETHODIMP
+    Run() override
+    {
+      MOZ_ASSERT(NS_IsMainThread());
+      nsRefPtr<nsGeoPosition> position =
+        new nsGeoPosition(mEstimate.mLatitude, mEstimate.mLongitude,
+                          mozilla::UnspecifiedNaN<double>(), mEstimate.mAccuracy,
+                          mozilla::UnspecifiedNaN<double>(),
+                          mozilla::UnspecifiedNaN<double>(),
+                          mozilla::UnspecifiedNaN<double>(),
+                          PR_Now() / PR_USEC_PER_MSEC);
+      mCallback->Update(position);
+      return NS_OK;
+    }
 
-  UploadFileStatus status = GetUploadFileStatus();
+  private:
+    ~LocateResultRunnable() {}
+    nsMainThreadPtrHandle<nsIGeolocationUpdate> mCallback;
+    StumbleGeoIndex::Estimate mEstimate;
+  };
 
-  if (UploadFileStatus::NoFile != status) {
-    if (UploadFileStatus::ExistsAndReadyToUpload == status) {
-      Upload();
-    }
-  } else {
-    Partition partition = GetWritePosition();
-    if (partition == Partition::Unknown) {
-      STUMBLER_ERR("GetWritePosition failed, skip once");
-    } else {
-      WriteJSON(partition);
+  class LocateRunnable : public nsRunnable
+  {
+  public:
+    LocateRunnable(const StumbleRecord& aScan, nsIGeolocationUpdate* aCallback)
+      : mScan(aScan)
+      , mCallback(new nsMainThreadPtrHolder<nsIGeolocationUpdate>(aCallback))
+    {}
+
+    NS_IMETHODIMP
+    Run() override
+    {
+      mozilla::TimeStamp start = mozilla::TimeStamp::Now();
+      ParseRawWifi(mScan);
+      StumbleGeoIndex::Estimate estimate;
+      bool found;
+      {
+        mozilla::StaticMutexAutoLock lock(sQueueMutex);
+        if (NS_FAILED(EnsureQueue()) || !sGeoIndex) {
+          return NS_OK;
+        }
+        found = sGeoIndex->Locate(mScan, &estimate);
+      }
+      if (!found) {
+        STUMBLER_DBG("No known AP or cell in %u APs and %u cells\n",
+                     mScan.mWifi.Length(), mScan.mCells.Length());
+        return NS_OK;
+      }
+      STUMBLER_DBG("Located from %u APs and %u cells, accuracy %.0f m, in %.0f us\n",
+                   estimate.mWifiMatches, estimate.mCellMatches, estimate.mAccuracy,
+                   (mozilla::TimeStamp::Now() - start).ToMicroseconds());
+      nsCOMPtr<nsIRunnable> result = new LocateResultRunnable(mCallback, estimate);
+      NS_DispatchToMainThread(result);
+      return NS_OK;
     }
-  }
 
-  sIsAlreadyRunning = false;
-  return NS_OK;
+  private:
+    ~LocateRunnable() {}
+    StumbleRecord mScan;
+    nsMainThreadPtrHandle<nsIGeolocationUpdate> mCallback;
+  };
+
+  nsCOMPtr<nsIRunnable> event = new LocateRunnable(aScan, aCallback);
+  StumblerIOThread::TryDispatch(event);
 }
 
+/* static */ void
+WriteStumbleOnThread::Write(const StumbleRecord& aRecord)
+{
+  if (!sRecordQueue.Push(aRecord)) {
+    StumbleRecordQueue::Stats stats;
+    sRecordQueue.GetStats(&stats);
+    STUMBLER_ERR("Record queue full, dropped %llu records so far",
+                 (unsigned long long)stats.mDropped);
+    return;
+  }
+  StumblerStats::Add(StumblerStats::RECORDS_QUEUED);
+  ScheduleDrain();
+}
 
-/*
- If the upload file exists, then check if it is one day old.
- • if it is a day old -> ExistsAndReadyToUpload
- • if it is less than the current day old -> Exists
- • otherwise -> NoFile
- 
- The Exists case means that the upload and the stumbling is rate limited
- per-day to the size of the one file.
- */
-WriteStumbleOnThread::UploadFileStatus
-WriteStumbleOnThread::GetUploadFileStatus()
+/* static */ void
+WriteStumbleOnThread::ScheduleDrain()
 {
-  nsCOMPtr<nsIFile> tmpFile;
-  nsresult rv = nsDumpUtils::OpenTempFile(kOutputFileNameCompleted, getter_AddRefs(tmpFile),
-                                          kOutputDirName, nsDumpUtils::CREATE);
-  int64_t fileSize;
-  rv = tmpFile->GetFileSize(&fileSize);
+  if (sIsDrainScheduled.exchange(true)) {
+    // The pending drain will pick up the record
+    return;
+  }
+
+  nsCOMPtr<nsIRunnable> event = new WriteStumbleOnThread();
+  nsresult rv = StumblerIOThread::TryDispatch(event);
   if (NS_WARN_IF(NS_FAILED(rv))) {
-    STUMBLER_ERR("GetFileSize failed");
-    return UploadFileStatus::NoFile;
+    // The records stay queued for the next attempt
+    sIsDrainScheduled = false;
   }
-  if (fileSize <= 0) {
-    tmpFile->Remove(true);
-    return UploadFileStatus::NoFile;
+}
+
+NS_IMETHODIMP
+WriteStumbleOnThread::Run()
+{
+  MOZ_ASSERT(!NS_IsMainThread());
+
+  STUMBLER_DBG("In WriteStumbleOnThread\n");
+
+  {
+    mozilla::StaticMutexAutoLock lock(sQueueMutex);
+    nsresult rv = EnsureQueue();
+    if (NS_SUCCEEDED(rv)) {
+      if (!sIsUploading.exchange(true)) {
+        if (!Upload()) {
+          sQueue->Unpin();
+          sIsUploading = false;
+        }
+      }
+    }
+
+    uint32_t count = sRecordQueue.Drain([&rv](StumbleRecord& aRecord,
+                                              const mozilla::TimeStamp& aPushTime) {
+      if (NS_FAILED(rv)) {
+        return;
+      }
+      mozilla::TimeStamp start = mozilla::TimeStamp::Now();
+      StumblerStats::AddLatency(StumblerStats::STAGE_QUEUE_WAIT, start - aPushTime);
+      ParseRawWifi(aRecord);
+      if (sGeoIndex) {
+        // Records the dedup drops still refine the positions.
+        sGeoIndex->Add(aRecord);
+      }
+      if (sDedupIndex && !sDedupIndex->AddIfNovel(aRecord)) {
+        StumblerStats::Add(StumblerStats::RECORDS_DEDUPED);
+        StumblerStats::AddLatencySince(StumblerStats::STAGE_WRITE, start);
+        return;
+      }
+      nsresult appendRv = sQueue->Append(aRecord);
+      if (NS_WARN_IF(NS_FAILED(appendRv))) {
+        STUMBLER_ERR("Append failed, skip once");
+      }
+      StumblerStats::AddLatencySince(StumblerStats::STAGE_WRITE, start);
+    });
+
+    StumbleRecordQueue::Stats stats;
+    sRecordQueue.GetStats(&stats);
+    STUMBLER_DBG("Wrote batch of %u, depth %u (max %u), max batch %u, dropped %llu\n",
+                 count, stats.mDepth, stats.mMaxDepth, stats.mMaxBatchSize,
+                 (unsigned long long)stats.mDropped);
   }
 
-  PRTime lastModifiedTime;
-  tmpFile->GetLastModifiedTime(&lastModifiedTime);
-  if ((PR_Now() / PR_USEC_PER_MSEC) - lastModifiedTime >= ONEDAY_IN_MSEC) {
-    return UploadFileStatus::ExistsAndReadyToUpload;
+  sIsDrainScheduled = false;
+  // A record pushed after the drain finished but before the flag was
+  // cleared would otherwise wait for the next scan.
+  if (!sRecordQueue.IsEmpty()) {
+    ScheduleDrain();
   }
-  return UploadFileStatus::Exists;
+  return NS_OK;
 }
 
-void
+/*
+ Uploads the next batch of the oldest sealed segment once it is a day
+ old. Returns true if an upload was dispatched; UploadEnded() is then
+ called when it is done.
+ */
+bool
 WriteStumbleOnThread::Upload()
 {
   MOZ_ASSERT(!NS_IsMainThread());
+  sQueueMutex.AssertCurrentThreadOwns();
+
+  uint32_t seq;
+  uint32_t uploadedRecords;
+  nsCOMPtr<nsIFile> segmentFile;
+  if (!sQueue->GetUploadCandidate(ONEDAY_IN_MSEC, &seq, getter_AddRefs(segmentFile),
+                                  &uploadedRecords)) {
+    return false;
+  }
 
-  bool b = sIsUploading.exchange(true);
-  if (b) {
-    return;
+  if (!sUploadScheduler->CanUpload(PR_Now() / PR_USEC_PER_MSEC)) {
+    STUMBLER_DBG("Upload backing off until %lld\n", sUploadScheduler->NextAttemptMs());
+    return false;
   }
 
-  time_t seconds = time(0);
-  int day = seconds / (60 * 60 * 24);
+  STUMBLER_LOG("uploading segment %u from record %u", seq, uploadedRecords);
 
-  if (sUploadFreqGuard.daySinceEpoch < day) {
-    sUploadFreqGuard.daySinceEpoch = day;
-    sUploadFreqGuard.attempts = 0;
+  nsCOMPtr<nsIFile> jsonFile;
+  nsresult rv = nsDumpUtils::OpenTempFile(kOutputFileNameUpload, getter_AddRefs(jsonFile),
+                                          kOutputDirName, nsDumpUtils::CREATE);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    return false;
   }
-
-  sUploadFreqGuard.attempts++;
-  if (sUploadFreqGuard.attempts > MAX_UPLOAD_ATTEMPTS) {
-    STUMBLER_ERR("Too many upload attempts today");
-    return;
+  uint32_t recordCount;
+  bool isLast;
+  rv = ExportStumbleLogAsJSON(segmentFile, sQueue->Dictionary(), jsonFile,
+                              uploadedRecords, sUploadBatchSize, &recordCount, &isLast);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    STUMBLER_ERR("Export to JSON failed");
+    return false;
+  }
+  STUMBLER_LOG("exported %u records", recordCount);
+  if (!recordCount) {
+    // Every record was uploaded, but the segment was not removed
+    sQueue->RemovePinned();
+    return false;
   }
 
-  nsCOMPtr<nsIFile> tmpFile;
-  nsresult rv = nsDumpUtils::OpenTempFile(kOutputFileNameCompleted, getter_AddRefs(tmpFile),
-                                          kOutputDirName, nsDumpUtils::CREATE);
   int64_t fileSize;
-  rv = tmpFile->GetFileSize(&fileSize);
+  rv = jsonFile->GetFileSize(&fileSize);
   if (NS_WARN_IF(NS_FAILED(rv))) {
     STUMBLER_ERR("GetFileSize failed");
-    sIsUploading = false;
-    return;
+    return false;
   }
   STUMBLER_LOG("size : %lld", fileSize);
-  if (fileSize <= 0) {
-    sIsUploading = false;
-    return;
-  }
 
-  // prepare json into nsIInputStream
+  // The file is opened here, off the main thread, and streamed to the
+  // network by the uploader without being read into memory.
   nsCOMPtr<nsIInputStream> inStream;
-  rv = NS_NewLocalFileInputStream(getter_AddRefs(inStream), tmpFile, -1, -1,
-                                  nsIFileInputStream::DEFER_OPEN);
-  NS_ENSURE_TRUE_VOID(inStream);
-
-  nsAutoCString bufStr;
-  rv = NS_ReadInputStreamToString(inStream, bufStr, fileSize);
-  NS_ENSURE_SUCCESS_VOID(rv);
-
-  nsCOMPtr<nsIRunnable> uploader = new UploadStumbleRunnable(bufStr);
-  NS_DispatchToMainThread(uploader);
+  rv = NS_NewLocalFileInputStream(getter_AddRefs(inStream), jsonFile);
+  NS_ENSURE_SUCCESS(rv, false);
+
+  sUploadBatch.mFirstRecord = uploadedRecords;
+  sUploadBatch.mRecordCount = recordCount;
+  sUploadBatch.mIsLast = isLast;
+  sUploadBatch.mStartTime = mozilla::TimeStamp::Now();
+
+  nsCOMPtr<nsIRunnable> uploader = new UploadStumbleRunnable(inStream, fileSize, recordCount);
+  rv = NS_DispatchToMainThread(uploader);
+  NS_ENSURE_SUCCESS(rv, false);
+  StumblerStats::Add(StumblerStats::UPLOADS_STARTED);
+  return true;
 }
@@ -2,76 +2,102 @@
 #define WriteStumbleOnThread_H
 
 #include "mozilla/Atomics.h"
+#include "mozilla/StaticMutex.h"
+#include "mozilla/StaticPtr.h"
+#include "nsThreadUtils.h"
+#include "StumbleRecordQueue.h"
+#include "StumbleUploadScheduler.h"
+
+class nsIGeolocationUpdate;
+class StumbleDedupIndex;
+class StumbleGeoIndex;
+class StumbleSegmentQueue;
 
 /*
  This class is the entry point to stumbling, in that it 
- receives the location+cell+wifi string and writes it 
- to disk, or instead, it calls UploadStumbleRunnable
- to upload the data.
+ receives the location+cell+wifi record and appends it
+ to disk in binary form, and when a sealed part of the log
+ is ready, it converts it to JSON and calls
+ UploadStumbleRunnable to upload the data.
  
- Writes will happen until the file is a max size, then stop.
- Uploads will happen only when the file is one day old.
- The purpose of these decisions is to have very simple rate-limiting
- on the writes, as well as the uploads.
-
- There is only one file active; it is either being used for writing,
- or for uploading. If the file is ready for uploading, no further
- writes will take place until this file has been uploaded.
- This can mean writing might not take place for days until the uploaded
- file is processed. This is correct by-design.
+ The log is a queue of segment files (see StumbleSegmentQueue).
+ Records always go to the head segment, so writing continues
+ while an upload is pending. Uploads take the oldest sealed
+ segment, once it is one day old. The queue has a byte budget;
+ when it is exceeded the oldest segments are dropped. The
+ purpose of these decisions is to have very simple rate-limiting
+ on the uploads, and bounded disk use.
 
  A notable limitation is that the upload is triggered by a location event,
  this is used as an arbitrary and simple trigger. In future, there are
  better events that can be used, such as detecting network activity.
  
- This thread is guarded so that only one instance is active (see the 
- mozilla::Atomics used for this).
+ Write() can be called from any thread; it pushes the record onto a
+ lock-free queue (see StumbleRecordQueue) and schedules this runnable
+ on the stumbler I/O thread (see StumblerIOThread) unless one is
+ already scheduled. The runnable drains every queued record in one
+ batch, so records are never dropped because a write is in progress,
+ and there is only ever one consumer of the queue.
  */
 class WriteStumbleOnThread : public nsRunnable
 {
 public:
-  explicit WriteStumbleOnThread(const nsCString& aDesc)
-  : mDesc(aDesc)
-  {}
+  static void Write(const StumbleRecord& aRecord);
 
   NS_IMETHODIMP Run() override;
 
-  static void UploadEnded(bool deleteUploadFile);
-
-private:
+  // The batch is dropped unless aOutcome is FAILED. aRetryAfterMs is the
+  // Retry-After of the response, or 0.
+  static void UploadEnded(StumbleUploadScheduler::Outcome aOutcome,
+                          int64_t aRetryAfterMs);
 
-  enum class Partition {
-    Begining,
-    Middle,
-    End,
-    Unknown
-  };
+  // Sync and close the head log, e.g. when the GPS is shut down.
+  static void FinishWriter();
 
-  enum class UploadFileStatus {
-    NoFile, Exists, ExistsAndReadyToUpload
-  };
+  // Locates the wifi and cells of aScan (which has no position) with
+  // the index of past stumbles, off the main thread, and passes the
+  // position to aCallback on the main thread. Nothing is passed if no
+  // transmitter is known.
+  static void Locate(const StumbleRecord& aScan, nsIGeolocationUpdate* aCallback);
 
+private:
+  WriteStumbleOnThread() {}
   ~WriteStumbleOnThread() {}
 
-  Partition GetWritePosition();
-  UploadFileStatus GetUploadFileStatus();
-  void WriteJSON(Partition aPart);
-  void Upload();
-  
-  nsCString mDesc;
+  static void ScheduleDrain();
+  static nsresult EnsureQueue();
+  static void ClearStateOnShutdown();
+  bool Upload();
+  static void AdaptUploadBatchSize(bool aSucceeded);
 
-  // Don't write while uploading is happening
+  // Only one batch is uploaded at a time
   static mozilla::Atomic<bool> sIsUploading;
-  // Only run one instance of this
-  static mozilla::Atomic<bool> sIsAlreadyRunning;
+  // Set while a drain runnable is pending or running
+  static mozilla::Atomic<bool> sIsDrainScheduled;
+  static StumbleRecordQueue sRecordQueue;
 
-  // Limit the upload attempts per day. If the device is rebooted
-  // this resets the allowed attempts, which is acceptable.
-  struct UploadFreqGuard {
-    int attempts;
-    int daySinceEpoch;
+  // Segments are uploaded in batches of records; see StumbleSegmentQueue
+  // for how the progress is kept. Guarded by sQueueMutex.
+  struct UploadBatch {
+    uint32_t mFirstRecord;
+    uint32_t mRecordCount;
+    bool mIsLast;
+    mozilla::TimeStamp mStartTime;
   };
-  static UploadFreqGuard sUploadFreqGuard;
+  static UploadBatch sUploadBatch;
+  // Records per batch, adapted to the measured throughput
+  static uint32_t sUploadBatchSize;
+
+  // The head segment stays open between records, see StumbleAppendLog.
+  // The lock is only contended by FinishWriter() and UploadEnded().
+  // It also guards the upload batch and scheduler.
+  static mozilla::StaticMutex sQueueMutex;
+  static mozilla::StaticRefPtr<StumbleSegmentQueue> sQueue;
+  static mozilla::StaticRefPtr<StumbleUploadScheduler> sUploadScheduler;
+  // Null if it could not be loaded; records are then all written.
+  static mozilla::StaticRefPtr<StumbleDedupIndex> sDedupIndex;
+  // Every record with a position is added; null if it could not be loaded.
+  static mozilla::StaticRefPtr<StumbleGeoIndex> sGeoIndex;
 
 };
 
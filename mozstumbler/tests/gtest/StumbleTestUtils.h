@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef StumbleTestUtils_H
+#define StumbleTestUtils_H
+
+#include "StumbleGZReader.h"
+#include "StumbleRecord.h"
+#include "nsCOMPtr.h"
+#include "nsDumpUtils.h"
+#include "nsICellInfo.h"
+#include "nsIFile.h"
+#include "nsString.h"
+
+/*
+ The stumbler keeps its files in the "mozstumbler" temporary directory;
+ tests that write there start and end with it removed.
+ */
+inline void
+RemoveStumblerDir()
+{
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = nsDumpUtils::OpenTempFile(NS_LITERAL_CSTRING("stumbles.manifest"),
+                                          getter_AddRefs(file),
+                                          NS_LITERAL_CSTRING("mozstumbler"),
+                                          nsDumpUtils::CREATE);
+  if (NS_FAILED(rv)) {
+    return;
+  }
+  nsCOMPtr<nsIFile> dir;
+  rv = file->GetParent(getter_AddRefs(dir));
+  if (NS_SUCCEEDED(rv)) {
+    dir->Remove(true);
+  }
+}
+
+inline nsresult
+GetStumblerTestFile(const char* aName, nsIFile** aFile)
+{
+  return nsDumpUtils::OpenTempFile(nsDependentCString(aName), aFile,
+                                   NS_LITERAL_CSTRING("mozstumbler"),
+                                   nsDumpUtils::CREATE);
+}
+
+/*
+ A record as a walk along a street would make it: aIndex seconds in,
+ one LTE cell and aWifiCount APs, some of which change every record.
+ */
+inline void
+MakeStumbleRecord(StumbleRecord& aRecord, uint32_t aIndex, uint32_t aWifiCount = 12)
+{
+  aRecord.Clear();
+  aRecord.mTimestamp = 1444444444000 + int64_t(aIndex) * 1000;
+  aRecord.mLatitude = 37.3861 + aIndex * 1e-5;
+  aRecord.mLongitude = -122.0839 + aIndex * 7e-6;
+  aRecord.mAccuracy = 8 + aIndex % 5;
+  aRecord.mSpeed = 1.4;
+
+  StumbleCell* cell = aRecord.mCells.AppendElement();
+  cell->mType = nsICellInfo::CELL_INFO_TYPE_LTE;
+  cell->mRegistered = true;
+  cell->mMcc = 310;
+  cell->mMnc = 410;
+  cell->mLac = 7033;
+  cell->mCid = 123456789 + aIndex / 60;
+  cell->mPsc = 301;
+  cell->mSignalDbm = -90 - int32_t(aIndex % 15);
+
+  aRecord.mHasWifi = true;
+  for (uint32_t i = 0; i < aWifiCount; i++) {
+    StumbleWifi* ap = aRecord.mWifi.AppendElement();
+    // Every 20 records a quarter of the APs go out of range
+    uint32_t block = (aIndex + i * 5) / 20;
+    ap->mBssid = 0x0011220000ULL + uint64_t(block) * 0x1000 + i;
+    ap->mSignal = 40 + (aIndex * 7 + i * 3) % 50;
+  }
+}
+
+// The decompressed content of a gzip file, e.g. an upload batch
+inline nsresult
+ReadGZipFile(nsIFile* aFile, nsACString& aOut)
+{
+  StumbleGZReader reader;
+  nsresult rv = reader.Open(aFile, nullptr);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  char buf[4096];
+  uint32_t bytesRead;
+  do {
+    rv = reader.Read(buf, sizeof(buf), &bytesRead);
+    NS_ENSURE_SUCCESS(rv, rv);
+    aOut.Append(buf, bytesRead);
+  } while (bytesRead);
+  return reader.IsComplete() ? NS_OK : NS_ERROR_FILE_CORRUPTED;
+}
+
+#endif
@@ -0,0 +1,271 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "LocationFusionFilter.h"
+#include "StumblerGeodesy.h"
+#include "mozilla/FloatingPoint.h"
+#include "mozilla/TimeStamp.h"
+#include "nsTArray.h"
+#include <math.h>
+#include <stdio.h>
+
+using namespace mozilla;
+
+static const int64_t kTraceStartMs = 1444444444000;
+static const double kTraceMetersPerDegree = M_PI / 180 * kGeoEarthRadiusMeters;
+
+// Deterministic, so a failure can be reproduced.
+class TraceRandom
+{
+public:
+  TraceRandom() : mState(7) {}
+
+  // Uniform in [0, 1)
+  double Uniform()
+  {
+    mState = mState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (mState >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  // Standard normal, by Box-Muller
+  double Normal()
+  {
+    double u = 1 - Uniform();
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * Uniform());
+  }
+
+private:
+  uint64_t mState;
+};
+
+/*
+ Two hours of walking, driving and stopping, with a turn every 90 s. The
+ GPS reports at 1 Hz with 5 m of noise, but is out 3 minutes in every 10.
+ The network reports every 10 s with an error of about its 50 to 150 m
+ accuracy, and 3% of its positions are 2 km off.
+ */
+struct TracePoint
+{
+  int64_t mTime;
+  // Where the device really is
+  double mLatitude;
+  double mLongitude;
+  double mSpeed;
+  double mHeading;
+  bool mHasGps;
+  double mGpsLatitude;
+  double mGpsLongitude;
+  bool mHasNetwork;
+  double mNetworkLatitude;
+  double mNetworkLongitude;
+  double mNetworkAccuracy;
+};
+
+static void
+MakeFusionTrace(nsTArray<TracePoint>& aTrace)
+{
+  TraceRandom random;
+  double lat = 52.5;
+  double lon = 13.4;
+  double heading = 30;
+  double speed = 0;
+  for (uint32_t t = 0; t < 7200; t++) {
+    static const double kPhaseSpeeds[] = { 1.4, 12, 0, 20 };
+    speed += (kPhaseSpeeds[(t / 300) % 4] - speed) * 0.1;
+    if (t % 90 == 0) {
+      heading = fmod(heading + (random.Uniform() - 0.5) * 120 + 360, 360);
+    }
+    double lonMeters = kTraceMetersPerDegree * cos(lat * M_PI / 180);
+    lat += speed * cos(heading * M_PI / 180) / kTraceMetersPerDegree;
+    lon += speed * sin(heading * M_PI / 180) / lonMeters;
+
+    TracePoint* point = aTrace.AppendElement();
+    point->mTime = kTraceStartMs + t * 1000;
+    point->mLatitude = lat;
+    point->mLongitude = lon;
+    point->mSpeed = speed;
+    point->mHeading = heading;
+    point->mHasGps = t % 600 < 420;
+    point->mGpsLatitude = lat + 5 * random.Normal() / kTraceMetersPerDegree;
+    point->mGpsLongitude = lon + 5 * random.Normal() / lonMeters;
+    point->mHasNetwork = t % 10 == 0;
+    point->mNetworkAccuracy = 50 + 100 * random.Uniform();
+    double error = random.Uniform() < 0.03 ? 2000 : point->mNetworkAccuracy;
+    point->mNetworkLatitude = lat + error * random.Normal() / kTraceMetersPerDegree;
+    point->mNetworkLongitude = lon + error * random.Normal() / lonMeters;
+  }
+}
+
+static double
+TraceError(const LocationFusionFilter::Estimate& aEstimate, const TracePoint& aPoint)
+{
+  return GeoDistanceMeters(aEstimate.mLatitude, aEstimate.mLongitude,
+                           aPoint.mLatitude, aPoint.mLongitude);
+}
+
+/*
+ While the GPS is out, the estimate is compared with what
+ NetworkLocationUpdate::Update did before the filter: the last GPS fix
+ while it was recent, else the network position.
+ */
+TEST(LocationFusionFilter, Trace)
+{
+  nsTArray<TracePoint> trace;
+  MakeFusionTrace(trace);
+
+  LocationFusionFilter filter;
+  double gpsError = 0;
+  uint32_t gpsUpdates = 0;
+  double fusedError = 0, oldError = 0, networkError = 0, accuracy = 0;
+  uint32_t outageUpdates = 0, withinAccuracy = 0;
+  int64_t lastGpsTime = 0;
+  double lastGpsLat = 0, lastGpsLon = 0;
+  double lastNetworkLat = 0, lastNetworkLon = 0;
+  for (const TracePoint& point : trace) {
+    if (point.mHasGps) {
+      filter.Update(LocationFusionFilter::SOURCE_GPS, point.mTime,
+                    point.mGpsLatitude, point.mGpsLongitude, 5,
+                    point.mSpeed, point.mHeading);
+      lastGpsTime = point.mTime;
+      lastGpsLat = point.mGpsLatitude;
+      lastGpsLon = point.mGpsLongitude;
+      if (point.mTime > kTraceStartMs + 60 * 1000) {
+        gpsError += TraceError(filter.Predict(point.mTime), point);
+        gpsUpdates++;
+      }
+    }
+    if (!point.mHasNetwork) {
+      continue;
+    }
+    filter.Update(LocationFusionFilter::SOURCE_NETWORK, point.mTime,
+                  point.mNetworkLatitude, point.mNetworkLongitude,
+                  point.mNetworkAccuracy);
+    if (point.mHasGps) {
+      continue;
+    }
+
+    double delta = GeoDistanceMeters(point.mNetworkLatitude, point.mNetworkLongitude,
+                                     lastNetworkLat, lastNetworkLon);
+    lastNetworkLat = point.mNetworkLatitude;
+    lastNetworkLon = point.mNetworkLongitude;
+    int64_t gpsAge = point.mTime - lastGpsTime;
+    bool useNetwork = gpsAge > 120000 || (gpsAge > 10000 && delta > 10);
+    oldError += GeoDistanceMeters(useNetwork ? point.mNetworkLatitude : lastGpsLat,
+                                  useNetwork ? point.mNetworkLongitude : lastGpsLon,
+                                  point.mLatitude, point.mLongitude);
+    networkError += GeoDistanceMeters(point.mNetworkLatitude, point.mNetworkLongitude,
+                                      point.mLatitude, point.mLongitude);
+
+    LocationFusionFilter::Estimate estimate = filter.Predict(point.mTime);
+    double error = TraceError(estimate, point);
+    fusedError += error;
+    accuracy += estimate.mAccuracy;
+    // 95% of a 2D normal distribution is within 2.45 sigma.
+    withinAccuracy += error <= 2.45 * estimate.mAccuracy;
+    outageUpdates++;
+  }
+
+  printf("With GPS: mean error %.1f m. During GPS outages (%u network "
+         "positions): mean error %.0f m, previously %.0f m, network alone "
+         "%.0f m; mean accuracy %.0f m, %u%% within 2.45 sigma\n",
+         gpsError / gpsUpdates, outageUpdates, fusedError / outageUpdates,
+         oldError / outageUpdates, networkError / outageUpdates,
+         accuracy / outageUpdates, withinAccuracy * 100 / outageUpdates);
+  EXPECT_LT(gpsError / gpsUpdates, 5.0);
+  EXPECT_LT(fusedError, oldError);
+  EXPECT_LT(fusedError, networkError);
+  // The accuracy is honest: not much worse than 95% within 2.45 sigma.
+  EXPECT_GE(withinAccuracy * 100 / outageUpdates, 85u);
+}
+
+TEST(LocationFusionFilter, NetworkOutliers)
+{
+  LocationFusionFilter filter;
+  filter.Update(LocationFusionFilter::SOURCE_GPS, kTraceStartMs, 52.5, 13.4, 5);
+  EXPECT_FALSE(filter.Update(LocationFusionFilter::SOURCE_NETWORK,
+                             kTraceStartMs + 1000, 52.55, 13.4, 100));
+  EXPECT_NEAR(52.5, filter.Predict(kTraceStartMs + 1000).mLatitude, 1e-5);
+
+  // Several in a row mean the estimate is what went wrong.
+  EXPECT_FALSE(filter.Update(LocationFusionFilter::SOURCE_NETWORK,
+                             kTraceStartMs + 2000, 52.55, 13.4, 100));
+  EXPECT_TRUE(filter.Update(LocationFusionFilter::SOURCE_NETWORK,
+                            kTraceStartMs + 3000, 52.55, 13.4, 100));
+  EXPECT_NEAR(52.55, filter.Predict(kTraceStartMs + 3000).mLatitude, 1e-5);
+}
+
+TEST(LocationFusionFilter, GpsJumpRestarts)
+{
+  LocationFusionFilter filter;
+  filter.Update(LocationFusionFilter::SOURCE_GPS, kTraceStartMs, 52.5, 13.4, 5);
+  EXPECT_TRUE(filter.Update(LocationFusionFilter::SOURCE_GPS,
+                            kTraceStartMs + 1000, 48.85, 2.35, 5));
+  LocationFusionFilter::Estimate estimate = filter.Predict(kTraceStartMs + 1000);
+  EXPECT_NEAR(48.85, estimate.mLatitude, 1e-6);
+  EXPECT_NEAR(2.35, estimate.mLongitude, 1e-6);
+  EXPECT_NEAR(5, estimate.mAccuracy, 1e-6);
+}
+
+TEST(LocationFusionFilter, Coasting)
+{
+  LocationFusionFilter filter;
+  EXPECT_FALSE(filter.HasEstimate());
+  // North at 10 m/s
+  for (uint32_t t = 0; t < 30; t++) {
+    filter.Update(LocationFusionFilter::SOURCE_GPS, kTraceStartMs + t * 1000,
+                  52.5 + t * 10 / kTraceMetersPerDegree, 13.4, 5, 10, 0);
+  }
+  ASSERT_TRUE(filter.HasEstimate());
+  int64_t last = kTraceStartMs + 29 * 1000;
+  LocationFusionFilter::Estimate estimate = filter.Predict(last);
+  EXPECT_NEAR(10, estimate.mSpeed, 0.5);
+  EXPECT_NEAR(0, fmod(estimate.mHeading + 180, 360) - 180, 2);
+
+  // Without the GPS the heading is kept for a while, the speed decays
+  // and the accuracy grows.
+  LocationFusionFilter::Estimate later = filter.Predict(last + 5000);
+  EXPECT_GT(later.mLatitude, estimate.mLatitude + 30 / kTraceMetersPerDegree);
+  EXPECT_LT(later.mSpeed, estimate.mSpeed);
+  EXPECT_GT(later.mAccuracy, estimate.mAccuracy);
+
+  // Long after, it stays put.
+  LocationFusionFilter::Estimate much = filter.Predict(last + 3600 * 1000);
+  EXPECT_TRUE(IsNaN(much.mHeading));
+  EXPECT_GT(much.mAccuracy, later.mAccuracy);
+
+  // A stationary GPS stops the estimate.
+  filter.Update(LocationFusionFilter::SOURCE_GPS, last + 1000,
+                52.5 + 300 / kTraceMetersPerDegree, 13.4, 5, 0, -1);
+  EXPECT_LT(filter.Predict(last + 1000).mSpeed, 2.0);
+}
+
+TEST(LocationFusionFilter, Benchmark)
+{
+  static const uint32_t kUpdates = 2000000;
+  LocationFusionFilter filter;
+  TimeStamp start = TimeStamp::Now();
+  for (uint32_t i = 0; i < kUpdates; i++) {
+    bool gps = i % 10;
+    filter.Update(gps ? LocationFusionFilter::SOURCE_GPS :
+                        LocationFusionFilter::SOURCE_NETWORK,
+                  kTraceStartMs + int64_t(i) * 1000, 52.5 + i * 1e-7, 13.4,
+                  gps ? 5 : 100, 3, 45);
+  }
+  double updateMs = (TimeStamp::Now() - start).ToMilliseconds();
+
+  // Summed so that the loop is not optimized away
+  double sum = 0;
+  int64_t last = kTraceStartMs + int64_t(kUpdates) * 1000;
+  start = TimeStamp::Now();
+  for (uint32_t i = 0; i < kUpdates; i++) {
+    sum += filter.Predict(last + i).mLatitude;
+  }
+  double predictMs = (TimeStamp::Now() - start).ToMilliseconds();
+
+  printf("LocationFusionFilter: Update %.0f ns, Predict %.0f ns (%g)\n",
+         updateMs * 1e6 / kUpdates, predictMs * 1e6 / kUpdates, sum);
+}
@@ -0,0 +1,198 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "StumbleDictionary.h"
+#include "StumbleGZReader.h"
+#include "StumbleGZWriter.h"
+#include "StumbleTestUtils.h"
+#include "mozilla/TimeStamp.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace mozilla;
+
+/*
+ The same commute on two days: the first one trains the dictionary, the
+ second one is written in segments of kSegmentRecords, as sealed
+ segments are, with and without it.
+ */
+
+static const uint32_t kCommuteRecords = 2000;
+// About what a SEGMENT_MAX_BYTES head holds
+static const uint32_t kSegmentRecords = 200;
+static const int64_t kDayMs = 24 * 60 * 60 * 1000;
+static const uint32_t kMaxDictLength = StumbleDictionary::kMaxLength;
+
+/*
+ The second day sees most of the APs of the first, with other signals.
+ BSSIDs are scrambled, as real ones share little more than a vendor
+ prefix.
+ */
+static void
+MakeCommuteRecord(StumbleRecord& aRecord, uint32_t aIndex, uint32_t aDay)
+{
+  MakeStumbleRecord(aRecord, aIndex, 30);
+  aRecord.mTimestamp += aDay * kDayMs;
+  for (uint32_t i = aRecord.mWifi.Length(); i > 0; i--) {
+    StumbleWifi& ap = aRecord.mWifi[i - 1];
+    if (aDay && (aIndex + i) % 7 == 0) {
+      aRecord.mWifi.RemoveElementAt(i - 1);
+      continue;
+    }
+    ap.mBssid = (ap.mBssid * 0x9e3779b97f4a7c15ULL >> 16) & 0xffffffffffffULL;
+    ap.mSignal = 40 + (ap.mSignal + aDay * 13) % 50;
+  }
+}
+
+// Writes records [aFirst, aFirst + aCount) of aDay as one sealed segment.
+static nsresult
+WriteCommuteSegment(nsIFile* aFile, uint32_t aFirst, uint32_t aCount,
+                    uint32_t aDay, StumbleDictionary* aDictionary)
+{
+  aFile->Remove(false);
+  nsRefPtr<StumbleGZWriter> writer = new StumbleGZWriter();
+  nsresult rv = writer->Open(aFile, StumbleLogValidLength, aDictionary);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  StumbleRecordEncoder encoder;
+  StumbleRecord record;
+  nsAutoCString data;
+  StumbleRecordEncoder::WriteHeader(data);
+  for (uint32_t i = aFirst; i < aFirst + aCount; i++) {
+    MakeCommuteRecord(record, i, aDay);
+    encoder.Encode(record, data);
+  }
+  rv = writer->Write(data);
+  NS_ENSURE_SUCCESS(rv, rv);
+  return writer->Finish();
+}
+
+class StumbleDictionaryTest : public ::testing::Test
+{
+protected:
+  virtual void SetUp() override
+  {
+    RemoveStumblerDir();
+    ASSERT_TRUE(NS_SUCCEEDED(GetStumblerTestFile("segment.gz",
+                                                 getter_AddRefs(mFile))));
+  }
+
+  virtual void TearDown() override
+  {
+    RemoveStumblerDir();
+  }
+
+  already_AddRefed<StumbleDictionary> TrainOnFirstDay()
+  {
+    EXPECT_TRUE(NS_SUCCEEDED(WriteCommuteSegment(mFile, 0, kCommuteRecords, 0,
+                                                 nullptr)));
+    return StumbleDictionary::Train(mFile);
+  }
+
+  // The size of the second day written in segments, and how long it took
+  int64_t WriteSecondDay(StumbleDictionary* aDictionary, double* aMs)
+  {
+    int64_t total = 0;
+    double ms = 0;
+    for (uint32_t first = 0; first < kCommuteRecords; first += kSegmentRecords) {
+      TimeStamp start = TimeStamp::Now();
+      EXPECT_TRUE(NS_SUCCEEDED(WriteCommuteSegment(mFile, first, kSegmentRecords,
+                                                   1, aDictionary)));
+      ms += (TimeStamp::Now() - start).ToMilliseconds();
+
+      int64_t size;
+      EXPECT_TRUE(NS_SUCCEEDED(mFile->GetFileSize(&size)));
+      total += size;
+    }
+    *aMs = ms;
+    return total;
+  }
+
+  nsCOMPtr<nsIFile> mFile;
+};
+
+TEST_F(StumbleDictionaryTest, TooFewBssids)
+{
+  ASSERT_TRUE(NS_SUCCEEDED(WriteCommuteSegment(mFile, 0, 2, 0, nullptr)));
+  nsRefPtr<StumbleDictionary> dict = StumbleDictionary::Train(mFile);
+  EXPECT_FALSE(dict);
+  EXPECT_FALSE(nsRefPtr<StumbleDictionary>(StumbleDictionary::Load()));
+}
+
+TEST_F(StumbleDictionaryTest, TrainAndLoad)
+{
+  nsRefPtr<StumbleDictionary> dict = TrainOnFirstDay();
+  ASSERT_TRUE(dict);
+  EXPECT_GT(dict->Length(), 0u);
+  EXPECT_LE(dict->Length(), kMaxDictLength);
+  // Whole BSSIDs only
+  EXPECT_EQ(0u, dict->Length() % 6);
+
+  nsRefPtr<StumbleDictionary> loaded = StumbleDictionary::Load();
+  ASSERT_TRUE(loaded);
+  EXPECT_EQ(dict->Id(), loaded->Id());
+  EXPECT_EQ(dict->Length(), loaded->Length());
+  EXPECT_EQ(0, memcmp(dict->Data(), loaded->Data(), dict->Length()));
+}
+
+TEST_F(StumbleDictionaryTest, RoundTrip)
+{
+  nsRefPtr<StumbleDictionary> dict = TrainOnFirstDay();
+  ASSERT_TRUE(dict);
+  ASSERT_TRUE(NS_SUCCEEDED(WriteCommuteSegment(mFile, 0, kSegmentRecords, 1,
+                                               dict)));
+
+  // Not readable without the dictionary
+  nsAutoCString data;
+  EXPECT_TRUE(NS_FAILED(ReadGZipFile(mFile, data)));
+
+  StumbleGZReader reader;
+  ASSERT_TRUE(NS_SUCCEEDED(reader.Open(mFile, dict)));
+  data.Truncate();
+  char buf[4096];
+  uint32_t bytesRead;
+  do {
+    ASSERT_TRUE(NS_SUCCEEDED(reader.Read(buf, sizeof(buf), &bytesRead)));
+    data.Append(buf, bytesRead);
+  } while (bytesRead);
+  EXPECT_TRUE(reader.IsComplete());
+
+  const char* cur = data.BeginReading();
+  const char* end = data.EndReading();
+  ASSERT_TRUE(StumbleRecordDecoder::ReadHeader(cur, end));
+  StumbleRecordDecoder decoder;
+  StumbleRecord record, expected;
+  for (uint32_t i = 0; i < kSegmentRecords; i++) {
+    ASSERT_TRUE(decoder.Decode(cur, end, record)) << "record " << i;
+    MakeCommuteRecord(expected, i, 1);
+    ASSERT_EQ(expected.mTimestamp, record.mTimestamp);
+    ASSERT_EQ(expected.mWifi.Length(), record.mWifi.Length());
+    for (uint32_t j = 0; j < expected.mWifi.Length(); j++) {
+      ASSERT_EQ(expected.mWifi[j].mBssid, record.mWifi[j].mBssid);
+    }
+  }
+  EXPECT_EQ(end, cur);
+}
+
+TEST_F(StumbleDictionaryTest, CompressionRatio)
+{
+  double plainMs;
+  int64_t plainBytes = WriteSecondDay(nullptr, &plainMs);
+
+  nsRefPtr<StumbleDictionary> dict = TrainOnFirstDay();
+  ASSERT_TRUE(dict);
+  double dictMs;
+  int64_t dictBytes = WriteSecondDay(dict, &dictMs);
+
+  printf("%u records in segments of %u: %.1f B/record in %.1f us/record, "
+         "with a %u byte dictionary %.1f B/record in %.1f us/record\n",
+         kCommuteRecords, kSegmentRecords,
+         double(plainBytes) / kCommuteRecords, plainMs * 1000 / kCommuteRecords,
+         dict->Length(),
+         double(dictBytes) / kCommuteRecords, dictMs * 1000 / kCommuteRecords);
+  EXPECT_LT(dictBytes, plainBytes);
+}
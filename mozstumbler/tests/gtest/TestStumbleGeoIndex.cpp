@@ -0,0 +1,293 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "StumbleGeoIndex.h"
+#include "StumbleTestUtils.h"
+#include "StumblerGeodesy.h"
+#include "mozilla/TimeStamp.h"
+#include "nsICellInfo.h"
+#include "nsTArray.h"
+#include <math.h>
+#include <stdio.h>
+
+using namespace mozilla;
+
+/*
+ A 5 km square of city with kCityAps APs and kCityCells cells, stumbled
+ along random walks with GPS fixes of 5 to 30 m. Scans at random points
+ are then located with the index, and compared with where they were.
+ */
+
+static const uint32_t kCityAps = 4000;
+static const uint32_t kCityCells = 60;
+static const double kCitySize = 5000;
+static const double kCityLatitude = 45.5;
+static const double kCityLongitude = -73.6;
+static const double kCityMetersPerDegree = M_PI / 180 * kGeoEarthRadiusMeters;
+static const int64_t kCityStartMs = 1444444444444;
+static const uint32_t kCityMaxEntries = StumbleGeoIndex::kMaxEntries;
+
+// Deterministic, so a failure can be reproduced.
+class CityRandom
+{
+public:
+  CityRandom() : mState(0x2545f4914f6cdd1dULL) {}
+
+  // Uniform in [0, 1)
+  double Uniform()
+  {
+    mState = mState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (mState >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  // Standard normal, by Box-Muller
+  double Normal()
+  {
+    double u = 1 - Uniform();
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * Uniform());
+  }
+
+private:
+  uint64_t mState;
+};
+
+struct CityTransmitter
+{
+  // m east and north of the corner of the city
+  double mX;
+  double mY;
+};
+
+class StumbleGeoIndexTest : public ::testing::Test
+{
+protected:
+  virtual void SetUp() override
+  {
+    RemoveStumblerDir();
+    for (uint32_t i = 0; i < kCityAps; i++) {
+      CityTransmitter* ap = mAps.AppendElement();
+      ap->mX = mRandom.Uniform() * kCitySize;
+      ap->mY = mRandom.Uniform() * kCitySize;
+    }
+    for (uint32_t i = 0; i < kCityCells; i++) {
+      CityTransmitter* cell = mCells.AppendElement();
+      cell->mX = mRandom.Uniform() * kCitySize;
+      cell->mY = mRandom.Uniform() * kCitySize;
+    }
+  }
+
+  virtual void TearDown() override
+  {
+    RemoveStumblerDir();
+  }
+
+  static double Latitude(double aY)
+  {
+    return kCityLatitude + aY / kCityMetersPerDegree;
+  }
+
+  static double Longitude(double aX)
+  {
+    return kCityLongitude +
+           aX / (kCityMetersPerDegree * cos(kCityLatitude * M_PI / 180));
+  }
+
+  // What a scan at (aX, aY) sees: APs within 90 m, cells within 1500 m
+  void Scan(double aX, double aY, bool aWifi, StumbleRecord& aRecord)
+  {
+    aRecord.Clear();
+    aRecord.mHasWifi = aWifi;
+    for (uint32_t i = 0; aWifi && i < mAps.Length(); i++) {
+      double distance = hypot(mAps[i].mX - aX, mAps[i].mY - aY);
+      if (distance < 90) {
+        StumbleWifi* ap = aRecord.mWifi.AppendElement();
+        ap->mBssid = 0x001122000000ULL + i * 7919;
+        ap->mSignal = uint32_t(int32_t(-40 - 25 * log10(fmax(distance, 1)) +
+                                       4 * mRandom.Normal()));
+      }
+    }
+    for (uint32_t i = 0; i < mCells.Length(); i++) {
+      if (hypot(mCells[i].mX - aX, mCells[i].mY - aY) < 1500) {
+        StumbleCell* cell = aRecord.mCells.AppendElement();
+        cell->mType = nsICellInfo::CELL_INFO_TYPE_LTE;
+        cell->mMcc = 302;
+        cell->mMnc = 220;
+        cell->mLac = 7;
+        cell->mCid = 1000 + i;
+      }
+    }
+  }
+
+  void Stumble(StumbleGeoIndex* aIndex)
+  {
+    int64_t time = kCityStartMs;
+    StumbleRecord record;
+    for (uint32_t walk = 0; walk < 300; walk++) {
+      double x = mRandom.Uniform() * kCitySize;
+      double y = mRandom.Uniform() * kCitySize;
+      double heading = mRandom.Uniform() * 2 * M_PI;
+      for (uint32_t step = 0; step < 60; step++, time += 5000) {
+        x += 30 * cos(heading);
+        y += 30 * sin(heading);
+        heading += 0.3 * mRandom.Normal();
+        if (x < 0 || y < 0 || x > kCitySize || y > kCitySize) {
+          break;
+        }
+        double accuracy = 5 + 25 * mRandom.Uniform();
+        Scan(x, y, true, record);
+        record.mTimestamp = time;
+        record.mAccuracy = accuracy;
+        record.mLatitude = Latitude(y + accuracy * mRandom.Normal());
+        record.mLongitude = Longitude(x + accuracy * mRandom.Normal());
+        aIndex->Add(record);
+      }
+    }
+  }
+
+  // Locates scans at random points and prints how well that went.
+  void LocateScans(StumbleGeoIndex* aIndex, bool aWifi, double* aMedianError,
+                   uint32_t* aLocatedPercent, uint32_t* aWithinPercent)
+  {
+    static const uint32_t kScans = 2000;
+    nsTArray<double> errors;
+    uint32_t within = 0;
+    double ms = 0;
+    StumbleRecord scan;
+    for (uint32_t i = 0; i < kScans; i++) {
+      double x = mRandom.Uniform() * kCitySize;
+      double y = mRandom.Uniform() * kCitySize;
+      Scan(x, y, aWifi, scan);
+      StumbleGeoIndex::Estimate estimate;
+      TimeStamp start = TimeStamp::Now();
+      bool located = aIndex->Locate(scan, &estimate);
+      ms += (TimeStamp::Now() - start).ToMilliseconds();
+      // A scan with no known AP is located from its cells.
+      if (!located || aWifi != (estimate.mWifiMatches > 0)) {
+        continue;
+      }
+      double error = GeoDistanceMeters(Latitude(y), Longitude(x),
+                                       estimate.mLatitude, estimate.mLongitude);
+      errors.AppendElement(error);
+      within += error <= estimate.mAccuracy;
+    }
+    ASSERT_FALSE(errors.IsEmpty());
+    errors.Sort();
+    *aMedianError = errors[errors.Length() / 2];
+    *aLocatedPercent = errors.Length() * 100 / kScans;
+    *aWithinPercent = within * 100 / errors.Length();
+    printf("%s: located %u%%, median error %.0f m, 90th percentile %.0f m, "
+           "%u%% within the accuracy, %.0f ns per Locate()\n",
+           aWifi ? "Wifi" : "Cells", *aLocatedPercent, *aMedianError,
+           errors[errors.Length() * 9 / 10], *aWithinPercent, ms * 1e6 / kScans);
+  }
+
+  CityRandom mRandom;
+  nsTArray<CityTransmitter> mAps;
+  nsTArray<CityTransmitter> mCells;
+};
+
+TEST_F(StumbleGeoIndexTest, Accuracy)
+{
+  nsRefPtr<StumbleGeoIndex> index = new StumbleGeoIndex();
+  Stumble(index);
+  EXPECT_GT(index->Count(), kCityAps / 2);
+  EXPECT_LE(index->Count(), kCityMaxEntries);
+
+  double median;
+  uint32_t located, within;
+  LocateScans(index, true, &median, &located, &within);
+  EXPECT_GT(located, 50u);
+  EXPECT_LT(median, 50.0);
+  EXPECT_GT(within, 50u);
+
+  // Without wifi, from cells that cover km
+  LocateScans(index, false, &median, &located, &within);
+  EXPECT_GT(located, 90u);
+  EXPECT_LT(median, 1000.0);
+  EXPECT_GT(within, 50u);
+}
+
+TEST_F(StumbleGeoIndexTest, SaveAndLoad)
+{
+  nsRefPtr<StumbleGeoIndex> index = new StumbleGeoIndex();
+  Stumble(index);
+  ASSERT_TRUE(NS_SUCCEEDED(index->Save()));
+
+  nsCOMPtr<nsIFile> file;
+  ASSERT_TRUE(NS_SUCCEEDED(GetStumblerTestFile("stumbles.geo", getter_AddRefs(file))));
+  int64_t size;
+  ASSERT_TRUE(NS_SUCCEEDED(file->GetFileSize(&size)));
+  printf("%u entries, %lld bytes on disk\n", index->Count(), (long long)size);
+  // A 9-byte header, then the entries
+  EXPECT_EQ(0, (size - 9) % index->Count());
+  EXPECT_LE((size - 9) / index->Count(), 24);
+
+  nsRefPtr<StumbleGeoIndex> loaded = new StumbleGeoIndex();
+  ASSERT_TRUE(NS_SUCCEEDED(loaded->Load()));
+  EXPECT_EQ(index->Count(), loaded->Count());
+
+  StumbleRecord scan;
+  for (uint32_t i = 0; i < 100; i++) {
+    Scan(mRandom.Uniform() * kCitySize, mRandom.Uniform() * kCitySize, true, scan);
+    StumbleGeoIndex::Estimate expected, actual;
+    bool located = index->Locate(scan, &expected);
+    ASSERT_EQ(located, loaded->Locate(scan, &actual));
+    if (located) {
+      EXPECT_EQ(expected.mLatitude, actual.mLatitude);
+      EXPECT_EQ(expected.mLongitude, actual.mLongitude);
+      EXPECT_EQ(expected.mAccuracy, actual.mAccuracy);
+    }
+  }
+}
+
+TEST_F(StumbleGeoIndexTest, UnreadableFile)
+{
+  nsCOMPtr<nsIFile> file;
+  ASSERT_TRUE(NS_SUCCEEDED(GetStumblerTestFile("stumbles.geo", getter_AddRefs(file))));
+  PRFileDesc* fd;
+  ASSERT_TRUE(NS_SUCCEEDED(file->OpenNSPRFileDesc(PR_WRONLY | PR_TRUNCATE, 0644, &fd)));
+  static const char kGarbage[] = "MZGX\x01\xff\xff not an index";
+  PR_Write(fd, kGarbage, sizeof(kGarbage) - 1);
+  PR_Close(fd);
+
+  nsRefPtr<StumbleGeoIndex> index = new StumbleGeoIndex();
+  EXPECT_TRUE(NS_SUCCEEDED(index->Load()));
+  EXPECT_EQ(0u, index->Count());
+}
+
+// More APs than fit, over ten days: the ones seen last are kept.
+TEST_F(StumbleGeoIndexTest, Eviction)
+{
+  static const uint32_t kPerDay = 2000;
+  nsRefPtr<StumbleGeoIndex> index = new StumbleGeoIndex();
+  StumbleRecord record;
+  for (uint32_t i = 0; i < 10 * kPerDay; i++) {
+    record.Clear();
+    record.mTimestamp = kCityStartMs + int64_t(i / kPerDay) * 24 * 60 * 60 * 1000;
+    record.mAccuracy = 10;
+    record.mLatitude = 45 + mRandom.Uniform();
+    record.mLongitude = -73 + mRandom.Uniform();
+    StumbleWifi* ap = record.mWifi.AppendElement();
+    ap->mBssid = i + 1;
+    ap->mSignal = uint32_t(-60);
+    index->Add(record);
+  }
+  EXPECT_LE(index->Count(), kCityMaxEntries);
+
+  uint32_t newest = 0, oldest = 0;
+  StumbleGeoIndex::Estimate estimate;
+  for (uint32_t i = 0; i < kPerDay; i++) {
+    record.mWifi[0].mBssid = 9 * kPerDay + i + 1;
+    newest += index->Locate(record, &estimate);
+    record.mWifi[0].mBssid = i + 1;
+    oldest += index->Locate(record, &estimate);
+  }
+  printf("After %u APs: %u entries, %u of the newest %u kept, %u of the oldest\n",
+         10 * kPerDay, index->Count(), newest, kPerDay, oldest);
+  EXPECT_EQ(kPerDay, newest);
+  EXPECT_EQ(0u, oldest);
+}
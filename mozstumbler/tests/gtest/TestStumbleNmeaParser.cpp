@@ -0,0 +1,181 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "StumbleNmeaParser.h"
+#include "mozilla/TimeStamp.h"
+#include "nsString.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace mozilla;
+
+static const int64_t kNmeaStartMs = 1444444444000;
+
+// "$<aBody>*<checksum>\r\n"
+static nsCString
+NmeaSentence(const char* aBody)
+{
+  uint8_t checksum = 0;
+  for (const char* c = aBody; *c; c++) {
+    checksum ^= uint8_t(*c);
+  }
+  nsCString sentence;
+  sentence.AppendPrintf("$%s*%02X\r\n", aBody, checksum);
+  return sentence;
+}
+
+// One second of a chip with a 3D fix
+static nsCString
+NmeaEpoch()
+{
+  nsCString epoch;
+  epoch += NmeaSentence("GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,");
+  epoch += NmeaSentence("GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1");
+  epoch += NmeaSentence("GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00");
+  epoch += NmeaSentence("GLGSV,2,1,07,65,10,100,30");
+  epoch += NmeaSentence("GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W");
+  return epoch;
+}
+
+TEST(StumbleNmeaParser, Epoch)
+{
+  StumbleNmeaParser parser;
+  nsCString epoch = NmeaEpoch();
+  parser.Feed(epoch.get(), epoch.Length(), kNmeaStartMs);
+  EXPECT_EQ(5u, parser.Sentences());
+  EXPECT_EQ(0u, parser.Rejected());
+
+  int64_t now = kNmeaStartMs + 50;
+  StumbleFixQuality quality = StumbleNmeaParser::Latest(now);
+  EXPECT_TRUE(quality.mValid);
+  // The HDOP of GSA, which comes with the fix type
+  EXPECT_EQ(130u, quality.mHdopCenti);
+  EXPECT_EQ(8u, quality.mSatellitesUsed);
+  // GPS and GLONASS together
+  EXPECT_EQ(18u, quality.mSatellitesInView);
+  EXPECT_EQ(StumbleFixQuality::FIX_3D, quality.mFixType);
+  EXPECT_TRUE(quality.IsFresh(now));
+  EXPECT_FALSE(quality.IsPoor(now));
+}
+
+TEST(StumbleNmeaParser, Fragments)
+{
+  StumbleNmeaParser parser;
+  nsCString sentence = NmeaSentence("GNGGA,1,2,N,3,E,0,00,99.99,,,,,,");
+  // Without its line ending, in two parts
+  sentence.Truncate(sentence.Length() - 2);
+  int64_t now = kNmeaStartMs + 1000;
+  parser.Feed(sentence.get(), 10, now);
+  EXPECT_EQ(0u, parser.Sentences());
+  parser.Feed(sentence.get() + 10, sentence.Length() - 10, now);
+  EXPECT_EQ(1u, parser.Sentences());
+
+  StumbleFixQuality quality = StumbleNmeaParser::Latest(now);
+  EXPECT_EQ(StumbleFixQuality::FIX_NONE, quality.mFixType);
+  EXPECT_EQ(9999u, quality.mHdopCenti);
+  EXPECT_TRUE(quality.IsPoor(now));
+  // Stale quality is not poor, only unknown.
+  int64_t later = now + StumbleFixQuality::kMaxAgeMs + 1000;
+  EXPECT_FALSE(StumbleNmeaParser::Latest(later).IsPoor(later));
+}
+
+TEST(StumbleNmeaParser, Rejected)
+{
+  StumbleNmeaParser parser;
+  nsCString epoch = NmeaEpoch();
+  parser.Feed(epoch.get(), epoch.Length(), kNmeaStartMs);
+
+  nsCString corrupt = NmeaSentence("GPGGA,1,2,N,3,E,1,03,0.8,,,,,,");
+  corrupt.BeginWriting()[corrupt.Length() - 3] ^= 1;
+  parser.Feed(corrupt.get(), corrupt.Length(), kNmeaStartMs);
+  EXPECT_EQ(1u, parser.Rejected());
+  EXPECT_EQ(8u, StumbleNmeaParser::Latest(kNmeaStartMs).mSatellitesUsed);
+
+  nsCString overlong("$GPGGA,");
+  for (uint32_t i = 0; i < 2 * StumbleNmeaParser::kMaxSentenceLength; i++) {
+    overlong.Append('1');
+  }
+  overlong.Append("\r\n");
+  parser.Feed(overlong.get(), overlong.Length(), kNmeaStartMs);
+  EXPECT_EQ(2u, parser.Rejected());
+
+  // The parser recovers at the next "$".
+  parser.Feed(epoch.get(), epoch.Length(), kNmeaStartMs);
+  EXPECT_EQ(10u, parser.Sentences());
+}
+
+/*
+ Random bytes replaced, inserted and deleted in an epoch, fed in two
+ parts. The parser must neither crash (run it under ASan) nor publish
+ impossible values.
+ */
+TEST(StumbleNmeaParser, Fuzz)
+{
+  nsCString epoch = NmeaEpoch();
+  StumbleNmeaParser parser;
+  uint32_t state = 1;
+  char buffer[1024];
+  for (uint32_t round = 0; round < 200000; round++) {
+    uint32_t length = epoch.Length();
+    memcpy(buffer, epoch.get(), length);
+    uint32_t mutations = (state = state * 1103515245 + 12345) >> 16 & 7;
+    for (uint32_t i = 0; i < mutations; i++) {
+      state = state * 1103515245 + 12345;
+      uint32_t pos = (state >> 8) % (length + 1);
+      char byte = char(state >> 24);
+      switch ((state >> 4) % 3) {
+        case 0:
+          if (pos < length) {
+            buffer[pos] = byte;
+          }
+          break;
+        case 1:
+          memmove(buffer + pos + 1, buffer + pos, length - pos);
+          buffer[pos] = byte;
+          length++;
+          break;
+        default:
+          if (pos < length) {
+            memmove(buffer + pos, buffer + pos + 1, length - pos - 1);
+            length--;
+          }
+          break;
+      }
+    }
+    state = state * 1103515245 + 12345;
+    uint32_t cut = (state >> 8) % (length + 1);
+    parser.Feed(buffer, cut, kNmeaStartMs);
+    parser.Feed(buffer + cut, length - cut, kNmeaStartMs);
+
+    StumbleFixQuality quality = StumbleNmeaParser::Latest(kNmeaStartMs);
+    ASSERT_LE(quality.mHdopCenti, 9999u);
+    ASSERT_LE(quality.mFixType, StumbleFixQuality::FIX_3D);
+  }
+  printf("Fuzz: %llu sentences accepted, %llu rejected\n",
+         (unsigned long long)parser.Sentences(),
+         (unsigned long long)parser.Rejected());
+  EXPECT_GT(parser.Sentences(), 0u);
+  EXPECT_GT(parser.Rejected(), 0u);
+}
+
+TEST(StumbleNmeaParser, Benchmark)
+{
+  nsCString epochs;
+  nsCString epoch = NmeaEpoch();
+  for (uint32_t i = 0; i < 1000; i++) {
+    epochs += epoch;
+  }
+
+  StumbleNmeaParser parser;
+  TimeStamp start = TimeStamp::Now();
+  for (uint32_t i = 0; i < 20; i++) {
+    parser.Feed(epochs.get(), epochs.Length(), kNmeaStartMs);
+  }
+  double ms = (TimeStamp::Now() - start).ToMilliseconds();
+  EXPECT_EQ(100000u, parser.Sentences());
+  printf("StumbleNmeaParser: %.0f sentences/s\n", parser.Sentences() * 1000 / ms);
+}
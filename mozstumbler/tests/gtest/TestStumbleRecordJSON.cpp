@@ -0,0 +1,186 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "StumbleRecord.h"
+#include "mozilla/FloatingPoint.h"
+#include "mozilla/TimeStamp.h"
+#include "nsICellInfo.h"
+#include "nsPrintfCString.h"
+#include <map>
+#include <stdio.h>
+
+using namespace mozilla;
+
+static const uint32_t kBenchRecords = 20000;
+
+static void
+MakeRecord(StumbleRecord& aRecord, uint32_t aIndex)
+{
+  aRecord.Clear();
+  aRecord.mTimestamp = 1444444444444 + aIndex * 2000;
+  aRecord.mLatitude = 37.3861 + aIndex * 1e-5;
+  aRecord.mLongitude = -122.0839 - aIndex * 1e-5;
+  aRecord.mAccuracy = 12.5;
+  aRecord.mAltitude = 31;
+  aRecord.mSpeed = 3.25;
+
+  StumbleCell* cell = aRecord.mCells.AppendElement();
+  cell->mType = nsICellInfo::CELL_INFO_TYPE_LTE;
+  cell->mRegistered = true;
+  cell->mMcc = 310;
+  cell->mMnc = 410;
+  cell->mLac = 7033;
+  cell->mCid = 123456789;
+  cell->mPsc = 301;
+  cell->mSignalDbm = -95 - int32_t(aIndex % 10);
+  cell->mTimingAdvance = 3;
+
+  aRecord.mHasWifi = true;
+  for (uint32_t i = 0; i < 12; i++) {
+    StumbleWifi* ap = aRecord.mWifi.AppendElement();
+    ap->mBssid = 0x0011223344aaULL + i * 0x10001;
+    ap->mSignal = 40 + (aIndex + i) % 50;
+  }
+}
+
+/*
+ How StumblerInfo formatted a fix before records were encoded: a map per
+ fix and per cell, and a printf per field.
+ */
+static void
+OldRecordToJSON(const StumbleRecord& aRecord, nsACString& aOut)
+{
+  std::map<nsCString, double> info;
+  info[NS_LITERAL_CSTRING("latitude")] = aRecord.mLatitude;
+  info[NS_LITERAL_CSTRING("longitude")] = aRecord.mLongitude;
+  info[NS_LITERAL_CSTRING("accuracy")] = aRecord.mAccuracy;
+  info[NS_LITERAL_CSTRING("altitude")] = aRecord.mAltitude;
+  info[NS_LITERAL_CSTRING("altitudeAccuracy")] = aRecord.mAltitudeAccuracy;
+  info[NS_LITERAL_CSTRING("heading")] = aRecord.mHeading;
+  info[NS_LITERAL_CSTRING("speed")] = aRecord.mSpeed;
+
+  aOut.Append('{');
+  for (auto it = info.begin(); it != info.end(); ++it) {
+    if (!IsNaN(it->second)) {
+      aOut += nsPrintfCString("\"%s\":%f,", it->first.get(), it->second);
+    }
+  }
+  aOut += nsPrintfCString("\"timestamp\":%lld,", aRecord.mTimestamp);
+
+  aOut += "\"cellTowers\": [";
+  for (uint32_t idx = 0; idx < aRecord.mCells.Length(); idx++) {
+    const StumbleCell& cell = aRecord.mCells[idx];
+    aOut += idx ? ",{" : "{";
+    std::map<nsCString, int32_t> cellInfo;
+    cellInfo[NS_LITERAL_CSTRING("serving")] = cell.mRegistered;
+    cellInfo[NS_LITERAL_CSTRING("mobileCountryCode")] = cell.mMcc;
+    cellInfo[NS_LITERAL_CSTRING("mobileNetworkCode")] = cell.mMnc;
+    cellInfo[NS_LITERAL_CSTRING("locationAreaCode")] = cell.mLac;
+    cellInfo[NS_LITERAL_CSTRING("cellId")] = cell.mCid;
+    cellInfo[NS_LITERAL_CSTRING("psc")] = cell.mPsc;
+    cellInfo[NS_LITERAL_CSTRING("signalStrength")] = cell.mSignalDbm;
+    cellInfo[NS_LITERAL_CSTRING("timingAdvance")] = cell.mTimingAdvance;
+    aOut += nsPrintfCString("\"%s\":\"%s\"", "radioType", "lte");
+    for (auto it = cellInfo.begin(); it != cellInfo.end(); ++it) {
+      if (it->second != nsICellInfo::UNKNOWN_VALUE) {
+        aOut += nsPrintfCString(",\"%s\":%d", it->first.get(), it->second);
+      }
+    }
+    aOut += "}";
+  }
+  aOut += "]";
+
+  aOut += ",\"wifiAccessPoints\": [";
+  for (uint32_t idx = 0; idx < aRecord.mWifi.Length(); idx++) {
+    const StumbleWifi& ap = aRecord.mWifi[idx];
+    aOut += nsPrintfCString("%s{\"macAddress\":\"%012llx\",\"signalStrength\":%d}",
+                            idx ? "," : "",
+                            (unsigned long long)ap.mBssid, int32_t(ap.mSignal));
+  }
+  aOut += "]}";
+}
+
+TEST(StumbleRecordJSON, Format)
+{
+  StumbleRecord record;
+  MakeRecord(record, 0);
+  record.mWifi.TruncateLength(1);
+
+  nsAutoCString json;
+  StumbleRecordToJSON(record, json);
+  EXPECT_STREQ("{\"accuracy\":12.5,\"altitude\":31,\"latitude\":37.3861,"
+               "\"longitude\":-122.0839,\"speed\":3.25,"
+               "\"timestamp\":1444444444444,"
+               "\"cellTowers\": [{\"radioType\":\"lte\","
+               "\"cellId\":123456789,\"locationAreaCode\":7033,"
+               "\"mobileCountryCode\":310,\"mobileNetworkCode\":410,"
+               "\"psc\":301,\"serving\":1,\"signalStrength\":-95,"
+               "\"timingAdvance\":3}],"
+               "\"wifiAccessPoints\": [{\"macAddress\":\"0011223344aa\","
+               "\"signalStrength\":40}]}",
+               json.get());
+}
+
+TEST(StumbleRecordJSON, NoWifiScan)
+{
+  StumbleRecord record;
+  MakeRecord(record, 0);
+  record.mHasWifi = false;
+  record.mCells.Clear();
+  record.mAltitude = UnspecifiedNaN<double>();
+
+  nsAutoCString json;
+  StumbleRecordToJSON(record, json);
+  EXPECT_EQ(kNotFound, json.Find("wifiAccessPoints"));
+  EXPECT_EQ(kNotFound, json.Find("altitude"));
+  EXPECT_NE(kNotFound, json.Find("\"cellTowers\": []"));
+}
+
+// Once the buffer has the capacity for a record, formatting one does not
+// allocate: the buffer is neither grown nor moved.
+TEST(StumbleRecordJSON, NoAllocation)
+{
+  StumbleRecord record;
+  MakeRecord(record, 0);
+
+  nsAutoCString json;
+  json.SetCapacity(4096);
+  StumbleRecordToJSON(record, json);
+  const char* buffer = json.BeginReading();
+  for (uint32_t i = 1; i < 1000; i++) {
+    MakeRecord(record, i);
+    json.Truncate();
+    StumbleRecordToJSON(record, json);
+    ASSERT_EQ(buffer, json.BeginReading());
+  }
+}
+
+TEST(StumbleRecordJSON, Benchmark)
+{
+  StumbleRecord record;
+  MakeRecord(record, 0);
+  nsAutoCString json;
+  json.SetCapacity(4096);
+
+  TimeStamp start = TimeStamp::Now();
+  for (uint32_t i = 0; i < kBenchRecords; i++) {
+    json.Truncate();
+    StumbleRecordToJSON(record, json);
+  }
+  double newMs = (TimeStamp::Now() - start).ToMilliseconds();
+
+  start = TimeStamp::Now();
+  for (uint32_t i = 0; i < kBenchRecords; i++) {
+    json.Truncate();
+    OldRecordToJSON(record, json);
+  }
+  double oldMs = (TimeStamp::Now() - start).ToMilliseconds();
+
+  printf("StumbleRecordToJSON: %.0f records/s, printf and map: %.0f records/s\n",
+         kBenchRecords * 1000 / newMs, kBenchRecords * 1000 / oldMs);
+  EXPECT_LT(newMs, oldMs);
+}
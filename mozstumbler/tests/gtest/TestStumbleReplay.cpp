@@ -0,0 +1,619 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "StumbleDedupIndex.h"
+#include "StumbleExporter.h"
+#include "StumbleGeoIndex.h"
+#include "StumbleNmeaParser.h"
+#include "StumbleRecordQueue.h"
+#include "StumbleScheduler.h"
+#include "StumbleSegmentQueue.h"
+#include "StumbleSvStatus.h"
+#include "StumbleTestUtils.h"
+#include "StumblerGeodesy.h"
+#include "StumblerStats.h"
+#include "mozilla/Atomics.h"
+#include "mozilla/FloatingPoint.h"
+#include "mozilla/TimeStamp.h"
+#include "nsPrintfCString.h"
+#include "nsTArray.h"
+#include "prenv.h"
+#include "prio.h"
+#include "prthread.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace mozilla;
+
+/*
+ Replays a GPS trace through the stumble pipeline as it runs on a phone,
+ without the GPS HAL, the radios or the network:
+
+ - A thread stands in for the GPS HAL and the main thread. For each fix
+   it feeds the NMEA parser and applies the quality gate and the
+   StumbleScheduler as LocationCallback does. For each scan it builds
+   the record StumblerInfo would, from a synthetic radio environment,
+   and pushes it onto the record queue.
+ - The test thread is the stumbler I/O thread. It drains the queue as
+   WriteStumbleOnThread::Run() does (geo index, dedup index, segment
+   queue), and uploads the sealed segments in batches, as Upload() and
+   UploadEnded() do, to an in-process stand-in for the server.
+
+ The trace is read from the file named by STUMBLE_REPLAY_TRACE, one fix
+ per line: "time (ms),latitude,longitude,accuracy (m),speed (m/s),
+ bearing (degrees)", speed and bearing negative when unknown, '#' for
+ comments. Without it, a synthetic two-hour trip is replayed. Fixes are
+ replayed as fast as possible, or at STUMBLE_REPLAY_SPEED times their
+ own pace (1 for real time).
+
+ The report has the throughput and the StumblerStats counters and
+ latencies the replay changed; replaying the same trace before and
+ after a change to the pipeline measures it.
+ */
+
+static const int64_t kReplayStartMs = 1446000000000;
+static const double kReplayMetersPerDegree = M_PI / 180 * kGeoEarthRadiusMeters;
+// Far more than MAX_QUEUED_RECORDS, as fixes come faster than in a car
+static const uint32_t kReplayQueueDepth = 1024;
+// DEFAULT_UPLOAD_BATCH of WriteStumbleOnThread
+static const uint32_t kReplayUploadBatch = 100;
+
+// APs are placed on a grid, 0 to 3 per square, and heard this far.
+static const double kReplayWifiGridMeters = 40;
+static const double kReplayWifiRangeMeters = 100;
+// One serving cell per square
+static const double kReplayCellGridMeters = 800;
+
+struct ReplayFix
+{
+  int64_t mTime;
+  double mLatitude;
+  double mLongitude;
+  double mAccuracy;
+  // Negative when unknown
+  double mSpeed;
+  double mBearing;
+};
+
+// In [0, 1), the same for the same seed
+static double
+ReplayNoise(uint64_t aSeed)
+{
+  return (StumbleMix64(aSeed) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool
+LoadReplayTrace(const char* aPath, nsTArray<ReplayFix>& aTrace)
+{
+  PRFileDesc* fd = PR_Open(aPath, PR_RDONLY, 0);
+  if (!fd) {
+    return false;
+  }
+  nsAutoCString data;
+  char buf[4096];
+  int32_t bytesRead;
+  while ((bytesRead = PR_Read(fd, buf, sizeof(buf))) > 0) {
+    data.Append(buf, bytesRead);
+  }
+  PR_Close(fd);
+
+  const char* cur = data.get();
+  while (*cur) {
+    const char* end = strchr(cur, '\n');
+    if (!end) {
+      end = cur + strlen(cur);
+    }
+    char* next;
+    int64_t time = strtoll(cur, &next, 10);
+    double values[5];
+    uint32_t count = 0;
+    if (*cur != '#' && next != cur) {
+      while (count < 5 && next < end && *next == ',') {
+        values[count++] = strtod(next + 1, &next);
+      }
+    }
+    if (count == 5 && next <= end) {
+      ReplayFix* fix = aTrace.AppendElement();
+      fix->mTime = time;
+      fix->mLatitude = values[0];
+      fix->mLongitude = values[1];
+      fix->mAccuracy = values[2];
+      fix->mSpeed = values[3];
+      fix->mBearing = values[4];
+    }
+    cur = *end ? end + 1 : end;
+  }
+  return !aTrace.IsEmpty();
+}
+
+/*
+ Two hours at 1 Hz of walking, driving in town, standing and driving
+ fast, with a turn every 90 s. For 90 s in every 15 minutes the fixes
+ are poor, as in a street canyon.
+ */
+static void
+MakeReplayTrace(nsTArray<ReplayFix>& aTrace)
+{
+  static const double kPhaseSpeeds[] = { 1.4, 12, 0, 20 };
+  double lat = 37.3861;
+  double lon = -122.0839;
+  double bearing = 30;
+  double speed = 0;
+  for (uint32_t t = 0; t < 7200; t++) {
+    speed += (kPhaseSpeeds[(t / 300) % 4] - speed) * 0.1;
+    if (t % 90 == 0) {
+      bearing = fmod(bearing + (ReplayNoise(t) - 0.5) * 120 + 360, 360);
+    }
+    lat += speed * cos(bearing * M_PI / 180) / kReplayMetersPerDegree;
+    lon += speed * sin(bearing * M_PI / 180) /
+           (kReplayMetersPerDegree * cos(lat * M_PI / 180));
+
+    ReplayFix* fix = aTrace.AppendElement();
+    fix->mTime = kReplayStartMs + t * 1000;
+    fix->mLatitude = lat;
+    fix->mLongitude = lon;
+    fix->mAccuracy = t % 900 >= 600 && t % 900 < 690 ? 40 : 4 + t * 7 % 5;
+    fix->mSpeed = speed;
+    fix->mBearing = speed > 0.5 ? bearing : -1;
+  }
+}
+
+// "$<aBody>*<checksum>\r\n"
+static void
+AppendReplayNmeaSentence(nsACString& aOut, const char* aBody)
+{
+  uint8_t checksum = 0;
+  for (const char* c = aBody; *c; c++) {
+    checksum ^= uint8_t(*c);
+  }
+  aOut.AppendPrintf("$%s*%02X\r\n", aBody, checksum);
+}
+
+// The GGA and GSA sentences of a fix, with an HDOP of a fifth of its
+// accuracy, so a fix worse than 25 m is poor.
+static void
+FeedReplayNmea(StumbleNmeaParser& aParser, const ReplayFix& aFix)
+{
+  double hdop = aFix.mAccuracy / 5;
+  uint32_t satellites = hdop > 3 ? 4 : 9;
+  nsAutoCString sentences;
+  AppendReplayNmeaSentence(sentences, nsPrintfCString(
+    "GPGGA,000000,0000.000,N,00000.000,E,1,%02u,%.1f,0.0,M,0.0,M,,",
+    satellites, hdop).get());
+  AppendReplayNmeaSentence(sentences, nsPrintfCString(
+    "GPGSA,A,3,01,02,03,04,,,,,,,,,%.1f,%.1f,%.1f",
+    hdop * 1.5, hdop, hdop * 1.2).get());
+  aParser.Feed(sentences.get(), sentences.Length(), aFix.mTime);
+}
+
+/*
+ What the radios report around a position. Each AP is at a fixed place
+ on a grid of squares, so a route driven again hears the same APs. Some
+ are hidden or opted out with "_nomap", which ParseRawWifi() drops.
+ */
+class ReplayRadios
+{
+public:
+  explicit ReplayRadios(const ReplayFix& aOrigin)
+    : mOriginLatitude(aOrigin.mLatitude)
+    , mOriginLongitude(aOrigin.mLongitude)
+    , mLonScale(kReplayMetersPerDegree * cos(aOrigin.mLatitude * M_PI / 180))
+  {}
+
+  void Scan(double aLatitude, double aLongitude, StumbleRecord& aRecord) const
+  {
+    double x = (aLongitude - mOriginLongitude) * mLonScale;
+    double y = (aLatitude - mOriginLatitude) * kReplayMetersPerDegree;
+
+    aRecord.mHasWifi = true;
+    int64_t minX = int64_t(floor((x - kReplayWifiRangeMeters) / kReplayWifiGridMeters));
+    int64_t maxX = int64_t(floor((x + kReplayWifiRangeMeters) / kReplayWifiGridMeters));
+    int64_t minY = int64_t(floor((y - kReplayWifiRangeMeters) / kReplayWifiGridMeters));
+    int64_t maxY = int64_t(floor((y + kReplayWifiRangeMeters) / kReplayWifiGridMeters));
+    for (int64_t gx = minX; gx <= maxX; gx++) {
+      for (int64_t gy = minY; gy <= maxY; gy++) {
+        uint64_t square = (uint64_t(gx) << 32) ^ uint64_t(gy & 0xffffffff);
+        uint32_t count = StumbleMix64(square) % 4;
+        for (uint32_t i = 0; i < count; i++) {
+          uint64_t seed = square * 4 + i;
+          double apX = (gx + ReplayNoise(seed * 3)) * kReplayWifiGridMeters;
+          double apY = (gy + ReplayNoise(seed * 3 + 1)) * kReplayWifiGridMeters;
+          double distance = hypot(apX - x, apY - y);
+          if (distance > kReplayWifiRangeMeters) {
+            continue;
+          }
+          AddRawWifi(seed, distance, aRecord);
+        }
+      }
+    }
+
+    int64_t cx = int64_t(floor(x / kReplayCellGridMeters));
+    int64_t cy = int64_t(floor(y / kReplayCellGridMeters));
+    uint64_t cellSeed = StumbleMix64((uint64_t(cx) << 32) ^ uint64_t(cy & 0xffffffff));
+    int32_t signalDbm = -75 - int32_t(ReplayNoise(cellSeed ^ uint64_t(x)) * 30);
+    StumbleCell* serving = aRecord.mCells.AppendElement();
+    serving->mType = nsICellInfo::CELL_INFO_TYPE_LTE;
+    serving->mRegistered = true;
+    serving->mMcc = 310;
+    serving->mMnc = 410;
+    serving->mLac = int32_t(cellSeed >> 48);
+    serving->mCid = int32_t(cellSeed & 0xfffffff);
+    serving->mPsc = int32_t(cellSeed % 504);
+    serving->mSignalDbm = signalDbm;
+    // A neighbour, known only by its PSC
+    StumbleCell* neighbour = aRecord.mCells.AppendElement();
+    neighbour->mType = nsICellInfo::CELL_INFO_TYPE_LTE;
+    neighbour->mPsc = int32_t((cellSeed >> 16) % 504);
+    neighbour->mSignalDbm = signalDbm - 10;
+  }
+
+private:
+  static void AddRawWifi(uint64_t aSeed, double aDistance, StumbleRecord& aRecord)
+  {
+    uint64_t bssid = StumbleMix64(aSeed) & 0xffffffffffffULL;
+    StumbleRawWifi* raw = aRecord.mRawWifi.AppendElement();
+    uint32_t kind = (bssid >> 40) % 32;
+    if (kind == 1) {
+      raw->mSsid = NS_LITERAL_STRING("ReplayAP_nomap");
+    } else if (kind != 0) {
+      raw->mSsid = NS_LITERAL_STRING("ReplayAP");
+    }
+    raw->mBssid = NS_ConvertASCIItoUTF16(nsPrintfCString(
+      "%02x:%02x:%02x:%02x:%02x:%02x",
+      uint32_t(bssid >> 40) & 0xff, uint32_t(bssid >> 32) & 0xff,
+      uint32_t(bssid >> 24) & 0xff, uint32_t(bssid >> 16) & 0xff,
+      uint32_t(bssid >> 8) & 0xff, uint32_t(bssid) & 0xff));
+    raw->mSignal = uint32_t(int32_t(-35 - 25 * log10(aDistance > 1 ? aDistance : 1)));
+  }
+
+  double mOriginLatitude;
+  double mOriginLongitude;
+  double mLonScale;
+};
+
+// What the GPS thread works on, and what it leaves for the report
+struct ReplayGps
+{
+  const nsTArray<ReplayFix>* mTrace;
+  const ReplayRadios* mRadios;
+  StumbleRecordQueue* mQueue;
+  // 0 for as fast as possible
+  double mSpeed;
+  uint64_t mDropped;
+  Atomic<bool> mDone;
+};
+
+// LocationCallback, then StumblerInfo with radios that answer at once
+static void
+ReplayGpsThread(void* aArg)
+{
+  ReplayGps* gps = static_cast<ReplayGps*>(aArg);
+  const nsTArray<ReplayFix>& trace = *gps->mTrace;
+  StumbleNmeaParser parser;
+  StumbleScheduler scheduler;
+  StumbleRecord record;
+  TimeStamp start = TimeStamp::Now();
+  for (const ReplayFix& fix : trace) {
+    if (gps->mSpeed > 0) {
+      double dueMs = (fix.mTime - trace[0].mTime) / gps->mSpeed;
+      double elapsedMs = (TimeStamp::Now() - start).ToMilliseconds();
+      if (dueMs > elapsedMs) {
+        PR_Sleep(PR_MillisecondsToInterval(uint32_t(dueMs - elapsedMs)));
+      }
+    }
+
+    uint64_t sentences = parser.Sentences();
+    uint64_t rejected = parser.Rejected();
+    FeedReplayNmea(parser, fix);
+    StumblerStats::Add(StumblerStats::NMEA_SENTENCES, parser.Sentences() - sentences);
+    StumblerStats::Add(StumblerStats::NMEA_REJECTED, parser.Rejected() - rejected);
+
+    TimeStamp fixTime = TimeStamp::Now();
+    StumblerStats::Add(StumblerStats::FIXES);
+    StumbleFixQuality quality = StumbleNmeaParser::Latest(fix.mTime);
+    if (quality.IsPoor(fix.mTime) || StumbleSvStatus::Read().IsPoor(fix.mTime)) {
+      StumblerStats::Add(StumblerStats::FIXES_LOW_QUALITY);
+      continue;
+    }
+
+    StumbleScheduler::Fix schedulerFix;
+    schedulerFix.mTime = fix.mTime;
+    schedulerFix.mLatitude = fix.mLatitude;
+    schedulerFix.mLongitude = fix.mLongitude;
+    schedulerFix.mSpeed = fix.mSpeed;
+    schedulerFix.mBearing = fix.mBearing;
+    scheduler.UpdateNovelty(StumblerStats::Get(StumblerStats::RECORDS_WRITTEN),
+                            StumblerStats::Get(StumblerStats::RECORDS_DEDUPED));
+    uint64_t fixedPolicyScans = scheduler.FixedPolicyScans();
+    bool shouldScan = scheduler.ShouldScan(schedulerFix);
+    StumblerStats::Add(StumblerStats::SCANS_FIXED_POLICY,
+                       scheduler.FixedPolicyScans() - fixedPolicyScans);
+    if (!shouldScan) {
+      continue;
+    }
+    StumblerStats::Add(StumblerStats::SCANS);
+
+    TimeStamp scanStart = TimeStamp::Now();
+    StumblerStats::AddLatency(StumblerStats::STAGE_SCAN_DISPATCH, scanStart - fixTime);
+    record.Clear();
+    gps->mRadios->Scan(fix.mLatitude, fix.mLongitude, record);
+    StumblerStats::AddLatencySince(StumblerStats::STAGE_SCAN, scanStart);
+
+    TimeStamp dumpStart = TimeStamp::Now();
+    record.mTimestamp = fix.mTime;
+    record.mLatitude = fix.mLatitude;
+    record.mLongitude = fix.mLongitude;
+    record.mAccuracy = fix.mAccuracy;
+    record.mSpeed = fix.mSpeed >= 0 ? fix.mSpeed : UnspecifiedNaN<double>();
+    record.mHeading = fix.mBearing >= 0 ? fix.mBearing : UnspecifiedNaN<double>();
+    // StumblerInfo::SetFixQuality()
+    if (quality.IsFresh(fix.mTime) && quality.mHdopCenti) {
+      record.mHdop = quality.mHdopCenti / 100.0;
+    }
+    if (quality.IsFresh(fix.mTime) &&
+        quality.mSatellitesUsed != StumbleFixQuality::kUnknownCount) {
+      record.mSatellites = quality.mSatellitesUsed;
+    }
+    if (gps->mQueue->Push(record)) {
+      StumblerStats::Add(StumblerStats::RECORDS_QUEUED);
+    } else {
+      gps->mDropped++;
+    }
+    StumblerStats::AddLatencySince(StumblerStats::STAGE_MAIN_THREAD, dumpStart);
+  }
+  gps->mDone = true;
+}
+
+// Accepts every batch, and keeps the timestamps of the records in it.
+class ReplayUploadSink
+{
+public:
+  // Returns the HTTP status.
+  uint32_t Receive(nsIFile* aJSON)
+  {
+    nsAutoCString json;
+    if (NS_FAILED(ReadGZipFile(aJSON, json)) ||
+        !StringBeginsWith(json, NS_LITERAL_CSTRING("{\"items\":[")) ||
+        !StringEndsWith(json, NS_LITERAL_CSTRING("]}"))) {
+      return 400;
+    }
+    static const char kKey[] = "\"timestamp\":";
+    int32_t pos = 0;
+    while ((pos = json.Find(kKey, false, pos)) != kNotFound) {
+      pos += sizeof(kKey) - 1;
+      mTimestamps.AppendElement(strtoll(json.get() + pos, nullptr, 10));
+    }
+    return 200;
+  }
+
+  nsTArray<int64_t> mTimestamps;
+};
+
+// The upper bound (us) of the bucket that holds aFraction of the samples
+static uint64_t
+ReplayLatencyPercentile(const uint32_t (&aBuckets)[StumblerStats::kLatencyBuckets],
+                        uint32_t aTotal, double aFraction)
+{
+  uint32_t seen = 0;
+  for (uint32_t i = 0; i < StumblerStats::kLatencyBuckets; i++) {
+    seen += aBuckets[i];
+    if (seen >= aTotal * aFraction) {
+      return uint64_t(1) << i;
+    }
+  }
+  return uint64_t(1) << (StumblerStats::kLatencyBuckets - 1);
+}
+
+class StumbleReplayTest : public ::testing::Test
+{
+protected:
+  virtual void SetUp() override
+  {
+    RemoveStumblerDir();
+    mQueue = new StumbleSegmentQueue();
+    ASSERT_TRUE(NS_SUCCEEDED(mQueue->Init()));
+    mDedupIndex = new StumbleDedupIndex();
+    ASSERT_TRUE(NS_SUCCEEDED(mDedupIndex->Load()));
+    mGeoIndex = new StumbleGeoIndex();
+    ASSERT_TRUE(NS_SUCCEEDED(mGeoIndex->Load()));
+  }
+
+  virtual void TearDown() override
+  {
+    mQueue->FinishHead();
+    RemoveStumblerDir();
+  }
+
+  // WriteStumbleOnThread::Run()
+  uint32_t Drain(StumbleRecordQueue& aRecordQueue)
+  {
+    return aRecordQueue.Drain([this](StumbleRecord& aRecord,
+                                     const TimeStamp& aPushTime) {
+      TimeStamp start = TimeStamp::Now();
+      StumblerStats::AddLatency(StumblerStats::STAGE_QUEUE_WAIT, start - aPushTime);
+      ParseRawWifi(aRecord);
+      mGeoIndex->Add(aRecord);
+      if (!mDedupIndex->AddIfNovel(aRecord)) {
+        StumblerStats::Add(StumblerStats::RECORDS_DEDUPED);
+        StumblerStats::AddLatencySince(StumblerStats::STAGE_WRITE, start);
+        return;
+      }
+      EXPECT_TRUE(NS_SUCCEEDED(mQueue->Append(aRecord)));
+      StumblerStats::AddLatencySince(StumblerStats::STAGE_WRITE, start);
+    });
+  }
+
+  // WriteStumbleOnThread::Upload(), UploadStumbleRunnable and
+  // UploadEnded(), for any sealed segment. Returns false if there was
+  // nothing to upload.
+  bool UploadBatch()
+  {
+    uint32_t seq;
+    uint32_t uploadedRecords;
+    nsCOMPtr<nsIFile> segmentFile;
+    if (!mQueue->GetUploadCandidate(0, &seq, getter_AddRefs(segmentFile),
+                                    &uploadedRecords)) {
+      return false;
+    }
+
+    nsCOMPtr<nsIFile> jsonFile;
+    EXPECT_TRUE(NS_SUCCEEDED(GetStumblerTestFile("upload.json.gz",
+                                                 getter_AddRefs(jsonFile))));
+    uint32_t recordCount;
+    bool isLast;
+    EXPECT_TRUE(NS_SUCCEEDED(ExportStumbleLogAsJSON(segmentFile, mQueue->Dictionary(),
+                                                    jsonFile, uploadedRecords,
+                                                    kReplayUploadBatch,
+                                                    &recordCount, &isLast)));
+    if (!recordCount) {
+      mQueue->RemovePinned();
+      return true;
+    }
+    int64_t fileSize;
+    EXPECT_TRUE(NS_SUCCEEDED(jsonFile->GetFileSize(&fileSize)));
+
+    StumblerStats::Add(StumblerStats::UPLOADS_STARTED);
+    TimeStamp sendTime = TimeStamp::Now();
+    uint32_t status = mSink.Receive(jsonFile);
+    StumblerStats::AddLatencySince(StumblerStats::STAGE_UPLOAD, sendTime);
+    EXPECT_EQ(200u, status);
+    if (status == 200) {
+      StumblerStats::Add(StumblerStats::UPLOADS_SUCCEEDED);
+      StumblerStats::Add(StumblerStats::RECORDS_UPLOADED, recordCount);
+      StumblerStats::Add(StumblerStats::BYTES_UPLOADED, fileSize);
+    }
+
+    if (isLast) {
+      mQueue->RemovePinned();
+    } else {
+      mQueue->SetPinnedProgress(uploadedRecords + recordCount);
+      mQueue->Unpin();
+    }
+    jsonFile->Remove(false);
+    return true;
+  }
+
+  nsRefPtr<StumbleSegmentQueue> mQueue;
+  nsRefPtr<StumbleDedupIndex> mDedupIndex;
+  nsRefPtr<StumbleGeoIndex> mGeoIndex;
+  ReplayUploadSink mSink;
+};
+
+TEST_F(StumbleReplayTest, Replay)
+{
+  nsTArray<ReplayFix> trace;
+  const char* path = PR_GetEnv("STUMBLE_REPLAY_TRACE");
+  bool synthetic = !path || !*path;
+  if (synthetic) {
+    MakeReplayTrace(trace);
+  } else {
+    ASSERT_TRUE(LoadReplayTrace(path, trace)) << "No fixes in " << path;
+  }
+  const char* speed = PR_GetEnv("STUMBLE_REPLAY_SPEED");
+
+  uint64_t before[StumblerStats::COUNTER_COUNT];
+  StumblerStats::Snapshot(before);
+  uint32_t latencyBefore[StumblerStats::STAGE_COUNT][StumblerStats::kLatencyBuckets];
+  for (uint32_t stage = 0; stage < StumblerStats::STAGE_COUNT; stage++) {
+    StumblerStats::GetLatencyHistogram(StumblerStats::Stage(stage), latencyBefore[stage]);
+  }
+
+  ReplayRadios radios(trace[0]);
+  StumbleRecordQueue recordQueue(kReplayQueueDepth);
+  ReplayGps gps;
+  gps.mTrace = &trace;
+  gps.mRadios = &radios;
+  gps.mQueue = &recordQueue;
+  gps.mSpeed = speed ? atof(speed) : 0;
+  gps.mDropped = 0;
+  gps.mDone = false;
+
+  TimeStamp start = TimeStamp::Now();
+  PRThread* thread = PR_CreateThread(PR_USER_THREAD, ReplayGpsThread, &gps,
+                                     PR_PRIORITY_NORMAL, PR_GLOBAL_THREAD,
+                                     PR_JOINABLE_THREAD, 0);
+  ASSERT_TRUE(thread);
+  for (;;) {
+    // Read first: once it is set, the drain below takes every record.
+    bool done = gps.mDone;
+    uint32_t drained = Drain(recordQueue);
+    bool uploaded = UploadBatch();
+    if (done && !drained && !uploaded) {
+      break;
+    }
+    if (!drained && !uploaded) {
+      PR_Sleep(PR_INTERVAL_NO_WAIT);
+    }
+  }
+  PR_JoinThread(thread);
+  ASSERT_TRUE(NS_SUCCEEDED(mQueue->FinishHead()));
+  double wallMs = (TimeStamp::Now() - start).ToMilliseconds();
+
+  uint64_t after[StumblerStats::COUNTER_COUNT];
+  StumblerStats::Snapshot(after);
+  uint64_t delta[StumblerStats::COUNTER_COUNT];
+  for (uint32_t i = 0; i < StumblerStats::COUNTER_COUNT; i++) {
+    delta[i] = after[i] - before[i];
+  }
+
+  double traceSeconds = (trace.LastElement().mTime - trace[0].mTime) / 1000.0;
+  printf("Replayed %u fixes (%.0f s of %s trace) in %.0f ms: %.0f fixes/s, "
+         "%.0f records/s, %llu records dropped by the queue\n",
+         trace.Length(), traceSeconds, synthetic ? "synthetic" : "recorded",
+         wallMs, trace.Length() * 1000 / wallMs,
+         delta[StumblerStats::RECORDS_QUEUED] * 1000 / wallMs,
+         (unsigned long long)gps.mDropped);
+  for (uint32_t i = 0; i < StumblerStats::COUNTER_COUNT; i++) {
+    if (delta[i]) {
+      printf("  %-28s %llu\n", StumblerStats::CounterName(StumblerStats::Counter(i)),
+             (unsigned long long)delta[i]);
+    }
+  }
+  if (delta[StumblerStats::RECORDS_WRITTEN]) {
+    printf("  %.1f bytes encoded, %.1f written per record\n",
+           double(delta[StumblerStats::BYTES_ENCODED]) / delta[StumblerStats::RECORDS_WRITTEN],
+           double(delta[StumblerStats::BYTES_COMPRESSED]) / delta[StumblerStats::RECORDS_WRITTEN]);
+  }
+  for (uint32_t stage = 0; stage < StumblerStats::STAGE_COUNT; stage++) {
+    uint32_t buckets[StumblerStats::kLatencyBuckets];
+    StumblerStats::GetLatencyHistogram(StumblerStats::Stage(stage), buckets);
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < StumblerStats::kLatencyBuckets; i++) {
+      buckets[i] -= latencyBefore[stage][i];
+      total += buckets[i];
+    }
+    if (total) {
+      printf("  %-28s %u, median < %llu us, 99%% < %llu us\n",
+             StumblerStats::StageName(StumblerStats::Stage(stage)), total,
+             (unsigned long long)ReplayLatencyPercentile(buckets, total, 0.5),
+             (unsigned long long)ReplayLatencyPercentile(buckets, total, 0.99));
+    }
+  }
+
+  // Every record is accounted for, and none was uploaded twice.
+  EXPECT_EQ(uint64_t(trace.Length()), delta[StumblerStats::FIXES]);
+  EXPECT_GT(delta[StumblerStats::SCANS], 0u);
+  EXPECT_EQ(delta[StumblerStats::SCANS], delta[StumblerStats::RECORDS_QUEUED] + gps.mDropped);
+  EXPECT_EQ(delta[StumblerStats::RECORDS_QUEUED],
+            delta[StumblerStats::RECORDS_WRITTEN] + delta[StumblerStats::RECORDS_DEDUPED]);
+  EXPECT_EQ(uint64_t(mSink.mTimestamps.Length()), delta[StumblerStats::RECORDS_UPLOADED]);
+  EXPECT_LE(delta[StumblerStats::RECORDS_UPLOADED], delta[StumblerStats::RECORDS_WRITTEN]);
+  mSink.mTimestamps.Sort();
+  for (uint32_t i = 1; i < mSink.mTimestamps.Length(); i++) {
+    ASSERT_NE(mSink.mTimestamps[i - 1], mSink.mTimestamps[i]);
+  }
+  EXPECT_EQ(0u, delta[StumblerStats::NMEA_REJECTED]);
+
+  if (synthetic) {
+    // The trace has poor fixes, and enough records to seal segments.
+    EXPECT_GT(delta[StumblerStats::FIXES_LOW_QUALITY], 0u);
+    EXPECT_GT(delta[StumblerStats::SEGMENTS_SEALED], 0u);
+    EXPECT_GT(delta[StumblerStats::BYTES_UPLOADED], 0u);
+  }
+}
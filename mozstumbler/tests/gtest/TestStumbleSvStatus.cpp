@@ -0,0 +1,174 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "StumbleSvStatus.h"
+#include "mozilla/Atomics.h"
+#include "prthread.h"
+#include <stdio.h>
+
+using namespace mozilla;
+
+static const uint8_t kUnknownSvCount = StumbleSvSummary::kUnknownCount;
+
+/*
+ The entries of a synthetic GpsSvStatus, as SvStatusCallback passes them
+ to the builder: used_in_fix_mask only covers the GPS PRNs 1 to 32.
+ */
+struct SyntheticSv
+{
+  int mPrn;
+  float mSnr;
+};
+
+template<size_t N>
+static StumbleSvSummary
+SummarizeSvStatus(int64_t aNowMs, const SyntheticSv (&aSvList)[N],
+                  uint32_t aUsedInFixMask)
+{
+  StumbleSvSummaryBuilder builder(aNowMs);
+  for (size_t i = 0; i < N; i++) {
+    int prn = aSvList[i].mPrn;
+    bool used = prn >= 1 && prn <= 32 && (aUsedInFixMask & (1u << (prn - 1)));
+    builder.AddSatellite(prn, aSvList[i].mSnr, used);
+  }
+  return builder.Finish(aUsedInFixMask != 0);
+}
+
+TEST(StumbleSvStatus, Constellations)
+{
+  EXPECT_EQ(StumbleSvSummary::GPS, StumbleSvSummaryBuilder::ConstellationForPrn(1));
+  EXPECT_EQ(StumbleSvSummary::GPS, StumbleSvSummaryBuilder::ConstellationForPrn(32));
+  EXPECT_EQ(StumbleSvSummary::SBAS, StumbleSvSummaryBuilder::ConstellationForPrn(33));
+  EXPECT_EQ(StumbleSvSummary::GLONASS, StumbleSvSummaryBuilder::ConstellationForPrn(70));
+  EXPECT_EQ(StumbleSvSummary::QZSS, StumbleSvSummaryBuilder::ConstellationForPrn(193));
+  EXPECT_EQ(StumbleSvSummary::BEIDOU, StumbleSvSummaryBuilder::ConstellationForPrn(205));
+  EXPECT_EQ(StumbleSvSummary::OTHER, StumbleSvSummaryBuilder::ConstellationForPrn(0));
+}
+
+TEST(StumbleSvStatus, Summary)
+{
+  static const SyntheticSv kSvList[] = {
+    { 3, 40 }, { 7, 38 }, { 12, 33 }, { 20, 30 }, { 25, 18 },
+    { 70, 35 }, { 205, 28 }, { 33, 40 }
+  };
+  uint32_t mask = (1 << 2) | (1 << 6) | (1 << 11) | (1 << 19);
+  StumbleSvSummary summary = SummarizeSvStatus(1000, kSvList, mask);
+  EXPECT_EQ(1000, summary.mTime);
+  EXPECT_EQ(mask, summary.mUsedInFixMask);
+  EXPECT_EQ(8u, summary.mInView);
+  // Satellites other than GPS are in view, which the mask cannot cover.
+  EXPECT_EQ(kUnknownSvCount, summary.mUsed);
+  EXPECT_EQ(40u, summary.mMaxSnr);
+  // So the strongest four of all satellites count, 40, 40, 38 and 35.
+  EXPECT_EQ(38u, summary.mTopSnr);
+  EXPECT_EQ(0u, summary.mMeanUsedSnr);
+  EXPECT_EQ(5u, summary.mInViewBy[StumbleSvSummary::GPS]);
+  EXPECT_EQ(1u, summary.mInViewBy[StumbleSvSummary::SBAS]);
+  EXPECT_EQ(1u, summary.mInViewBy[StumbleSvSummary::GLONASS]);
+  EXPECT_EQ(1u, summary.mInViewBy[StumbleSvSummary::BEIDOU]);
+  EXPECT_FALSE(summary.IsPoor(1000));
+}
+
+TEST(StumbleSvStatus, GpsOnlySummary)
+{
+  static const SyntheticSv kSvList[] = {
+    { 3, 40 }, { 7, 38 }, { 12, 33 }, { 20, 30 }, { 25, 45 }
+  };
+  uint32_t mask = (1 << 2) | (1 << 6) | (1 << 11) | (1 << 19);
+  StumbleSvSummary summary = SummarizeSvStatus(1000, kSvList, mask);
+  EXPECT_EQ(5u, summary.mInView);
+  EXPECT_EQ(4u, summary.mUsed);
+  EXPECT_EQ(45u, summary.mMaxSnr);
+  // Of the satellites used only: PRN 25 is strong, but not in the fix.
+  EXPECT_EQ(35u, summary.mTopSnr);
+  EXPECT_EQ(35u, summary.mMeanUsedSnr);
+  EXPECT_FALSE(summary.IsPoor(1000));
+}
+
+TEST(StumbleSvStatus, Poor)
+{
+  // Indoors: enough satellites, all of them weak
+  static const SyntheticSv kWeak[] = {
+    { 3, 20 }, { 7, 18 }, { 12, 22 }, { 20, 15 }, { 9, 12 }
+  };
+  StumbleSvSummary weak = SummarizeSvStatus(2000, kWeak, 0x1f | (1 << 8));
+  EXPECT_TRUE(weak.IsPoor(2000));
+  // Too old to say
+  EXPECT_FALSE(weak.IsPoor(2000 + StumbleSvSummary::kMaxAgeMs + 1));
+
+  static const SyntheticSv kFew[] = { { 3, 40 }, { 7, 40 }, { 12, 40 } };
+  StumbleSvSummary few = SummarizeSvStatus(2000, kFew, (1 << 2) | (1 << 6));
+  EXPECT_EQ(2u, few.mUsed);
+  EXPECT_TRUE(few.IsPoor(2000));
+
+  // No used_in_fix_mask: the number used is unknown, which is not poor.
+  static const SyntheticSv kStrong[] = {
+    { 3, 40 }, { 7, 40 }, { 12, 40 }, { 9, 40 }
+  };
+  StumbleSvSummary unknown = SummarizeSvStatus(2000, kStrong, 0);
+  EXPECT_EQ(kUnknownSvCount, unknown.mUsed);
+  EXPECT_FALSE(unknown.IsPoor(2000));
+}
+
+TEST(StumbleSvStatus, PublishAndClear)
+{
+  static const SyntheticSv kSvList[] = {
+    { 3, 40 }, { 7, 38 }, { 12, 33 }, { 20, 30 }
+  };
+  StumbleSvSummary summary = SummarizeSvStatus(1000, kSvList, 0x80844);
+  StumbleSvStatus::Publish(summary);
+  StumbleSvSummary read = StumbleSvStatus::Read();
+  EXPECT_EQ(summary.mTime, read.mTime);
+  EXPECT_EQ(summary.mUsedInFixMask, read.mUsedInFixMask);
+  EXPECT_EQ(summary.mUsed, read.mUsed);
+  EXPECT_EQ(summary.mTopSnr, read.mTopSnr);
+  EXPECT_TRUE(read.IsFresh(1000));
+
+  StumbleSvStatus::Clear();
+  EXPECT_FALSE(StumbleSvStatus::Read().IsFresh(1000));
+}
+
+static Atomic<bool> sSvWriterDone;
+
+// Publishes summaries whose fields all follow from their time.
+static void
+PublishSvSummaries(void*)
+{
+  for (int64_t time = 1; time < 1000000; time++) {
+    StumbleSvSummary summary;
+    summary.mTime = time;
+    summary.mUsedInFixMask = uint32_t(time * 7);
+    summary.mInView = time & 0xff;
+    summary.mMaxSnr = (time >> 8) & 0xff;
+    StumbleSvStatus::Publish(summary);
+  }
+  sSvWriterDone = true;
+}
+
+// A reader never sees the fields of two summaries at once.
+TEST(StumbleSvStatus, ConcurrentRead)
+{
+  sSvWriterDone = false;
+  PRThread* writer = PR_CreateThread(PR_USER_THREAD, PublishSvSummaries,
+                                     nullptr, PR_PRIORITY_NORMAL,
+                                     PR_GLOBAL_THREAD, PR_JOINABLE_THREAD, 0);
+  ASSERT_TRUE(writer);
+
+  uint64_t reads = 0;
+  while (!sSvWriterDone) {
+    StumbleSvSummary summary = StumbleSvStatus::Read();
+    if (summary.mTime) {
+      ASSERT_EQ(uint32_t(summary.mTime * 7), summary.mUsedInFixMask);
+      ASSERT_EQ(summary.mTime & 0xff, summary.mInView);
+      ASSERT_EQ((summary.mTime >> 8) & 0xff, summary.mMaxSnr);
+    }
+    reads++;
+  }
+  PR_JoinThread(writer);
+  StumbleSvStatus::Clear();
+  printf("%llu reads during 1000000 publishes\n", (unsigned long long)reads);
+}
@@ -0,0 +1,290 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "StumbleExporter.h"
+#include "StumbleSegmentQueue.h"
+#include "StumbleTestUtils.h"
+#include "StumbleUploadScheduler.h"
+#include "StumblerStats.h"
+#include "mozilla/ArrayUtils.h"
+#include "nsReadableUtils.h"
+#include "nsTArray.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace mozilla;
+
+/*
+ Drives the batched upload protocol of WriteStumbleOnThread::Upload() and
+ UploadEnded() against an in-process stand-in for the upload server that
+ fails on request, and checks what the server ends up with.
+ */
+
+// Enough for several sealed segments, within the budget
+static const uint32_t kUploadRecords = 2000;
+
+class TestUploadServer
+{
+public:
+  enum Fault {
+    NONE,
+    // The request never reaches the server
+    NETWORK_ERROR,
+    // The server stores the batch, but the response is lost
+    LOST_RESPONSE,
+    SERVER_ERROR,
+    // The server refuses the data itself
+    BAD_REQUEST,
+    TOO_MANY_REQUESTS
+  };
+
+  TestUploadServer() {}
+
+  // Returns the HTTP status, or 0 if the request failed.
+  uint32_t Receive(nsIFile* aJSON, Fault aFault)
+  {
+    nsAutoCString json;
+    if (NS_FAILED(ReadGZipFile(aJSON, json)) ||
+        !StringBeginsWith(json, NS_LITERAL_CSTRING("{\"items\":[")) ||
+        !StringEndsWith(json, NS_LITERAL_CSTRING("]}"))) {
+      return 400;
+    }
+
+    switch (aFault) {
+      case NETWORK_ERROR:
+        return 0;
+      case SERVER_ERROR:
+        return 503;
+      case BAD_REQUEST:
+        return 400;
+      case TOO_MANY_REQUESTS:
+        return 429;
+      default:
+        break;
+    }
+
+    static const char kKey[] = "\"timestamp\":";
+    int32_t pos = 0;
+    while ((pos = json.Find(kKey, false, pos)) != kNotFound) {
+      pos += sizeof(kKey) - 1;
+      int64_t timestamp = strtoll(json.get() + pos, nullptr, 10);
+      uint32_t index = uint32_t((timestamp - 1444444444000) / 1000);
+      if (index >= mReceived.Length()) {
+        mReceived.SetLength(index + 1);
+      }
+      mReceived[index]++;
+    }
+    return aFault == LOST_RESPONSE ? 0 : 200;
+  }
+
+  // How many times the record made with aIndex was received
+  uint32_t Received(uint32_t aIndex) const
+  {
+    return aIndex < mReceived.Length() ? mReceived[aIndex] : 0;
+  }
+
+private:
+  nsTArray<uint32_t> mReceived;
+};
+
+class StumbleUploadTest : public ::testing::Test
+{
+protected:
+  virtual void SetUp() override
+  {
+    RemoveStumblerDir();
+    mQueue = new StumbleSegmentQueue();
+    ASSERT_TRUE(NS_SUCCEEDED(mQueue->Init()));
+
+    uint64_t sealed = StumblerStats::Get(StumblerStats::SEGMENTS_SEALED);
+    uint64_t evicted = StumblerStats::Get(StumblerStats::SEGMENTS_EVICTED);
+    StumbleRecord record;
+    for (uint32_t i = 0; i < kUploadRecords; i++) {
+      MakeStumbleRecord(record, i);
+      ASSERT_TRUE(NS_SUCCEEDED(mQueue->Append(record)));
+    }
+    // Several segments, and every one of them kept
+    ASSERT_GE(StumblerStats::Get(StumblerStats::SEGMENTS_SEALED) - sealed, 3u);
+    ASSERT_EQ(evicted, StumblerStats::Get(StumblerStats::SEGMENTS_EVICTED));
+  }
+
+  virtual void TearDown() override
+  {
+    mQueue->FinishHead();
+    mQueue = nullptr;
+    RemoveStumblerDir();
+  }
+
+  // A reboot: the queue is read back from its manifest.
+  void Restart()
+  {
+    mQueue->FinishHead();
+    mQueue = new StumbleSegmentQueue();
+    ASSERT_TRUE(NS_SUCCEEDED(mQueue->Init()));
+  }
+
+  /*
+   One round of WriteStumbleOnThread::Upload() and UploadEnded(). Returns
+   false once there is nothing left to upload.
+   */
+  bool UploadBatch(uint32_t aBatchSize, TestUploadServer::Fault aFault,
+                   StumbleUploadScheduler::Outcome* aOutcome,
+                   uint32_t* aRecordCount)
+  {
+    uint32_t seq;
+    uint32_t uploadedRecords;
+    nsCOMPtr<nsIFile> segmentFile;
+    if (!mQueue->GetUploadCandidate(0, &seq, getter_AddRefs(segmentFile),
+                                    &uploadedRecords)) {
+      return false;
+    }
+
+    nsCOMPtr<nsIFile> jsonFile;
+    EXPECT_TRUE(NS_SUCCEEDED(GetStumblerTestFile("upload.json.gz",
+                                                 getter_AddRefs(jsonFile))));
+    bool isLast;
+    EXPECT_TRUE(NS_SUCCEEDED(ExportStumbleLogAsJSON(segmentFile, mQueue->Dictionary(),
+                                                    jsonFile, uploadedRecords,
+                                                    aBatchSize, aRecordCount,
+                                                    &isLast)));
+    if (!*aRecordCount) {
+      *aOutcome = StumbleUploadScheduler::SUCCEEDED;
+      mQueue->RemovePinned();
+      return true;
+    }
+
+    uint32_t status = mServer.Receive(jsonFile, aFault);
+    *aOutcome = StumbleUploadScheduler::OutcomeForStatus(status);
+    if (*aOutcome == StumbleUploadScheduler::FAILED) {
+      mQueue->Unpin();
+    } else if (isLast) {
+      mQueue->RemovePinned();
+    } else {
+      mQueue->SetPinnedProgress(uploadedRecords + *aRecordCount);
+      mQueue->Unpin();
+    }
+    jsonFile->Remove(false);
+    return true;
+  }
+
+  // Records 0 to the first one never received, which is the first record
+  // of the head once every sealed segment was uploaded.
+  uint32_t ReceivedPrefix()
+  {
+    uint32_t count = 0;
+    while (count < kUploadRecords && mServer.Received(count)) {
+      count++;
+    }
+    return count;
+  }
+
+  nsRefPtr<StumbleSegmentQueue> mQueue;
+  TestUploadServer mServer;
+};
+
+TEST_F(StumbleUploadTest, EveryRecordOnce)
+{
+  StumbleUploadScheduler::Outcome outcome;
+  uint32_t recordCount;
+  uint32_t batches = 0;
+  while (UploadBatch(100, TestUploadServer::NONE, &outcome, &recordCount)) {
+    EXPECT_EQ(StumbleUploadScheduler::SUCCEEDED, outcome);
+    EXPECT_LE(recordCount, 100u);
+    batches++;
+  }
+
+  uint32_t sealedRecords = ReceivedPrefix();
+  EXPECT_GT(sealedRecords, kUploadRecords / 2);
+  EXPECT_GE(batches, sealedRecords / 100);
+  for (uint32_t i = 0; i < kUploadRecords; i++) {
+    ASSERT_EQ(i < sealedRecords ? 1u : 0u, mServer.Received(i)) << "record " << i;
+  }
+}
+
+/*
+ Failed batches are sent again from the same record, acknowledged ones
+ never are, across restarts too. Only a lost response duplicates records,
+ and only a refused batch loses them.
+ */
+TEST_F(StumbleUploadTest, FailuresResume)
+{
+  static const TestUploadServer::Fault kFaults[] = {
+    TestUploadServer::NONE,
+    TestUploadServer::NETWORK_ERROR,
+    TestUploadServer::NONE,
+    TestUploadServer::SERVER_ERROR,
+    TestUploadServer::LOST_RESPONSE,
+    TestUploadServer::NONE,
+    TestUploadServer::TOO_MANY_REQUESTS,
+    TestUploadServer::BAD_REQUEST,
+    TestUploadServer::NONE,
+  };
+
+  uint32_t attempt = 0;
+  uint32_t batchSize = 37;
+  uint32_t failures = 0;
+  uint32_t lostResponses = 0;
+  uint32_t refusals = 0;
+  StumbleUploadScheduler::Outcome outcome;
+  uint32_t recordCount;
+  for (;;) {
+    TestUploadServer::Fault fault = kFaults[attempt % ArrayLength(kFaults)];
+    if (!UploadBatch(batchSize, fault, &outcome, &recordCount)) {
+      break;
+    }
+    attempt++;
+    ASSERT_LT(attempt, 1000u);
+
+    if (fault == TestUploadServer::NONE) {
+      EXPECT_EQ(StumbleUploadScheduler::SUCCEEDED, outcome);
+    } else if (fault == TestUploadServer::BAD_REQUEST) {
+      EXPECT_EQ(StumbleUploadScheduler::REJECTED, outcome);
+      refusals++;
+    } else {
+      EXPECT_EQ(StumbleUploadScheduler::FAILED, outcome);
+      failures++;
+      lostResponses += fault == TestUploadServer::LOST_RESPONSE;
+    }
+    if (attempt % 5 == 0) {
+      Restart();
+    }
+  }
+  EXPECT_GT(failures, 0u);
+
+  // The last record received is the last one of the sealed segments, as
+  // the final batch succeeded.
+  uint32_t sealedRecords = 0;
+  for (uint32_t i = kUploadRecords; i > 0; i--) {
+    if (mServer.Received(i - 1)) {
+      sealedRecords = i;
+      break;
+    }
+  }
+  EXPECT_GT(sealedRecords, kUploadRecords / 2);
+
+  uint32_t duplicates = 0;
+  uint32_t missing = 0;
+  for (uint32_t i = 0; i < sealedRecords; i++) {
+    ASSERT_LE(mServer.Received(i), 2u) << "record " << i;
+    if (!mServer.Received(i)) {
+      missing++;
+    } else {
+      duplicates += mServer.Received(i) - 1;
+    }
+  }
+  for (uint32_t i = sealedRecords; i < kUploadRecords; i++) {
+    ASSERT_EQ(0u, mServer.Received(i)) << "record " << i;
+  }
+  printf("%u upload attempts, %u failed, %u records sent twice, %u refused, "
+         "of %u\n", attempt, failures, duplicates, missing, sealedRecords);
+
+  // A lost response resends one batch, a refusal drops one.
+  EXPECT_GT(duplicates, 0u);
+  EXPECT_GT(missing, 0u);
+  EXPECT_LE(duplicates, lostResponses * 37);
+  EXPECT_LE(missing, refusals * 37);
+}
@@ -0,0 +1,194 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "StumbleTestUtils.h"
+#include "StumbleUploadScheduler.h"
+#include "prio.h"
+
+/*
+ The scheduler takes the time as an argument, so these tests run on a
+ virtual clock: kStartMs plus whatever time the test lets pass.
+ */
+
+static const int64_t kStartMs = 1444444444000;
+static const int64_t kMinuteMs = 60 * 1000;
+static const int64_t kInitialBackoffMs = StumbleUploadScheduler::kInitialBackoffMs;
+static const int64_t kMaxBackoffMs = StumbleUploadScheduler::kMaxBackoffMs;
+
+class StumbleUploadSchedulerTest : public ::testing::Test
+{
+protected:
+  virtual void SetUp() override
+  {
+    RemoveStumblerDir();
+    mNowMs = kStartMs;
+  }
+
+  virtual void TearDown() override
+  {
+    RemoveStumblerDir();
+  }
+
+  already_AddRefed<StumbleUploadScheduler> Load(uint64_t aSeed = 42)
+  {
+    nsRefPtr<StumbleUploadScheduler> scheduler = new StumbleUploadScheduler(aSeed);
+    EXPECT_TRUE(NS_SUCCEEDED(scheduler->Load(mNowMs)));
+    return scheduler.forget();
+  }
+
+  // Moves the clock to the next attempt the scheduler allows.
+  void WaitForNextAttempt(StumbleUploadScheduler* aScheduler)
+  {
+    EXPECT_FALSE(aScheduler->CanUpload(aScheduler->NextAttemptMs() - 1));
+    mNowMs = aScheduler->NextAttemptMs();
+    EXPECT_TRUE(aScheduler->CanUpload(mNowMs));
+  }
+
+  int64_t mNowMs;
+};
+
+TEST_F(StumbleUploadSchedulerTest, OutcomeForStatus)
+{
+  EXPECT_EQ(StumbleUploadScheduler::SUCCEEDED, StumbleUploadScheduler::OutcomeForStatus(200));
+  EXPECT_EQ(StumbleUploadScheduler::SUCCEEDED, StumbleUploadScheduler::OutcomeForStatus(204));
+  EXPECT_EQ(StumbleUploadScheduler::REJECTED, StumbleUploadScheduler::OutcomeForStatus(400));
+  EXPECT_EQ(StumbleUploadScheduler::REJECTED, StumbleUploadScheduler::OutcomeForStatus(413));
+  EXPECT_EQ(StumbleUploadScheduler::FAILED, StumbleUploadScheduler::OutcomeForStatus(401));
+  EXPECT_EQ(StumbleUploadScheduler::FAILED, StumbleUploadScheduler::OutcomeForStatus(403));
+  EXPECT_EQ(StumbleUploadScheduler::FAILED, StumbleUploadScheduler::OutcomeForStatus(404));
+  EXPECT_EQ(StumbleUploadScheduler::FAILED, StumbleUploadScheduler::OutcomeForStatus(408));
+  EXPECT_EQ(StumbleUploadScheduler::FAILED, StumbleUploadScheduler::OutcomeForStatus(429));
+  EXPECT_EQ(StumbleUploadScheduler::FAILED, StumbleUploadScheduler::OutcomeForStatus(500));
+  EXPECT_EQ(StumbleUploadScheduler::FAILED, StumbleUploadScheduler::OutcomeForStatus(503));
+  // No response at all
+  EXPECT_EQ(StumbleUploadScheduler::FAILED, StumbleUploadScheduler::OutcomeForStatus(0));
+}
+
+TEST_F(StumbleUploadSchedulerTest, ExponentialBackoff)
+{
+  nsRefPtr<StumbleUploadScheduler> scheduler = Load();
+  EXPECT_TRUE(scheduler->CanUpload(mNowMs));
+
+  int64_t backoff = kInitialBackoffMs;
+  for (uint32_t failure = 0; failure < 12; failure++) {
+    scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 0);
+    int64_t delay = scheduler->NextAttemptMs() - mNowMs;
+    EXPECT_GE(delay, backoff / 2) << "failure " << failure;
+    EXPECT_LE(delay, backoff) << "failure " << failure;
+    WaitForNextAttempt(scheduler);
+
+    backoff = backoff * 2 > kMaxBackoffMs ? kMaxBackoffMs : backoff * 2;
+  }
+
+  // A success clears the backoff.
+  scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::SUCCEEDED, 0);
+  EXPECT_TRUE(scheduler->CanUpload(mNowMs));
+  scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 0);
+  EXPECT_LE(scheduler->NextAttemptMs() - mNowMs, kInitialBackoffMs);
+}
+
+TEST_F(StumbleUploadSchedulerTest, RejectedIsNotRetried)
+{
+  nsRefPtr<StumbleUploadScheduler> scheduler = Load();
+  scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 0);
+  WaitForNextAttempt(scheduler);
+  scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::REJECTED, 0);
+  // The next batch may go right away.
+  EXPECT_TRUE(scheduler->CanUpload(mNowMs));
+}
+
+TEST_F(StumbleUploadSchedulerTest, Jitter)
+{
+  nsRefPtr<StumbleUploadScheduler> first = new StumbleUploadScheduler(1);
+  nsRefPtr<StumbleUploadScheduler> again = new StumbleUploadScheduler(1);
+  nsRefPtr<StumbleUploadScheduler> other = new StumbleUploadScheduler(2);
+  uint32_t differences = 0;
+  for (uint32_t i = 0; i < 8; i++) {
+    first->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 0);
+    again->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 0);
+    other->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 0);
+    // The same seed replays the same schedule.
+    EXPECT_EQ(first->NextAttemptMs(), again->NextAttemptMs());
+    differences += first->NextAttemptMs() != other->NextAttemptMs();
+  }
+  // Devices that failed together do not retry together.
+  EXPECT_GE(differences, 7u);
+}
+
+TEST_F(StumbleUploadSchedulerTest, RetryAfter)
+{
+  nsRefPtr<StumbleUploadScheduler> scheduler = Load();
+
+  // Longer than the backoff: honoured
+  scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 60 * kMinuteMs);
+  EXPECT_EQ(mNowMs + 60 * kMinuteMs, scheduler->NextAttemptMs());
+  WaitForNextAttempt(scheduler);
+
+  // Shorter than the backoff: ignored
+  scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 1000);
+  EXPECT_GE(scheduler->NextAttemptMs() - mNowMs, kInitialBackoffMs);
+  WaitForNextAttempt(scheduler);
+
+  // Never longer than kMaxBackoffMs
+  scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 30 * kMaxBackoffMs);
+  EXPECT_EQ(mNowMs + kMaxBackoffMs, scheduler->NextAttemptMs());
+}
+
+TEST_F(StumbleUploadSchedulerTest, SurvivesRestart)
+{
+  nsRefPtr<StumbleUploadScheduler> scheduler = Load();
+  for (uint32_t i = 0; i < 3; i++) {
+    scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 0);
+    WaitForNextAttempt(scheduler);
+  }
+  scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 0);
+  int64_t nextAttemptMs = scheduler->NextAttemptMs();
+
+  mNowMs += kMinuteMs;
+  nsRefPtr<StumbleUploadScheduler> restarted = Load(7);
+  EXPECT_EQ(nextAttemptMs, restarted->NextAttemptMs());
+  EXPECT_FALSE(restarted->CanUpload(mNowMs));
+
+  // The failure count was kept too: the fifth failure backs off by at
+  // least half of 16 times the initial backoff.
+  WaitForNextAttempt(restarted);
+  restarted->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, 0);
+  EXPECT_GE(restarted->NextAttemptMs() - mNowMs, 8 * kInitialBackoffMs);
+}
+
+// A failure recorded while the clock was days ahead (e.g. a bad RTC) does
+// not block uploads once the clock is corrected.
+TEST_F(StumbleUploadSchedulerTest, ClockMovedBack)
+{
+  nsRefPtr<StumbleUploadScheduler> scheduler = Load();
+  mNowMs += 30 * kMaxBackoffMs;
+  scheduler->OnUploadEnded(mNowMs, StumbleUploadScheduler::FAILED, kMaxBackoffMs);
+
+  mNowMs = kStartMs;
+  nsRefPtr<StumbleUploadScheduler> restarted = Load();
+  EXPECT_EQ(mNowMs + kMaxBackoffMs, restarted->NextAttemptMs());
+
+  // Also without a restart
+  EXPECT_FALSE(scheduler->CanUpload(mNowMs));
+  EXPECT_EQ(mNowMs + kMaxBackoffMs, scheduler->NextAttemptMs());
+  EXPECT_TRUE(scheduler->CanUpload(mNowMs + kMaxBackoffMs));
+}
+
+TEST_F(StumbleUploadSchedulerTest, UnreadableState)
+{
+  nsCOMPtr<nsIFile> file;
+  ASSERT_TRUE(NS_SUCCEEDED(GetStumblerTestFile("stumbles.upload-state",
+                                               getter_AddRefs(file))));
+  PRFileDesc* fd;
+  ASSERT_TRUE(NS_SUCCEEDED(file->OpenNSPRFileDesc(PR_WRONLY | PR_TRUNCATE, 0644, &fd)));
+  static const char kGarbage[] = "\x7f\x01 not a state";
+  PR_Write(fd, kGarbage, sizeof(kGarbage) - 1);
+  PR_Close(fd);
+
+  nsRefPtr<StumbleUploadScheduler> scheduler = Load();
+  EXPECT_TRUE(scheduler->CanUpload(mNowMs));
+}
@@ -0,0 +1,273 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "StumblerGeodesy.h"
+#include "mozilla/Constants.h"
+#include "mozilla/TimeStamp.h"
+#include "nsTArray.h"
+#include <math.h>
+#include <stdio.h>
+
+using namespace mozilla;
+
+static const double kRadsInDeg = M_PI / 180.0;
+static const uint32_t kSamples = 200000;
+
+// Deterministic, so a failure can be reproduced.
+class Random
+{
+public:
+  Random() : mState(0x853c49e6748fea9bULL) {}
+
+  // Uniform in [aMin, aMax)
+  double Next(double aMin, double aMax)
+  {
+    mState = mState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return aMin + (mState >> 11) * (1.0 / 9007199254740992.0) * (aMax - aMin);
+  }
+
+private:
+  uint64_t mState;
+};
+
+static double
+Haversine(double aLat1, double aLon1, double aLat2, double aLon2)
+{
+  double dLat = (aLat2 - aLat1) * kRadsInDeg;
+  double dLon = (aLon2 - aLon1) * kRadsInDeg;
+  double a = sin(dLat / 2) * sin(dLat / 2) +
+             cos(aLat1 * kRadsInDeg) * cos(aLat2 * kRadsInDeg) *
+             sin(dLon / 2) * sin(dLon / 2);
+  return 2 * asin(sqrt(fmin(a, 1.0))) * kGeoEarthRadiusMeters;
+}
+
+// The spherical law of cosines, as CalculateDeltaInMeter computed it
+static double
+LawOfCosines(double aLat1, double aLon1, double aLat2, double aLon2)
+{
+  double c = sin(aLat1 * kRadsInDeg) * sin(aLat2 * kRadsInDeg) +
+             cos(aLat1 * kRadsInDeg) * cos(aLat2 * kRadsInDeg) *
+             cos((aLon2 - aLon1) * kRadsInDeg);
+  return acos(fmax(-1.0, fmin(c, 1.0))) * kGeoEarthRadiusMeters;
+}
+
+// Vincenty's inverse formula on the WGS84 ellipsoid, for points that are
+// not nearly antipodal.
+static double
+Vincenty(double aLat1, double aLon1, double aLat2, double aLon2)
+{
+  const double a = 6378137;
+  const double f = 1 / 298.257223563;
+  const double b = a * (1 - f);
+
+  double L = (aLon2 - aLon1) * kRadsInDeg;
+  double U1 = atan((1 - f) * tan(aLat1 * kRadsInDeg));
+  double U2 = atan((1 - f) * tan(aLat2 * kRadsInDeg));
+  double sinU1 = sin(U1), cosU1 = cos(U1);
+  double sinU2 = sin(U2), cosU2 = cos(U2);
+
+  double lambda = L, sinSigma = 0, cosSigma = 1, sigma = 0;
+  double cosSqAlpha = 1, cos2SigmaM = 0;
+  for (int i = 0; i < 200; i++) {
+    double sinLambda = sin(lambda), cosLambda = cos(lambda);
+    sinSigma = sqrt((cosU2 * sinLambda) * (cosU2 * sinLambda) +
+                    (cosU1 * sinU2 - sinU1 * cosU2 * cosLambda) *
+                    (cosU1 * sinU2 - sinU1 * cosU2 * cosLambda));
+    if (sinSigma == 0) {
+      return 0;
+    }
+    cosSigma = sinU1 * sinU2 + cosU1 * cosU2 * cosLambda;
+    sigma = atan2(sinSigma, cosSigma);
+    double sinAlpha = cosU1 * cosU2 * sinLambda / sinSigma;
+    cosSqAlpha = 1 - sinAlpha * sinAlpha;
+    cos2SigmaM = cosSqAlpha ? cosSigma - 2 * sinU1 * sinU2 / cosSqAlpha : 0;
+    double C = f / 16 * cosSqAlpha * (4 + f * (4 - 3 * cosSqAlpha));
+    double previous = lambda;
+    lambda = L + (1 - C) * f * sinAlpha *
+             (sigma + C * sinSigma *
+              (cos2SigmaM + C * cosSigma * (-1 + 2 * cos2SigmaM * cos2SigmaM)));
+    if (fabs(lambda - previous) < 1e-12) {
+      break;
+    }
+  }
+
+  double uSq = cosSqAlpha * (a * a - b * b) / (b * b);
+  double A = 1 + uSq / 16384 * (4096 + uSq * (-768 + uSq * (320 - 175 * uSq)));
+  double B = uSq / 1024 * (256 + uSq * (-128 + uSq * (74 - 47 * uSq)));
+  double deltaSigma =
+    B * sinSigma * (cos2SigmaM + B / 4 *
+                    (cosSigma * (-1 + 2 * cos2SigmaM * cos2SigmaM) -
+                     B / 6 * cos2SigmaM * (-3 + 4 * sinSigma * sinSigma) *
+                     (-3 + 4 * cos2SigmaM * cos2SigmaM)));
+  return b * A * (sigma - deltaSigma);
+}
+
+static double
+WrapLongitude(double aLon)
+{
+  if (aLon > 180) {
+    return aLon - 360;
+  }
+  if (aLon < -180) {
+    return aLon + 360;
+  }
+  return aLon;
+}
+
+TEST(StumblerGeodesy, FastPathMatchesHaversine)
+{
+  Random random;
+  double worst = 0;
+  for (uint32_t i = 0; i < kSamples; i++) {
+    double lat = random.Next(-85, 85);
+    double lon = random.Next(-180, 180);
+    // 1 cm to just under kGeoFastPathDegrees
+    double spread = pow(10, random.Next(-7, log10(kGeoFastPathDegrees)));
+    double lat2 = fmax(-85, fmin(85, lat + random.Next(-spread, spread)));
+    double lon2 = WrapLongitude(lon + random.Next(-spread, spread));
+
+    double expected = Haversine(lat, lon, lat2, lon2);
+    double actual = GeoDistanceMeters(lat, lon, lat2, lon2);
+    if (expected > 0) {
+      worst = fmax(worst, fabs(actual - expected) / expected);
+    }
+  }
+  printf("Fast path: worst relative error %g\n", worst);
+  EXPECT_LT(worst, 1e-5);
+}
+
+TEST(StumblerGeodesy, LongDistancesMatchHaversine)
+{
+  Random random;
+  for (uint32_t i = 0; i < kSamples; i++) {
+    double lat = random.Next(-90, 90);
+    double lon = random.Next(-180, 180);
+    double lat2 = random.Next(-90, 90);
+    double lon2 = random.Next(-180, 180);
+    if (fabs(lat2 - lat) < kGeoFastPathDegrees &&
+        fabs(lon2 - lon) < kGeoFastPathDegrees) {
+      continue;
+    }
+    double expected = Haversine(lat, lon, lat2, lon2);
+    ASSERT_NEAR(expected, GeoDistanceMeters(lat, lon, lat2, lon2),
+                expected * 1e-9 + 1e-6);
+  }
+}
+
+// The sphere is within the flattening of the ellipsoid, a bit over 0.3%
+// either way, plus the difference of the equatorial and meridional radii
+// near the poles.
+TEST(StumblerGeodesy, MatchesVincenty)
+{
+  Random random;
+  double worst = 0;
+  for (uint32_t i = 0; i < kSamples; i++) {
+    double lat = random.Next(-89, 89);
+    double lon = random.Next(-180, 180);
+    double spread = pow(10, random.Next(-4, 1));
+    double lat2 = fmax(-89, fmin(89, lat + random.Next(-spread, spread)));
+    double lon2 = WrapLongitude(lon + random.Next(-spread, spread));
+
+    double expected = Vincenty(lat, lon, lat2, lon2);
+    double actual = GeoDistanceMeters(lat, lon, lat2, lon2);
+    if (expected > 1) {
+      worst = fmax(worst, fabs(actual - expected) / expected);
+    }
+  }
+  printf("Sphere against WGS84: worst relative error %g\n", worst);
+  EXPECT_LT(worst, 0.007);
+}
+
+TEST(StumblerGeodesy, ShortDistances)
+{
+  // 1e-7 degrees of latitude is about 1.1 cm.
+  EXPECT_NEAR(1e-7 * kRadsInDeg * kGeoEarthRadiusMeters,
+              GeoDistanceMeters(48.8566, 2.3522, 48.8566001, 2.3522), 1e-6);
+  EXPECT_EQ(0, GeoDistanceMeters(48.8566, 2.3522, 48.8566, 2.3522));
+}
+
+TEST(StumblerGeodesy, Antimeridian)
+{
+  double across = GeoDistanceMeters(10, 179.9999, 10, -179.9999);
+  EXPECT_NEAR(Haversine(10, -0.0001, 10, 0.0001), across, 1e-6);
+
+  double lat = 10, lon = 179.9999;
+  double lat2 = 10, lon2 = -179.9999;
+  double batch;
+  GeoDistancesMeters(lat, lon, &lat2, &lon2, &batch, 1);
+  EXPECT_NEAR(across, batch, 1e-6);
+}
+
+TEST(StumblerGeodesy, BatchMatchesHaversine)
+{
+  Random random;
+  nsTArray<double> lats, lons, distances;
+  lats.SetLength(kSamples);
+  lons.SetLength(kSamples);
+  distances.SetLength(kSamples);
+
+  double worst = 0;
+  for (uint32_t round = 0; round < 20; round++) {
+    double lat = random.Next(-60, 60);
+    double lon = random.Next(-180, 180);
+    // Within about 10 km
+    for (uint32_t i = 0; i < kSamples; i++) {
+      lats[i] = lat + random.Next(-0.06, 0.06);
+      lons[i] = WrapLongitude(lon + random.Next(-0.06, 0.06));
+    }
+    GeoDistancesMeters(lat, lon, lats.Elements(), lons.Elements(),
+                       distances.Elements(), kSamples);
+    for (uint32_t i = 0; i < kSamples; i++) {
+      double expected = Haversine(lat, lon, lats[i], lons[i]);
+      if (expected > 1) {
+        worst = fmax(worst, fabs(distances[i] - expected) / expected);
+      }
+    }
+  }
+  printf("Batch: worst relative error %g\n", worst);
+  EXPECT_LT(worst, 5e-4);
+}
+
+TEST(StumblerGeodesy, Benchmark)
+{
+  Random random;
+  nsTArray<double> lats, lons, distances;
+  lats.SetLength(kSamples);
+  lons.SetLength(kSamples);
+  distances.SetLength(kSamples);
+  for (uint32_t i = 0; i < kSamples; i++) {
+    lats[i] = 37.3861 + random.Next(-0.01, 0.01);
+    lons[i] = -122.0839 + random.Next(-0.01, 0.01);
+  }
+
+  // Summed so that the loops are not optimized away
+  double sum = 0;
+  TimeStamp start = TimeStamp::Now();
+  for (uint32_t i = 0; i < kSamples; i++) {
+    sum += LawOfCosines(37.3861, -122.0839, lats[i], lons[i]);
+  }
+  double oldMs = (TimeStamp::Now() - start).ToMilliseconds();
+
+  start = TimeStamp::Now();
+  for (uint32_t i = 0; i < kSamples; i++) {
+    sum += GeoDistanceMeters(37.3861, -122.0839, lats[i], lons[i]);
+  }
+  double scalarMs = (TimeStamp::Now() - start).ToMilliseconds();
+
+  start = TimeStamp::Now();
+  GeoDistancesMeters(37.3861, -122.0839, lats.Elements(), lons.Elements(),
+                     distances.Elements(), kSamples);
+  double batchMs = (TimeStamp::Now() - start).ToMilliseconds();
+  for (uint32_t i = 0; i < kSamples; i++) {
+    sum += distances[i];
+  }
+
+  printf("Distances/s: law of cosines %.0f, GeoDistanceMeters %.0f, "
+         "GeoDistancesMeters %.0f (%g)\n",
+         kSamples * 1000 / oldMs, kSamples * 1000 / scalarMs,
+         kSamples * 1000 / batchMs, sum);
+}